@@ -0,0 +1,186 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+//
+// Batches of commands submitted with one request.
+//
+// A batch travels through the submission ring as a single entry. The
+// consumer sends its commands back to back under one power reference
+// and one hold of the command lock, keeping the locality between them
+// and, on SPI, skipping the wake sequence that otherwise precedes every
+// transfer. Responses are written straight into the caller's output
+// buffer, which is separate from the input (METHOD_OUT_DIRECT), so a
+// long response cannot overwrite commands that have not been sent yet.
+//
+
+/* Size of the command in @c, which has been checked to fit the input */
+static UINT32 tpm_cr50_batch_header_size(PCR50_BATCH_COMMAND c) {
+	return RtlUlongByteSwap(*((UINT32*)((UINT8*)(c + 1) + 2)));
+}
+
+/*
+ * Checks that the entries are well formed and that the output can at
+ * least hold an empty response for each, then hands the batch to the
+ * consumer. Returns STATUS_PENDING when it was queued.
+ */
+NTSTATUS tpm_cr50_batch_submit(PCR50_CONTEXT pDevice, WDFREQUEST Request) {
+	LONGLONG queued = tpm_cr50_timestamp();
+	PCR50_BATCH batch;
+	PVOID out;
+	size_t inLen, outLen, pos;
+	NTSTATUS status;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(*batch), (PVOID*)&batch, &inLen);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (!batch->Count || batch->Count > CR50_BATCH_MAX_COMMANDS) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(Request,
+		sizeof(CR50_BATCH_RESULT) + batch->Count * sizeof(CR50_BATCH_RESPONSE), &out, &outLen);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	pos = sizeof(*batch);
+	for (ULONG i = 0; i < batch->Count; i++) {
+		PCR50_BATCH_COMMAND c = (PCR50_BATCH_COMMAND)((UINT8*)batch + pos);
+
+		if (inLen - pos < sizeof(*c) || c->Length < TPM_HEADER_SIZE ||
+			c->Length > CR50_MAX_COMMAND_SIZE || inLen - pos - sizeof(*c) < c->Length ||
+			tpm_cr50_batch_header_size(c) != c->Length) {
+			return STATUS_INVALID_PARAMETER;
+		}
+
+		/* The padding of the last entry may be left out */
+		pos += min(CR50_BATCH_ENTRY_SIZE(c->Length), inLen - pos);
+	}
+
+	WDFFILEOBJECT fileObject = WdfRequestGetFileObject(Request);
+	UINT8 locality = fileObject ? GetFileContext(fileObject)->Locality : 0;
+
+	return tpm_cr50_ring_submit(pDevice, Request, queued, locality);
+}
+
+/**
+ * tpm_cr50_batch_execute() - Send the commands of a batch on the consumer thread.
+ * @locality:	Locality the submitting handle is bound to.
+ * @last:	No further command for @locality follows the batch in the ring.
+ *
+ * Only fails as a whole if the TPM could not be powered up; the outcome
+ * of every command is in its CR50_BATCH_RESPONSE.
+ */
+NTSTATUS tpm_cr50_batch_execute(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	LONGLONG queued, UINT8 locality, BOOLEAN last, size_t* bytesReturned) {
+	PCR50_BATCH batch;
+	PCR50_BATCH_RESULT result;
+	ULONG64 handshakes, wakes;
+	size_t outLen, in, out;
+	BOOLEAN stopped = FALSE;
+	NTSTATUS status;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(*batch), (PVOID*)&batch, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*result), (PVOID*)&result, &outLen);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	tpm_cr50_idle_arrival(pDevice, queued);
+
+	status = tpm_cr50_begin(pDevice);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	handshakes = pDevice->HandshakesSaved;
+	wakes = pDevice->WakesSaved;
+
+	RtlZeroMemory(result, sizeof(*result));
+	result->Count = batch->Count;
+
+	tpm_cr50_select_locality(pDevice, locality);
+	pDevice->BusHeld = TRUE;
+
+	in = sizeof(*batch);
+	out = sizeof(*result);
+	for (ULONG i = 0; i < batch->Count; i++) {
+		PCR50_BATCH_COMMAND c = (PCR50_BATCH_COMMAND)((UINT8*)batch + in);
+		PCR50_BATCH_RESPONSE r = (PCR50_BATCH_RESPONSE)((UINT8*)result + out);
+		UINT8* rsp = pDevice->InternalResponse;
+		size_t reserve, room;
+
+		/*
+		 * Leave room for an empty response to each remaining command,
+		 * which submission made sure of, and for the padding.
+		 */
+		reserve = (batch->Count - i - 1) * sizeof(*r);
+		room = (outLen - out - reserve - sizeof(*r)) & ~(size_t)7;
+
+		in += CR50_BATCH_ENTRY_SIZE(c->Length);
+		r->Length = 0;
+
+		if (stopped) {
+			r->Status = STATUS_CANCELLED;
+		}
+		else if (room < TPM_HEADER_SIZE) {
+			r->Status = STATUS_BUFFER_TOO_SMALL;
+		}
+		else {
+			pDevice->LocalityCommands[locality]++;
+			pDevice->HoldLocality = !last || i + 1 < batch->Count;
+
+			/*
+			 * The output buffer is the caller's memory, which it can
+			 * rewrite while the NV and key caches read the response,
+			 * so the response goes through a driver buffer.
+			 */
+			room = min(room, sizeof(pDevice->InternalResponse));
+			r->Status = tpm_cr50_transmit_retry(pDevice, (UINT8*)(c + 1), c->Length,
+				rsp, room, i ? 0 : queued);
+			result->Executed++;
+
+			if (NT_SUCCESS(r->Status)) {
+				r->Length = min(RtlUlongByteSwap(*((UINT32*)(rsp + 2))), (ULONG)room);
+				RtlCopyMemory(r + 1, rsp, r->Length);
+			}
+		}
+
+		if (!stopped && (c->Flags & CR50_BATCH_STOP_ON_ERROR) &&
+			(!NT_SUCCESS(r->Status) || tpm2_response_code(rsp) != TPM2_RC_SUCCESS)) {
+			stopped = TRUE;
+		}
+
+		out += CR50_BATCH_ENTRY_SIZE(r->Length);
+	}
+
+	/* A command that was cut short left the locality held for the next one */
+	pDevice->BusHeld = FALSE;
+	if (last && pDevice->HoldLocality) {
+		pDevice->HoldLocality = FALSE;
+		tpm_cr50_release_locality(pDevice, FALSE);
+	}
+
+	result->TransitionsSaved = result->Executed ? result->Executed - 1 : 0;
+	result->HandshakesSaved = (ULONG)(pDevice->HandshakesSaved - handshakes);
+	result->WakesSaved = (ULONG)(pDevice->WakesSaved - wakes);
+
+	pDevice->Batches++;
+	pDevice->BatchCommands += result->Executed;
+	pDevice->BatchTransitionsSaved += result->TransitionsSaved;
+	if (stopped)
+		pDevice->BatchesStopped++;
+
+	tpm_cr50_end(pDevice);
+
+	*bytesReturned = out;
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,159 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+NTSTATUS tpm_cr50_trace_init(PCR50_CONTEXT pDevice) {
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDFMEMORY memory;
+	ULONG entries = pDevice->TraceEntries;
+	ULONG index;
+	NTSTATUS status;
+
+	pDevice->TraceRing = NULL;
+	if (!entries) {
+		return STATUS_SUCCESS;
+	}
+
+	/* The ring is indexed with a mask, so round down to a power of two */
+	_BitScanReverse(&index, entries);
+	entries = 1UL << index;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = pDevice->FxDevice;
+
+	status = WdfMemoryCreate(&attributes,
+		NonPagedPoolNx,
+		CR50_POOL_TAG,
+		sizeof(CR50_TRACE_ENTRY) * entries,
+		&memory,
+		(PVOID*)&pDevice->TraceRing);
+	if (!NT_SUCCESS(status)) {
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"Could not allocate trace ring 0x%x\n", status);
+		pDevice->TraceRing = NULL;
+		return status;
+	}
+
+	RtlZeroMemory(pDevice->TraceRing, sizeof(CR50_TRACE_ENTRY) * entries);
+	pDevice->TraceEntries = entries;
+	pDevice->TraceNext = 0;
+	return status;
+}
+
+/* Bytes of a transfer or command that may be kept in the trace */
+static size_t tpm_cr50_trace_visible(PCR50_CONTEXT pDevice, CR50_TRACE_TYPE type, UINT32 reg,
+	size_t len) {
+	BOOLEAN fifo;
+
+	if (pDevice->TracePayload) {
+		return len;
+	}
+
+	if (pDevice->Transport == CR50_TRANSPORT_SPI)
+		fifo = (reg & 0xFFF) == TPM_DATA_FIFO(0);
+	else
+		fifo = (reg & 0x0F) == TPM_I2C_DATA_FIFO(0);
+
+	switch (type) {
+	case Cr50TraceRead:
+	case Cr50TraceWrite:
+		return fifo ? 0 : len;
+	case Cr50TraceCommandStart:
+		return min(len, TPM_HEADER_SIZE);
+	default:
+		return len;
+	}
+}
+
+/*
+ * Claims the next slot without taking a lock. The sequence number is
+ * cleared while the slot is filled in and published last, so a reader
+ * that races with a writer sees a mismatched sequence and skips the slot.
+ */
+void tpm_cr50_trace(PCR50_CONTEXT pDevice, CR50_TRACE_TYPE type, UINT32 reg,
+	const UINT8* buf, size_t len, NTSTATUS result, LONGLONG start) {
+	PCR50_TRACE_ENTRY entry;
+	LARGE_INTEGER CurrentTime;
+	ULONG sequence;
+
+	if (!pDevice->TraceRing) {
+		return;
+	}
+
+	KeQuerySystemTimePrecise(&CurrentTime);
+
+	sequence = (ULONG)InterlockedIncrement(&pDevice->TraceNext);
+	entry = &pDevice->TraceRing[sequence & (pDevice->TraceEntries - 1)];
+
+	entry->Sequence = 0;
+	MemoryBarrier();
+
+	entry->Type = (UCHAR)type;
+	entry->Transport = (UCHAR)pDevice->Transport;
+	entry->Length = (USHORT)min(len, MAXUSHORT);
+	entry->Register = reg;
+	entry->Result = result;
+	entry->StartTime = start ? start : CurrentTime.QuadPart;
+	entry->EndTime = CurrentTime.QuadPart;
+	RtlZeroMemory(entry->Data, sizeof(entry->Data));
+	if (buf) {
+		RtlCopyMemory(entry->Data, buf,
+			min(tpm_cr50_trace_visible(pDevice, type, reg, len), sizeof(entry->Data)));
+	}
+
+	MemoryBarrier();
+	entry->Sequence = sequence;
+}
+
+NTSTATUS tpm_cr50_trace_query(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	size_t* bytesReturned) {
+	PCR50_TRACE trace;
+	size_t outLen;
+	ULONG written, first, returned = 0;
+	NTSTATUS status;
+
+	*bytesReturned = 0;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, FIELD_OFFSET(CR50_TRACE, Entries),
+		(PVOID*)&trace, &outLen);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	trace->Magic = CR50_TRACE_MAGIC;
+	trace->Version = CR50_TRACE_VERSION;
+	trace->EntrySize = sizeof(CR50_TRACE_ENTRY);
+	trace->Capacity = pDevice->TraceRing ? pDevice->TraceEntries : 0;
+
+	written = (ULONG)pDevice->TraceNext;
+	trace->Written = written;
+
+	if (pDevice->TraceRing) {
+		ULONG maxEntries = (ULONG)((outLen - FIELD_OFFSET(CR50_TRACE, Entries)) /
+			sizeof(CR50_TRACE_ENTRY));
+		ULONG available = min(written, pDevice->TraceEntries);
+
+		/* Return the newest entries that fit */
+		available = min(available, maxEntries);
+		first = written - available + 1;
+
+		for (ULONG i = 0; i < available; i++) {
+			ULONG sequence = first + i;
+			PCR50_TRACE_ENTRY entry = &pDevice->TraceRing[sequence & (pDevice->TraceEntries - 1)];
+
+			RtlCopyMemory(&trace->Entries[returned], entry, sizeof(*entry));
+			MemoryBarrier();
+
+			/* Drop slots that were overwritten while being copied */
+			if (trace->Entries[returned].Sequence != sequence ||
+				entry->Sequence != sequence)
+				continue;
+			returned++;
+		}
+	}
+
+	trace->EntriesReturned = returned;
+	*bytesReturned = FIELD_OFFSET(CR50_TRACE, Entries[returned]);
+	return STATUS_SUCCESS;
+}
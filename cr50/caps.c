@@ -0,0 +1,438 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+//
+// Cache of what GetCapability reports about the TPM itself.
+//
+// The fixed TPM properties, the implemented algorithms and commands and
+// the PCR allocation do not change while the TPM runs the same
+// firmware. They are read once after the first startup and kept in the
+// device context, and a copy is saved in the device's registry key. On
+// later boots only the firmware version is asked for; if it matches the
+// saved copy, that is used instead of reading everything again.
+//
+// GetCapability commands for these categories are answered from the
+// cache with the response the TPM would have given, including how many
+// entries it returns per response, which is learned while reading.
+// Property ranges that reach past the fixed properties into the
+// variable ones are still sent to the TPM.
+//
+
+/* Entries per response when the TPM returned every entry at once */
+#define CR50_CAPS_UNLIMITED	MAXULONG
+
+#define CR50_CAPS_VALUE_NAME	L"CapabilityCache"
+
+/**
+ * tpm_cr50_caps_query() - Send GetCapability with the command lock held.
+ * @list:	Receives the capability data after its type, a count
+ *		followed by the entries.
+ * @length:	Receives the length of @list.
+ */
+static NTSTATUS tpm_cr50_caps_query(PCR50_CONTEXT pDevice, UINT32 cap, UINT32 property,
+	UINT32 count, const UINT8** list, ULONG* length, BOOLEAN* more) {
+	ULONG_PTR args[3] = { cap, property, count };
+	UINT8* rsp = pDevice->InternalResponse;
+	size_t len = sizeof(pDevice->InternalResponse);
+	NTSTATUS status;
+	UINT32 rc;
+
+	status = tpm_cr50_internal(pDevice, TPM2_CMD_GET_CAPABILITY, args, &rc);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (rc != TPM2_RC_SUCCESS) {
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"GetCapability(0x%x, 0x%x) failed 0x%x\n", cap, property, rc);
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	if (tpm2_field(TPM2_CMD_GET_CAPABILITY, rsp, len, TPM2_GET_CAPABILITY_CAPABILITY) != cap) {
+		return STATUS_DEVICE_PROTOCOL_ERROR;
+	}
+
+	*more = tpm2_field(TPM2_CMD_GET_CAPABILITY, rsp, len, TPM2_GET_CAPABILITY_MORE_DATA) != 0;
+	*list = rsp + 15;
+	*length = RtlUlongByteSwap(*((UINT32*)(rsp + 2))) - 15;
+	return STATUS_SUCCESS;
+}
+
+/*
+ * Key that GetCapability's property selects entries by: the property
+ * of a TPMS_TAGGED_PROPERTY (8 bytes), the algorithm of a
+ * TPMS_ALG_PROPERTY (6 bytes) or the command index and vendor bit of a
+ * TPMA_CC (4 bytes).
+ */
+static UINT32 tpm_cr50_caps_entry_key(const UINT8* e, ULONG size) {
+	switch (size) {
+	case 4:
+		return RtlUlongByteSwap(*((UINT32*)e)) & 0x2000FFFF;
+	case 6:
+		return RtlUshortByteSwap(*((UINT16*)e));
+	default:
+		return RtlUlongByteSwap(*((UINT32*)e));
+	}
+}
+
+/*
+ * Reads a category of @size byte entries page by page, from the key
+ * @first on, leaving out entries from the key @last on.
+ */
+static NTSTATUS tpm_cr50_caps_read_list(PCR50_CONTEXT pDevice, UINT32 cap, UINT32 first,
+	UINT32 last, ULONG size, UINT8* entries, ULONG max, ULONG* count, ULONG* page) {
+	UINT32 property = first;
+	const UINT8* list;
+	ULONG length, n;
+	BOOLEAN more;
+	NTSTATUS status;
+
+	*count = 0;
+	*page = CR50_CAPS_UNLIMITED;
+
+	do {
+		status = tpm_cr50_caps_query(pDevice, cap, property, max, &list, &length, &more);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
+		n = RtlUlongByteSwap(*((UINT32*)list));
+		if (length < 4 || (length - 4) / size < n) {
+			return STATUS_DEVICE_PROTOCOL_ERROR;
+		}
+
+		/* A short page with more to come is the TPM's limit per response */
+		if (more && n < max && *page == CR50_CAPS_UNLIMITED) {
+			*page = n;
+		}
+
+		for (ULONG i = 0; i < n; i++) {
+			const UINT8* e = list + 4 + i * size;
+			UINT32 key = tpm_cr50_caps_entry_key(e, size);
+
+			if (key >= last) {
+				return STATUS_SUCCESS;
+			}
+			if (*count == max) {
+				return STATUS_BUFFER_OVERFLOW;
+			}
+
+			RtlCopyMemory(entries + *count * size, e, size);
+			(*count)++;
+			property = key + 1;
+		}
+	} while (more && n);
+
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS tpm_cr50_caps_gather(PCR50_CONTEXT pDevice) {
+	PCR50_CAPS caps = &pDevice->Caps;
+	const UINT8* list;
+	ULONG length;
+	BOOLEAN more;
+	NTSTATUS status;
+
+	RtlZeroMemory(caps, sizeof(*caps));
+
+	/* A category with more entries than there is room for is not cached */
+	status = tpm_cr50_caps_read_list(pDevice, TPM2_CAP_TPM_PROPERTIES, TPM2_PT_FIXED,
+		TPM2_PT_VAR, 8, (UINT8*)caps->Properties, CR50_CAPS_MAX_PROPERTIES,
+		&caps->PropertyCount, &caps->PropertyPage);
+	if (status == STATUS_BUFFER_OVERFLOW) {
+		caps->PropertyCount = 0;
+	}
+	else if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = tpm_cr50_caps_read_list(pDevice, TPM2_CAP_ALGS, 0, MAXULONG, 6,
+		caps->Algs, CR50_CAPS_MAX_ALGS, &caps->AlgCount, &caps->AlgPage);
+	if (status == STATUS_BUFFER_OVERFLOW) {
+		caps->AlgCount = 0;
+	}
+	else if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = tpm_cr50_caps_read_list(pDevice, TPM2_CAP_COMMANDS, 0, MAXULONG, 4,
+		(UINT8*)caps->Commands, CR50_CAPS_MAX_COMMANDS, &caps->CommandCount,
+		&caps->CommandPage);
+	if (status == STATUS_BUFFER_OVERFLOW) {
+		caps->CommandCount = 0;
+	}
+	else if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/* Every bank comes back at once, the property is not used */
+	status = tpm_cr50_caps_query(pDevice, TPM2_CAP_PCRS, 0, 1, &list, &length, &more);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+	if (!more && length <= sizeof(caps->Pcrs)) {
+		RtlCopyMemory(caps->Pcrs, list, length);
+		caps->PcrLength = length;
+	}
+
+	tpm_cr50_caps_property(pDevice, TPM2_PT_FIRMWARE_VERSION_1, &caps->Firmware[0]);
+	tpm_cr50_caps_property(pDevice, TPM2_PT_FIRMWARE_VERSION_2, &caps->Firmware[1]);
+	caps->VendorId = pDevice->VendorId;
+	caps->Size = sizeof(*caps);
+	caps->Magic = CR50_CAPS_MAGIC;
+	return STATUS_SUCCESS;
+}
+
+static WDFKEY tpm_cr50_caps_open(PCR50_CONTEXT pDevice, ACCESS_MASK access) {
+	WDFKEY key;
+
+	if (!NT_SUCCESS(WdfDeviceOpenRegistryKey(pDevice->FxDevice, PLUGPLAY_REGKEY_DEVICE,
+		access, WDF_NO_OBJECT_ATTRIBUTES, &key))) {
+		return NULL;
+	}
+	return key;
+}
+
+/* Loads the saved copy if it was taken from the same chip and firmware */
+static BOOLEAN tpm_cr50_caps_load(PCR50_CONTEXT pDevice, const UINT32* firmware) {
+	DECLARE_CONST_UNICODE_STRING(valueName, CR50_CAPS_VALUE_NAME);
+	PCR50_CAPS caps = &pDevice->Caps;
+	ULONG length = 0, type = 0;
+	WDFKEY key;
+	NTSTATUS status;
+
+	key = tpm_cr50_caps_open(pDevice, KEY_READ);
+	if (!key) {
+		return FALSE;
+	}
+
+	status = WdfRegistryQueryValue(key, &valueName, sizeof(*caps), caps, &length, &type);
+	WdfRegistryClose(key);
+
+	if (!NT_SUCCESS(status) || type != REG_BINARY || length != sizeof(*caps) ||
+		caps->Magic != CR50_CAPS_MAGIC || caps->Size != sizeof(*caps) ||
+		caps->VendorId != pDevice->VendorId ||
+		caps->Firmware[0] != firmware[0] || caps->Firmware[1] != firmware[1] ||
+		caps->PropertyCount > CR50_CAPS_MAX_PROPERTIES ||
+		caps->AlgCount > CR50_CAPS_MAX_ALGS ||
+		caps->CommandCount > CR50_CAPS_MAX_COMMANDS ||
+		caps->PcrLength > sizeof(caps->Pcrs)) {
+		RtlZeroMemory(caps, sizeof(*caps));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void tpm_cr50_caps_save(PCR50_CONTEXT pDevice) {
+	DECLARE_CONST_UNICODE_STRING(valueName, CR50_CAPS_VALUE_NAME);
+	WDFKEY key;
+	NTSTATUS status;
+
+	key = tpm_cr50_caps_open(pDevice, KEY_WRITE);
+	if (!key) {
+		return;
+	}
+
+	status = WdfRegistryAssignValue(key, &valueName, REG_BINARY, sizeof(pDevice->Caps),
+		&pDevice->Caps);
+	if (!NT_SUCCESS(status)) {
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"Could not save the capability cache 0x%x\n", status);
+	}
+	WdfRegistryClose(key);
+}
+
+static void tpm_cr50_caps_forget(PCR50_CONTEXT pDevice) {
+	DECLARE_CONST_UNICODE_STRING(valueName, CR50_CAPS_VALUE_NAME);
+	WDFKEY key;
+
+	key = tpm_cr50_caps_open(pDevice, KEY_WRITE);
+	if (key) {
+		WdfRegistryRemoveValue(key, &valueName);
+		WdfRegistryClose(key);
+	}
+}
+
+/*
+ * Fills the cache after the TPM has started, from the registry if the
+ * firmware is the one it was saved for. Called with the command lock held.
+ */
+void tpm_cr50_caps_init(PCR50_CONTEXT pDevice) {
+	UINT32 firmware[2] = { 0 };
+	const UINT8* list;
+	ULONG length;
+	BOOLEAN more;
+	NTSTATUS status;
+
+	if (pDevice->CapsSource != Cr50CapsNone && !pDevice->CapsReload) {
+		return;
+	}
+
+	if (!pDevice->CapsReload) {
+		status = tpm_cr50_caps_query(pDevice, TPM2_CAP_TPM_PROPERTIES,
+			TPM2_PT_FIRMWARE_VERSION_1, 2, &list, &length, &more);
+		if (NT_SUCCESS(status) && length >= 20 &&
+			RtlUlongByteSwap(*((UINT32*)list)) == 2 &&
+			RtlUlongByteSwap(*((UINT32*)(list + 4))) == TPM2_PT_FIRMWARE_VERSION_1 &&
+			RtlUlongByteSwap(*((UINT32*)(list + 12))) == TPM2_PT_FIRMWARE_VERSION_2) {
+			firmware[0] = RtlUlongByteSwap(*((UINT32*)(list + 8)));
+			firmware[1] = RtlUlongByteSwap(*((UINT32*)(list + 16)));
+
+			if (tpm_cr50_caps_load(pDevice, firmware)) {
+				pDevice->CapsSource = Cr50CapsRegistry;
+				return;
+			}
+		}
+	}
+
+	pDevice->CapsSource = Cr50CapsNone;
+	pDevice->CapsReload = FALSE;
+
+	status = tpm_cr50_caps_gather(pDevice);
+	if (!NT_SUCCESS(status)) {
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"Could not read the TPM capabilities 0x%x\n", status);
+		RtlZeroMemory(&pDevice->Caps, sizeof(pDevice->Caps));
+		return;
+	}
+
+	pDevice->CapsSource = Cr50CapsQueried;
+	tpm_cr50_caps_save(pDevice);
+}
+
+/* Looks up a fixed TPM property, FALSE if it is not cached */
+BOOLEAN tpm_cr50_caps_property(PCR50_CONTEXT pDevice, UINT32 property, UINT32* value) {
+	PCR50_CAPS caps = &pDevice->Caps;
+
+	for (ULONG i = 0; i < caps->PropertyCount; i++) {
+		if (RtlUlongByteSwap(caps->Properties[i][0]) == property) {
+			*value = RtlUlongByteSwap(caps->Properties[i][1]);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Index of the first entry whose key is at least @property */
+static ULONG tpm_cr50_caps_find(const UINT8* entries, ULONG count, ULONG size, UINT32 property) {
+	ULONG i;
+
+	for (i = 0; i < count; i++) {
+		if (tpm_cr50_caps_entry_key(entries + i * size, size) >= property)
+			break;
+	}
+	return i;
+}
+
+/**
+ * tpm_cr50_caps_lookup() - Answer GetCapability from the cache.
+ *
+ * Returns TRUE if @rsp holds the response, in which case the command
+ * must not be sent.
+ */
+BOOLEAN tpm_cr50_caps_lookup(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len,
+	UINT8* rsp, size_t rsp_len) {
+	PCR50_CAPS caps = &pDevice->Caps;
+	const UINT8* entries;
+	ULONG size, count, page, first, n;
+	UINT32 cap, property, requested;
+	UINT8 more;
+
+	if (pDevice->CapsSource == Cr50CapsNone || cmd_len != 22 ||
+		RtlUshortByteSwap(*((UINT16*)cmd)) != TPM2_ST_NO_SESSIONS ||
+		RtlUlongByteSwap(*((UINT32*)(cmd + 6))) != TPM2_CC_GET_CAPABILITY) {
+		return FALSE;
+	}
+
+	cap = RtlUlongByteSwap(*((UINT32*)(cmd + 10)));
+	property = RtlUlongByteSwap(*((UINT32*)(cmd + 14)));
+	requested = RtlUlongByteSwap(*((UINT32*)(cmd + 18)));
+
+	switch (cap) {
+	case TPM2_CAP_TPM_PROPERTIES:
+		entries = (const UINT8*)caps->Properties;
+		size = 8;
+		count = caps->PropertyCount;
+		page = caps->PropertyPage;
+		break;
+	case TPM2_CAP_ALGS:
+		entries = caps->Algs;
+		size = 6;
+		count = caps->AlgCount;
+		page = caps->AlgPage;
+		break;
+	case TPM2_CAP_COMMANDS:
+		entries = (const UINT8*)caps->Commands;
+		size = 4;
+		count = caps->CommandCount;
+		page = caps->CommandPage;
+		break;
+	case TPM2_CAP_PCRS:
+		if (!caps->PcrLength || rsp_len < 15 + caps->PcrLength)
+			goto miss;
+
+		*((UINT16*)rsp) = RtlUshortByteSwap(TPM2_ST_NO_SESSIONS);
+		*((UINT32*)(rsp + 2)) = RtlUlongByteSwap(15 + caps->PcrLength);
+		*((UINT32*)(rsp + 6)) = RtlUlongByteSwap(TPM2_RC_SUCCESS);
+		rsp[10] = 0;
+		*((UINT32*)(rsp + 11)) = RtlUlongByteSwap(cap);
+		RtlCopyMemory(rsp + 15, caps->Pcrs, caps->PcrLength);
+		pDevice->CapsHits++;
+		return TRUE;
+	default:
+		return FALSE;
+	}
+
+	if (!count || !requested)
+		goto miss;
+
+	first = tpm_cr50_caps_find(entries, count, size, property);
+	n = min(requested, page);
+
+	if (cap == TPM2_CAP_TPM_PROPERTIES) {
+		/* Only the fixed properties are cached, the variable ones follow */
+		if (property >= TPM2_PT_VAR || n > count - first)
+			goto miss;
+		more = 1;
+	}
+	else {
+		n = min(n, count - first);
+		more = first + n < count;
+	}
+
+	if (rsp_len < 19 + n * size)
+		goto miss;
+
+	*((UINT16*)rsp) = RtlUshortByteSwap(TPM2_ST_NO_SESSIONS);
+	*((UINT32*)(rsp + 2)) = RtlUlongByteSwap(19 + n * size);
+	*((UINT32*)(rsp + 6)) = RtlUlongByteSwap(TPM2_RC_SUCCESS);
+	rsp[10] = more;
+	*((UINT32*)(rsp + 11)) = RtlUlongByteSwap(cap);
+	*((UINT32*)(rsp + 15)) = RtlUlongByteSwap(n);
+	RtlCopyMemory(rsp + 19, entries + first * size, n * size);
+	pDevice->CapsHits++;
+	return TRUE;
+
+miss:
+	pDevice->CapsMisses++;
+	return FALSE;
+}
+
+/*
+ * PCR_Allocate takes effect at the next TPM reset, after which the
+ * cached allocation is stale, so it is read again at the next startup
+ * and the saved copy is dropped in case that is after a reboot.
+ */
+void tpm_cr50_caps_update(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len,
+	NTSTATUS status, const UINT8* rsp, size_t rsp_len) {
+	if (!NT_SUCCESS(status) || cmd_len < TPM_HEADER_SIZE || rsp_len < TPM_HEADER_SIZE ||
+		RtlUlongByteSwap(*((UINT32*)(cmd + 6))) != TPM2_CC_PCR_ALLOCATE ||
+		tpm2_response_code(rsp) != TPM2_RC_SUCCESS) {
+		return;
+	}
+
+	pDevice->CapsReload = TRUE;
+	tpm_cr50_caps_forget(pDevice);
+}
@@ -0,0 +1,401 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+#define CR50_RETRY_DELAY_MS	2	/* First backoff after TPM_RC_RETRY */
+#define CR50_TESTING_DELAY_MS	10	/* First backoff after TPM_RC_TESTING */
+
+/**
+ * tpm_cr50_send_retry() - Send a command, retrying transient warnings.
+ * @pDevice:	Device context.
+ * @queued:	Time the command was submitted, or 0.
+ *
+ * TPM_RC_YIELDED is resent at once, TPM_RC_RETRY and TPM_RC_TESTING
+ * after an exponential backoff that starts longer for TESTING, since a
+ * self-test takes much longer than the TPM is ever busy. The warning is
+ * only returned to the caller once the long command duration has been
+ * spent waiting.
+ */
+static NTSTATUS tpm_cr50_send_retry(PCR50_CONTEXT pDevice, UINT8* cmd, size_t cmd_len,
+	UINT8* rsp, size_t rsp_len, LONGLONG queued) {
+	BOOLEAN yielded = FALSE;
+	ULONG delay = 0, waited = 0;
+	UINT32 ordinal, rc;
+	NTSTATUS status;
+
+	if (cmd_len < TPM_HEADER_SIZE) {
+		return STATUS_INVALID_BUFFER_SIZE;
+	}
+
+	ordinal = RtlUlongByteSwap(*((UINT32*)(cmd + 6)));
+
+	for (;;) {
+		status = tpm_cr50_transmit(pDevice, cmd, cmd_len, rsp, rsp_len, queued);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+		queued = 0;
+
+		rc = tpm2_response_code(rsp);
+		if (rc != TPM2_RC_YIELDED && rc != TPM2_RC_RETRY && rc != TPM2_RC_TESTING)
+			return status;
+
+		/* For the self-test commands TESTING means the tests were started */
+		if (rc == TPM2_RC_TESTING && (ordinal == TPM2_CC_SELF_TEST ||
+			ordinal == TPM2_CC_INCREMENTAL_SELF_TEST))
+			return status;
+
+		if (rc == TPM2_RC_YIELDED && !yielded) {
+			yielded = TRUE;
+			continue;
+		}
+
+		if (waited >= pDevice->Durations[TPM2_DURATION_LONG]) {
+			Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+				"Command 0x%x still answered 0x%x after %d ms\n", ordinal, rc, waited);
+			return status;
+		}
+
+		if (!delay)
+			delay = rc == TPM2_RC_TESTING ? CR50_TESTING_DELAY_MS : CR50_RETRY_DELAY_MS;
+		else
+			delay *= 2;
+
+		LARGE_INTEGER WaitInterval;
+		WaitInterval.QuadPart = -10 * 1000 * (LONGLONG)delay;
+		KeDelayExecutionThread(KernelMode, FALSE, &WaitInterval);
+		waited += delay;
+	}
+}
+
+/*
+ * Like tpm_cr50_send_retry(), but NV reads, capability queries, loads
+ * of cached keys and creates of registered templates are answered from
+ * the caches and the key pool when possible.
+ */
+NTSTATUS tpm_cr50_transmit_retry(PCR50_CONTEXT pDevice, UINT8* cmd, size_t cmd_len,
+	UINT8* rsp, size_t rsp_len, LONGLONG queued) {
+	NTSTATUS status;
+
+	if (tpm_cr50_nv_lookup(pDevice, cmd, cmd_len, rsp, rsp_len) ||
+		tpm_cr50_caps_lookup(pDevice, cmd, cmd_len, rsp, rsp_len) ||
+		tpm_cr50_keys_lookup(pDevice, cmd, cmd_len, rsp, rsp_len) ||
+		tpm_cr50_keygen_lookup(pDevice, cmd, cmd_len, rsp, rsp_len)) {
+		return STATUS_SUCCESS;
+	}
+
+	status = tpm_cr50_send_retry(pDevice, cmd, cmd_len, rsp, rsp_len, queued);
+
+	/* Cached keys nobody holds give way to the command's objects */
+	while (NT_SUCCESS(status) && tpm_cr50_keys_evict(pDevice, rsp))
+		status = tpm_cr50_send_retry(pDevice, cmd, cmd_len, rsp, rsp_len, 0);
+
+	tpm_cr50_nv_update(pDevice, cmd, cmd_len, status, rsp, rsp_len);
+	tpm_cr50_caps_update(pDevice, cmd, cmd_len, status, rsp, rsp_len);
+	tpm_cr50_keys_update(pDevice, cmd, cmd_len, status, rsp, rsp_len);
+	tpm_cr50_keygen_update(pDevice, cmd, cmd_len);
+	return status;
+}
+
+/**
+ * tpm_cr50_internal() - Send one of the driver's own commands.
+ * @args:	Variable fields of @cmd, see tpm2_build().
+ * @rc:		Receives the response code.
+ *
+ * Builds @cmd in the command buffer and leaves the response in the
+ * internal response buffer. Called with the command lock held.
+ */
+NTSTATUS tpm_cr50_internal(PCR50_CONTEXT pDevice, TPM2_CMD cmd, const ULONG_PTR* args,
+	UINT32* rc) {
+	size_t len;
+	NTSTATUS status;
+
+	len = tpm2_build(cmd, pDevice->CommandBuffer, sizeof(pDevice->CommandBuffer), args);
+	if (!len) {
+		return STATUS_INVALID_BUFFER_SIZE;
+	}
+
+	status = tpm_cr50_transmit_retry(pDevice, pDevice->CommandBuffer, len,
+		pDevice->InternalResponse, sizeof(pDevice->InternalResponse), 0);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	return tpm2_parse(cmd, pDevice->InternalResponse, sizeof(pDevice->InternalResponse), rc);
+}
+
+static NTSTATUS tpm_cr50_startup(PCR50_CONTEXT pDevice) {
+	ULONG_PTR su = TPM2_SU_STATE;
+	NTSTATUS status;
+	UINT32 rc;
+
+	/* Startup(STATE) resumes the state saved by Shutdown */
+	status = tpm_cr50_internal(pDevice, TPM2_CMD_STARTUP, &su, &rc);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/*
+	 * INITIALIZE means the firmware or an earlier D0 entry already ran
+	 * Startup, which is the common case when resuming from S0 idle.
+	 */
+	if (rc != TPM2_RC_SUCCESS && rc != TPM2_RC_INITIALIZE) {
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"Startup(STATE) failed 0x%x, trying Startup(CLEAR)\n", rc);
+
+		su = TPM2_SU_CLEAR;
+		status = tpm_cr50_internal(pDevice, TPM2_CMD_STARTUP, &su, &rc);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
+		if (rc != TPM2_RC_SUCCESS && rc != TPM2_RC_INITIALIZE) {
+			return STATUS_TPM_FAIL;
+		}
+	}
+
+	status = tpm_cr50_internal(pDevice, TPM2_CMD_INCREMENTAL_SELF_TEST, NULL, &rc);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (rc != TPM2_RC_SUCCESS && rc != TPM2_RC_TESTING) {
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"IncrementalSelfTest failed 0x%x\n", rc);
+		return STATUS_TPM_FAIL;
+	}
+
+	return status;
+}
+
+/*
+ * Starts the TPM if a D0 entry asked for it and makes sure it is still
+ * powered. Called by the consumer with the command lock held. Commands
+ * are let through even when startup failed so that callers see the
+ * TPM's own error instead of hanging.
+ */
+BOOLEAN tpm_cr50_ensure_started(PCR50_CONTEXT pDevice) {
+	NTSTATUS status;
+
+	if (pDevice->StartupPending) {
+		status = tpm_cr50_startup(pDevice);
+		if (!NT_SUCCESS(status)) {
+			Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+				"TPM startup failed 0x%x\n", status);
+		}
+		else {
+			tpm_cr50_caps_init(pDevice);
+		}
+
+		pDevice->StartupPending = FALSE;
+		pDevice->TpmStarted = TRUE;
+	}
+
+	return pDevice->TpmStarted;
+}
+
+/*
+ * Waits for the D0 entry a pending power reference started. Returns
+ * FALSE if the ring is stopped first, as the device is then going away
+ * and may never enter D0 again.
+ */
+static BOOLEAN tpm_cr50_wait_d0(PCR50_CONTEXT pDevice) {
+	PVOID objects[2] = { &pDevice->D0Event, &pDevice->RingEvent };
+
+	for (;;) {
+		if (pDevice->RingStopping)
+			return FALSE;
+
+		/* A kick of the ring wakes the wait only to look at RingStopping */
+		if (KeWaitForMultipleObjects(ARRAYSIZE(objects), objects, WaitAny, Executive,
+			KernelMode, FALSE, NULL, NULL) == STATUS_WAIT_0)
+			return !pDevice->RingStopping;
+	}
+}
+
+/*
+ * Takes a power reference and the command lock for running submitted
+ * commands on the consumer thread. A D0 exit for a system sleep can slip
+ * in between the two, in which case the power reference is taken again,
+ * which waits for the next D0 entry. The reference is taken without
+ * blocking in the framework, so that stopping the ring on removal
+ * never waits for a D0 entry that will not come.
+ */
+NTSTATUS tpm_cr50_begin(PCR50_CONTEXT pDevice) {
+	NTSTATUS status;
+
+	for (;;) {
+		if (pDevice->RingStopping) {
+			return STATUS_DEVICE_REMOVED;
+		}
+
+		status = WdfDeviceStopIdle(pDevice->FxDevice, FALSE);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
+		if (status == STATUS_PENDING && !tpm_cr50_wait_d0(pDevice)) {
+			WdfDeviceResumeIdle(pDevice->FxDevice);
+			return STATUS_DEVICE_REMOVED;
+		}
+
+		WdfWaitLockAcquire(pDevice->CommandLock, NULL);
+		if (tpm_cr50_ensure_started(pDevice)) {
+			return STATUS_SUCCESS;
+		}
+		WdfWaitLockRelease(pDevice->CommandLock);
+		WdfDeviceResumeIdle(pDevice->FxDevice);
+	}
+}
+
+void tpm_cr50_end(PCR50_CONTEXT pDevice) {
+	WdfWaitLockRelease(pDevice->CommandLock);
+	WdfDeviceResumeIdle(pDevice->FxDevice);
+}
+
+/* Runs one submitted command on the consumer thread */
+static NTSTATUS tpm_cr50_execute(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	LONGLONG queued, UINT8 locality, BOOLEAN last, size_t* bytesReturned) {
+	UINT8* cmd;
+	UINT8* rsp;
+	size_t cmd_len, rsp_len;
+	NTSTATUS status;
+
+	status = WdfRequestRetrieveInputBuffer(Request, TPM_HEADER_SIZE, (PVOID*)&cmd, &cmd_len);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(Request, TPM_HEADER_SIZE, (PVOID*)&rsp, &rsp_len);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	tpm_cr50_idle_arrival(pDevice, queued);
+
+	status = tpm_cr50_begin(pDevice);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/*
+	 * Input and output share the system buffer, and a retried
+	 * command must be sent again after the response overwrote it.
+	 */
+	RtlCopyMemory(pDevice->CommandBuffer, cmd, cmd_len);
+
+	tpm_cr50_select_locality(pDevice, locality);
+	pDevice->LocalityCommands[locality]++;
+	pDevice->HoldLocality = !last;
+
+	status = tpm_cr50_transmit_retry(pDevice, pDevice->CommandBuffer, cmd_len,
+		rsp, rsp_len, queued);
+
+	/* A pooled session may hold the room the command needs */
+	if (NT_SUCCESS(status) && (tpm2_response_code(rsp) == TPM2_RC_SESSION_MEMORY ||
+		tpm2_response_code(rsp) == TPM2_RC_SESSION_HANDLES) &&
+		tpm_cr50_session_evict(pDevice)) {
+		status = tpm_cr50_transmit_retry(pDevice, pDevice->CommandBuffer, cmd_len,
+			rsp, rsp_len, 0);
+	}
+
+	tpm_cr50_end(pDevice);
+
+	if (NT_SUCCESS(status)) {
+		*bytesReturned = min(RtlUlongByteSwap(*((UINT32*)(rsp + 2))), rsp_len);
+	}
+	return status;
+}
+
+/**
+ * tpm_cr50_complete() - Run a queued command, batch, NV write, quote or session start and complete its request.
+ * @locality:	Locality the submitting handle is bound to.
+ * @last:	No further command for @locality follows in this batch, so
+ *		the locality may be given up afterwards.
+ */
+void tpm_cr50_complete(PCR50_CONTEXT pDevice, WDFREQUEST Request, LONGLONG queued,
+	UINT8 locality, BOOLEAN last) {
+	WDF_REQUEST_PARAMETERS params;
+	size_t bytesReturned = 0;
+	NTSTATUS status;
+
+	WDF_REQUEST_PARAMETERS_INIT(&params);
+	WdfRequestGetParameters(Request, &params);
+
+	if (params.Parameters.DeviceIoControl.IoControlCode == IOCTL_CR50_SUBMIT_BATCH)
+		status = tpm_cr50_batch_execute(pDevice, Request, queued, locality, last,
+			&bytesReturned);
+	else if (params.Parameters.DeviceIoControl.IoControlCode == IOCTL_CR50_NV_WRITE)
+		status = tpm_cr50_nv_write_execute(pDevice, Request, queued, locality, last,
+			&bytesReturned);
+	else if (params.Parameters.DeviceIoControl.IoControlCode == IOCTL_CR50_QUOTE)
+		status = tpm_cr50_quote_execute(pDevice, Request, queued, locality, last,
+			&bytesReturned);
+	else if (params.Parameters.DeviceIoControl.IoControlCode == IOCTL_CR50_SESSION_ACQUIRE)
+		status = tpm_cr50_session_execute(pDevice, Request, queued, locality, last,
+			&bytesReturned);
+	else
+		status = tpm_cr50_execute(pDevice, Request, queued, locality, last, &bytesReturned);
+	WdfRequestCompleteWithInformation(Request, status, bytesReturned);
+}
+
+/*
+ * Validates a submitted command and hands it to the consumer thread.
+ * Returns STATUS_PENDING when the request was queued, in which case the
+ * consumer completes it.
+ */
+NTSTATUS tpm_cr50_submit(PCR50_CONTEXT pDevice, WDFREQUEST Request) {
+	UINT8* cmd;
+	UINT8* rsp;
+	size_t cmd_len, rsp_len;
+	LONGLONG queued = tpm_cr50_timestamp();
+	NTSTATUS status;
+
+	status = WdfRequestRetrieveInputBuffer(Request, TPM_HEADER_SIZE, (PVOID*)&cmd, &cmd_len);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(Request, TPM_HEADER_SIZE, (PVOID*)&rsp, &rsp_len);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (cmd_len > CR50_MAX_COMMAND_SIZE ||
+		RtlUlongByteSwap(*((UINT32*)(cmd + 2))) != cmd_len) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	WDFFILEOBJECT fileObject = WdfRequestGetFileObject(Request);
+	UINT8 locality = fileObject ? GetFileContext(fileObject)->Locality : 0;
+
+	return tpm_cr50_ring_submit(pDevice, Request, queued, locality);
+}
+
+NTSTATUS tpm_cr50_set_locality(PCR50_CONTEXT pDevice, WDFREQUEST Request) {
+	PCR50_LOCALITY input;
+	WDFFILEOBJECT fileObject;
+	NTSTATUS status;
+
+	UNREFERENCED_PARAMETER(pDevice);
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(*input), (PVOID*)&input, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	fileObject = WdfRequestGetFileObject(Request);
+	if (!fileObject || input->Locality >= CR50_LOCALITY_COUNT) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	/* Higher localities are meant for the platform's trusted agents */
+	if (input->Locality > 0 && WdfRequestGetRequestorMode(Request) == UserMode &&
+		!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_TCB_PRIVILEGE), UserMode)) {
+		return STATUS_PRIVILEGE_NOT_HELD;
+	}
+
+	GetFileContext(fileObject)->Locality = (UINT8)input->Locality;
+	return STATUS_SUCCESS;
+}
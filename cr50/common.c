@@ -39,8 +39,13 @@ NTSTATUS tpm_cr50_spi_request_locality(PCR50_CONTEXT pDevice);
 NTSTATUS tpm_cr50_spi_tis_status(PCR50_CONTEXT pDevice, UINT8* buf, size_t sz);
 NTSTATUS tpm_cr50_spi_tis_status_write(PCR50_CONTEXT pDevice, UINT8* buf, size_t sz);
 void tpm_cr50_spi_tis_set_ready(PCR50_CONTEXT pDevice);
+void tpm_cr50_spi_irq_init(PCR50_CONTEXT pDevice);
+void tpm_cr50_spi_tis_wait(PCR50_CONTEXT pDevice, UINT8 sts, ULONG us);
 
 void tpm_cr50_release_locality(PCR50_CONTEXT pDevice, BOOLEAN force) {
+	/* Without force the TPM may keep the locality, so check it on the next request */
+	pDevice->ActiveLocality = CR50_NO_LOCALITY;
+
 	if (pDevice->Transport == CR50_TRANSPORT_I2C) {
 		tpm_cr50_i2c_release_locality(pDevice, force);
 		return;
@@ -53,14 +58,46 @@ void tpm_cr50_release_locality(PCR50_CONTEXT pDevice, BOOLEAN force) {
 }
 
 NTSTATUS tpm_cr50_request_locality(PCR50_CONTEXT pDevice) {
+	NTSTATUS status;
+
+	/*
+	 * Still held from the previous command of a batch. Another locality
+	 * can only take over after we release, so ACCESS need not be read.
+	 */
+	if (pDevice->ActiveLocality == pDevice->Locality) {
+		pDevice->HandshakesSaved++;
+		return STATUS_SUCCESS;
+	}
+
 	if (pDevice->Transport == CR50_TRANSPORT_I2C) {
-		return tpm_cr50_i2c_request_locality(pDevice);
+		status = tpm_cr50_i2c_request_locality(pDevice);
 	}
 	else if (pDevice->Transport == CR50_TRANSPORT_SPI) {
-		return tpm_cr50_spi_request_locality(pDevice);
+		status = tpm_cr50_spi_request_locality(pDevice);
 	}
-	ASSERTMSG("Invalid Transport", FALSE);
-	return STATUS_UNSUCCESSFUL;
+	else {
+		ASSERTMSG("Invalid Transport", FALSE);
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	/* After a failure the TPM may hold any locality or none */
+	pDevice->ActiveLocality = NT_SUCCESS(status) ? pDevice->Locality : CR50_NO_LOCALITY;
+	return status;
+}
+
+/*
+ * Makes @locality the one used for register access. The previous one
+ * is given up first: the TPM only grants a request once the active
+ * locality has been released.
+ */
+void tpm_cr50_select_locality(PCR50_CONTEXT pDevice, UINT8 locality) {
+	if (pDevice->Locality == locality) {
+		return;
+	}
+
+	tpm_cr50_release_locality(pDevice, TRUE);
+	pDevice->Locality = locality;
+	pDevice->LocalitySwitches[locality]++;
 }
 
 NTSTATUS tpm_cr50_tis_status(PCR50_CONTEXT pDevice, UINT8* buf, size_t sz) {
@@ -98,22 +135,28 @@ void tpm_cr50_tis_set_ready(PCR50_CONTEXT pDevice) {
 }
 
 NTSTATUS tpm_cr50_tis_read_data_fifo(PCR50_CONTEXT pDevice, UINT8* buf, size_t burstcnt) {
+	pDevice->Inflight.FifoBursts++;
+	pDevice->Inflight.BytesReceived += (ULONG)burstcnt;
+
 	if (pDevice->Transport == CR50_TRANSPORT_I2C) {
-		return tpm_cr50_i2c_read(pDevice, TPM_I2C_DATA_FIFO(0), buf, burstcnt);
+		return tpm_cr50_i2c_read(pDevice, TPM_I2C_DATA_FIFO(pDevice->Locality), buf, burstcnt);
 	}
 	else if (pDevice->Transport == CR50_TRANSPORT_SPI) {
-		return tpm2_read_reg_spi(pDevice, TPM_DATA_FIFO(0), buf, burstcnt);
+		return tpm2_read_reg_spi(pDevice, TPM_DATA_FIFO(pDevice->Locality), buf, burstcnt);
 	}
 	ASSERTMSG("Invalid Transport", FALSE);
 	return STATUS_UNSUCCESSFUL;
 }
 
 NTSTATUS tpm_cr50_tis_write_data_fifo(PCR50_CONTEXT pDevice, UINT8* buf, size_t burstcnt) {
+	pDevice->Inflight.FifoBursts++;
+	pDevice->Inflight.BytesSent += (ULONG)burstcnt;
+
 	if (pDevice->Transport == CR50_TRANSPORT_I2C) {
-		return tpm_cr50_i2c_write(pDevice, TPM_I2C_DATA_FIFO(0), buf, burstcnt);
+		return tpm_cr50_i2c_write(pDevice, TPM_I2C_DATA_FIFO(pDevice->Locality), buf, burstcnt);
 	}
 	else if (pDevice->Transport == CR50_TRANSPORT_SPI) {
-		return tpm2_write_reg_spi(pDevice, TPM_DATA_FIFO(0), buf, burstcnt);
+		return tpm2_write_reg_spi(pDevice, TPM_DATA_FIFO(pDevice->Locality), buf, burstcnt);
 	}
 	ASSERTMSG("Invalid Transport", FALSE);
 	return STATUS_UNSUCCESSFUL;
@@ -121,11 +164,60 @@ NTSTATUS tpm_cr50_tis_write_data_fifo(PCR50_CONTEXT pDevice, UINT8* buf, size_t
 
 NTSTATUS tpm_cr50_read_vendor(PCR50_CONTEXT pDevice, UINT8* buf, size_t sz) {
 	if (pDevice->Transport == CR50_TRANSPORT_I2C) {
-		return tpm_cr50_i2c_read(pDevice, TPM_I2C_DID_VID(0), buf, sz);
+		return tpm_cr50_i2c_read(pDevice, TPM_I2C_DID_VID(pDevice->Locality), buf, sz);
 	}
 	else if (pDevice->Transport == CR50_TRANSPORT_SPI) {
-		return tpm2_read_reg_spi(pDevice, TPM_DID_VID(0), buf, sz);
+		return tpm2_read_reg_spi(pDevice, TPM_DID_VID(pDevice->Locality), buf, sz);
 	}
 	ASSERTMSG("Invalid Transport", FALSE);
 	return STATUS_UNSUCCESSFUL;
-}
\ No newline at end of file
+}
+
+/*
+ * The I2C interface has no TIS interrupt registers: its interrupt line
+ * is the ready pulse after every transfer, see i2c.c.
+ */
+void tpm_cr50_tis_irq_init(PCR50_CONTEXT pDevice) {
+	if (pDevice->Transport == CR50_TRANSPORT_SPI) {
+		tpm_cr50_spi_irq_init(pDevice);
+	}
+}
+
+/* Waits up to @us for the TPM to set the TPM_STS bits in @sts */
+void tpm_cr50_tis_wait(PCR50_CONTEXT pDevice, UINT8 sts, ULONG us) {
+	LARGE_INTEGER WaitInterval;
+
+	if (pDevice->Transport == CR50_TRANSPORT_SPI) {
+		tpm_cr50_spi_tis_wait(pDevice, sts, us);
+		return;
+	}
+
+	WaitInterval.QuadPart = -10 * (LONGLONG)us;
+	KeDelayExecutionThread(KernelMode, FALSE, &WaitInterval);
+}
+
+/*
+ * Sets the largest FIFO transfer and allocates the I2C write buffer for
+ * it. On SPI a transfer is chained from 64 byte frames after a single
+ * wake of the TPM, so only its burst count bounds it. An I2C
+ * transfer reaches the controller as a single write of the register
+ * address and the data, which BusMaxTransfer bounds; its default is the
+ * 64 bytes every controller takes.
+ */
+NTSTATUS tpm_cr50_transfer_init(PCR50_CONTEXT pDevice) {
+	ULONG max = pDevice->BusMaxTransfer;
+
+	if (pDevice->Transport == CR50_TRANSPORT_SPI) {
+		pDevice->BurstMax = max ? max : CR50_MAX_COMMAND_SIZE;
+	}
+	else {
+		pDevice->BurstMax = (max ? max : TPM_CR50_MAX_BUFSIZE) - 1;
+	}
+	pDevice->BurstMax = max(1, min(pDevice->BurstMax, CR50_MAX_COMMAND_SIZE));
+
+	pDevice->buf = ExAllocatePoolZero(NonPagedPool, pDevice->BurstMax + 1, CR50_POOL_TAG);
+	if (!pDevice->buf) {
+		return STATUS_MEMORY_NOT_ALLOCATED;
+	}
+	return STATUS_SUCCESS;
+}
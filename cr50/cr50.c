@@ -42,6 +42,17 @@ __in PUNICODE_STRING RegistryPath
 	return status;
 }
 
+/*
+ * Applies the cap on bus handshake waits that is set while the device
+ * powers down. The wait for a command to execute is never capped, see
+ * tpm_cr50_tis_recv().
+ */
+static ULONG tpm_cr50_timeout(PCR50_CONTEXT pDevice, ULONG timeout) {
+	if (pDevice->TimeoutCap && timeout > pDevice->TimeoutCap)
+		return pDevice->TimeoutCap;
+	return timeout;
+}
+
 UINT8 tpm_cr50_tis_status_inline(PCR50_CONTEXT pDevice) {
 	UINT8 buf[4];
 	if (!NT_SUCCESS(tpm_cr50_tis_status(pDevice, buf, sizeof(buf)))) {
@@ -51,7 +62,7 @@ UINT8 tpm_cr50_tis_status_inline(PCR50_CONTEXT pDevice) {
 }
 
 static NTSTATUS tpm_cr50_get_burst_and_status(PCR50_CONTEXT pDevice, UINT8 mask,
-	size_t* burst, UINT32* status) {
+	size_t* burst, UINT32* status, ULONG timeout) {
 	LARGE_INTEGER StopTime;
 
 	LARGE_INTEGER CurrentTime;
@@ -60,13 +71,16 @@ static NTSTATUS tpm_cr50_get_burst_and_status(PCR50_CONTEXT pDevice, UINT8 mask,
 	UINT8 buf[4];
 	*status = 0;
 
-	StopTime.QuadPart = CurrentTime.QuadPart + (10 * 1000 * TIS_LONG_TIMEOUT);
+	StopTime.QuadPart = CurrentTime.QuadPart + (10 * 1000 * (LONGLONG)timeout);
 	while (CurrentTime.QuadPart < StopTime.QuadPart) {
 		NTSTATUS ret = tpm_cr50_tis_status(pDevice, buf, sizeof(buf));
 		LARGE_INTEGER WaitInterval;
-		WaitInterval.QuadPart = -10 * 1000 * TPM_CR50_TIMEOUT_SHORT_MS;
+		WaitInterval.QuadPart = -10 * (LONGLONG)pDevice->Timing->PollUs;
+
+		pDevice->Inflight.StatusPolls++;
 
 		if (!NT_SUCCESS(ret)) {
+			pDevice->Inflight.Retries++;
 			KeDelayExecutionThread(KernelMode, FALSE, &WaitInterval);
 
 			KeQuerySystemTimePrecise(&CurrentTime);
@@ -76,13 +90,29 @@ static NTSTATUS tpm_cr50_get_burst_and_status(PCR50_CONTEXT pDevice, UINT8 mask,
 		*status = *buf;
 		*burst = *((UINT16*)(buf + 1));
 
-		if ((*status & mask) == mask && *burst > 0 && *burst <= TPM_CR50_MAX_BUFSIZE - 1)
+		/* A larger burst only allows more per transfer than the bus takes */
+		if ((*status & mask) == mask && *burst > 0) {
+			tpm_cr50_trace(pDevice, Cr50TraceStatus, mask, buf, sizeof(buf), STATUS_SUCCESS, 0);
+			pDevice->BurstSeen = max(pDevice->BurstSeen, (ULONG)*burst);
+			*burst = tpm_cr50_health_chunk(pDevice, *burst);
 			return STATUS_SUCCESS;
+		}
+
+		tpm_cr50_trace(pDevice, Cr50TraceStatus, mask, buf, sizeof(buf), STATUS_RETRY, 0);
+		pDevice->Inflight.Misses++;
+		pDevice->Inflight.LastMiss = tpm_cr50_timestamp();
 
 		Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
 			"burst/mask, status: 0x%x, mask: 0x%x, burst: %lld\n", *status & mask, mask, *burst);
 
-		KeDelayExecutionThread(KernelMode, FALSE, &WaitInterval);
+		/*
+		 * Near a predicted completion poll finely, otherwise sleep until
+		 * the missing bits are raised; a short burst is polled.
+		 */
+		if (pDevice->Inflight.FineUntil > pDevice->Inflight.LastMiss)
+			KeStallExecutionProcessor(CR50_PREDICT_POLL_US);
+		else
+			tpm_cr50_tis_wait(pDevice, (UINT8)(mask & ~*status), pDevice->Timing->PollUs);
 		KeQuerySystemTimePrecise(&CurrentTime);
 	}
 
@@ -101,12 +131,35 @@ static NTSTATUS tpm_cr50_tis_recv(PCR50_CONTEXT pDevice, UINT8* buf, size_t buf_
 		return STATUS_INVALID_BUFFER_SIZE;
 	}
 
-	ret = tpm_cr50_get_burst_and_status(pDevice, mask, &burstcnt, &status);
+	/* Sleep through most of the learned execution time, then poll */
+	tpm_cr50_predict_wait(pDevice);
+
+	/*
+	 * Wait for the command to complete, bounded by its duration class
+	 * even while the device powers down: a Shutdown cut short loses the
+	 * state saved for the next Startup.
+	 */
+	ret = tpm_cr50_get_burst_and_status(pDevice, mask, &burstcnt, &status,
+		pDevice->CommandDuration);
 	if (!NT_SUCCESS(ret)) {
+		/*
+		 * Writing commandReady aborts the command that is executing,
+		 * which Shutdown(STATE) must never be; the TPM may still
+		 * complete it.
+		 */
+		if (ret == STATUS_TIMEOUT && pDevice->Inflight.Ordinal != TPM2_CC_SHUTDOWN) {
+			Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+				"Command did not complete in %d ms, aborting\n", pDevice->CommandDuration);
+			tpm_cr50_tis_set_ready(pDevice);
+		}
 		goto out_err;
 	}
 
-	if (burstcnt > buf_len || burstcnt < TPM_HEADER_SIZE) {
+	tpm_cr50_stats_stamp(pDevice, Cr50PhaseExecute);
+	tpm_cr50_predict_learn(pDevice);
+
+	burstcnt = min(burstcnt, buf_len);
+	if (burstcnt < TPM_HEADER_SIZE) {
 		Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
 			"Unexpected burstcnt: %zu (max=%zu, min=%d)\n",
 			burstcnt, buf_len, TPM_HEADER_SIZE);
@@ -133,7 +186,8 @@ static NTSTATUS tpm_cr50_tis_recv(PCR50_CONTEXT pDevice, UINT8* buf, size_t buf_
 	/* Now read the rest of the data */
 	cur = burstcnt;
 	while (cur < expected) {
-		ret = tpm_cr50_get_burst_and_status(pDevice, mask, &burstcnt, &status);
+		ret = tpm_cr50_get_burst_and_status(pDevice, mask, &burstcnt, &status,
+			tpm_cr50_timeout(pDevice, TIS_SHORT_TIMEOUT));
 		if (!NT_SUCCESS(ret)) {
 			goto out_err;
 		}
@@ -150,7 +204,8 @@ static NTSTATUS tpm_cr50_tis_recv(PCR50_CONTEXT pDevice, UINT8* buf, size_t buf_
 	}
 
 	/* Ensure TPM is done reading data */
-	ret = tpm_cr50_get_burst_and_status(pDevice, TPM_STS_VALID, &burstcnt, &status);
+	ret = tpm_cr50_get_burst_and_status(pDevice, TPM_STS_VALID, &burstcnt, &status,
+		tpm_cr50_timeout(pDevice, TIS_SHORT_TIMEOUT));
 	if (!NT_SUCCESS(ret)) {
 		goto out_err;
 	}
@@ -162,7 +217,9 @@ static NTSTATUS tpm_cr50_tis_recv(PCR50_CONTEXT pDevice, UINT8* buf, size_t buf_
 		goto out_err;
 	}
 
-	tpm_cr50_release_locality(pDevice, FALSE);
+	/* Within a batch the locality is kept for the next command */
+	if (!pDevice->HoldLocality)
+		tpm_cr50_release_locality(pDevice, FALSE);
 	return ret;
 
 out_err:
@@ -179,6 +236,14 @@ static NTSTATUS tpm_cr50_tis_send(PCR50_CONTEXT pDevice, UINT8* buf, size_t len)
 	UINT32 status;
 	NTSTATUS ret;
 
+	if (len < TPM_HEADER_SIZE) {
+		return STATUS_INVALID_BUFFER_SIZE;
+	}
+
+	pDevice->CommandDuration = pDevice->Durations[
+		tpm2_ordinal_duration(RtlUlongByteSwap(*((UINT32*)(buf + 6))))];
+	tpm_cr50_predict_select(pDevice, buf, len);
+
 	ret = tpm_cr50_request_locality(pDevice);
 	if (!NT_SUCCESS(ret))
 		return ret;
@@ -188,7 +253,8 @@ static NTSTATUS tpm_cr50_tis_send(PCR50_CONTEXT pDevice, UINT8* buf, size_t len)
 
 	LARGE_INTEGER CurrentTime;
 	KeQuerySystemTimePrecise(&CurrentTime);
-	StopTime.QuadPart = CurrentTime.QuadPart + (10 * 1000 * TIS_LONG_TIMEOUT);
+	StopTime.QuadPart = CurrentTime.QuadPart +
+		(10 * 1000 * (LONGLONG)tpm_cr50_timeout(pDevice, TIS_LONG_TIMEOUT));
 
 	while (!(tpm_cr50_tis_status_inline(pDevice) & TPM_STS_COMMAND_READY)) {
 		KeQuerySystemTimePrecise(&CurrentTime);
@@ -208,15 +274,18 @@ static NTSTATUS tpm_cr50_tis_send(PCR50_CONTEXT pDevice, UINT8* buf, size_t len)
 			mask |= TPM_STS_DATA_EXPECT;
 
 		/* Read burst count and check status */
-		ret = tpm_cr50_get_burst_and_status(pDevice, mask, &burstcnt, &status);
+		ret = tpm_cr50_get_burst_and_status(pDevice, mask, &burstcnt, &status,
+			tpm_cr50_timeout(pDevice, TIS_SHORT_TIMEOUT));
 		if (!NT_SUCCESS(ret))
 			goto out_err;
 
 		/*
-		 * Use burstcnt - 1 to account for the address byte
+		 * On I2C use burstcnt - 1, as Cr50 counts the address byte
 		 * that is inserted by tpm_cr50_i2c_write()
 		 */
-		limit = min((size_t)(burstcnt - 1), (size_t)(len));
+		if (pDevice->Transport == CR50_TRANSPORT_I2C && burstcnt > 1)
+			burstcnt--;
+		limit = min((size_t)(burstcnt), (size_t)(len));
 		ret = tpm_cr50_tis_write_data_fifo(pDevice, &buf[sent], limit);
 		if (!NT_SUCCESS(ret)) {
 			Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
@@ -229,7 +298,8 @@ static NTSTATUS tpm_cr50_tis_send(PCR50_CONTEXT pDevice, UINT8* buf, size_t len)
 	}
 
 	/* Ensure TPM is not expecting more data */
-	ret = tpm_cr50_get_burst_and_status(pDevice, TPM_STS_VALID, &burstcnt, &status);
+	ret = tpm_cr50_get_burst_and_status(pDevice, TPM_STS_VALID, &burstcnt, &status,
+		tpm_cr50_timeout(pDevice, TIS_SHORT_TIMEOUT));
 	if (!NT_SUCCESS(ret))
 		goto out_err;
 	if (status & TPM_STS_DATA_EXPECT) {
@@ -247,6 +317,8 @@ static NTSTATUS tpm_cr50_tis_send(PCR50_CONTEXT pDevice, UINT8* buf, size_t len)
 			"Start command failed\n");
 		goto out_err;
 	}
+
+	tpm_cr50_stats_stamp(pDevice, Cr50PhaseSend);
 	return STATUS_SUCCESS;
 
 out_err:
@@ -258,6 +330,54 @@ out_err:
 	return ret;
 }
 
+/**
+ * tpm_cr50_transmit_overlap() - Send a command and receive its response.
+ * @pDevice:	Device context.
+ * @cmd:	Marshalled command, at least TPM_HEADER_SIZE bytes.
+ * @rsp:	Buffer for the response.
+ * @queued:	Time the command was submitted, or 0 if it was not queued.
+ * @overlap:	Called once the TPM has started executing the command, or NULL.
+ *
+ * @overlap runs while the TPM is busy, ahead of the wait for the
+ * response; it must not touch @cmd or @rsp, and on the bus may only
+ * read TPM_STS or set commandCancel. Accounts the command in the per
+ * command code statistics.
+ */
+NTSTATUS tpm_cr50_transmit_overlap(PCR50_CONTEXT pDevice, UINT8* cmd, size_t cmd_len,
+	UINT8* rsp, size_t rsp_len, LONGLONG queued, PCR50_OVERLAP overlap, PVOID context) {
+	NTSTATUS status;
+	UINT32 ordinal;
+	LONGLONG start;
+
+	if (cmd_len < TPM_HEADER_SIZE) {
+		return STATUS_INVALID_BUFFER_SIZE;
+	}
+
+	ordinal = RtlUlongByteSwap(*((UINT32*)(cmd + 6)));
+	start = tpm_cr50_timestamp();
+
+	tpm_cr50_trace(pDevice, Cr50TraceCommandStart, ordinal, cmd, cmd_len, STATUS_SUCCESS, start);
+	tpm_cr50_stats_begin(pDevice, ordinal, queued);
+
+	status = tpm_cr50_tis_send(pDevice, cmd, cmd_len);
+	if (NT_SUCCESS(status)) {
+		if (overlap)
+			overlap(context);
+		status = tpm_cr50_tis_recv(pDevice, rsp, rsp_len);
+	}
+
+	tpm_cr50_stats_end(pDevice, status);
+	tpm_cr50_trace(pDevice, Cr50TraceCommandEnd, ordinal,
+		NT_SUCCESS(status) ? rsp : NULL, NT_SUCCESS(status) ? TPM_HEADER_SIZE : 0,
+		status, start);
+	return status;
+}
+
+NTSTATUS tpm_cr50_transmit(PCR50_CONTEXT pDevice, UINT8* cmd, size_t cmd_len,
+	UINT8* rsp, size_t rsp_len, LONGLONG queued) {
+	return tpm_cr50_transmit_overlap(pDevice, cmd, cmd_len, rsp, rsp_len, queued, NULL, NULL);
+}
+
 /**
  * tpm_cr50_req_canceled() - Callback to notify a request cancel.
  * @chip:	A TPM chip.
@@ -280,6 +400,24 @@ NTSTATUS InitializeCR50(
 	UINT32 vendor;
 	UINT8 buf[4];
 
+	if (pDevice->VendorId) {
+		/*
+		 * The identity was cached by the first probe. On resume a single
+		 * DID_VID read is enough to know the same chip is answering; the
+		 * locality is requested by the first command that needs it.
+		 */
+		status = tpm_cr50_read_vendor(pDevice, buf, sizeof(buf));
+		if (NT_SUCCESS(status) && *((UINT32*)buf) == pDevice->VendorId) {
+			return status;
+		}
+
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"Cached identity check failed, probing again\n");
+		pDevice->VendorId = 0;
+	}
+
+	tpm_cr50_select_locality(pDevice, 0);
+
 	status = tpm_cr50_request_locality(pDevice);
 	if (!NT_SUCCESS(status)) {
 		Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
@@ -308,6 +446,9 @@ NTSTATUS InitializeCR50(
 		vendor == TPM_TI50_DID_VID ? "ti50" : "cr50",
 		vendor >> 16);
 
+	tpm_cr50_tis_irq_init(pDevice);
+
+	pDevice->VendorId = vendor;
 	return status;
 }
 
@@ -316,6 +457,9 @@ NTSTATUS ReleaseCR50(
 	)
 {
 	tpm_cr50_release_locality(pDevice, TRUE);
+
+	/* The interrupt enables may not survive the TPM's sleep */
+	pDevice->TisIrqLocalities = 0;
 	return STATUS_SUCCESS;
 }
 
@@ -358,6 +502,7 @@ Status
 	//
 
 	ULONG resourceCount = WdfCmResourceListGetCount(FxResourcesTranslated);
+	pDevice->InterruptFound = FALSE;
 
 	for (ULONG i = 0; i < resourceCount; i++)
 	{
@@ -370,6 +515,10 @@ Status
 
 		switch (pDescriptor->Type)
 		{
+		case CmResourceTypeInterrupt:
+			pDevice->InterruptFound = TRUE;
+			pDevice->InterruptFlags = pDescriptor->Flags;
+			break;
 		case CmResourceTypeConnection:
 			//
 			// Look for I2C or SPI resource and save connection ID.
@@ -446,9 +595,14 @@ Status
 		return STATUS_INVALID_CONNECTION;
 	}
 
-	pDevice->buf = ExAllocatePoolZero(NonPagedPool, TPM_CR50_MAX_BUFSIZE, CR50_POOL_TAG);
-	if (!pDevice->buf) {
-		return STATUS_MEMORY_NOT_ALLOCATED;
+	status = tpm_cr50_transfer_init(pDevice);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = tpm_cr50_ring_start(pDevice);
+	if (!NT_SUCCESS(status)) {
+		return status;
 	}
 
 	return status;
@@ -480,8 +634,14 @@ Status
 
 	UNREFERENCED_PARAMETER(FxResourcesTranslated);
 
+	tpm_cr50_quote_flush(pDevice);
+	tpm_cr50_ring_stop(pDevice);
+	tpm_cr50_idle_release(pDevice);
+	tpm_cr50_nv_flush(pDevice);
+
 	if (pDevice->buf) {
 		ExFreePoolWithTag(pDevice->buf, CR50_POOL_TAG);
+		pDevice->buf = NULL;
 	}
 
 	if (pDevice->Transport == CR50_TRANSPORT_I2C) {
@@ -516,13 +676,25 @@ Status
 
 --*/
 {
-	UNREFERENCED_PARAMETER(FxPreviousState);
-
 	PCR50_CONTEXT pDevice = GetDeviceContext(FxDevice);
 	NTSTATUS status = STATUS_SUCCESS;
+	LONGLONG start = tpm_cr50_timestamp();
+
+	/* The TPM may have been reset while the device was off */
+	pDevice->ActiveLocality = CR50_NO_LOCALITY;
 
 	status = InitializeCR50(pDevice);
+	if (NT_SUCCESS(status)) {
+		/* Startup and self-test run on the consumer thread, not inside D0 entry */
+		WdfWaitLockAcquire(pDevice->CommandLock, NULL);
+		pDevice->StartupPending = TRUE;
+		pDevice->KeygenStop = FALSE;
+		WdfWaitLockRelease(pDevice->CommandLock);
+		KeSetEvent(&pDevice->D0Event, IO_NO_INCREMENT, FALSE);
+		tpm_cr50_ring_kick(pDevice);
+	}
 
+	tpm_cr50_stats_transition(pDevice, Cr50TransitionD0Entry, FxPreviousState, start, status);
 	return status;
 }
 
@@ -548,47 +720,69 @@ Status
 
 --*/
 {
-	UNREFERENCED_PARAMETER(FxTargetState);
-
 	PCR50_CONTEXT pDevice = GetDeviceContext(FxDevice);
 
 	NTSTATUS status = STATUS_SUCCESS;
+	LONGLONG start = tpm_cr50_timestamp();
+
+	KeClearEvent(&pDevice->D0Event);
+
+	/* Cancels a Create of the key pool holding the command lock */
+	pDevice->KeygenStop = TRUE;
+
+	WdfWaitLockAcquire(pDevice->CommandLock, NULL);
+	pDevice->StartupPending = FALSE;
+	pDevice->TpmStarted = FALSE;
+
+	/* NV may change while the driver is not looking, e.g. from firmware */
+	tpm_cr50_nv_flush(pDevice);
+
+	/* Shutdown is sent from locality 0, even in the middle of a batch */
+	pDevice->HoldLocality = FALSE;
+	tpm_cr50_select_locality(pDevice, 0);
+
+	/*
+	 * The bus handshakes of the shutdown are capped so a TPM that stopped
+	 * responding cannot hold up the system power transition. Execution
+	 * keeps the full duration of Shutdown.
+	 */
+	ULONG_PTR su = TPM2_SU_STATE;
+	size_t len;
+	UINT32 rc;
+
+	pDevice->TimeoutCap = pDevice->ShutdownTimeout;
+
+	/* Pooled sessions are started again after the next D0 entry */
+	tpm_cr50_session_forget_all(pDevice);
+	tpm_cr50_keys_forget(pDevice);
 
-	UINT8 shutdown_cmd[] = {
-		0x80, 0x01,		/* TPM_ST_COMMAND_TAG (0x8001) */
-		0, 0, 0, 12,	/* Length in bytes */
-		0, 0, 0x01, 0x45,	/* TPM_CC_Shutdown (0x145) */
-		0x00, 0x01
-	};
-	status = tpm_cr50_tis_send(pDevice, shutdown_cmd, sizeof(shutdown_cmd));
+	len = tpm2_build(TPM2_CMD_SHUTDOWN, pDevice->CommandBuffer,
+		sizeof(pDevice->CommandBuffer), &su);
+	status = tpm_cr50_transmit(pDevice, pDevice->CommandBuffer, len,
+		pDevice->InternalResponse, sizeof(pDevice->InternalResponse), 0);
+	pDevice->TimeoutCap = 0;
 	if (!NT_SUCCESS(status)) {
 		Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
 			"Failed to send TPM shutdown command\n");
-		return status;
+		goto out;
 	}
 
-	UINT8 shutdown_response[TPM_HEADER_SIZE];
-	status = tpm_cr50_tis_recv(pDevice, shutdown_response, TPM_HEADER_SIZE);
-	if (!NT_SUCCESS(status)) {
+	status = tpm2_parse(TPM2_CMD_SHUTDOWN, pDevice->InternalResponse,
+		sizeof(pDevice->InternalResponse), &rc);
+	if (NT_SUCCESS(status) && rc != TPM2_RC_SUCCESS) {
 		Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
-			"Failed to receive TPM shutdown response\n");
-		return status;
+			"TPM shutdown failed 0x%x\n", rc);
+		status = STATUS_TPM_FAIL;
 	}
-
-	UINT8 expected_response[] = {
-		0x80, 0x01,		/* TPM_ST_COMMAND_TAG (0x8001) */
-		0, 0, 0, 10,
-		0, 0, 0, 0
-	};
-	if (memcmp(shutdown_response, expected_response, TPM_HEADER_SIZE) != 0) {
-		return STATUS_TPM_FAIL;
+	if (!NT_SUCCESS(status)) {
+		goto out;
 	}
 
 	status = ReleaseCR50(pDevice);
-	if (!NT_SUCCESS(status)) {
-		return status;
-	}
 
+out:
+	WdfWaitLockRelease(pDevice->CommandLock);
+	tpm_cr50_stats_transition(pDevice, Cr50TransitionD0Exit, FxTargetState, start, status);
 	return status;
 }
 
@@ -602,6 +796,12 @@ BOOLEAN OnInterruptIsr(
 
 	pDevice->InterruptServiced = TRUE;
 
+	/* TPM_INT_STATUS is acknowledged by the waiter, see spi.c */
+	if (pDevice->TisIrqEnable) {
+		InterlockedIncrement64(&pDevice->TisInterrupts);
+		KeSetEvent(&pDevice->TisEvent, IO_NO_INCREMENT, FALSE);
+	}
+
 	return TRUE;
 }
 
@@ -639,6 +839,21 @@ IN PWDFDEVICE_INIT DeviceInit
 		WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &pnpCallbacks);
 	}
 
+	//
+	// The interface sends raw commands to the TPM and resets the
+	// statistics, so only SYSTEM and administrators may open the device.
+	// cr50.inf sets the same descriptor on the whole device stack.
+	//
+
+	status = WdfDeviceInitAssignSDDLString(DeviceInit, &SDDL_DEVOBJ_SYS_ALL_ADM_ALL);
+	if (!NT_SUCCESS(status))
+	{
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"WdfDeviceInitAssignSDDLString failed 0x%x\n", status);
+
+		return status;
+	}
+
 	//
 	// Because we are a virtual device the root enumerator would just put null values 
 	// in response to IRP_MN_QUERY_ID. Lets override that.
@@ -665,7 +880,23 @@ IN PWDFDEVICE_INIT DeviceInit
 	// Setup the device context
 	//
 
+	{
+		WDF_FILEOBJECT_CONFIG fileConfig;
+
+		//
+		// Each handle carries the locality its commands are sent from,
+		// locality 0 until IOCTL_CR50_SET_LOCALITY changes it, and owns
+		// the authorization sessions it acquired until it is closed.
+		//
+		WDF_FILEOBJECT_CONFIG_INIT(&fileConfig, Cr50EvtDeviceFileCreate,
+			WDF_NO_EVENT_CALLBACK, Cr50EvtFileCleanup);
+		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, CR50_FILE_CONTEXT);
+
+		WdfDeviceInitSetFileObjectConfig(DeviceInit, &fileConfig, &attributes);
+	}
+
 	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, CR50_CONTEXT);
+	attributes.EvtCleanupCallback = Cr50EvtDeviceCleanup;
 
 	//
 	// Create a framework device object.This call will in turn create
@@ -683,8 +914,116 @@ IN PWDFDEVICE_INIT DeviceInit
 		return status;
 	}
 
+	devContext = GetDeviceContext(device);
+	devContext->FxDevice = device;
+
+	Cr50LoadSettings(devContext);
+
+	status = tpm_cr50_trace_init(devContext);
+	if (!NT_SUCCESS(status))
+	{
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"tpm_cr50_trace_init failed 0x%x\n", status);
+
+		return status;
+	}
+
+	status = tpm_cr50_stats_init(devContext);
+	if (!NT_SUCCESS(status))
+	{
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"tpm_cr50_stats_init failed 0x%x\n", status);
+
+		return status;
+	}
+
+	tpm_cr50_ring_init(devContext);
+
+	devContext->ActiveLocality = CR50_NO_LOCALITY;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = device;
+
+	status = WdfWaitLockCreate(&attributes, &devContext->CommandLock);
+	if (!NT_SUCCESS(status))
+	{
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"WdfWaitLockCreate failed 0x%x\n", status);
+
+		return status;
+	}
+
+	status = tpm_cr50_idle_init(devContext);
+	if (!NT_SUCCESS(status))
+	{
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"tpm_cr50_idle_init failed 0x%x\n", status);
+
+		return status;
+	}
+
+	status = tpm_cr50_health_init(devContext);
+	if (!NT_SUCCESS(status))
+	{
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"tpm_cr50_health_init failed 0x%x\n", status);
+
+		return status;
+	}
+
+	status = tpm_cr50_shared_init(devContext);
+	if (!NT_SUCCESS(status))
+	{
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"tpm_cr50_shared_init failed 0x%x\n", status);
+
+		return status;
+	}
+
+	status = tpm_cr50_quote_init(devContext);
+	if (!NT_SUCCESS(status))
+	{
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"tpm_cr50_quote_init failed 0x%x\n", status);
+
+		return status;
+	}
+
+	status = tpm_cr50_session_init(devContext);
+	if (!NT_SUCCESS(status))
+	{
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"tpm_cr50_session_init failed 0x%x\n", status);
+
+		return status;
+	}
+
+	status = tpm_cr50_keygen_init(devContext);
+	if (!NT_SUCCESS(status))
+	{
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"tpm_cr50_keygen_init failed 0x%x\n", status);
+
+		return status;
+	}
+
+	status = WdfDeviceCreateDeviceInterface(device, &GUID_DEVINTERFACE_CR50, NULL);
+	if (!NT_SUCCESS(status))
+	{
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"WdfDeviceCreateDeviceInterface failed 0x%x\n", status);
+
+		return status;
+	}
+
 	WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&queueConfig, WdfIoQueueDispatchParallel);
 
+	//
+	// Statistics queries must not power up the TPM, so the default queue
+	// is not power managed.
+	//
+	queueConfig.PowerManaged = WdfFalse;
+	queueConfig.EvtIoDeviceControl = Cr50EvtDeviceControl;
 	queueConfig.EvtIoInternalDeviceControl = Cr50EvtInternalDeviceControl;
 
 	status = WdfIoQueueCreate(device,
@@ -705,8 +1044,6 @@ IN PWDFDEVICE_INIT DeviceInit
 	// Create manual I/O queue to take care of hid report read requests
 	//
 
-	devContext = GetDeviceContext(device);
-
 	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
 
 	queueConfig.PowerManaged = WdfFalse;
@@ -751,12 +1088,14 @@ IN PWDFDEVICE_INIT DeviceInit
 
 	WdfInterruptDisable(devContext->Interrupt);
 
+	KeInitializeEvent(&devContext->TisEvent, SynchronizationEvent, FALSE);
+
 	{
 		WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS IdleSettings;
 
 		WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS_INIT(&IdleSettings, IdleCannotWakeFromS0);
 		IdleSettings.IdleTimeoutType = SystemManagedIdleTimeoutWithHint;
-		IdleSettings.IdleTimeout = 1000;
+		IdleSettings.IdleTimeout = devContext->IdleTimeout;
 		IdleSettings.UserControlOfIdleSettings = IdleDoNotAllowUserControl;
 
 		WdfDeviceAssignS0IdleSettings(device, &IdleSettings);
@@ -769,11 +1108,99 @@ IN PWDFDEVICE_INIT DeviceInit
 		WdfDeviceSetDeviceState(device, &deviceState);
 	}
 
-	devContext->FxDevice = device;
-
 	return status;
 }
 
+VOID
+Cr50EvtDeviceCleanup(
+WDFOBJECT Object
+)
+/*++
+
+Routine Description:
+
+Frees what the framework does not free with the device.
+
+Arguments:
+
+Object - a handle to the framework device object
+
+--*/
+{
+	PCR50_CONTEXT pDevice = GetDeviceContext((WDFDEVICE)Object);
+
+	tpm_cr50_quote_cleanup(pDevice);
+	tpm_cr50_keygen_cleanup(pDevice);
+}
+
+VOID
+Cr50EvtDeviceFileCreate(
+WDFDEVICE Device,
+WDFREQUEST Request,
+WDFFILEOBJECT FileObject
+)
+/*++
+
+Routine Description:
+
+Lets only SYSTEM and administrators open the device from user mode.
+The device security descriptor already says so; this also holds when
+the descriptor of the stack was replaced, since every handle can send
+raw commands to the TPM.
+
+Arguments:
+
+Device - a handle to the framework device object
+Request - the create request
+FileObject - a handle to the framework file object
+
+--*/
+{
+	SECURITY_SUBJECT_CONTEXT subjectContext;
+	BOOLEAN admin;
+
+	UNREFERENCED_PARAMETER(Device);
+	UNREFERENCED_PARAMETER(FileObject);
+
+	if (WdfRequestGetRequestorMode(Request) == KernelMode) {
+		WdfRequestComplete(Request, STATUS_SUCCESS);
+		return;
+	}
+
+	/* Called in the context of the thread that opens the device */
+	SeCaptureSubjectContext(&subjectContext);
+	SeLockSubjectContext(&subjectContext);
+	admin = SeTokenIsAdmin(SeQuerySubjectContextToken(&subjectContext));
+	SeUnlockSubjectContext(&subjectContext);
+	SeReleaseSubjectContext(&subjectContext);
+
+	if (!admin) {
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"Open of the device by a non-administrator denied\n");
+	}
+
+	WdfRequestComplete(Request, admin ? STATUS_SUCCESS : STATUS_ACCESS_DENIED);
+}
+
+VOID
+Cr50EvtFileCleanup(
+WDFFILEOBJECT FileObject
+)
+/*++
+
+Routine Description:
+
+Gives up the authorization sessions a closing handle still holds.
+
+Arguments:
+
+FileObject - a handle to the framework file object
+
+--*/
+{
+	tpm_cr50_session_close(GetDeviceContext(WdfFileObjectGetDevice(FileObject)), FileObject);
+}
+
 NTSTATUS
 Cr50EvtWdmPreprocessMnQueryId(
 WDFDEVICE Device,
@@ -879,7 +1306,7 @@ PIRP Irp
 }
 
 VOID
-Cr50EvtInternalDeviceControl(
+Cr50EvtDeviceControl(
 IN WDFQUEUE     Queue,
 IN WDFREQUEST   Request,
 IN size_t       OutputBufferLength,
@@ -890,21 +1317,107 @@ IN ULONG        IoControlCode
 	NTSTATUS            status = STATUS_SUCCESS;
 	WDFDEVICE           device;
 	PCR50_CONTEXT     devContext;
+	size_t              bytesReturned = 0;
 
 	UNREFERENCED_PARAMETER(OutputBufferLength);
-	UNREFERENCED_PARAMETER(InputBufferLength);
 
 	device = WdfIoQueueGetDevice(Queue);
 	devContext = GetDeviceContext(device);
 
 	switch (IoControlCode)
 	{
+	case IOCTL_CR50_QUERY_STATS:
+		status = tpm_cr50_stats_query(devContext, Request, &bytesReturned);
+		break;
+	case IOCTL_CR50_RESET_STATS:
+		status = tpm_cr50_stats_reset(devContext);
+		break;
+	case IOCTL_CR50_QUERY_TRACE:
+		status = tpm_cr50_trace_query(devContext, Request, &bytesReturned);
+		break;
+	case IOCTL_CR50_SUBMIT_COMMAND:
+		status = tpm_cr50_submit(devContext, Request);
+		if (status == STATUS_PENDING) {
+			/* Completed by the consumer thread */
+			return;
+		}
+		break;
+	case IOCTL_CR50_SUBMIT_BATCH:
+		status = tpm_cr50_batch_submit(devContext, Request);
+		if (status == STATUS_PENDING) {
+			/* Completed by the consumer thread */
+			return;
+		}
+		break;
+	case IOCTL_CR50_NV_WRITE:
+		status = tpm_cr50_nv_write_submit(devContext, Request);
+		if (status == STATUS_PENDING) {
+			/* Completed by the consumer thread */
+			return;
+		}
+		break;
+	case IOCTL_CR50_SHARED_REGISTER:
+		status = tpm_cr50_shared_register(devContext, Request);
+		if (status == STATUS_PENDING) {
+			/* Held until cancelled */
+			return;
+		}
+		break;
+	case IOCTL_CR50_SHARED_DOORBELL:
+		status = tpm_cr50_shared_doorbell(devContext, Request, InputBufferLength);
+		if (status == STATUS_PENDING) {
+			/* Completed once the ring holds a completion */
+			return;
+		}
+		break;
+	case IOCTL_CR50_SET_LOCALITY:
+		status = tpm_cr50_set_locality(devContext, Request);
+		break;
+	case IOCTL_CR50_QUERY_HEALTH:
+		status = tpm_cr50_health_query(devContext, Request, &bytesReturned);
+		break;
+	case IOCTL_CR50_QUOTE:
+		status = tpm_cr50_quote_submit(devContext, Request);
+		if (status == STATUS_PENDING) {
+			/* Completed by the consumer thread */
+			return;
+		}
+		break;
+	case IOCTL_CR50_SESSION_ACQUIRE:
+		status = tpm_cr50_session_acquire(devContext, Request, &bytesReturned);
+		if (status == STATUS_PENDING) {
+			/* Completed by the consumer once the session is started */
+			return;
+		}
+		break;
+	case IOCTL_CR50_SESSION_RELEASE:
+		status = tpm_cr50_session_release(devContext, Request);
+		break;
+	case IOCTL_CR50_KEYGEN_TEMPLATE:
+		status = tpm_cr50_keygen_register(devContext, Request);
+		break;
 	default:
 		status = STATUS_NOT_SUPPORTED;
 		break;
 	}
 
-	WdfRequestComplete(Request, status);
+	WdfRequestCompleteWithInformation(Request, status, bytesReturned);
 
 	return;
 }
+
+VOID
+Cr50EvtInternalDeviceControl(
+IN WDFQUEUE     Queue,
+IN WDFREQUEST   Request,
+IN size_t       OutputBufferLength,
+IN size_t       InputBufferLength,
+IN ULONG        IoControlCode
+)
+{
+	//
+	// Kernel mode clients get the same interface as user mode ones.
+	//
+	Cr50EvtDeviceControl(Queue, Request, OutputBufferLength,
+		InputBufferLength, IoControlCode);
+}
@@ -17,6 +17,32 @@ enum tis_status {
 	TPM_STS_DATA_EXPECT = 0x08
 };
 
+/* Bits of the last byte of TPM_STS */
+enum tis_status_ext {
+	TPM_STS_COMMAND_CANCEL = 0x01
+};
+
+enum tis_int_flags {
+	TPM_GLOBAL_INT_ENABLE = 0x80000000,
+	TPM_INTF_BURST_COUNT_STATIC = 0x100,
+	TPM_INTF_CMD_READY_INT = 0x080,
+	TPM_INTF_INT_EDGE_FALLING = 0x040,
+	TPM_INTF_INT_EDGE_RISING = 0x020,
+	TPM_INTF_INT_LEVEL_LOW = 0x010,
+	TPM_INTF_INT_LEVEL_HIGH = 0x008,
+	TPM_INTF_LOCALITY_CHANGE_INT = 0x004,
+	TPM_INTF_STS_VALID_INT = 0x002,
+	TPM_INTF_DATA_AVAIL_INT = 0x001
+};
+
+/* typePolarity field of TPM_INT_ENABLE */
+enum tis_int_type {
+	TPM_INT_LEVEL_HIGH = 0x00,
+	TPM_INT_LEVEL_LOW = 0x08,
+	TPM_INT_EDGE_RISING = 0x10,
+	TPM_INT_EDGE_FALLING = 0x18
+};
+
 enum tis_defaults {
 	TIS_SHORT_TIMEOUT = 750,
 	TIS_LONG_TIMEOUT = 2000,
@@ -32,6 +58,7 @@ enum tis_defaults {
 #define 	TPM_MAX_RNG_DATA   128
 
 #define TPM_CR50_MAX_BUFSIZE		64
+#define TPM_CR50_SPI_MAX_FRAME		64		/* Data bytes in one SPI frame */
 #define TPM_CR50_TIMEOUT_SHORT_MS	2		/* Short timeout during transactions */
 #define TPM_CR50_TIMEOUT_NOIRQ_MS	20		/* Timeout for TPM ready without IRQ */
 #define TPM_CR50_DID_VID		0x00281ae0L	/* Device and vendor ID reg value */
@@ -0,0 +1,743 @@
+#ifndef __CR50_IOCTL_H__
+#define __CR50_IOCTL_H__
+
+//
+// Interface shared between the driver and its user mode clients.
+// Include after <windows.h>/<winioctl.h> (user mode) or <wdm.h> (kernel mode).
+//
+// The device can only be opened by SYSTEM and administrators, since most
+// of these requests reach the TPM. The driver checks the token of the
+// opening thread as well as the device security descriptor.
+//
+
+// {5E3C1F6A-8B2D-4C7E-9A41-3D2F0B6C8E15}
+DEFINE_GUID(GUID_DEVINTERFACE_CR50,
+	0x5e3c1f6a, 0x8b2d, 0x4c7e, 0x9a, 0x41, 0x3d, 0x2f, 0x0b, 0x6c, 0x8e, 0x15);
+
+#define CR50_IOCTL(Function, Access) \
+	CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800 + (Function), METHOD_BUFFERED, (Access))
+
+//
+// IOCTL_CR50_QUERY_STATS
+//
+// Output: CR50_STATS followed by as many CR50_COMMAND_STATS as fit
+//
+#define IOCTL_CR50_QUERY_STATS		CR50_IOCTL(0, FILE_READ_ACCESS)
+
+//
+// IOCTL_CR50_RESET_STATS
+//
+// Zeroes the counters. Waits for the command on the TPM, if any, so
+// that the counters of a command are not cut in half.
+//
+#define IOCTL_CR50_RESET_STATS		CR50_IOCTL(14, FILE_WRITE_ACCESS)
+
+//
+// Phases of a command. Queue runs from submission to the start of the
+// send, Send until GO is written, Execute until the TPM reports dataAvail
+// and Receive until the response has been drained from the FIFO.
+//
+typedef enum _CR50_PHASE {
+	Cr50PhaseQueue,
+	Cr50PhaseSend,
+	Cr50PhaseExecute,
+	Cr50PhaseReceive,
+	Cr50PhaseCount
+} CR50_PHASE;
+
+//
+// Latency histogram bucket i counts samples in [2^i, 2^(i+1)) microseconds.
+// Bucket 0 also holds samples below 1us and the last bucket everything above.
+//
+#define CR50_HISTOGRAM_BUCKETS	24
+
+typedef struct _CR50_COMMAND_STATS {
+	ULONG CommandCode;		/* 0 collects vendor and unknown commands */
+	ULONG Count;
+	ULONG Failures;
+	ULONG Timeouts;
+	ULONG Retries;
+	ULONG StatusPolls;
+	ULONG FifoBursts;
+	ULONG BusTransactions;
+	ULONG64 BytesSent;
+	ULONG64 BytesReceived;
+	ULONG64 TotalUs[Cr50PhaseCount];
+	ULONG Histogram[Cr50PhaseCount][CR50_HISTOGRAM_BUCKETS];
+} CR50_COMMAND_STATS, *PCR50_COMMAND_STATS;
+
+typedef enum _CR50_TRANSITION {
+	Cr50TransitionD0Entry,
+	Cr50TransitionD0Exit,
+	Cr50TransitionCount
+} CR50_TRANSITION;
+
+typedef struct _CR50_TRANSITION_STATS {
+	ULONG Count;
+	ULONG Failures;
+	ULONG LastUs;
+	ULONG MaxUs;
+	ULONG64 TotalUs;
+} CR50_TRANSITION_STATS, *PCR50_TRANSITION_STATS;
+
+typedef struct _CR50_POWER_STATS {
+	ULONG64 TimeInD0;		/* 100ns units */
+	ULONG64 TimeInDx;
+	ULONG IdleHolds;		/* Times the TPM was kept powered between requests */
+	ULONG IdleHoldMs;		/* Current hold window, 0 while traffic is irregular */
+	ULONG ArrivalGapMs;		/* Smoothed request inter-arrival time */
+	ULONG ArrivalJitterMs;		/* Smoothed deviation of the inter-arrival time */
+} CR50_POWER_STATS, *PCR50_POWER_STATS;
+
+typedef struct _CR50_QUEUE_STATS {
+	ULONG64 Enqueued;
+	ULONG64 Rejected;		/* Failed with STATUS_DEVICE_BUSY, the ring was full */
+	ULONG64 Contended;		/* Enqueues that lost a race to another submitter */
+	ULONG Capacity;
+	ULONG MaxDepth;
+	ULONG EnqueueHistogram[CR50_HISTOGRAM_BUCKETS];	/* Bucket i: [2^i, 2^(i+1)) ns */
+} CR50_QUEUE_STATS, *PCR50_QUEUE_STATS;
+
+#define CR50_LOCALITY_COUNT	5
+
+typedef struct _CR50_LOCALITY_STATS {
+	ULONG64 HandshakesSaved;	/* ACCESS requests skipped inside a batch */
+	ULONG64 Commands[CR50_LOCALITY_COUNT];
+	ULONG64 Switches[CR50_LOCALITY_COUNT];	/* Times the locality was switched to */
+} CR50_LOCALITY_STATS, *PCR50_LOCALITY_STATS;
+
+/* Bus the driver talks to */
+typedef struct _CR50_BUS_STATS {
+	ULONG Transport;		/* 0 = I2C, 1 = SPI */
+	ULONG TransferMax;		/* FIFO bytes moved per transaction at most */
+	ULONG BurstSeen;		/* Largest burst count the TPM reported */
+} CR50_BUS_STATS, *PCR50_BUS_STATS;
+
+/* IOCTL_CR50_SUBMIT_BATCH */
+typedef struct _CR50_BATCH_STATS {
+	ULONG64 Batches;
+	ULONG64 Commands;		/* Commands sent as part of a batch */
+	ULONG64 Stopped;		/* Batches cut short by CR50_BATCH_STOP_ON_ERROR */
+	ULONG64 TransitionsSaved;	/* Requests that would otherwise have been needed */
+	ULONG64 WakesSaved;		/* SPI wake sequences skipped */
+} CR50_BATCH_STATS, *PCR50_BATCH_STATS;
+
+/* IOCTL_CR50_SHARED_REGISTER */
+typedef struct _CR50_SHARED_STATS {
+	ULONG Registered;		/* A client ring is registered */
+	ULONG Entries;
+	ULONG64 Doorbells;
+	ULONG64 Commands;
+	ULONG64 Invalid;		/* Entries completed with STATUS_INVALID_PARAMETER */
+	ULONG64 CompletionsFull;	/* Passes stopped because the completion ring was full */
+} CR50_SHARED_STATS, *PCR50_SHARED_STATS;
+
+/* NV index cache */
+typedef struct _CR50_NV_CACHE_STATS {
+	ULONG Budget;			/* NvCacheBytes setting, 0 when disabled */
+	ULONG Bytes;			/* Memory held by cached indexes */
+	ULONG Entries;
+	ULONG Reserved;
+	ULONG64 Hits;
+	ULONG64 Misses;			/* Cacheable reads sent to the TPM */
+	ULONG64 Invalidations;
+	ULONG64 Evictions;		/* Entries dropped to stay within the budget */
+} CR50_NV_CACHE_STATS, *PCR50_NV_CACHE_STATS;
+
+/* IOCTL_CR50_NV_WRITE */
+typedef struct _CR50_NV_WRITE_STATS {
+	ULONG Active;			/* A write is in progress */
+	ULONG Index;			/* Of the write in progress or the last one */
+	ULONG Written;			/* Bytes of it written so far */
+	ULONG Total;
+	ULONG BufferMax;		/* TPM_PT_NV_BUFFER_MAX, 0 until known */
+	ULONG CommandMax;		/* TPM_PT_MAX_COMMAND_SIZE */
+	ULONG64 Writes;
+	ULONG64 Chunks;			/* NV_Write commands sent */
+	ULONG64 Failures;
+} CR50_NV_WRITE_STATS, *PCR50_NV_WRITE_STATS;
+
+/* GetCapability cache */
+typedef struct _CR50_CAPS_STATS {
+	ULONG Source;			/* 0 = not cached, 1 = read from the TPM, 2 = registry */
+	ULONG Properties;		/* Fixed properties cached */
+	ULONG Algorithms;
+	ULONG Commands;
+	ULONG Firmware[2];		/* TPM_PT_FIRMWARE_VERSION_1 and _2 */
+	ULONG64 Hits;
+	ULONG64 Misses;			/* GetCapability commands sent to the TPM */
+} CR50_CAPS_STATS, *PCR50_CAPS_STATS;
+
+/* TIS interrupts (SPI) */
+typedef struct _CR50_IRQ_STATS {
+	ULONG Caps;			/* TPM_INTF_CAPS */
+	ULONG Enable;			/* Value written to TPM_INT_ENABLE, 0 when polling */
+	ULONG64 Interrupts;
+	ULONG64 Wakes;			/* Waits ended by an interrupt */
+	ULONG64 Fallbacks;		/* Waits that timed out and polled */
+} CR50_IRQ_STATS, *PCR50_IRQ_STATS;
+
+/* Predictive completion waits */
+typedef struct _CR50_PREDICT_STATS {
+	ULONG Classes;			/* Command classes with an estimate */
+	ULONG SlackUs;			/* Learned oversleep of the system timer */
+	ULONG64 Waits;			/* Completion waits measured */
+	ULONG64 Sleeps;			/* ... that slept on an estimate first */
+	ULONG64 Polls;			/* Status reads while commands executed */
+	ULONG64 Wasted;			/* ... that found the TPM still busy */
+	ULONG64 Overslept;		/* Sleeps after which the first read found the response */
+	ULONG64 DetectUs;		/* Sum of last busy read to completion read */
+	ULONG64 Detected;		/* Waits in DetectUs */
+} CR50_PREDICT_STATS, *PCR50_PREDICT_STATS;
+
+/* IOCTL_CR50_QUOTE */
+typedef struct _CR50_QUOTE_STATS {
+	ULONG WindowMs;			/* Setting, 0 when requests are not collected */
+	ULONG MaxBatch;			/* Most requests answered by one TPM2_Quote */
+	ULONG64 Requests;		/* Quote requests answered */
+	ULONG64 Quotes;			/* TPM2_Quote commands sent for them */
+	ULONG64 Failures;		/* Requests failed as a whole */
+	ULONG64 WaitUs;			/* Sum of the time requests were collected */
+	ULONG64 LatencyUs;		/* Sum of the time from submission to completion */
+} CR50_QUOTE_STATS, *PCR50_QUOTE_STATS;
+
+/* IOCTL_CR50_SESSION_ACQUIRE */
+typedef struct _CR50_SESSION_STATS {
+	ULONG PoolTarget;		/* Setting, sessions kept started for any handle */
+	ULONG Pooled;			/* Started and not handed out, for any handle */
+	ULONG Cached;			/* ... kept for the handle that released them */
+	ULONG Acquired;			/* Handed out */
+	ULONG64 Hits;			/* Acquired without starting a session */
+	ULONG64 Misses;
+	ULONG64 Started;		/* StartAuthSession commands sent */
+	ULONG64 Flushed;
+	ULONG64 Refreshed;		/* Flushed for reaching the use limit */
+	ULONG64 Evicted;		/* Flushed to make room in the TPM */
+} CR50_SESSION_STATS, *PCR50_SESSION_STATS;
+
+/* Repeated TPM2_Load of the same key blob */
+typedef struct _CR50_KEY_CACHE_STATS {
+	ULONG Capacity;			/* Setting, 0 when disabled */
+	ULONG Entries;			/* Keys kept loaded */
+	ULONG Held;			/* ... of which callers have not flushed yet */
+	ULONG Reserved;
+	ULONG64 Hits;			/* Loads answered with a cached handle */
+	ULONG64 Misses;
+	ULONG64 Stale;			/* Cached handles found flushed or replaced */
+	ULONG64 Evictions;		/* Flushed to make room */
+	ULONG64 FlushesAbsorbed;	/* FlushContexts of cached handles not sent */
+} CR50_KEY_CACHE_STATS, *PCR50_KEY_CACHE_STATS;
+
+/* TPM2_Create answered from keys made ahead, see IOCTL_CR50_KEYGEN_TEMPLATE */
+typedef struct _CR50_KEYGEN_STATS {
+	ULONG MaxDepth;			/* Setting, 0 when the pool is off */
+	ULONG QuietMs;			/* Setting */
+	ULONG Templates;
+	ULONG Ready;			/* Keys created and not handed out */
+	ULONG64 Generated;
+	ULONG64 Served;			/* Creates answered from the pool */
+	ULONG64 Misses;			/* ... that matched a template with no key ready */
+	ULONG64 Cancels;		/* Creates of the pool that gave way */
+	ULONG64 Failures;
+	ULONG64 GenerateUs;		/* Sum of the time of the Creates in Generated */
+} CR50_KEYGEN_STATS, *PCR50_KEYGEN_STATS;
+
+#define CR50_STATS_VERSION	20
+
+typedef struct _CR50_STATS {
+	ULONG Version;
+	ULONG Size;			/* Bytes needed to return every entry */
+	ULONG64 Uptime100ns;		/* Time since the counters were last reset */
+	ULONG64 IdleBusTransactions;	/* Bus transactions outside of any command */
+	CR50_TRANSITION_STATS Transitions[Cr50TransitionCount];
+	CR50_POWER_STATS Power;
+	CR50_QUEUE_STATS Queue;
+	CR50_LOCALITY_STATS Locality;
+	CR50_BUS_STATS Bus;
+	CR50_BATCH_STATS Batch;
+	CR50_SHARED_STATS Shared;
+	CR50_NV_CACHE_STATS NvCache;
+	CR50_NV_WRITE_STATS NvWrite;
+	CR50_CAPS_STATS Caps;
+	CR50_IRQ_STATS Irq;
+	CR50_PREDICT_STATS Predict;
+	CR50_QUOTE_STATS Quote;
+	CR50_SESSION_STATS Session;
+	CR50_KEY_CACHE_STATS KeyCache;
+	CR50_KEYGEN_STATS Keygen;
+	ULONG CommandsReturned;
+	ULONG CommandsTotal;
+	CR50_COMMAND_STATS Commands[1];
+} CR50_STATS, *PCR50_STATS;
+
+//
+// IOCTL_CR50_QUERY_TRACE
+//
+// Output: CR50_TRACE followed by the retained entries, oldest first.
+// The output buffer can be written to a file as is and decoded offline,
+// or replayed on the host with host/replay.c, which needs the FIFO data
+// of a trace recorded with the "TracePayload" setting.
+//
+#define IOCTL_CR50_QUERY_TRACE		CR50_IOCTL(1, FILE_READ_ACCESS)
+
+typedef enum _CR50_TRACE_TYPE {
+	Cr50TraceRead = 1,		/* Register read */
+	Cr50TraceWrite,			/* Register write */
+	Cr50TraceStatus,		/* Status poll decision */
+	Cr50TraceCommandStart,		/* Register holds the command code */
+	Cr50TraceCommandEnd,		/* Result holds the command status */
+	Cr50TraceD0Entry,		/* Register holds the previous power state */
+	Cr50TraceD0Exit			/* Register holds the target power state */
+} CR50_TRACE_TYPE;
+
+#define CR50_TRACE_DATA_BYTES	64	/* One full FIFO burst */
+
+//
+// Data holds no FIFO bytes and only the header of a command unless the
+// "TracePayload" setting is set, since those carry authorization values,
+// unsealed secrets and NV contents. Length is kept either way.
+//
+// For Cr50TraceStatus, Register holds the expected status mask, Data the
+// raw STS bytes (status, then the little endian burst count) and Result
+// is STATUS_SUCCESS when the status was accepted or STATUS_RETRY when it
+// was polled again.
+//
+typedef struct _CR50_TRACE_ENTRY {
+	ULONG Sequence;
+	UCHAR Type;
+	UCHAR Transport;		/* 0 = I2C, 1 = SPI */
+	USHORT Length;
+	ULONG Register;
+	LONG Result;
+	LONG64 StartTime;		/* System time, 100ns units */
+	LONG64 EndTime;
+	UCHAR Data[CR50_TRACE_DATA_BYTES];
+} CR50_TRACE_ENTRY, *PCR50_TRACE_ENTRY;
+
+#define CR50_TRACE_VERSION	2
+#define CR50_TRACE_MAGIC	0x54303543	/* "C50T" */
+
+typedef struct _CR50_TRACE {
+	ULONG Magic;
+	ULONG Version;
+	ULONG EntrySize;
+	ULONG Capacity;
+	ULONG Written;			/* Entries written since the driver loaded */
+	ULONG EntriesReturned;
+	CR50_TRACE_ENTRY Entries[1];
+} CR50_TRACE, *PCR50_TRACE;
+
+//
+// IOCTL_CR50_SUBMIT_COMMAND
+//
+// Input:  a marshalled TPM2 command, whose header size must match the
+//         input length
+// Output: the TPM2 response
+//
+// Commands are queued to a single thread that owns the TPM, and fail with
+// STATUS_DEVICE_BUSY when the queue is full. They are held while the TPM
+// starts up after D0 entry. TPM_RC_RETRY, TPM_RC_YIELDED and
+// TPM_RC_TESTING are retried by the driver.
+//
+#define IOCTL_CR50_SUBMIT_COMMAND	CR50_IOCTL(2, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+//
+// IOCTL_CR50_SET_LOCALITY
+//
+// Input: CR50_LOCALITY
+//
+// Binds the handle to a TPM locality for the commands it submits.
+// Localities above 0 require a kernel mode caller or SeTcbPrivilege.
+// Consecutive commands for the same locality are sent without giving
+// the locality up in between.
+//
+#define IOCTL_CR50_SET_LOCALITY		CR50_IOCTL(3, FILE_WRITE_ACCESS)
+
+typedef struct _CR50_LOCALITY {
+	ULONG Locality;
+} CR50_LOCALITY, *PCR50_LOCALITY;
+
+//
+// IOCTL_CR50_SUBMIT_BATCH
+//
+// Input:  CR50_BATCH, then Count entries of a CR50_BATCH_COMMAND followed
+//         by a marshalled TPM2 command
+// Output: CR50_BATCH_RESULT, then one entry per command of a
+//         CR50_BATCH_RESPONSE followed by the TPM2 response
+//
+// Every entry starts on an 8 byte boundary, see CR50_BATCH_ENTRY_SIZE.
+// The commands are sent back to back in order, from the handle's
+// locality, without giving up the locality or letting an SPI TPM fall
+// asleep in between, and the request completes once all of them have.
+// Commands after one with CR50_BATCH_STOP_ON_ERROR that failed or was
+// answered with an error code are not sent, and are returned with
+// STATUS_CANCELLED. Retries are handled as for IOCTL_CR50_SUBMIT_COMMAND.
+//
+#define IOCTL_CR50_SUBMIT_BATCH \
+	CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800 + 5, METHOD_OUT_DIRECT, \
+		FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+#define CR50_BATCH_MAX_COMMANDS		64
+
+#define CR50_BATCH_ENTRY_SIZE(Length)	((8 + (ULONG)(Length) + 7) & ~7UL)
+
+#define CR50_BATCH_STOP_ON_ERROR	0x00000001
+
+typedef struct _CR50_BATCH_COMMAND {
+	ULONG Flags;
+	ULONG Length;			/* Of the command that follows */
+} CR50_BATCH_COMMAND, *PCR50_BATCH_COMMAND;
+
+typedef struct _CR50_BATCH {
+	ULONG Count;
+	ULONG Reserved;
+} CR50_BATCH, *PCR50_BATCH;
+
+typedef struct _CR50_BATCH_RESPONSE {
+	LONG Status;			/* NTSTATUS of sending the command */
+	ULONG Length;			/* Of the response that follows */
+} CR50_BATCH_RESPONSE, *PCR50_BATCH_RESPONSE;
+
+typedef struct _CR50_BATCH_RESULT {
+	ULONG Count;
+	ULONG Executed;			/* Commands that were sent */
+	ULONG TransitionsSaved;		/* Requests saved over one per command */
+	ULONG HandshakesSaved;		/* Locality requests skipped */
+	ULONG WakesSaved;		/* SPI wake sequences skipped */
+	ULONG Reserved;
+} CR50_BATCH_RESULT, *PCR50_BATCH_RESULT;
+
+//
+// IOCTL_CR50_SHARED_REGISTER
+//
+// Output: the client's ring memory, laid out as a CR50_SHARED_HEADER,
+//         Entries submission entries, Entries completion entries and an
+//         arena of ArenaSize bytes (CR50_SHARED_SIZE). The client fills
+//         in Magic, Version, Entries and ArenaSize and zeroes the rest.
+//
+// Sends commands without a request per command and without copying
+// them. The driver locks the memory down and keeps the request pending
+// for as long as the ring is in use, so it must be sent overlapped; it
+// is completed with STATUS_CANCELLED once it is cancelled or the handle
+// is closed. One ring can be registered per device.
+//
+// The client places a command and room for its response in the arena,
+// fills the submission entry at SqTail and then advances SqTail. The
+// driver sends the commands in order from the registering handle's
+// locality, writes each response in place and publishes a completion
+// entry at CqTail; the client consumes completions by advancing CqHead.
+// Submissions are only picked up after IOCTL_CR50_SHARED_DOORBELL, and
+// while the completion ring is full they wait for the next doorbell.
+// The command and response of an entry must not overlap.
+//
+#define IOCTL_CR50_SHARED_REGISTER \
+	CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800 + 6, METHOD_OUT_DIRECT, \
+		FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+#define CR50_SHARED_MAGIC		0x53303543	/* "C50S" */
+#define CR50_SHARED_VERSION		1
+#define CR50_SHARED_MAX_ENTRIES		1024		/* Entries must be a power of two */
+#define CR50_SHARED_MAX_ARENA		(16 * 1024 * 1024)
+
+typedef struct _CR50_SQ_ENTRY {
+	ULONG Tag;			/* Returned in the completion */
+	ULONG Reserved;
+	ULONG CommandOffset;		/* In the arena */
+	ULONG CommandLength;
+	ULONG ResponseOffset;
+	ULONG ResponseLength;		/* Room for the response */
+} CR50_SQ_ENTRY, *PCR50_SQ_ENTRY;
+
+typedef struct _CR50_CQ_ENTRY {
+	ULONG Tag;
+	LONG Status;			/* NTSTATUS of sending the command */
+	ULONG ResponseLength;		/* Bytes of response written */
+	ULONG Reserved;
+} CR50_CQ_ENTRY, *PCR50_CQ_ENTRY;
+
+//
+// The indexes count up freely and are taken modulo Entries. Each side
+// only writes its own, and they are on separate cache lines.
+//
+typedef struct _CR50_SHARED_HEADER {
+	ULONG Magic;
+	ULONG Version;
+	ULONG Entries;
+	ULONG ArenaSize;
+	ULONG Reserved0[12];
+	volatile LONG SqTail;		/* Client */
+	ULONG Reserved1[15];
+	volatile LONG SqHead;		/* Driver */
+	volatile LONG CqTail;		/* Driver */
+	ULONG Reserved2[14];
+	volatile LONG CqHead;		/* Client */
+	ULONG Reserved3[15];
+} CR50_SHARED_HEADER, *PCR50_SHARED_HEADER;
+
+#define CR50_SHARED_SQ(Header) \
+	((PCR50_SQ_ENTRY)((PUCHAR)(Header) + sizeof(CR50_SHARED_HEADER)))
+#define CR50_SHARED_CQ(Header) \
+	((PCR50_CQ_ENTRY)(CR50_SHARED_SQ(Header) + (Header)->Entries))
+#define CR50_SHARED_ARENA(Header) \
+	((PUCHAR)(CR50_SHARED_CQ(Header) + (Header)->Entries))
+#define CR50_SHARED_SIZE(Entries, ArenaSize) \
+	(sizeof(CR50_SHARED_HEADER) + \
+	(Entries) * (sizeof(CR50_SQ_ENTRY) + sizeof(CR50_CQ_ENTRY)) + (ArenaSize))
+
+//
+// IOCTL_CR50_SHARED_DOORBELL
+//
+// Input: optional CR50_DOORBELL
+//
+// Tells the driver that submissions are waiting in the registered ring.
+// With CR50_DOORBELL_WAIT the request also stays pending until the
+// completion ring holds an entry.
+//
+#define IOCTL_CR50_SHARED_DOORBELL	CR50_IOCTL(7, FILE_WRITE_ACCESS)
+
+#define CR50_DOORBELL_WAIT	0x00000001
+
+typedef struct _CR50_DOORBELL {
+	ULONG Flags;
+} CR50_DOORBELL, *PCR50_DOORBELL;
+
+//
+// IOCTL_CR50_NV_WRITE
+//
+// Input:  CR50_NV_WRITE followed by Length bytes of data
+// Output: CR50_NV_WRITE_RESULT
+//
+// Writes the data to an NV index starting at Offset, split into as few
+// NV_Write commands as the TPM's NV buffer allows, of even size. The
+// commands are sent back to back from the handle's locality, each one
+// built while the TPM executes the one before. AuthHandle is the index
+// itself, TPM_RH_OWNER or TPM_RH_PLATFORM, authorized with Password in a
+// password session. Progress can be followed in the NvWrite statistics.
+//
+// The request only fails if it could not be started. Otherwise Status
+// and ResponseCode are those of the first chunk that failed, and the
+// data before Offset + Written is known to be written, so the caller
+// can resume from there.
+//
+#define IOCTL_CR50_NV_WRITE	CR50_IOCTL(8, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+#define CR50_NV_MAX_PASSWORD	64
+
+typedef struct _CR50_NV_WRITE {
+	ULONG Index;
+	ULONG AuthHandle;
+	ULONG Offset;
+	ULONG Length;
+	ULONG PasswordLength;
+	ULONG Reserved;
+	UCHAR Password[CR50_NV_MAX_PASSWORD];
+} CR50_NV_WRITE, *PCR50_NV_WRITE;
+
+typedef struct _CR50_NV_WRITE_RESULT {
+	LONG Status;			/* NTSTATUS of the first chunk that failed */
+	ULONG ResponseCode;		/* TPM response code of that chunk */
+	ULONG Written;			/* Bytes written from Offset on */
+	ULONG Chunks;			/* NV_Write commands sent */
+	ULONG ChunkSize;
+	ULONG Reserved;
+} CR50_NV_WRITE_RESULT, *PCR50_NV_WRITE_RESULT;
+
+//
+// IOCTL_CR50_QUERY_HEALTH
+//
+// Output: CR50_HEALTH
+//
+// The bus timings are picked from three tiers by watching the bus for
+// errors: Fast while the link is clean, Safe while it fails, Normal,
+// the fixed timings of older drivers, in between and at start. The
+// "BusHealth" setting turns the monitor off, leaving the bus at Normal.
+//
+#define IOCTL_CR50_QUERY_HEALTH	CR50_IOCTL(9, FILE_READ_ACCESS)
+
+typedef enum _CR50_TIER {
+	Cr50TierFast,
+	Cr50TierNormal,
+	Cr50TierSafe,
+	Cr50TierCount
+} CR50_TIER;
+
+typedef enum _CR50_HEALTH_REASON {
+	Cr50HealthErrors = 1,		/* Too many failed transfers in a window */
+	Cr50HealthErrorRun,		/* Failed transfers in a row */
+	Cr50HealthDrift,		/* Register accesses got much slower */
+	Cr50HealthClean			/* Clean windows in a row */
+} CR50_HEALTH_REASON;
+
+typedef struct _CR50_HEALTH_TRANSITION {
+	LONG64 Time;			/* System time, 100ns units */
+	UCHAR From;
+	UCHAR To;
+	UCHAR Reason;
+	UCHAR Reserved;
+	ULONG WindowErrors;
+	ULONG LatencyUs;
+	ULONG BaselineUs;
+} CR50_HEALTH_TRANSITION, *PCR50_HEALTH_TRANSITION;
+
+#define CR50_HEALTH_HISTORY	16
+#define CR50_HEALTH_VERSION	1
+
+typedef struct _CR50_HEALTH {
+	ULONG Version;
+	ULONG Transport;		/* 0 = I2C, 1 = SPI */
+	ULONG Enabled;
+	ULONG Tier;
+	ULONG PollUs;			/* Timings of the tier */
+	ULONG WakeUs;
+	ULONG RetryLimit;
+	ULONG ChunkMax;
+	ULONG LatencyUs;		/* Smoothed time of a register access */
+	ULONG BaselineUs;
+	ULONG WindowTransfers;		/* In the window being counted */
+	ULONG WindowErrors;
+	ULONG CleanWindows;
+	ULONG PromoteWindows;		/* Clean windows needed to move towards Fast */
+	ULONG64 Transfers;
+	ULONG64 Errors;			/* Failed transfers, including the two below */
+	ULONG64 StallTimeouts;		/* SPI flow control never released */
+	ULONG64 ReadyTimeouts;		/* I2C ready pulse missing */
+	ULONG64 Retries;
+	ULONG64 Windows;
+	ULONG Transitions;		/* Since the driver loaded */
+	ULONG TransitionsReturned;
+	CR50_HEALTH_TRANSITION History[CR50_HEALTH_HISTORY];	/* Oldest first */
+} CR50_HEALTH, *PCR50_HEALTH;
+
+//
+// IOCTL_CR50_QUOTE
+//
+// Input:  CR50_QUOTE
+// Output: CR50_QUOTE_RESULT followed by the TPM2_Quote response
+//
+// Quotes the PCRs in PcrSelect with the loaded key SignHandle, authorized
+// with Password in a password session, over the caller's Nonce. Requests
+// for the same key, scheme, password and selection from the same
+// locality that arrive within the "QuoteWindowMs" setting are answered
+// by one TPM2_Quote: the nonces are the leaves of a Merkle tree as in
+// RFC 6962, leaf SHA-256(0x00 || Nonce) and node SHA-256(0x01 || left ||
+// right), and its Root is the qualifyingData of the quote. Each caller
+// checks that Proof, the sibling hashes from its leaf up, leads from its
+// own nonce to Root, and that Root is the extraData of the signed quote.
+//
+// The request only fails if the quote could not be sent. A TPM error is
+// returned in ResponseCode with the response as for a successful one.
+//
+#define IOCTL_CR50_QUOTE	CR50_IOCTL(10, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+#define CR50_QUOTE_MAX_NONCE		64
+#define CR50_QUOTE_MAX_PCR_SELECT	64
+#define CR50_QUOTE_MAX_REQUESTS		64	/* Leaves of one tree */
+#define CR50_QUOTE_MAX_DEPTH		6
+#define CR50_QUOTE_HASH_SIZE		32
+
+typedef struct _CR50_QUOTE {
+	ULONG SignHandle;		/* Loaded signing key */
+	USHORT Scheme;			/* TPM_ALG_xxx, or TPM_ALG_NULL for the key's own */
+	USHORT HashAlg;			/* Of Scheme */
+	ULONG PasswordLength;
+	ULONG PcrSelectLength;
+	ULONG NonceLength;
+	ULONG Reserved;
+	UCHAR Password[CR50_NV_MAX_PASSWORD];
+	UCHAR PcrSelect[CR50_QUOTE_MAX_PCR_SELECT];	/* TPML_PCR_SELECTION as marshalled */
+	UCHAR Nonce[CR50_QUOTE_MAX_NONCE];
+} CR50_QUOTE, *PCR50_QUOTE;
+
+typedef struct _CR50_QUOTE_RESULT {
+	LONG Status;			/* NTSTATUS of the quote */
+	ULONG ResponseCode;		/* TPM response code of the quote */
+	ULONG ResponseLength;		/* Bytes of response after this header */
+	ULONG Requests;			/* Requests answered by the quote */
+	ULONG LeafIndex;		/* Of this request's nonce */
+	ULONG ProofLength;		/* Hashes in Proof */
+	ULONG WaitUs;			/* Time the request was collected */
+	ULONG LatencyUs;		/* Time from submission to completion */
+	UCHAR Root[CR50_QUOTE_HASH_SIZE];
+	UCHAR Proof[CR50_QUOTE_MAX_DEPTH][CR50_QUOTE_HASH_SIZE];	/* Leaf level first */
+} CR50_QUOTE_RESULT, *PCR50_QUOTE_RESULT;
+
+//
+// IOCTL_CR50_SESSION_ACQUIRE
+//
+// Input:  CR50_SESSION_REQUEST
+// Output: CR50_SESSION
+//
+// Hands out an authorization session the driver started, unsalted and
+// unbound with SHA-256, so its session key is empty and the HMAC key of
+// a command is the authValue alone. NonceTpm is the nonceOlder of the
+// first command sent with it; the session stays loaded between
+// commands. HMAC sessions come from a pool the driver keeps started in
+// the background ("SessionPool" setting); a policy session is only
+// started on demand.
+//
+// IOCTL_CR50_SESSION_RELEASE
+//
+// Input:  CR50_SESSION
+//
+// Gives a session back with the nonceTPM of its last response and the
+// number of commands it authorized in total. It is kept for the same
+// handle to acquire again, until "SessionMaxUses" is reached, in which
+// case it is flushed and replaced. A policy session comes back as it was
+// left: TPM2_PolicyRestart it unless it authorized a command since its
+// last policy. CR50_SESSION_DISCARD flushes the session, which must also
+// be done for a session the TPM already flushed (continueSession
+// clear), with CR50_SESSION_GONE. Sessions are flushed when the device
+// leaves D0, after which TPM commands fail with them and release only
+// frees their slots; closing the handle releases what it holds.
+//
+#define IOCTL_CR50_SESSION_ACQUIRE	CR50_IOCTL(11, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define IOCTL_CR50_SESSION_RELEASE	CR50_IOCTL(12, FILE_WRITE_ACCESS)
+
+#define CR50_SESSION_NONCE_SIZE		32
+
+#define CR50_SESSION_DISCARD		0x1	/* Release: flush instead of keeping it */
+#define CR50_SESSION_GONE		0x2	/* Release: the TPM flushed it already */
+#define CR50_SESSION_REUSED		0x1	/* Acquire: not started for this request */
+
+typedef struct _CR50_SESSION_REQUEST {
+	ULONG Type;			/* TPM_SE_HMAC or TPM_SE_POLICY */
+	ULONG Reserved;
+} CR50_SESSION_REQUEST, *PCR50_SESSION_REQUEST;
+
+typedef struct _CR50_SESSION {
+	ULONG Handle;
+	ULONG Type;
+	ULONG Uses;			/* Commands it authorized */
+	ULONG Flags;
+	UCHAR NonceTpm[CR50_SESSION_NONCE_SIZE];
+} CR50_SESSION, *PCR50_SESSION;
+
+//
+// IOCTL_CR50_KEYGEN_TEMPLATE
+//
+// Input:  CR50_KEYGEN_TEMPLATE followed by a TPM2_Create command
+//
+// Registers a template with the key pre-generation pool, which is off
+// unless the "KeyPoolDepth" setting is set. While the device is in D0
+// and no command arrived for "KeyPoolQuietMs", the driver sends the
+// Create from the locality of the registering handle until Depth
+// responses are kept. A TPM2_Create that is the same command byte for
+// byte, from the same locality, is then answered with one of them, and
+// each is handed out once. The command must be authorized by a single
+// password session, have a persistent parent and an empty creationPCR,
+// since the creation data is returned later than it was made. Depth 0
+// removes the template and its keys. A Create of the pool gives way to
+// any other command and to D0 exit: it is cancelled with
+// TPM_STS.commandCancel and sent again after the next quiet spell.
+//
+#define IOCTL_CR50_KEYGEN_TEMPLATE	CR50_IOCTL(13, FILE_WRITE_ACCESS)
+
+#define CR50_KEYGEN_MAX_DEPTH		8
+
+typedef struct _CR50_KEYGEN_TEMPLATE {
+	ULONG Depth;			/* Keys kept ready, at most "KeyPoolDepth" */
+	ULONG Reserved;
+	/* TPM2_Create command follows */
+} CR50_KEYGEN_TEMPLATE, *PCR50_KEYGEN_TEMPLATE;
+
+#endif /* __CR50_IOCTL_H__ */
@@ -6,18 +6,23 @@
 #pragma warning(disable:4201)  // suppress nameless struct/union warning
 #pragma warning(disable:4214)  // suppress bit field types other than int warning
 #include <initguid.h>
+#include <ntifs.h>		/* SeTokenIsAdmin, must precede wdm.h */
 #include <wdm.h>
 
 #pragma warning(default:4200)
 #pragma warning(default:4201)
 #pragma warning(default:4214)
 #include <wdf.h>
+#include <wdmsec.h>
 
 #pragma warning(disable:4201)  // suppress nameless struct/union warning
 #pragma warning(disable:4214)  // suppress bit field types other than int warning
 #include <hidport.h>
+#include <bcrypt.h>
 
 #include "cr50.h"
+#include "cr50ioctl.h"
+#include "tpm2.h"
 #include "spb.h"
 
 //
@@ -38,6 +43,224 @@ typedef enum {
 	CR50_TRANSPORT_SPI
 } CR50_TRANSPORT;
 
+//
+// Learned execution time of one class of command (see predict.c)
+//
+
+typedef struct _CR50_PREDICT
+{
+	UINT32 Ordinal;		/* 0 if the entry is free */
+	UINT32 Variant;		/* Key type and size for commands that create keys */
+	ULONG Samples;
+	LONG MeanUs;
+	LONG DevUs;		/* Mean absolute deviation */
+} CR50_PREDICT, *PCR50_PREDICT;
+
+#define CR50_PREDICT_ENTRIES 64
+#define CR50_PREDICT_MIN_SAMPLES 4
+#define CR50_PREDICT_POLL_US 50	/* Poll interval close to a predicted completion */
+
+//
+// Bus timings of one tier of the health monitor (see health.c)
+//
+
+typedef struct _CR50_TIMING
+{
+	ULONG PollUs;		/* Between status reads while waiting for the TPM */
+	ULONG WakeUs;		/* SPI: settle time after the wake pulse */
+	ULONG Retries;		/* Of a transfer that failed before data moved */
+	ULONG ChunkMax;		/* FIFO bytes per transfer, 0 for BurstMax */
+} CR50_TIMING, *PCR50_TIMING;
+
+//
+// Counters for the command that is currently on the bus. Only one command
+// is in flight at a time, so these are plain increments and get folded
+// into the per command code statistics when the command completes.
+//
+
+typedef struct _CR50_INFLIGHT
+{
+	BOOLEAN Active;
+	UINT32 Ordinal;
+	LONGLONG Stamp[Cr50PhaseCount + 1];
+	ULONG Retries;
+	ULONG StatusPolls;
+	ULONG FifoBursts;
+	ULONG BusTransactions;
+	ULONG BytesSent;
+	ULONG BytesReceived;
+	ULONG Misses;		/* Status reads that did not show the awaited bits */
+	ULONG MissesAtGo;
+	LONGLONG LastMiss;
+	LONGLONG FineUntil;	/* Poll without sleeping until then */
+	BOOLEAN Slept;
+	PCR50_PREDICT Predict;
+} CR50_INFLIGHT, *PCR50_INFLIGHT;
+
+#define CR50_STATS_SLOTS (TPM2_CC_LAST - TPM2_CC_FIRST + 2)
+
+#define CR50_TRACE_DEFAULT_ENTRIES 2048
+
+#define CR50_SHUTDOWN_TIMEOUT_MS 200
+
+#define CR50_MAX_COMMAND_SIZE 4096
+
+#define CR50_RING_ENTRIES 64	/* Power of two */
+
+#define CR50_NV_ENTRIES 16
+#define CR50_NV_MAX_DATA 2048		/* Largest NV index of the Cr50 and Ti50 */
+#define CR50_NV_MAX_PUBLIC 256
+#define CR50_NV_DEFAULT_BYTES 16384
+
+typedef struct _CR50_NV_ENTRY
+{
+	UINT32 Index;			/* 0 when the entry is free */
+	ULONG64 LastUse;
+	UINT8* Public;			/* NV_ReadPublic response */
+	UINT16 PublicLength;
+	UINT8* Data;			/* Bytes ValidStart..ValidEnd are cached */
+	UINT16 DataLength;
+	UINT16 ValidStart;
+	UINT16 ValidEnd;
+	UINT8 SessionAttributes;	/* Of the reads the data came from */
+	UINT8 SessionResponse[5];
+} CR50_NV_ENTRY, *PCR50_NV_ENTRY;
+
+#define CR50_KEY_ENTRIES 8
+#define CR50_KEY_CACHE 2
+#define CR50_KEY_DIGEST_SIZE 32
+#define CR50_KEY_RESPONSE_MAX 96	/* Load response with a SHA-512 name */
+
+typedef struct _CR50_KEY_ENTRY
+{
+	BOOLEAN Valid;
+	ULONG Users;			/* Loads answered, less FlushContexts absorbed */
+	UINT32 Parent;
+	UINT32 Handle;
+	ULONG64 LastUse;
+	UINT8 Digest[CR50_KEY_DIGEST_SIZE];	/* Of the Load from parentHandle on */
+	UINT16 ResponseLength;
+	UINT8 Response[CR50_KEY_RESPONSE_MAX];	/* Load response, with the name */
+} CR50_KEY_ENTRY, *PCR50_KEY_ENTRY;
+
+#define CR50_CAPS_MAGIC 0x43303543	/* "C50C" */
+#define CR50_CAPS_MAX_PROPERTIES 64
+#define CR50_CAPS_MAX_ALGS 64
+#define CR50_CAPS_MAX_COMMANDS 256
+
+typedef enum {
+	Cr50CapsNone,
+	Cr50CapsQueried,
+	Cr50CapsRegistry
+} CR50_CAPS_SOURCE;
+
+/* Saved to the registry as is, entries as the TPM marshals them */
+typedef struct _CR50_CAPS
+{
+	ULONG Magic;
+	ULONG Size;
+	UINT32 VendorId;
+	UINT32 Firmware[2];		/* TPM_PT_FIRMWARE_VERSION_1 and _2 */
+	ULONG PropertyCount;		/* 0 when the category is not cached */
+	ULONG PropertyPage;		/* Entries the TPM returns per response */
+	ULONG AlgCount;
+	ULONG AlgPage;
+	ULONG CommandCount;
+	ULONG CommandPage;
+	ULONG PcrLength;
+	UINT32 Properties[CR50_CAPS_MAX_PROPERTIES][2];
+	UINT8 Algs[CR50_CAPS_MAX_ALGS * 6];
+	UINT32 Commands[CR50_CAPS_MAX_COMMANDS];
+	UINT8 Pcrs[128];		/* TPML_PCR_SELECTION */
+} CR50_CAPS, *PCR50_CAPS;
+
+typedef struct _CR50_RING_SLOT
+{
+	LONG Sequence;
+	LONG State;			/* Position and owner of the request, see ring.c */
+	UINT8 Locality;
+	WDFREQUEST Request;
+	LONGLONG Queued;
+} CR50_RING_SLOT, *PCR50_RING_SLOT;
+
+#define CR50_NO_LOCALITY 0xFF
+
+typedef struct _CR50_FILE_CONTEXT
+{
+	UINT8 Locality;
+} CR50_FILE_CONTEXT, *PCR50_FILE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CR50_FILE_CONTEXT, GetFileContext)
+
+#define CR50_SESSION_SLOTS 4
+#define CR50_SESSION_POOL 1
+#define CR50_SESSION_MAX_USES 4096
+
+typedef enum _CR50_SESSION_STATE {
+	Cr50SessionFree,
+	Cr50SessionStarting,		/* Slot taken by the consumer for a new session */
+	Cr50SessionReady,		/* Loaded in the TPM, not handed out */
+	Cr50SessionAcquired,		/* Handed out to Owner */
+	Cr50SessionFlush		/* Left for the consumer to flush */
+} CR50_SESSION_STATE;
+
+typedef struct _CR50_SESSION_SLOT
+{
+	CR50_SESSION_STATE State;
+	UCHAR Type;			/* TPM_SE_HMAC or TPM_SE_POLICY */
+	BOOLEAN Stale;			/* Flushed by a D0 exit while handed out */
+	WDFFILEOBJECT Owner;		/* NULL while pooled for any handle */
+	ULONG Handle;
+	ULONG Uses;
+	LONGLONG LastUsed;
+	UCHAR NonceTpm[CR50_SESSION_NONCE_SIZE];
+} CR50_SESSION_SLOT, *PCR50_SESSION_SLOT;
+
+#define CR50_KEYGEN_TEMPLATES 4
+#define CR50_KEYGEN_QUIET_MS 200
+
+typedef struct _CR50_KEYGEN_SLOT
+{
+	ULONG Id;			/* 0 when free, new with every registration */
+	UCHAR Locality;
+	BOOLEAN Failed;			/* Refused by the TPM, until registered again */
+	UINT32 Parent;
+	ULONG Depth;
+	ULONG Count;			/* Keys ready */
+	ULONG CommandLength;
+	UINT8* Command;			/* TPM2_Create, as clients send it */
+	UINT8* Keys[CR50_KEYGEN_MAX_DEPTH];	/* Its responses, each handed out once */
+} CR50_KEYGEN_SLOT, *PCR50_KEYGEN_SLOT;
+
+#define CR50_QUOTE_GROUPS 4
+#define CR50_QUOTE_WINDOW_MS 10
+#define CR50_QUOTE_WINDOW_MAX_MS 1000
+
+typedef enum _CR50_QUOTE_STATE {
+	Cr50QuoteFree,
+	Cr50QuoteOpen,			/* Collecting requests */
+	Cr50QuoteQueued,		/* Handed to the consumer as its first request */
+	Cr50QuoteRunning		/* Taken by the consumer, followers out of Queue */
+} CR50_QUOTE_STATE;
+
+typedef struct _CR50_QUOTE_GROUP
+{
+	CR50_QUOTE_STATE State;
+	UINT8 Locality;
+	LONGLONG Deadline;		/* Collecting ends, system time */
+	LONGLONG Closed;
+	CR50_QUOTE Key;			/* Input of the first request, without the nonce */
+	WDFQUEUE Queue;			/* Requests after the first, while they wait */
+	ULONG Count;
+	WDFREQUEST Requests[CR50_QUOTE_MAX_REQUESTS];
+	LONGLONG Submitted[CR50_QUOTE_MAX_REQUESTS];
+	UINT8 Leaves[CR50_QUOTE_MAX_REQUESTS][CR50_QUOTE_HASH_SIZE];
+} CR50_QUOTE_GROUP, *PCR50_QUOTE_GROUP;
+
+#define CR50_IDLE_TIMEOUT_MS 250
+
+#define CR50_IDLE_HOLD_MAX_MS 10000
+
 typedef struct _CR50_CONTEXT
 {
 
@@ -58,7 +281,474 @@ typedef struct _CR50_CONTEXT
 
 	BOOLEAN InterruptServiced;
 
-	char* buf;
+	BOOLEAN InterruptFound;
+
+	USHORT InterruptFlags;		/* CM_RESOURCE_INTERRUPT_* of the line */
+
+	//
+	// TIS interrupts on SPI (see spi.c). The ISR only sets TisEvent;
+	// INT_STATUS is read and acknowledged by the waiter, which owns
+	// the bus.
+	//
+
+	BOOLEAN TisIrqAllowed;
+
+	UINT32 TisIrqCaps;		/* TPM_INTF_CAPS */
+
+	UINT32 TisIrqEnable;		/* Value for TPM_INT_ENABLE, 0 to poll */
+
+	UINT8 TisIrqLocalities;		/* Localities with TPM_INT_ENABLE written */
+
+	KEVENT TisEvent;
+
+	LONG64 TisInterrupts;
+
+	ULONG64 TisWakes;
+
+	ULONG64 TisFallbacks;
+
+	char* buf;			/* I2C writes: register address and data */
+
+	ULONG BusMaxTransfer;		/* Setting: bytes the controller moves at once */
+
+	ULONG BurstMax;			/* Largest FIFO transfer, see tpm_cr50_transfer_init */
+
+	ULONG BurstSeen;		/* Largest burst count the TPM reported */
+
+	ULONG Durations[TPM2_DURATION_COUNT];
+
+	ULONG CommandDuration;
+
+	CR50_INFLIGHT Inflight;
+
+	PCR50_COMMAND_STATS CommandStats;
+
+	LONG64 IdleBusTransactions;
+
+	LONGLONG StatsResetTime;
+
+	PCR50_TRACE_ENTRY TraceRing;
+
+	ULONG TraceEntries;
+
+	LONG TraceNext;
+
+	BOOLEAN TracePayload;
+
+	UINT32 VendorId;
+
+	ULONG TimeoutCap;
+
+	ULONG ShutdownTimeout;
+
+	CR50_TRANSITION_STATS Transitions[Cr50TransitionCount];
+
+	//
+	// Serializes the consumer thread with the power callbacks.
+	// StartupPending and TpmStarted are protected by the lock.
+	//
+
+	WDFWAITLOCK CommandLock;
+
+	BOOLEAN StartupPending;
+
+	BOOLEAN TpmStarted;
+
+	UINT8 CommandBuffer[CR50_MAX_COMMAND_SIZE];
+
+	/* Responses to the driver's own commands */
+	UINT8 InternalResponse[CR50_MAX_COMMAND_SIZE];
+
+	//
+	// Submission ring and its consumer thread (see ring.c)
+	//
+
+	CR50_RING_SLOT Ring[CR50_RING_ENTRIES];
+
+	DECLSPEC_CACHEALIGN LONG RingHead;
+
+	DECLSPEC_CACHEALIGN LONG RingTail;
+
+	LONG ConsumerIdle;
+
+	KEVENT RingEvent;
+
+	KEVENT D0Event;			/* Set while in D0 */
+
+	BOOLEAN RingStopping;
+
+	EX_RUNDOWN_REF RingRundown;
+
+	PKTHREAD ConsumerThread;
+
+	LONGLONG PerfFrequency;
+
+	LONG64 RingEnqueued;
+
+	LONG64 RingRejected;
+
+	LONG64 RingContended;
+
+	LONG RingMaxDepth;
+
+	ULONG RingHistogram[CR50_HISTOGRAM_BUCKETS];
+
+	CR50_RING_SLOT Batch[CR50_RING_ENTRIES];	/* Consumer only */
+
+	//
+	// Locality used for register access, the one the TPM has granted us
+	// (CR50_NO_LOCALITY if unknown) and whether the current command is
+	// followed by another one for the same locality.
+	//
+
+	UINT8 Locality;
+
+	UINT8 ActiveLocality;
+
+	BOOLEAN HoldLocality;
+
+	ULONG64 HandshakesSaved;
+
+	ULONG64 LocalityCommands[CR50_LOCALITY_COUNT];
+
+	ULONG64 LocalitySwitches[CR50_LOCALITY_COUNT];
+
+	//
+	// Batched submissions (see batch.c). While BusHeld is set commands
+	// follow each other back to back, so an SPI TPM cannot fall asleep
+	// and is not woken before every transfer.
+	//
+
+	BOOLEAN BusHeld;
+
+	ULONG64 Batches;
+
+	ULONG64 BatchCommands;
+
+	ULONG64 BatchesStopped;
+
+	ULONG64 BatchTransitionsSaved;
+
+	ULONG64 WakesSaved;
+
+	//
+	// Client registered submission and completion rings (see shared.c).
+	// SharedLock protects the registration; the ring itself is only
+	// accessed by the consumer, and by the doorbell to peek at CqHead.
+	//
+
+	WDFSPINLOCK SharedLock;
+
+	WDFQUEUE SharedQueue;		/* Holds the pending registration */
+
+	WDFQUEUE SharedWaitQueue;	/* Doorbells waiting for a completion */
+
+	WDFREQUEST SharedRequest;
+
+	BOOLEAN SharedActive;		/* The consumer is working on the ring */
+
+	BOOLEAN SharedClosing;		/* Cancelled while active */
+
+	LONG SharedPending;
+
+	UINT8 SharedLocality;
+
+	PCR50_SHARED_HEADER Shared;
+
+	PCR50_SQ_ENTRY SharedSq;
+
+	PCR50_CQ_ENTRY SharedCq;
+
+	UINT8* SharedArena;
+
+	ULONG SharedEntries;		/* Captured at registration */
+
+	ULONG SharedArenaSize;
+
+	LONG SharedSqHead;		/* Private copies the client cannot move */
+
+	LONG SharedCqTail;
+
+	ULONG64 SharedDoorbells;
+
+	ULONG64 SharedCommands;
+
+	ULONG64 SharedInvalid;
+
+	ULONG64 SharedCompletionsFull;
+
+	//
+	// NV cache, protected by CommandLock (see nvcache.c)
+	//
+
+	CR50_NV_ENTRY NvCache[CR50_NV_ENTRIES];
+
+	ULONG NvCacheBudget;		/* 0 disables the cache */
+
+	ULONG NvCacheBytes;
+
+	ULONG64 NvCacheTick;
+
+	ULONG64 NvHits;
+
+	ULONG64 NvMisses;
+
+	ULONG64 NvInvalidations;
+
+	ULONG64 NvEvictions;
+
+	//
+	// Loaded-key cache, protected by CommandLock (see keys.c)
+	//
+
+	CR50_KEY_ENTRY Keys[CR50_KEY_ENTRIES];
+
+	ULONG KeyCacheEntries;		/* Setting, 0 disables the cache */
+
+	ULONG64 KeyCacheTick;
+
+	ULONG64 KeyHits;
+
+	ULONG64 KeyMisses;
+
+	ULONG64 KeyStale;
+
+	ULONG64 KeyEvictions;
+
+	ULONG64 KeyFlushesAbsorbed;
+
+	//
+	// Capability cache, protected by CommandLock (see caps.c)
+	//
+
+	CR50_CAPS Caps;
+
+	CR50_CAPS_SOURCE CapsSource;
+
+	BOOLEAN CapsReload;		/* Read again at the next startup */
+
+	ULONG64 CapsHits;
+
+	ULONG64 CapsMisses;
+
+	//
+	// Predictive completion waits (see predict.c)
+	//
+
+	BOOLEAN PredictEnabled;
+
+	CR50_PREDICT Predict[CR50_PREDICT_ENTRIES];
+
+	LONGLONG PredictSlack;		/* Learned oversleep, 100ns units */
+
+	ULONG64 PredictWaits;
+
+	ULONG64 PredictSleeps;
+
+	ULONG64 PredictPolls;
+
+	ULONG64 PredictWasted;
+
+	ULONG64 PredictOverslept;
+
+	ULONG64 PredictDetectUs;
+
+	ULONG64 PredictDetected;
+
+	//
+	// Bus health monitor, transitions and queries under HealthLock
+	// (see health.c)
+	//
+
+	BOOLEAN HealthEnabled;
+
+	WDFSPINLOCK HealthLock;
+
+	CR50_TIER Tier;
+
+	const CR50_TIMING* Timing;	/* Of Tier */
+
+	ULONG HealthWindowTransfers;
+
+	ULONG HealthWindowErrors;
+
+	ULONG HealthErrorRun;		/* Failed transfers in a row */
+
+	ULONG HealthCleanWindows;	/* Clean windows in a row */
+
+	ULONG HealthPromoteWindows;	/* Clean windows needed to move towards Fast */
+
+	ULONG HealthSincePromotion;	/* Windows since an unproven promotion */
+
+	BOOLEAN HealthPromoted;
+
+	LONG HealthLatencyUs;		/* Smoothed register access time */
+
+	LONG HealthBaselineUs;
+
+	ULONG64 HealthTransfers;
+
+	ULONG64 HealthErrors;
+
+	ULONG64 HealthStallTimeouts;
+
+	ULONG64 HealthReadyTimeouts;
+
+	ULONG64 HealthRetries;
+
+	ULONG64 HealthWindows;
+
+	ULONG HealthTransitions;
+
+	CR50_HEALTH_TRANSITION HealthHistory[CR50_HEALTH_HISTORY];
+
+	//
+	// Bulk NV writes (see nvwrite.c)
+	//
+
+	UINT8 NvWriteBuffer[CR50_MAX_COMMAND_SIZE];	/* Chunk built while one executes */
+
+	BOOLEAN NvWriteActive;
+
+	ULONG NvWriteIndex;
+
+	ULONG NvWriteWritten;
+
+	ULONG NvWriteTotal;
+
+	ULONG64 NvWrites;
+
+	ULONG64 NvWriteChunks;
+
+	ULONG64 NvWriteFailures;
+
+	//
+	// Authorization session pool, slot states under SessionLock (see session.c)
+	//
+
+	WDFSPINLOCK SessionLock;
+
+	ULONG SessionPool;		/* Setting */
+
+	ULONG SessionMaxUses;		/* Setting */
+
+	BOOLEAN SessionRefillFailed;	/* Until the next D0 entry or release */
+
+	CR50_SESSION_SLOT Sessions[CR50_SESSION_SLOTS];
+
+	ULONG64 SessionHits;
+
+	ULONG64 SessionMisses;
+
+	ULONG64 SessionsStarted;
+
+	ULONG64 SessionsFlushed;
+
+	ULONG64 SessionsRefreshed;
+
+	ULONG64 SessionsEvicted;
+
+	//
+	// Key pre-generation pool, templates protected by KeygenLock (see keygen.c)
+	//
+
+	WDFSPINLOCK KeygenLock;
+
+	WDFTIMER KeygenTimer;
+
+	BOOLEAN KeygenTimerArmed;
+
+	ULONG KeygenDepth;		/* Setting, 0 disables the pool */
+
+	ULONG KeygenQuietMs;		/* Setting */
+
+	ULONG KeygenNextId;
+
+	CR50_KEYGEN_SLOT KeygenSlots[CR50_KEYGEN_TEMPLATES];
+
+	BOOLEAN KeygenActive;		/* A Create of the pool is being sent */
+
+	BOOLEAN KeygenCancelled;	/* ... and was asked to stop */
+
+	BOOLEAN KeygenStop;		/* D0 exit waits for the command lock */
+
+	LONGLONG KeygenYielded;		/* When a Create last gave way */
+
+	ULONG64 KeygenGenerated;
+
+	ULONG64 KeygenServed;
+
+	ULONG64 KeygenMisses;
+
+	ULONG64 KeygenCancels;
+
+	ULONG64 KeygenFailures;
+
+	ULONG64 KeygenUs;
+
+	//
+	// Quote aggregation, groups protected by QuoteLock (see quote.c)
+	//
+
+	WDFSPINLOCK QuoteLock;
+
+	WDFTIMER QuoteTimer;
+
+	BOOLEAN QuoteTimerArmed;
+
+	ULONG QuoteWindow;		/* Setting, ms */
+
+	BCRYPT_ALG_HANDLE QuoteHash;
+
+	CR50_QUOTE_GROUP QuoteGroups[CR50_QUOTE_GROUPS];
+
+	UINT8 QuoteTree[2 * CR50_QUOTE_MAX_REQUESTS][CR50_QUOTE_HASH_SIZE];	/* Consumer only */
+
+	ULONG QuoteMaxBatch;
+
+	ULONG64 QuoteRequests;
+
+	ULONG64 Quotes;
+
+	ULONG64 QuoteFailures;
+
+	ULONG64 QuoteWaitUs;
+
+	ULONG64 QuoteLatencyUs;
+
+	//
+	// Learned idle policy, protected by IdleLock (see power.c)
+	//
+
+	WDFSPINLOCK IdleLock;
+
+	WDFTIMER IdleHoldTimer;
+
+	ULONG IdleTimeout;
+
+	ULONG IdleHoldMax;
+
+	LONGLONG LastArrival;
+
+	LONG ArrivalGap;
+
+	LONG ArrivalJitter;
+
+	ULONG ArrivalSamples;
+
+	ULONG IdleHoldWindow;
+
+	BOOLEAN IdleHeld;
+
+	ULONG IdleHolds;
+
+	BOOLEAN PoweredOn;
+
+	LONGLONG PowerStateSince;
+
+	ULONG64 TimeInD0;
+
+	ULONG64 TimeInDx;
 
 } CR50_CONTEXT, *PCR50_CONTEXT;
 
@@ -76,8 +766,24 @@ EVT_WDF_DRIVER_DEVICE_ADD Cr50EvtDeviceAdd;
 
 EVT_WDFDEVICE_WDM_IRP_PREPROCESS Cr50EvtWdmPreprocessMnQueryId;
 
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL Cr50EvtDeviceControl;
+
 EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL Cr50EvtInternalDeviceControl;
 
+EVT_WDF_TIMER Cr50EvtIdleHoldTimer;
+
+EVT_WDF_TIMER Cr50EvtQuoteTimer;
+
+EVT_WDF_OBJECT_CONTEXT_CLEANUP Cr50EvtDeviceCleanup;
+
+EVT_WDF_DEVICE_FILE_CREATE Cr50EvtDeviceFileCreate;
+
+EVT_WDF_FILE_CLEANUP Cr50EvtFileCleanup;
+
+EVT_WDF_TIMER Cr50EvtKeygenTimer;
+
+EVT_WDF_REQUEST_CANCEL Cr50EvtRingRequestCancel;
+
 void tpm_cr50_release_locality(PCR50_CONTEXT pDevice, BOOLEAN force);
 NTSTATUS tpm_cr50_request_locality(PCR50_CONTEXT pDevice);
 NTSTATUS tpm_cr50_tis_status(PCR50_CONTEXT pDevice, UINT8* buf, size_t sz);
@@ -88,6 +794,146 @@ NTSTATUS tpm_cr50_tis_read_data_fifo(PCR50_CONTEXT pDevice, UINT8* buf, size_t b
 NTSTATUS tpm_cr50_tis_write_data_fifo(PCR50_CONTEXT pDevice, UINT8* buf, size_t burstcnt);
 
 NTSTATUS tpm_cr50_read_vendor(PCR50_CONTEXT pDevice, UINT8* buf, size_t sz);
+NTSTATUS tpm_cr50_transfer_init(PCR50_CONTEXT pDevice);
+void tpm_cr50_tis_irq_init(PCR50_CONTEXT pDevice);
+void tpm_cr50_tis_wait(PCR50_CONTEXT pDevice, UINT8 sts, ULONG us);
+void tpm_cr50_select_locality(PCR50_CONTEXT pDevice, UINT8 locality);
+
+typedef VOID CR50_OVERLAP(PVOID Context);
+typedef CR50_OVERLAP* PCR50_OVERLAP;
+
+NTSTATUS tpm_cr50_transmit(PCR50_CONTEXT pDevice, UINT8* cmd, size_t cmd_len,
+	UINT8* rsp, size_t rsp_len, LONGLONG queued);
+NTSTATUS tpm_cr50_transmit_overlap(PCR50_CONTEXT pDevice, UINT8* cmd, size_t cmd_len,
+	UINT8* rsp, size_t rsp_len, LONGLONG queued, PCR50_OVERLAP overlap, PVOID context);
+NTSTATUS tpm_cr50_transmit_retry(PCR50_CONTEXT pDevice, UINT8* cmd, size_t cmd_len,
+	UINT8* rsp, size_t rsp_len, LONGLONG queued);
+NTSTATUS tpm_cr50_internal(PCR50_CONTEXT pDevice, TPM2_CMD cmd, const ULONG_PTR* args,
+	UINT32* rc);
+BOOLEAN tpm_cr50_ensure_started(PCR50_CONTEXT pDevice);
+NTSTATUS tpm_cr50_begin(PCR50_CONTEXT pDevice);
+void tpm_cr50_end(PCR50_CONTEXT pDevice);
+void tpm_cr50_complete(PCR50_CONTEXT pDevice, WDFREQUEST Request, LONGLONG queued,
+	UINT8 locality, BOOLEAN last);
+NTSTATUS tpm_cr50_submit(PCR50_CONTEXT pDevice, WDFREQUEST Request);
+NTSTATUS tpm_cr50_set_locality(PCR50_CONTEXT pDevice, WDFREQUEST Request);
+
+NTSTATUS tpm_cr50_shared_init(PCR50_CONTEXT pDevice);
+NTSTATUS tpm_cr50_shared_register(PCR50_CONTEXT pDevice, WDFREQUEST Request);
+NTSTATUS tpm_cr50_shared_doorbell(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	size_t InputBufferLength);
+BOOLEAN tpm_cr50_shared_pending(PCR50_CONTEXT pDevice);
+void tpm_cr50_shared_run(PCR50_CONTEXT pDevice);
+
+BOOLEAN tpm_cr50_nv_lookup(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len,
+	UINT8* rsp, size_t rsp_len);
+void tpm_cr50_nv_update(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len,
+	NTSTATUS status, const UINT8* rsp, size_t rsp_len);
+void tpm_cr50_nv_flush(PCR50_CONTEXT pDevice);
+
+BOOLEAN tpm_cr50_keys_lookup(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len,
+	UINT8* rsp, size_t rsp_len);
+void tpm_cr50_keys_update(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len,
+	NTSTATUS status, const UINT8* rsp, size_t rsp_len);
+BOOLEAN tpm_cr50_keys_evict(PCR50_CONTEXT pDevice, const UINT8* rsp);
+void tpm_cr50_keys_flush(PCR50_CONTEXT pDevice);
+void tpm_cr50_keys_forget(PCR50_CONTEXT pDevice);
+
+void tpm_cr50_predict_select(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t len);
+void tpm_cr50_predict_wait(PCR50_CONTEXT pDevice);
+void tpm_cr50_predict_learn(PCR50_CONTEXT pDevice);
+
+NTSTATUS tpm_cr50_health_init(PCR50_CONTEXT pDevice);
+void tpm_cr50_health_transfer(PCR50_CONTEXT pDevice, size_t len, NTSTATUS status,
+	LONGLONG start);
+BOOLEAN tpm_cr50_health_retry(PCR50_CONTEXT pDevice, NTSTATUS status, ULONG attempt);
+ULONG tpm_cr50_health_chunk(PCR50_CONTEXT pDevice, size_t burst);
+NTSTATUS tpm_cr50_health_query(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	size_t* bytesReturned);
+
+void tpm_cr50_caps_init(PCR50_CONTEXT pDevice);
+BOOLEAN tpm_cr50_caps_property(PCR50_CONTEXT pDevice, UINT32 property, UINT32* value);
+BOOLEAN tpm_cr50_caps_lookup(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len,
+	UINT8* rsp, size_t rsp_len);
+void tpm_cr50_caps_update(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len,
+	NTSTATUS status, const UINT8* rsp, size_t rsp_len);
+
+NTSTATUS tpm_cr50_nv_write_submit(PCR50_CONTEXT pDevice, WDFREQUEST Request);
+NTSTATUS tpm_cr50_nv_write_execute(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	LONGLONG queued, UINT8 locality, BOOLEAN last, size_t* bytesReturned);
+
+NTSTATUS tpm_cr50_session_init(PCR50_CONTEXT pDevice);
+NTSTATUS tpm_cr50_session_acquire(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	size_t* bytesReturned);
+NTSTATUS tpm_cr50_session_execute(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	LONGLONG queued, UINT8 locality, BOOLEAN last, size_t* bytesReturned);
+NTSTATUS tpm_cr50_session_release(PCR50_CONTEXT pDevice, WDFREQUEST Request);
+void tpm_cr50_session_close(PCR50_CONTEXT pDevice, WDFFILEOBJECT FileObject);
+BOOLEAN tpm_cr50_session_evict(PCR50_CONTEXT pDevice);
+void tpm_cr50_session_forget_all(PCR50_CONTEXT pDevice);
+BOOLEAN tpm_cr50_session_pending(PCR50_CONTEXT pDevice);
+void tpm_cr50_session_run(PCR50_CONTEXT pDevice);
+void tpm_cr50_session_stats(PCR50_CONTEXT pDevice, PCR50_SESSION_STATS stats);
+
+NTSTATUS tpm_cr50_keygen_init(PCR50_CONTEXT pDevice);
+void tpm_cr50_keygen_cleanup(PCR50_CONTEXT pDevice);
+NTSTATUS tpm_cr50_keygen_register(PCR50_CONTEXT pDevice, WDFREQUEST Request);
+BOOLEAN tpm_cr50_keygen_lookup(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len,
+	UINT8* rsp, size_t rsp_len);
+void tpm_cr50_keygen_update(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len);
+BOOLEAN tpm_cr50_keygen_pending(PCR50_CONTEXT pDevice);
+void tpm_cr50_keygen_run(PCR50_CONTEXT pDevice);
+void tpm_cr50_keygen_stats(PCR50_CONTEXT pDevice, PCR50_KEYGEN_STATS stats);
+
+NTSTATUS tpm_cr50_quote_init(PCR50_CONTEXT pDevice);
+void tpm_cr50_quote_cleanup(PCR50_CONTEXT pDevice);
+NTSTATUS tpm_cr50_quote_submit(PCR50_CONTEXT pDevice, WDFREQUEST Request);
+NTSTATUS tpm_cr50_quote_execute(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	LONGLONG queued, UINT8 locality, BOOLEAN last, size_t* bytesReturned);
+BOOLEAN tpm_cr50_quote_fail(PCR50_CONTEXT pDevice, WDFREQUEST Request, NTSTATUS status);
+BOOLEAN tpm_cr50_quote_cancel(PCR50_CONTEXT pDevice, WDFREQUEST Request);
+void tpm_cr50_quote_flush(PCR50_CONTEXT pDevice);
+
+NTSTATUS tpm_cr50_batch_submit(PCR50_CONTEXT pDevice, WDFREQUEST Request);
+NTSTATUS tpm_cr50_batch_execute(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	LONGLONG queued, UINT8 locality, BOOLEAN last, size_t* bytesReturned);
+
+void tpm_cr50_ring_init(PCR50_CONTEXT pDevice);
+NTSTATUS tpm_cr50_ring_start(PCR50_CONTEXT pDevice);
+void tpm_cr50_ring_stop(PCR50_CONTEXT pDevice);
+NTSTATUS tpm_cr50_ring_submit(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	LONGLONG queued, UINT8 locality);
+void tpm_cr50_ring_kick(PCR50_CONTEXT pDevice);
+BOOLEAN tpm_cr50_ring_waiting(PCR50_CONTEXT pDevice);
+
+void Cr50LoadSettings(PCR50_CONTEXT pDevice);
+
+NTSTATUS tpm_cr50_idle_init(PCR50_CONTEXT pDevice);
+void tpm_cr50_idle_arrival(PCR50_CONTEXT pDevice, LONGLONG now);
+void tpm_cr50_idle_release(PCR50_CONTEXT pDevice);
+
+NTSTATUS tpm_cr50_stats_init(PCR50_CONTEXT pDevice);
+void tpm_cr50_stats_begin(PCR50_CONTEXT pDevice, UINT32 ordinal, LONGLONG queued);
+void tpm_cr50_stats_stamp(PCR50_CONTEXT pDevice, CR50_PHASE phase);
+void tpm_cr50_stats_bus(PCR50_CONTEXT pDevice);
+void tpm_cr50_stats_end(PCR50_CONTEXT pDevice, NTSTATUS status);
+void tpm_cr50_stats_transition(PCR50_CONTEXT pDevice, CR50_TRANSITION transition,
+	WDF_POWER_DEVICE_STATE state, LONGLONG start, NTSTATUS status);
+NTSTATUS tpm_cr50_stats_query(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	size_t* bytesReturned);
+NTSTATUS tpm_cr50_stats_reset(PCR50_CONTEXT pDevice);
+
+NTSTATUS tpm_cr50_trace_init(PCR50_CONTEXT pDevice);
+void tpm_cr50_trace(PCR50_CONTEXT pDevice, CR50_TRACE_TYPE type, UINT32 reg,
+	const UINT8* buf, size_t len, NTSTATUS result, LONGLONG start);
+NTSTATUS tpm_cr50_trace_query(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	size_t* bytesReturned);
+
+static __forceinline LONGLONG tpm_cr50_timestamp(void) {
+	LARGE_INTEGER CurrentTime;
+	KeQuerySystemTimePrecise(&CurrentTime);
+	return CurrentTime.QuadPart;
+}
 
 //
 // Helper macros
@@ -0,0 +1,265 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+//
+// Bus health monitor.
+//
+// Boards differ in pull-ups, wiring and controllers, so the bus timings
+// are one of three tiers picked at run time. Every transfer is reported
+// here with its result, and per window of CR50_HEALTH_WINDOW transfers
+// the failures (controller errors, SPI flow control that never released,
+// missing I2C ready pulses) and the smoothed time of register accesses
+// are checked:
+//
+// - CR50_HEALTH_ERRORS failures in a window, or CR50_HEALTH_ERROR_RUN in
+//   a row at any time, move one tier towards Safe.
+// - Register accesses taking twice their baseline leave Fast, as a slow
+//   link tends to fail next.
+// - HealthPromoteWindows clean windows in a row move one tier towards
+//   Fast. That number doubles whenever a promotion is undone before it
+//   has held for as long, so a marginal link does not flap between
+//   tiers, and halves again once one holds.
+//
+// Normal has the timings the driver always used and is where it starts.
+//
+
+#define CR50_HEALTH_WINDOW		256	/* Transfers */
+#define CR50_HEALTH_ERRORS		2
+#define CR50_HEALTH_ERROR_RUN		3
+#define CR50_HEALTH_PROMOTE		4	/* Windows */
+#define CR50_HEALTH_PROMOTE_MAX		256
+#define CR50_HEALTH_SHIFT		3	/* Latency weight 1/8 */
+#define CR50_HEALTH_BASE_SHIFT		4	/* Baseline rises with 1/16 per window */
+#define CR50_HEALTH_DRIFT_SLACK_US	50
+#define CR50_HEALTH_SAFE_CHUNK		32
+
+static const CR50_TIMING tpm_cr50_tiers[Cr50TierCount] = {
+	/* PollUs, WakeUs, Retries, ChunkMax */
+	{ 1000, 100, 0, 0 },
+	{ 1000 * TPM_CR50_TIMEOUT_SHORT_MS, 100, 0, 0 },
+	{ 5000, 300, TPM_CR50_I2C_MAX_RETRIES, CR50_HEALTH_SAFE_CHUNK },
+};
+
+NTSTATUS tpm_cr50_health_init(PCR50_CONTEXT pDevice) {
+	WDF_OBJECT_ATTRIBUTES attributes;
+
+	pDevice->Tier = Cr50TierNormal;
+	pDevice->Timing = &tpm_cr50_tiers[Cr50TierNormal];
+	pDevice->HealthPromoteWindows = CR50_HEALTH_PROMOTE;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = pDevice->FxDevice;
+
+	return WdfSpinLockCreate(&attributes, &pDevice->HealthLock);
+}
+
+static void tpm_cr50_health_move(PCR50_CONTEXT pDevice, CR50_TIER tier,
+	CR50_HEALTH_REASON reason) {
+	PCR50_HEALTH_TRANSITION t;
+
+	WdfSpinLockAcquire(pDevice->HealthLock);
+
+	t = &pDevice->HealthHistory[pDevice->HealthTransitions % CR50_HEALTH_HISTORY];
+	t->Time = tpm_cr50_timestamp();
+	t->From = (UCHAR)pDevice->Tier;
+	t->To = (UCHAR)tier;
+	t->Reason = (UCHAR)reason;
+	t->Reserved = 0;
+	t->WindowErrors = pDevice->HealthWindowErrors;
+	t->LatencyUs = pDevice->HealthLatencyUs;
+	t->BaselineUs = pDevice->HealthBaselineUs;
+	pDevice->HealthTransitions++;
+
+	pDevice->Tier = tier;
+	pDevice->Timing = &tpm_cr50_tiers[tier];
+
+	WdfSpinLockRelease(pDevice->HealthLock);
+
+	Cr50Print(DEBUG_LEVEL_INFO, DBG_IOCTL,
+		"Bus timing tier %d -> %d, reason %d\n", t->From, tier, reason);
+
+	pDevice->HealthCleanWindows = 0;
+}
+
+static void tpm_cr50_health_demote(PCR50_CONTEXT pDevice, CR50_HEALTH_REASON reason) {
+	if (pDevice->Tier >= Cr50TierSafe) {
+		return;
+	}
+
+	/* A promotion that did not hold makes the next one wait longer */
+	if (pDevice->HealthPromoted) {
+		pDevice->HealthPromoteWindows = min(pDevice->HealthPromoteWindows * 2,
+			CR50_HEALTH_PROMOTE_MAX);
+		pDevice->HealthPromoted = FALSE;
+	}
+
+	tpm_cr50_health_move(pDevice, pDevice->Tier + 1, reason);
+}
+
+static void tpm_cr50_health_window(PCR50_CONTEXT pDevice) {
+	ULONG errors = pDevice->HealthWindowErrors;
+	LONG latency = pDevice->HealthLatencyUs;
+	BOOLEAN drift = FALSE;
+
+	pDevice->HealthWindows++;
+
+	/* The baseline follows a faster link at once and a slower one slowly */
+	if (!pDevice->HealthBaselineUs || latency < pDevice->HealthBaselineUs) {
+		pDevice->HealthBaselineUs = latency;
+	}
+	else {
+		drift = latency > 2 * pDevice->HealthBaselineUs + CR50_HEALTH_DRIFT_SLACK_US;
+		pDevice->HealthBaselineUs += (latency - pDevice->HealthBaselineUs) >>
+			CR50_HEALTH_BASE_SHIFT;
+	}
+
+	if (pDevice->HealthPromoted &&
+		++pDevice->HealthSincePromotion >= pDevice->HealthPromoteWindows) {
+		pDevice->HealthPromoteWindows = max(pDevice->HealthPromoteWindows / 2,
+			CR50_HEALTH_PROMOTE);
+		pDevice->HealthPromoted = FALSE;
+	}
+
+	if (pDevice->HealthEnabled) {
+		if (errors >= CR50_HEALTH_ERRORS) {
+			tpm_cr50_health_demote(pDevice, Cr50HealthErrors);
+		}
+		else if (errors) {
+			pDevice->HealthCleanWindows = 0;
+		}
+		else if (drift) {
+			if (pDevice->Tier == Cr50TierFast)
+				tpm_cr50_health_demote(pDevice, Cr50HealthDrift);
+			pDevice->HealthCleanWindows = 0;
+		}
+		else if (++pDevice->HealthCleanWindows >= pDevice->HealthPromoteWindows &&
+			pDevice->Tier > Cr50TierFast) {
+			tpm_cr50_health_move(pDevice, pDevice->Tier - 1, Cr50HealthClean);
+			pDevice->HealthPromoted = TRUE;
+			pDevice->HealthSincePromotion = 0;
+		}
+	}
+
+	pDevice->HealthWindowTransfers = 0;
+	pDevice->HealthWindowErrors = 0;
+}
+
+/*
+ * Called for every attempt at a bus transfer of @len bytes that began at
+ * @start. STATUS_IO_TIMEOUT is a missing ready pulse on I2C and flow
+ * control that was never released on SPI.
+ */
+void tpm_cr50_health_transfer(PCR50_CONTEXT pDevice, size_t len, NTSTATUS status,
+	LONGLONG start) {
+	LONG us;
+
+	pDevice->HealthTransfers++;
+	pDevice->HealthWindowTransfers++;
+
+	if (!NT_SUCCESS(status)) {
+		pDevice->HealthErrors++;
+		pDevice->HealthWindowErrors++;
+		if (status == STATUS_IO_TIMEOUT && pDevice->Transport == CR50_TRANSPORT_SPI)
+			pDevice->HealthStallTimeouts++;
+		else if (status == STATUS_IO_TIMEOUT)
+			pDevice->HealthReadyTimeouts++;
+
+		if (++pDevice->HealthErrorRun >= CR50_HEALTH_ERROR_RUN && pDevice->HealthEnabled) {
+			pDevice->HealthErrorRun = 0;
+			tpm_cr50_health_demote(pDevice, Cr50HealthErrorRun);
+		}
+	}
+	else {
+		pDevice->HealthErrorRun = 0;
+
+		/* Register accesses take about the same time, FIFO bursts do not */
+		if (len <= sizeof(UINT32)) {
+			us = (LONG)min((tpm_cr50_timestamp() - start) / 10, MAXLONG);
+			if (!pDevice->HealthLatencyUs)
+				pDevice->HealthLatencyUs = us;
+			else
+				pDevice->HealthLatencyUs += (us - pDevice->HealthLatencyUs) >> CR50_HEALTH_SHIFT;
+		}
+	}
+
+	if (pDevice->HealthWindowTransfers >= CR50_HEALTH_WINDOW) {
+		tpm_cr50_health_window(pDevice);
+	}
+}
+
+/*
+ * Whether a transfer that failed with @status before moving data is
+ * tried again after its @attempt'th failure, with the pause Cr50 wants
+ * between transfers.
+ */
+BOOLEAN tpm_cr50_health_retry(PCR50_CONTEXT pDevice, NTSTATUS status, ULONG attempt) {
+	if (NT_SUCCESS(status) || attempt >= pDevice->Timing->Retries) {
+		return FALSE;
+	}
+
+	pDevice->HealthRetries++;
+	KeStallExecutionProcessor((TPM_CR50_I2C_RETRY_DELAY_LO + TPM_CR50_I2C_RETRY_DELAY_HI) / 2);
+	return TRUE;
+}
+
+/* FIFO bytes to move in one transfer when the TPM takes or has @burst */
+ULONG tpm_cr50_health_chunk(PCR50_CONTEXT pDevice, size_t burst) {
+	ULONG chunk = pDevice->Timing->ChunkMax;
+
+	chunk = chunk ? min(chunk, pDevice->BurstMax) : pDevice->BurstMax;
+	return (ULONG)min(burst, chunk);
+}
+
+NTSTATUS tpm_cr50_health_query(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	size_t* bytesReturned) {
+	PCR50_HEALTH health;
+	ULONG first, returned;
+	NTSTATUS status;
+
+	*bytesReturned = 0;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*health), (PVOID*)&health, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	RtlZeroMemory(health, sizeof(*health));
+
+	WdfSpinLockAcquire(pDevice->HealthLock);
+
+	health->Version = CR50_HEALTH_VERSION;
+	health->Transport = pDevice->Transport;
+	health->Enabled = pDevice->HealthEnabled;
+	health->Tier = pDevice->Tier;
+	health->PollUs = pDevice->Timing->PollUs;
+	health->WakeUs = pDevice->Timing->WakeUs;
+	health->RetryLimit = pDevice->Timing->Retries;
+	health->ChunkMax = tpm_cr50_health_chunk(pDevice, MAXULONG);
+	health->LatencyUs = pDevice->HealthLatencyUs;
+	health->BaselineUs = pDevice->HealthBaselineUs;
+	health->WindowTransfers = pDevice->HealthWindowTransfers;
+	health->WindowErrors = pDevice->HealthWindowErrors;
+	health->CleanWindows = pDevice->HealthCleanWindows;
+	health->PromoteWindows = pDevice->HealthPromoteWindows;
+	health->Transfers = pDevice->HealthTransfers;
+	health->Errors = pDevice->HealthErrors;
+	health->StallTimeouts = pDevice->HealthStallTimeouts;
+	health->ReadyTimeouts = pDevice->HealthReadyTimeouts;
+	health->Retries = pDevice->HealthRetries;
+	health->Windows = pDevice->HealthWindows;
+	health->Transitions = pDevice->HealthTransitions;
+
+	returned = min(pDevice->HealthTransitions, CR50_HEALTH_HISTORY);
+	first = pDevice->HealthTransitions - returned;
+	for (ULONG i = 0; i < returned; i++) {
+		health->History[i] = pDevice->HealthHistory[(first + i) % CR50_HEALTH_HISTORY];
+	}
+	health->TransitionsReturned = returned;
+
+	WdfSpinLockRelease(pDevice->HealthLock);
+
+	*bytesReturned = sizeof(*health);
+	return STATUS_SUCCESS;
+}
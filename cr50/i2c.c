@@ -14,7 +14,8 @@ static NTSTATUS tpm_cr50_i2c_wait_tpm_ready(PCR50_CONTEXT pDevice) {
 		if (CurrentTime.QuadPart > Timeout.QuadPart) {
 			Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
 				"Timeout waiting for TPM Interrupt\n");
-			return STATUS_TIMEOUT;
+			/* STATUS_TIMEOUT would pass NT_SUCCESS */
+			return STATUS_IO_TIMEOUT;
 		}
 	}
 	KeQuerySystemTimePrecise(&CurrentTime);
@@ -32,13 +33,22 @@ static void tpm_cr50_i2c_disable_tpm_irq(PCR50_CONTEXT pDevice) {
 	WdfInterruptDisable(pDevice->Interrupt);
 }
 
-NTSTATUS tpm_cr50_i2c_read(
+/*
+ * A missing ready pulse fails the transfer with STATUS_IO_TIMEOUT, so
+ * that the health monitor counts it and the caller may try again; the
+ * data is not read, since the TPM may not have it ready.
+ */
+static NTSTATUS tpm_cr50_i2c_read_once(
 	_In_ PCR50_CONTEXT pDevice,
 	UINT8 addr,
 	UINT8* buf,
 	size_t len
 ) {
-	NTSTATUS status = tpm_cr50_i2c_enable_tpm_irq(pDevice);
+	NTSTATUS status;
+
+	tpm_cr50_stats_bus(pDevice);
+
+	status = tpm_cr50_i2c_enable_tpm_irq(pDevice);
 	if (!NT_SUCCESS(status)) {
 		return status;
 	}
@@ -69,22 +79,15 @@ out:
 	return status;
 }
 
-NTSTATUS tpm_cr50_i2c_write(
+static NTSTATUS tpm_cr50_i2c_write_once(
 	_In_ PCR50_CONTEXT pDevice,
-	UINT8 addr,
-	UINT8* buf,
 	size_t len
 ) {
-	if (len > TPM_CR50_MAX_BUFSIZE - 1) {
-		Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
-			"Insufficient memory for write\n");
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
+	NTSTATUS status;
 
-	pDevice->buf[0] = addr;
-	memcpy(pDevice->buf + 1, buf, len);
+	tpm_cr50_stats_bus(pDevice);
 
-	NTSTATUS status = tpm_cr50_i2c_enable_tpm_irq(pDevice);
+	status = tpm_cr50_i2c_enable_tpm_irq(pDevice);
 	if (!NT_SUCCESS(status)) {
 		return status;
 	}
@@ -99,20 +102,79 @@ NTSTATUS tpm_cr50_i2c_write(
 	//Wait for TPM to be ready
 
 	status = tpm_cr50_i2c_wait_tpm_ready(pDevice);
-	if (!NT_SUCCESS(status)) {
-		goto out;
-	}
 
 out:
 	tpm_cr50_i2c_disable_tpm_irq(pDevice);
 	return status;
 }
 
+/*
+ * Only the other registers are tried again after a failure: a FIFO
+ * transfer may have moved part of its data.
+ */
+static BOOLEAN tpm_cr50_i2c_retry(PCR50_CONTEXT pDevice, UINT8 addr, NTSTATUS status,
+	ULONG attempt) {
+	if (addr == TPM_I2C_DATA_FIFO(pDevice->Locality)) {
+		return FALSE;
+	}
+	return tpm_cr50_health_retry(pDevice, status, attempt);
+}
+
+NTSTATUS tpm_cr50_i2c_read(
+	_In_ PCR50_CONTEXT pDevice,
+	UINT8 addr,
+	UINT8* buf,
+	size_t len
+) {
+	LONGLONG start;
+	NTSTATUS status;
+	ULONG attempt = 0;
+
+	do {
+		start = tpm_cr50_timestamp();
+		status = tpm_cr50_i2c_read_once(pDevice, addr, buf, len);
+		tpm_cr50_trace(pDevice, Cr50TraceRead, addr, buf, len, status, start);
+		tpm_cr50_health_transfer(pDevice, len, status, start);
+	} while (tpm_cr50_i2c_retry(pDevice, addr, status, attempt++));
+
+	return status;
+}
+
+NTSTATUS tpm_cr50_i2c_write(
+	_In_ PCR50_CONTEXT pDevice,
+	UINT8 addr,
+	UINT8* buf,
+	size_t len
+) {
+	if (len > pDevice->BurstMax) {
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"Insufficient memory for write\n");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	pDevice->buf[0] = addr;
+	memcpy(pDevice->buf + 1, buf, len);
+
+	LONGLONG start;
+	NTSTATUS status;
+	ULONG attempt = 0;
+
+	do {
+		start = tpm_cr50_timestamp();
+		status = tpm_cr50_i2c_write_once(pDevice, len);
+		tpm_cr50_trace(pDevice, Cr50TraceWrite, addr, buf, len, status, start);
+		tpm_cr50_health_transfer(pDevice, len, status, start);
+	} while (tpm_cr50_i2c_retry(pDevice, addr, status, attempt++));
+
+	return status;
+}
+
 static NTSTATUS tpm_cr50_check_locality(PCR50_CONTEXT pDevice) {
 	UINT8 mask = TPM_ACCESS_VALID | TPM_ACCESS_ACTIVE_LOCALITY;
 	UINT8 buf;
 
-	NTSTATUS status = tpm_cr50_i2c_read(pDevice, TPM_I2C_ACCESS(0), &buf, sizeof(buf));
+	NTSTATUS status = tpm_cr50_i2c_read(pDevice, TPM_I2C_ACCESS(pDevice->Locality),
+		&buf, sizeof(buf));
 	if (!NT_SUCCESS(status)) {
 		return status;
 	}
@@ -127,7 +189,7 @@ static NTSTATUS tpm_cr50_check_locality(PCR50_CONTEXT pDevice) {
 
 void tpm_cr50_i2c_release_locality(PCR50_CONTEXT pDevice, BOOLEAN force) {
 	UINT8 mask = TPM_ACCESS_VALID | TPM_ACCESS_REQUEST_PENDING;
-	UINT8 addr = TPM_I2C_ACCESS(0);
+	UINT8 addr = TPM_I2C_ACCESS(pDevice->Locality);
 	UINT8 buf;
 
 	NTSTATUS status = tpm_cr50_i2c_read(pDevice, addr, &buf, sizeof(buf));
@@ -149,13 +211,13 @@ NTSTATUS tpm_cr50_i2c_request_locality(PCR50_CONTEXT pDevice) {
 		return status;
 	}
 
-	status = tpm_cr50_i2c_write(pDevice, TPM_I2C_ACCESS(0), &buf, sizeof(buf));
+	status = tpm_cr50_i2c_write(pDevice, TPM_I2C_ACCESS(pDevice->Locality), &buf, sizeof(buf));
 	if (!NT_SUCCESS(status)) {
 		return status;
 	}
 
 	LARGE_INTEGER WaitInterval;
-	WaitInterval.QuadPart = -10 * 1000 * TPM_CR50_TIMEOUT_SHORT_MS;
+	WaitInterval.QuadPart = -10 * (LONGLONG)pDevice->Timing->PollUs;
 
 	for (int i = 0; i < 3; i++) {
 		status = tpm_cr50_check_locality(pDevice);
@@ -171,21 +233,21 @@ NTSTATUS tpm_cr50_i2c_request_locality(PCR50_CONTEXT pDevice) {
 }
 
 NTSTATUS tpm_cr50_i2c_tis_status(PCR50_CONTEXT pDevice, UINT8* buf, size_t sz) {
-	return tpm_cr50_i2c_read(pDevice, TPM_I2C_STS(0), buf, sz);
+	return tpm_cr50_i2c_read(pDevice, TPM_I2C_STS(pDevice->Locality), buf, sz);
 }
 
 NTSTATUS tpm_cr50_i2c_tis_status_write(PCR50_CONTEXT pDevice, UINT8* buf, size_t sz) {
-	return tpm_cr50_i2c_write(pDevice, TPM_I2C_STS(0), buf, sz);
+	return tpm_cr50_i2c_write(pDevice, TPM_I2C_STS(pDevice->Locality), buf, sz);
 }
 
 void tpm_cr50_i2c_tis_set_ready(PCR50_CONTEXT pDevice)
 {
 	UINT8 buf[4] = { TPM_STS_COMMAND_READY };
 
-	tpm_cr50_i2c_write(pDevice, TPM_I2C_STS(0), buf, sizeof(buf));
+	tpm_cr50_i2c_write(pDevice, TPM_I2C_STS(pDevice->Locality), buf, sizeof(buf));
 
 	LARGE_INTEGER WaitInterval;
-	WaitInterval.QuadPart = -10 * 1000 * TPM_CR50_TIMEOUT_SHORT_MS;
+	WaitInterval.QuadPart = -10 * (LONGLONG)pDevice->Timing->PollUs;
 
 	KeDelayExecutionThread(KernelMode, FALSE, &WaitInterval);
 }
\ No newline at end of file
@@ -0,0 +1,502 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+//
+// Key pre-generation pool.
+//
+// An RSA TPM2_Create takes seconds on the Cr50, most of it spent looking
+// for primes, while the TPM is idle most of the time. Clients register
+// the Create commands of the keys they make (IOCTL_CR50_KEYGEN_TEMPLATE)
+// and the consumer sends them ahead of time, keeping up to Depth
+// responses, i.e. wrapped key blobs, per template. When a client then
+// sends the same Create, it is answered with one of them right away and
+// the key is ready after a Load.
+//
+// Only a Create with a persistent parent and an empty creationPCR is
+// accepted: the blob stays valid across power transitions for as long
+// as its parent does, and the creation data holds nothing that changes
+// between the time it was made and the time it is handed out. Blobs are
+// dropped when the parent is evicted or the hierarchies are reset.
+//
+// The pool works only in D0 and after KeygenQuietMs without a command,
+// never wakes the device and never delays another command for long:
+// while a Create of the pool runs, a command arriving in the ring or the
+// shared ring, or a D0 exit, asks the TPM to cancel it through
+// TPM_STS.commandCancel, and it is sent again after the next quiet spell.
+//
+
+#define CR50_KEYGEN_CREATE_MIN	37	/* Create, password session, empty parameters */
+
+static UINT32 tpm_cr50_keygen_get32(const UINT8* p) {
+	return RtlUlongByteSwap(*((UINT32*)p));
+}
+
+static UINT16 tpm_cr50_keygen_get16(const UINT8* p) {
+	return RtlUshortByteSwap(*((UINT16*)p));
+}
+
+/*
+ * Checks a template: TPM2_Create under a persistent parent, authorized
+ * by one password session, with an empty creationPCR.
+ */
+static BOOLEAN tpm_cr50_keygen_parse_create(const UINT8* cmd, size_t len) {
+	size_t pos;
+
+	if (len < CR50_KEYGEN_CREATE_MIN || len > CR50_MAX_COMMAND_SIZE ||
+		tpm_cr50_keygen_get16(cmd) != TPM2_ST_SESSIONS ||
+		tpm_cr50_keygen_get32(cmd + 2) != len ||
+		tpm_cr50_keygen_get32(cmd + 6) != TPM2_CC_CREATE ||
+		(tpm_cr50_keygen_get32(cmd + 10) >> 24) != TPM2_HT_PERSISTENT ||
+		tpm_cr50_keygen_get32(cmd + 18) != TPM2_RS_PW ||
+		tpm_cr50_keygen_get16(cmd + 22) != 0 ||
+		tpm_cr50_keygen_get32(cmd + 14) != 9 + (UINT32)tpm_cr50_keygen_get16(cmd + 25))
+		return FALSE;
+
+	/* After the session: inSensitive, inPublic and outsideInfo, then creationPCR */
+	pos = 18 + (size_t)tpm_cr50_keygen_get32(cmd + 14);
+	for (ULONG i = 0; i < 3; i++) {
+		if (pos + 2 > len)
+			return FALSE;
+		pos += 2 + tpm_cr50_keygen_get16(cmd + pos);
+	}
+	return pos + 4 == len && tpm_cr50_keygen_get32(cmd + pos) == 0;
+}
+
+/* Template sent as @cmd from @locality, with KeygenLock held */
+static PCR50_KEYGEN_SLOT tpm_cr50_keygen_find(PCR50_CONTEXT pDevice, const UINT8* cmd,
+	size_t len, UCHAR locality) {
+	for (ULONG i = 0; i < CR50_KEYGEN_TEMPLATES; i++) {
+		PCR50_KEYGEN_SLOT t = &pDevice->KeygenSlots[i];
+
+		if (t->Id && t->Locality == locality && t->CommandLength == len &&
+			RtlEqualMemory(t->Command, cmd, len))
+			return t;
+	}
+	return NULL;
+}
+
+/* Drops the keys of @t beyond @keep, with KeygenLock held */
+static void tpm_cr50_keygen_trim(PCR50_KEYGEN_SLOT t, ULONG keep) {
+	while (t->Count > keep) {
+		t->Count--;
+		ExFreePoolWithTag(t->Keys[t->Count], CR50_POOL_TAG);
+		t->Keys[t->Count] = NULL;
+	}
+}
+
+static void tpm_cr50_keygen_free(PCR50_KEYGEN_SLOT t) {
+	tpm_cr50_keygen_trim(t, 0);
+	if (t->Command) {
+		ExFreePoolWithTag(t->Command, CR50_POOL_TAG);
+	}
+	RtlZeroMemory(t, sizeof(*t));
+}
+
+VOID Cr50EvtKeygenTimer(WDFTIMER Timer) {
+	PCR50_CONTEXT pDevice = GetDeviceContext((WDFDEVICE)WdfTimerGetParentObject(Timer));
+
+	pDevice->KeygenTimerArmed = FALSE;
+	tpm_cr50_ring_kick(pDevice);
+}
+
+NTSTATUS tpm_cr50_keygen_init(PCR50_CONTEXT pDevice) {
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDF_TIMER_CONFIG timerConfig;
+	NTSTATUS status;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = pDevice->FxDevice;
+
+	status = WdfSpinLockCreate(&attributes, &pDevice->KeygenLock);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	WDF_TIMER_CONFIG_INIT(&timerConfig, Cr50EvtKeygenTimer);
+	timerConfig.AutomaticSerialization = FALSE;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = pDevice->FxDevice;
+
+	return WdfTimerCreate(&timerConfig, &attributes, &pDevice->KeygenTimer);
+}
+
+/* Called from the device cleanup callback */
+void tpm_cr50_keygen_cleanup(PCR50_CONTEXT pDevice) {
+	for (ULONG i = 0; i < CR50_KEYGEN_TEMPLATES; i++) {
+		tpm_cr50_keygen_free(&pDevice->KeygenSlots[i]);
+	}
+}
+
+/* Adds, resizes or removes a template; completes without a TPM command */
+NTSTATUS tpm_cr50_keygen_register(PCR50_CONTEXT pDevice, WDFREQUEST Request) {
+	WDFFILEOBJECT fileObject = WdfRequestGetFileObject(Request);
+	PCR50_KEYGEN_TEMPLATE input;
+	PCR50_KEYGEN_SLOT t;
+	const UINT8* cmd;
+	UINT8* copy = NULL;
+	UCHAR locality;
+	ULONG depth;
+	size_t len;
+	NTSTATUS status;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(*input), (PVOID*)&input, &len);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (!pDevice->KeygenDepth) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	cmd = (const UINT8*)(input + 1);
+	len -= sizeof(*input);
+	if (!tpm_cr50_keygen_parse_create(cmd, len)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	depth = min(input->Depth, pDevice->KeygenDepth);
+	locality = fileObject ? GetFileContext(fileObject)->Locality : 0;
+
+	/* Registration may run at dispatch level, so the copy is made up front */
+	if (depth) {
+		copy = ExAllocatePoolZero(NonPagedPoolNx, len, CR50_POOL_TAG);
+		if (!copy) {
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		RtlCopyMemory(copy, cmd, len);
+	}
+
+	WdfSpinLockAcquire(pDevice->KeygenLock);
+
+	t = tpm_cr50_keygen_find(pDevice, cmd, len, locality);
+	if (t && !depth) {
+		tpm_cr50_keygen_free(t);
+	}
+	else if (t) {
+		tpm_cr50_keygen_trim(t, depth);
+		t->Depth = depth;
+		t->Failed = FALSE;
+	}
+	else if (depth) {
+		for (ULONG i = 0; i < CR50_KEYGEN_TEMPLATES && !t; i++) {
+			if (!pDevice->KeygenSlots[i].Id)
+				t = &pDevice->KeygenSlots[i];
+		}
+		if (t) {
+			t->Id = ++pDevice->KeygenNextId;
+			t->Locality = locality;
+			t->Parent = tpm_cr50_keygen_get32(cmd + TPM_HEADER_SIZE);
+			t->Depth = depth;
+			t->CommandLength = (ULONG)len;
+			t->Command = copy;
+			copy = NULL;
+		}
+		else {
+			status = STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	WdfSpinLockRelease(pDevice->KeygenLock);
+
+	if (copy) {
+		ExFreePoolWithTag(copy, CR50_POOL_TAG);
+	}
+
+	if (NT_SUCCESS(status)) {
+		tpm_cr50_ring_kick(pDevice);
+	}
+	return status;
+}
+
+/**
+ * tpm_cr50_keygen_lookup() - Answer a TPM2_Create from the pool.
+ *
+ * Returns TRUE if @rsp holds the response, in which case the command
+ * must not be sent. Called with the command lock held.
+ */
+BOOLEAN tpm_cr50_keygen_lookup(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len,
+	UINT8* rsp, size_t rsp_len) {
+	PCR50_KEYGEN_SLOT t;
+	UINT8* key = NULL;
+
+	/* The pool's own Create is sent */
+	if (!pDevice->KeygenDepth || pDevice->KeygenActive || cmd_len < TPM_HEADER_SIZE ||
+		tpm_cr50_keygen_get32(cmd + 6) != TPM2_CC_CREATE) {
+		return FALSE;
+	}
+
+	WdfSpinLockAcquire(pDevice->KeygenLock);
+	t = tpm_cr50_keygen_find(pDevice, cmd, cmd_len, pDevice->Locality);
+	if (t && t->Count &&
+		tpm_cr50_keygen_get32(t->Keys[t->Count - 1] + 2) <= rsp_len) {
+		t->Count--;
+		key = t->Keys[t->Count];
+		t->Keys[t->Count] = NULL;
+	}
+	else if (t) {
+		pDevice->KeygenMisses++;
+	}
+	WdfSpinLockRelease(pDevice->KeygenLock);
+
+	if (!key) {
+		return FALSE;
+	}
+
+	RtlCopyMemory(rsp, key, tpm_cr50_keygen_get32(key + 2));
+	ExFreePoolWithTag(key, CR50_POOL_TAG);
+	pDevice->KeygenServed++;
+	return TRUE;
+}
+
+/*
+ * Drops the keys of templates under @parent, or of all of them if 0.
+ * Called for every command sent, with the command lock held.
+ */
+void tpm_cr50_keygen_update(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len) {
+	UINT32 parent;
+
+	if (!pDevice->KeygenDepth || cmd_len < TPM_HEADER_SIZE) {
+		return;
+	}
+
+	switch (tpm_cr50_keygen_get32(cmd + 6)) {
+	case TPM2_CC_EVICT_CONTROL:
+		/* The persistent handle follows the authorization and object handles */
+		if (cmd_len < 18)
+			return;
+		parent = tpm_cr50_keygen_get32(cmd + 14);
+		break;
+	case TPM2_CC_CLEAR:
+	case TPM2_CC_CHANGE_EPS:
+	case TPM2_CC_CHANGE_PPS:
+		parent = 0;
+		break;
+	default:
+		return;
+	}
+
+	WdfSpinLockAcquire(pDevice->KeygenLock);
+	for (ULONG i = 0; i < CR50_KEYGEN_TEMPLATES; i++) {
+		PCR50_KEYGEN_SLOT t = &pDevice->KeygenSlots[i];
+
+		if (t->Id && (!parent || t->Parent == parent))
+			tpm_cr50_keygen_trim(t, 0);
+	}
+	WdfSpinLockRelease(pDevice->KeygenLock);
+}
+
+/* Whether anything else wants the TPM while a Create of the pool runs */
+static BOOLEAN tpm_cr50_keygen_preempted(PCR50_CONTEXT pDevice) {
+	return tpm_cr50_ring_waiting(pDevice) || tpm_cr50_shared_pending(pDevice) ||
+		pDevice->KeygenStop || pDevice->RingStopping;
+}
+
+/*
+ * Overlap of a Create of the pool, run once the TPM executes it: waits
+ * for the response, and asks the TPM to cancel the Create through
+ * TPM_STS.commandCancel as soon as anything else wants the TPM, or once
+ * it outruns its duration. The response, or TPM_RC_CANCELED, is then
+ * received as usual.
+ */
+static VOID tpm_cr50_keygen_watch(PVOID Context) {
+	PCR50_CONTEXT pDevice = (PCR50_CONTEXT)Context;
+	UINT8 cancel[4] = { 0, 0, 0, TPM_STS_COMMAND_CANCEL };
+	UINT8 mask = TPM_STS_VALID | TPM_STS_DATA_AVAIL;
+	LONGLONG stop = tpm_cr50_timestamp() + 10 * 1000 * (LONGLONG)pDevice->CommandDuration;
+	UINT8 buf[4];
+
+	while (!tpm_cr50_keygen_preempted(pDevice)) {
+		if (NT_SUCCESS(tpm_cr50_tis_status(pDevice, buf, sizeof(buf))) &&
+			(buf[0] & mask) == mask)
+			return;
+		if (tpm_cr50_timestamp() >= stop)
+			break;
+		tpm_cr50_tis_wait(pDevice, TPM_STS_DATA_AVAIL, pDevice->Timing->PollUs);
+	}
+
+	pDevice->KeygenCancelled = TRUE;
+	tpm_cr50_tis_status_write(pDevice, cancel, sizeof(cancel));
+}
+
+/* Template most short of keys, with KeygenLock held */
+static PCR50_KEYGEN_SLOT tpm_cr50_keygen_next(PCR50_CONTEXT pDevice) {
+	PCR50_KEYGEN_SLOT t, next = NULL;
+
+	for (ULONG i = 0; i < CR50_KEYGEN_TEMPLATES; i++) {
+		t = &pDevice->KeygenSlots[i];
+		if (t->Id && !t->Failed && t->Count < t->Depth &&
+			(!next || t->Count < next->Count))
+			next = t;
+	}
+	return next;
+}
+
+/*
+ * Whether the consumer has a key to make now. When one is wanted but the
+ * TPM has not been quiet for long enough, a timer kicks the consumer
+ * once it has.
+ */
+BOOLEAN tpm_cr50_keygen_pending(PCR50_CONTEXT pDevice) {
+	LONGLONG now, quiet;
+	BOOLEAN wanted;
+
+	/* The pool never wakes the device */
+	if (!pDevice->KeygenDepth || !pDevice->PoweredOn || pDevice->KeygenStop ||
+		pDevice->RingStopping) {
+		return FALSE;
+	}
+
+	WdfSpinLockAcquire(pDevice->KeygenLock);
+	wanted = tpm_cr50_keygen_next(pDevice) != NULL;
+	WdfSpinLockRelease(pDevice->KeygenLock);
+
+	if (!wanted) {
+		return FALSE;
+	}
+
+	now = tpm_cr50_timestamp();
+	quiet = max(pDevice->LastArrival, pDevice->KeygenYielded) +
+		10 * 1000 * (LONGLONG)pDevice->KeygenQuietMs;
+	if (now >= quiet) {
+		return TRUE;
+	}
+
+	if (!pDevice->KeygenTimerArmed) {
+		pDevice->KeygenTimerArmed = TRUE;
+		WdfTimerStart(pDevice->KeygenTimer, -(quiet - now));
+	}
+	return FALSE;
+}
+
+/* Keeps the response of a Create of the pool for template @id */
+static void tpm_cr50_keygen_store(PCR50_CONTEXT pDevice, ULONG id, const UINT8* rsp,
+	LONGLONG start) {
+	UINT32 len = tpm_cr50_keygen_get32(rsp + 2);
+	PCR50_KEYGEN_SLOT t;
+	UINT8* key;
+
+	key = ExAllocatePoolZero(NonPagedPoolNx, len, CR50_POOL_TAG);
+	if (!key) {
+		return;
+	}
+	RtlCopyMemory(key, rsp, len);
+
+	/* The template may have been removed or resized meanwhile */
+	WdfSpinLockAcquire(pDevice->KeygenLock);
+	for (ULONG i = 0; i < CR50_KEYGEN_TEMPLATES && key; i++) {
+		t = &pDevice->KeygenSlots[i];
+		if (t->Id == id && t->Count < t->Depth) {
+			t->Keys[t->Count++] = key;
+			key = NULL;
+		}
+	}
+	WdfSpinLockRelease(pDevice->KeygenLock);
+
+	if (key) {
+		ExFreePoolWithTag(key, CR50_POOL_TAG);
+		return;
+	}
+
+	pDevice->KeygenGenerated++;
+	pDevice->KeygenUs += (tpm_cr50_timestamp() - start) / 10;
+}
+
+/* Called by the consumer between requests: makes one key for the pool */
+void tpm_cr50_keygen_run(PCR50_CONTEXT pDevice) {
+	UINT8* rsp = pDevice->InternalResponse;
+	size_t rsp_len = sizeof(pDevice->InternalResponse);
+	PCR50_KEYGEN_SLOT t;
+	UCHAR locality = 0;
+	ULONG id = 0, len = 0;
+	LONGLONG start;
+	NTSTATUS status;
+	UINT32 rc = 0;
+
+	if (!tpm_cr50_keygen_pending(pDevice)) {
+		return;
+	}
+
+	status = tpm_cr50_begin(pDevice);
+	if (!NT_SUCCESS(status)) {
+		pDevice->KeygenYielded = tpm_cr50_timestamp();
+		return;
+	}
+
+	/* Copied with the command lock held, which keeps the buffer ours */
+	WdfSpinLockAcquire(pDevice->KeygenLock);
+	t = tpm_cr50_keygen_next(pDevice);
+	if (t) {
+		id = t->Id;
+		locality = t->Locality;
+		len = t->CommandLength;
+		RtlCopyMemory(pDevice->CommandBuffer, t->Command, len);
+	}
+	WdfSpinLockRelease(pDevice->KeygenLock);
+
+	if (!id) {
+		tpm_cr50_end(pDevice);
+		return;
+	}
+
+	tpm_cr50_select_locality(pDevice, locality);
+	pDevice->HoldLocality = FALSE;
+
+	start = tpm_cr50_timestamp();
+	pDevice->KeygenCancelled = FALSE;
+	pDevice->KeygenActive = TRUE;
+	status = tpm_cr50_transmit_overlap(pDevice, pDevice->CommandBuffer, len, rsp, rsp_len, 0,
+		tpm_cr50_keygen_watch, pDevice);
+	pDevice->KeygenActive = FALSE;
+	if (NT_SUCCESS(status)) {
+		rc = tpm2_response_code(rsp);
+	}
+
+	if (NT_SUCCESS(status) && rc == TPM2_RC_SUCCESS) {
+		tpm_cr50_keygen_store(pDevice, id, rsp, start);
+	}
+	else if (!NT_SUCCESS(status) || pDevice->KeygenCancelled || rc == TPM2_RC_CANCELED ||
+		rc == TPM2_RC_YIELDED || rc == TPM2_RC_RETRY || rc == TPM2_RC_TESTING) {
+		/* Tried again after the next quiet spell */
+		pDevice->KeygenYielded = tpm_cr50_timestamp();
+		pDevice->KeygenCancels++;
+	}
+	else {
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"Create of key pool template %d failed: rc 0x%x\n", id, rc);
+		pDevice->KeygenFailures++;
+
+		WdfSpinLockAcquire(pDevice->KeygenLock);
+		for (ULONG i = 0; i < CR50_KEYGEN_TEMPLATES; i++) {
+			if (pDevice->KeygenSlots[i].Id == id)
+				pDevice->KeygenSlots[i].Failed = TRUE;
+		}
+		WdfSpinLockRelease(pDevice->KeygenLock);
+	}
+
+	tpm_cr50_end(pDevice);
+}
+
+void tpm_cr50_keygen_stats(PCR50_CONTEXT pDevice, PCR50_KEYGEN_STATS stats) {
+	RtlZeroMemory(stats, sizeof(*stats));
+
+	WdfSpinLockAcquire(pDevice->KeygenLock);
+	for (ULONG i = 0; i < CR50_KEYGEN_TEMPLATES; i++) {
+		if (pDevice->KeygenSlots[i].Id) {
+			stats->Templates++;
+			stats->Ready += pDevice->KeygenSlots[i].Count;
+		}
+	}
+	WdfSpinLockRelease(pDevice->KeygenLock);
+
+	stats->MaxDepth = pDevice->KeygenDepth;
+	stats->QuietMs = pDevice->KeygenQuietMs;
+	stats->Generated = pDevice->KeygenGenerated;
+	stats->Served = pDevice->KeygenServed;
+	stats->Misses = pDevice->KeygenMisses;
+	stats->Cancels = pDevice->KeygenCancels;
+	stats->Failures = pDevice->KeygenFailures;
+	stats->GenerateUs = pDevice->KeygenUs;
+}
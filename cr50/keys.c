@@ -0,0 +1,363 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+//
+// Cache of loaded keys.
+//
+// Services load the same wrapped key before every use, and Load is one
+// of the slow commands of the Cr50. A Load authorized with a password
+// session is hashed from its parentHandle on, which covers the parent,
+// the password and both blobs, and the object it loaded is kept: the same
+// Load again is answered with the response it got the first time, and a
+// FlushContext of the handle only drops the caller's reference, leaving
+// the object loaded for the next one.
+//
+// A handle is only handed out again once TPM2_ReadPublic found the same
+// name at it, so an object flushed or replaced behind the cache's back is
+// never returned. Entries go when their parent is flushed or evicted,
+// with commands that flush or invalidate transient objects, and on D0
+// exit. Objects nobody holds are flushed least recently used first when
+// a command fails for the lack of object slots, or when the cache is
+// full.
+//
+// Everything here runs with the command lock held.
+//
+
+#define CR50_KEY_LOAD_MIN	31	/* Load with a password session, empty blobs */
+#define CR50_KEY_NAME_OFFSET	18	/* Of the name in a Load response */
+
+static UINT32 tpm_cr50_keys_get32(const UINT8* p) {
+	return RtlUlongByteSwap(*((UINT32*)p));
+}
+
+static UINT16 tpm_cr50_keys_get16(const UINT8* p) {
+	return RtlUshortByteSwap(*((UINT16*)p));
+}
+
+static void tpm_cr50_keys_put32(UINT8* p, UINT32 value) {
+	*((UINT32*)p) = RtlUlongByteSwap(value);
+}
+
+static void tpm_cr50_keys_put16(UINT8* p, UINT16 value) {
+	*((UINT16*)p) = RtlUshortByteSwap(value);
+}
+
+/* Recognizes Load authorized by one password session, the only form that is cached */
+static BOOLEAN tpm_cr50_keys_parse_load(const UINT8* cmd, size_t len) {
+	UINT32 auth;
+
+	if (len < CR50_KEY_LOAD_MIN ||
+		tpm_cr50_keys_get16(cmd) != TPM2_ST_SESSIONS ||
+		tpm_cr50_keys_get32(cmd + 2) != len ||
+		tpm_cr50_keys_get32(cmd + 6) != TPM2_CC_LOAD ||
+		tpm_cr50_keys_get32(cmd + 18) != TPM2_RS_PW ||
+		tpm_cr50_keys_get16(cmd + 22) != 0)
+		return FALSE;
+
+	/* parentHandle is the only handle; the password is all of the session */
+	auth = tpm_cr50_keys_get32(cmd + 14);
+	return auth == 9 + (UINT32)tpm_cr50_keys_get16(cmd + 25) && 18 + (size_t)auth + 4 <= len;
+}
+
+static BOOLEAN tpm_cr50_keys_digest(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t len,
+	UINT8* digest) {
+	return NT_SUCCESS(BCryptHash(pDevice->QuoteHash, NULL, 0, (PUCHAR)cmd + TPM_HEADER_SIZE,
+		(ULONG)len - TPM_HEADER_SIZE, digest, CR50_KEY_DIGEST_SIZE));
+}
+
+static PCR50_KEY_ENTRY tpm_cr50_keys_find(PCR50_CONTEXT pDevice, const UINT8* digest) {
+	for (ULONG i = 0; i < pDevice->KeyCacheEntries; i++) {
+		PCR50_KEY_ENTRY e = &pDevice->Keys[i];
+
+		if (e->Valid && RtlEqualMemory(e->Digest, digest, CR50_KEY_DIGEST_SIZE))
+			return e;
+	}
+	return NULL;
+}
+
+static PCR50_KEY_ENTRY tpm_cr50_keys_find_handle(PCR50_CONTEXT pDevice, UINT32 handle) {
+	for (ULONG i = 0; i < pDevice->KeyCacheEntries; i++) {
+		if (pDevice->Keys[i].Valid && pDevice->Keys[i].Handle == handle)
+			return &pDevice->Keys[i];
+	}
+	return NULL;
+}
+
+/* Least recently used entry nobody holds */
+static PCR50_KEY_ENTRY tpm_cr50_keys_victim(PCR50_CONTEXT pDevice) {
+	PCR50_KEY_ENTRY e, victim = NULL;
+
+	for (ULONG i = 0; i < pDevice->KeyCacheEntries; i++) {
+		e = &pDevice->Keys[i];
+		if (e->Valid && !e->Users && (!victim || e->LastUse < victim->LastUse))
+			victim = e;
+	}
+	return victim;
+}
+
+/* Forgets @e, flushing its object unless a caller still holds it */
+static void tpm_cr50_keys_drop(PCR50_CONTEXT pDevice, PCR50_KEY_ENTRY e) {
+	UINT8 cmd[TPM_HEADER_SIZE + 4], rsp[TPM_HEADER_SIZE];
+
+	e->Valid = FALSE;
+	if (e->Users) {
+		return;
+	}
+
+	/* Not in the cache anymore, so it is sent like any FlushContext */
+	tpm_cr50_keys_put16(cmd, TPM2_ST_NO_SESSIONS);
+	tpm_cr50_keys_put32(cmd + 2, sizeof(cmd));
+	tpm_cr50_keys_put32(cmd + 6, TPM2_CC_FLUSH_CONTEXT);
+	tpm_cr50_keys_put32(cmd + 10, e->Handle);
+	tpm_cr50_transmit_retry(pDevice, cmd, sizeof(cmd), rsp, sizeof(rsp), 0);
+}
+
+/*
+ * Whether the object at the handle of @e still has the name it was
+ * loaded with. STATUS_NOT_FOUND if it does not; other failures decide
+ * nothing. @rsp is the caller's response buffer, used as scratch.
+ */
+static NTSTATUS tpm_cr50_keys_verify(PCR50_CONTEXT pDevice, PCR50_KEY_ENTRY e,
+	UINT8* rsp, size_t rsp_len) {
+	const UINT8* name = e->Response + CR50_KEY_NAME_OFFSET;
+	UINT16 nameSize = tpm_cr50_keys_get16(name);
+	UINT8 cmd[TPM_HEADER_SIZE + 4];
+	size_t size, pos;
+	NTSTATUS status;
+	UINT32 rc;
+
+	tpm_cr50_keys_put16(cmd, TPM2_ST_NO_SESSIONS);
+	tpm_cr50_keys_put32(cmd + 2, sizeof(cmd));
+	tpm_cr50_keys_put32(cmd + 6, TPM2_CC_READ_PUBLIC);
+	tpm_cr50_keys_put32(cmd + 10, e->Handle);
+
+	status = tpm_cr50_transmit_retry(pDevice, cmd, sizeof(cmd), rsp, rsp_len, 0);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	rc = tpm2_response_code(rsp);
+	if (rc == TPM2_RC_YIELDED || rc == TPM2_RC_RETRY || rc == TPM2_RC_TESTING) {
+		return STATUS_DEVICE_BUSY;
+	}
+
+	/* outPublic, then name */
+	size = min(rsp_len, tpm_cr50_keys_get32(rsp + 2));
+	if (rc != TPM2_RC_SUCCESS || size < TPM_HEADER_SIZE + 2) {
+		return STATUS_NOT_FOUND;
+	}
+	pos = TPM_HEADER_SIZE + 2 + tpm_cr50_keys_get16(rsp + TPM_HEADER_SIZE);
+	if (pos + 2 + nameSize > size || tpm_cr50_keys_get16(rsp + pos) != nameSize ||
+		!RtlEqualMemory(rsp + pos + 2, name + 2, nameSize)) {
+		return STATUS_NOT_FOUND;
+	}
+	return STATUS_SUCCESS;
+}
+
+/**
+ * tpm_cr50_keys_lookup() - Answer Load and FlushContext from the key cache.
+ *
+ * Returns TRUE if @rsp holds the response, in which case the command
+ * must not be sent.
+ */
+BOOLEAN tpm_cr50_keys_lookup(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len,
+	UINT8* rsp, size_t rsp_len) {
+	UINT8 digest[CR50_KEY_DIGEST_SIZE];
+	PCR50_KEY_ENTRY e;
+	NTSTATUS status;
+
+	if (!pDevice->KeyCacheEntries || cmd_len < TPM_HEADER_SIZE + 4) {
+		return FALSE;
+	}
+
+	if (cmd_len == TPM_HEADER_SIZE + 4 &&
+		tpm_cr50_keys_get32(cmd + 6) == TPM2_CC_FLUSH_CONTEXT) {
+		e = tpm_cr50_keys_find_handle(pDevice, tpm_cr50_keys_get32(cmd + 10));
+		if (!e || !e->Users || rsp_len < TPM_HEADER_SIZE) {
+			return FALSE;
+		}
+
+		/* Stays loaded for the next Load of the same key */
+		e->Users--;
+		tpm_cr50_keys_put16(rsp, TPM2_ST_NO_SESSIONS);
+		tpm_cr50_keys_put32(rsp + 2, TPM_HEADER_SIZE);
+		tpm_cr50_keys_put32(rsp + 6, TPM2_RC_SUCCESS);
+		pDevice->KeyFlushesAbsorbed++;
+		return TRUE;
+	}
+
+	if (!tpm_cr50_keys_parse_load(cmd, cmd_len) ||
+		!tpm_cr50_keys_digest(pDevice, cmd, cmd_len, digest)) {
+		return FALSE;
+	}
+
+	e = tpm_cr50_keys_find(pDevice, digest);
+	if (!e || rsp_len < e->ResponseLength) {
+		pDevice->KeyMisses++;
+		return FALSE;
+	}
+
+	status = tpm_cr50_keys_verify(pDevice, e, rsp, rsp_len);
+	if (status == STATUS_NOT_FOUND) {
+		Cr50Print(DEBUG_LEVEL_INFO, DBG_IOCTL,
+			"Cached key 0x%x is not loaded anymore\n", e->Handle);
+		e->Valid = FALSE;
+		pDevice->KeyStale++;
+	}
+	if (!NT_SUCCESS(status)) {
+		pDevice->KeyMisses++;
+		return FALSE;
+	}
+
+	RtlCopyMemory(rsp, e->Response, e->ResponseLength);
+	e->Users++;
+	e->LastUse = ++pDevice->KeyCacheTick;
+	pDevice->KeyHits++;
+	return TRUE;
+}
+
+/* Keeps the object a Load that was sent loaded */
+static void tpm_cr50_keys_store(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len,
+	const UINT8* rsp, size_t rsp_len) {
+	UINT8 digest[CR50_KEY_DIGEST_SIZE];
+	PCR50_KEY_ENTRY e = NULL;
+	UINT32 len;
+
+	len = tpm_cr50_keys_get32(rsp + 2);
+	if (len > rsp_len || len > CR50_KEY_RESPONSE_MAX ||
+		len < CR50_KEY_NAME_OFFSET + 2 + (UINT32)tpm_cr50_keys_get16(rsp + CR50_KEY_NAME_OFFSET) ||
+		!tpm_cr50_keys_parse_load(cmd, cmd_len) ||
+		!tpm_cr50_keys_digest(pDevice, cmd, cmd_len, digest)) {
+		return;
+	}
+
+	/* Loaded again while the cached one could not be checked: not cached */
+	if (tpm_cr50_keys_find(pDevice, digest)) {
+		return;
+	}
+
+	for (ULONG i = 0; i < pDevice->KeyCacheEntries; i++) {
+		if (!pDevice->Keys[i].Valid) {
+			e = &pDevice->Keys[i];
+			break;
+		}
+	}
+	if (!e) {
+		e = tpm_cr50_keys_victim(pDevice);
+		if (!e) {
+			return;
+		}
+		tpm_cr50_keys_drop(pDevice, e);
+		pDevice->KeyEvictions++;
+	}
+
+	e->Valid = TRUE;
+	e->Users = 1;
+	e->Parent = tpm_cr50_keys_get32(cmd + TPM_HEADER_SIZE);
+	e->Handle = tpm_cr50_keys_get32(rsp + TPM_HEADER_SIZE);
+	e->LastUse = ++pDevice->KeyCacheTick;
+	RtlCopyMemory(e->Digest, digest, CR50_KEY_DIGEST_SIZE);
+	RtlCopyMemory(e->Response, rsp, len);
+	e->ResponseLength = (UINT16)len;
+}
+
+/* Drops the entries of objects at or under @handle */
+static void tpm_cr50_keys_invalidate(PCR50_CONTEXT pDevice, UINT32 handle) {
+	for (ULONG i = 0; i < pDevice->KeyCacheEntries; i++) {
+		PCR50_KEY_ENTRY e = &pDevice->Keys[i];
+
+		if (!e->Valid)
+			continue;
+		if (e->Handle == handle)
+			e->Valid = FALSE;
+		else if (e->Parent == handle)
+			tpm_cr50_keys_drop(pDevice, e);
+	}
+}
+
+/**
+ * tpm_cr50_keys_update() - Keep the key cache in step with a command sent to the TPM.
+ * @status:	Result of sending the command; @rsp is only valid on success.
+ *
+ * Like the NV cache, invalidation does not depend on the outcome.
+ */
+void tpm_cr50_keys_update(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len,
+	NTSTATUS status, const UINT8* rsp, size_t rsp_len) {
+	if (!pDevice->KeyCacheEntries || cmd_len < TPM_HEADER_SIZE) {
+		return;
+	}
+
+	switch (tpm_cr50_keys_get32(cmd + 6)) {
+	case TPM2_CC_LOAD:
+		if (NT_SUCCESS(status) && rsp_len >= TPM_HEADER_SIZE &&
+			tpm2_response_code(rsp) == TPM2_RC_SUCCESS)
+			tpm_cr50_keys_store(pDevice, cmd, cmd_len, rsp, rsp_len);
+		return;
+	case TPM2_CC_FLUSH_CONTEXT:
+		if (cmd_len >= 14)
+			tpm_cr50_keys_invalidate(pDevice, tpm_cr50_keys_get32(cmd + 10));
+		return;
+	case TPM2_CC_EVICT_CONTROL:
+		/* A persistent parent, after the authorization and object handles */
+		if (cmd_len >= 18)
+			tpm_cr50_keys_invalidate(pDevice, tpm_cr50_keys_get32(cmd + 14));
+		return;
+	case TPM2_CC_STARTUP:
+		/* Transient objects do not survive a TPM reset or restart */
+		tpm_cr50_keys_forget(pDevice);
+		return;
+	case TPM2_CC_CLEAR:
+	case TPM2_CC_CHANGE_EPS:
+	case TPM2_CC_CHANGE_PPS:
+	case TPM2_CC_HIERARCHY_CONTROL:
+	case TPM2_CC_HIERARCHY_CHANGE_AUTH:
+		/* Transient objects flushed or their hierarchy's authorization changed */
+		tpm_cr50_keys_flush(pDevice);
+		return;
+	default:
+		return;
+	}
+}
+
+/*
+ * Called with the response of a command that was sent. If it failed for
+ * the lack of object slots, flushes the least recently used object nobody
+ * holds and returns TRUE for the command to be sent again.
+ */
+BOOLEAN tpm_cr50_keys_evict(PCR50_CONTEXT pDevice, const UINT8* rsp) {
+	PCR50_KEY_ENTRY e;
+	UINT32 rc = tpm2_response_code(rsp);
+
+	if (rc != TPM2_RC_OBJECT_MEMORY && rc != TPM2_RC_OBJECT_HANDLES) {
+		return FALSE;
+	}
+
+	e = tpm_cr50_keys_victim(pDevice);
+	if (!e) {
+		return FALSE;
+	}
+
+	tpm_cr50_keys_drop(pDevice, e);
+	pDevice->KeyEvictions++;
+	return TRUE;
+}
+
+/* Drops every entry, flushing the objects nobody holds */
+void tpm_cr50_keys_flush(PCR50_CONTEXT pDevice) {
+	for (ULONG i = 0; i < CR50_KEY_ENTRIES; i++) {
+		if (pDevice->Keys[i].Valid)
+			tpm_cr50_keys_drop(pDevice, &pDevice->Keys[i]);
+	}
+}
+
+/*
+ * Drops every entry without sending anything, for when the TPM has lost
+ * its transient objects already, e.g. on D0 exit.
+ */
+void tpm_cr50_keys_forget(PCR50_CONTEXT pDevice) {
+	for (ULONG i = 0; i < CR50_KEY_ENTRIES; i++) {
+		pDevice->Keys[i].Valid = FALSE;
+	}
+}
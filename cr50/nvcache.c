@@ -0,0 +1,362 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+//
+// Cache of NV index contents and public areas.
+//
+// NV_Read moves at most the TPM's NV buffer size per command, and each
+// command is a full trip through the FIFO, so reading a certificate or a
+// policy blob takes many of them. Responses to NV_ReadPublic and to
+// NV_Read are kept per index and answered from memory the next time.
+//
+// Only reads that needed no secret are cached: NV_Read authorized by the
+// index itself with an empty password. A hit requires the same
+// authorization, so nothing is returned that the TPM would not have
+// returned to the caller. Every command that can change an index's data,
+// attributes or authorization drops its entry, commands that can affect
+// many indexes drop everything, and the cache is emptied on D0 exit.
+//
+// Everything here runs with the command lock held.
+//
+
+#define CR50_NV_READ_SIZE	35	/* NV_Read with one password session */
+#define CR50_NV_SESSION_SIZE	5	/* Password session in a response */
+
+typedef struct _CR50_NV_READ {
+	UINT32 Index;
+	UINT16 Size;
+	UINT16 Offset;
+	UINT8 Attributes;
+} CR50_NV_READ, *PCR50_NV_READ;
+
+static UINT32 tpm_cr50_nv_get32(const UINT8* p) {
+	return RtlUlongByteSwap(*((UINT32*)p));
+}
+
+static UINT16 tpm_cr50_nv_get16(const UINT8* p) {
+	return RtlUshortByteSwap(*((UINT16*)p));
+}
+
+static void tpm_cr50_nv_put32(UINT8* p, UINT32 value) {
+	*((UINT32*)p) = RtlUlongByteSwap(value);
+}
+
+static void tpm_cr50_nv_put16(UINT8* p, UINT16 value) {
+	*((UINT16*)p) = RtlUshortByteSwap(value);
+}
+
+/*
+ * Recognizes NV_Read(index, index) with a password session that has an
+ * empty password, the only form that is cached.
+ */
+static BOOLEAN tpm_cr50_nv_parse_read(const UINT8* cmd, size_t len, PCR50_NV_READ read) {
+	if (len != CR50_NV_READ_SIZE ||
+		tpm_cr50_nv_get16(cmd) != TPM2_ST_SESSIONS ||
+		tpm_cr50_nv_get32(cmd + 2) != CR50_NV_READ_SIZE ||
+		tpm_cr50_nv_get32(cmd + 6) != TPM2_CC_NV_READ ||
+		tpm_cr50_nv_get32(cmd + 10) != tpm_cr50_nv_get32(cmd + 14) ||
+		tpm_cr50_nv_get32(cmd + 18) != 9 ||
+		tpm_cr50_nv_get32(cmd + 22) != TPM2_RS_PW ||
+		tpm_cr50_nv_get16(cmd + 26) != 0 ||
+		tpm_cr50_nv_get16(cmd + 29) != 0)
+		return FALSE;
+
+	read->Index = tpm_cr50_nv_get32(cmd + 14);
+	read->Attributes = cmd[28];
+	read->Size = tpm_cr50_nv_get16(cmd + 31);
+	read->Offset = tpm_cr50_nv_get16(cmd + 33);
+	return read->Size && read->Size <= CR50_NV_MAX_DATA &&
+		(ULONG)read->Offset + read->Size <= CR50_NV_MAX_DATA;
+}
+
+static BOOLEAN tpm_cr50_nv_parse_read_public(const UINT8* cmd, size_t len, UINT32* index) {
+	if (len != 14 ||
+		tpm_cr50_nv_get16(cmd) != TPM2_ST_NO_SESSIONS ||
+		tpm_cr50_nv_get32(cmd + 6) != TPM2_CC_NV_READ_PUBLIC)
+		return FALSE;
+
+	*index = tpm_cr50_nv_get32(cmd + 10);
+	return TRUE;
+}
+
+static PCR50_NV_ENTRY tpm_cr50_nv_find(PCR50_CONTEXT pDevice, UINT32 index) {
+	for (ULONG i = 0; i < CR50_NV_ENTRIES; i++) {
+		if (pDevice->NvCache[i].Index == index && index)
+			return &pDevice->NvCache[i];
+	}
+	return NULL;
+}
+
+static void tpm_cr50_nv_free(PCR50_CONTEXT pDevice, PCR50_NV_ENTRY e) {
+	if (e->Public) {
+		ExFreePoolWithTag(e->Public, CR50_POOL_TAG);
+		pDevice->NvCacheBytes -= e->PublicLength;
+	}
+	if (e->Data) {
+		ExFreePoolWithTag(e->Data, CR50_POOL_TAG);
+		pDevice->NvCacheBytes -= e->DataLength;
+	}
+	RtlZeroMemory(e, sizeof(*e));
+}
+
+static void tpm_cr50_nv_invalidate(PCR50_CONTEXT pDevice, UINT32 index) {
+	PCR50_NV_ENTRY e = tpm_cr50_nv_find(pDevice, index);
+
+	if (e) {
+		tpm_cr50_nv_free(pDevice, e);
+		pDevice->NvInvalidations++;
+	}
+}
+
+/* Drops every entry, e.g. on D0 exit or when the TPM was reset */
+void tpm_cr50_nv_flush(PCR50_CONTEXT pDevice) {
+	for (ULONG i = 0; i < CR50_NV_ENTRIES; i++) {
+		if (pDevice->NvCache[i].Index)
+			tpm_cr50_nv_free(pDevice, &pDevice->NvCache[i]);
+	}
+}
+
+/*
+ * Makes room for @bytes more within the budget by evicting the least
+ * recently used entries other than @keep.
+ */
+static BOOLEAN tpm_cr50_nv_reserve(PCR50_CONTEXT pDevice, PCR50_NV_ENTRY keep, ULONG bytes) {
+	while (pDevice->NvCacheBytes + bytes > pDevice->NvCacheBudget) {
+		PCR50_NV_ENTRY victim = NULL;
+
+		for (ULONG i = 0; i < CR50_NV_ENTRIES; i++) {
+			PCR50_NV_ENTRY e = &pDevice->NvCache[i];
+
+			if (e->Index && e != keep && (!victim || e->LastUse < victim->LastUse))
+				victim = e;
+		}
+
+		if (!victim)
+			return FALSE;
+
+		tpm_cr50_nv_free(pDevice, victim);
+		pDevice->NvEvictions++;
+	}
+	return TRUE;
+}
+
+static PCR50_NV_ENTRY tpm_cr50_nv_entry(PCR50_CONTEXT pDevice, UINT32 index) {
+	PCR50_NV_ENTRY e = tpm_cr50_nv_find(pDevice, index);
+	PCR50_NV_ENTRY oldest = NULL;
+
+	if (!e) {
+		for (ULONG i = 0; i < CR50_NV_ENTRIES && !e; i++) {
+			if (!pDevice->NvCache[i].Index)
+				e = &pDevice->NvCache[i];
+			else if (!oldest || pDevice->NvCache[i].LastUse < oldest->LastUse)
+				oldest = &pDevice->NvCache[i];
+		}
+
+		if (!e) {
+			tpm_cr50_nv_free(pDevice, oldest);
+			pDevice->NvEvictions++;
+			e = oldest;
+		}
+		e->Index = index;
+	}
+
+	e->LastUse = ++pDevice->NvCacheTick;
+	return e;
+}
+
+static void tpm_cr50_nv_store_public(PCR50_CONTEXT pDevice, UINT32 index,
+	const UINT8* rsp, ULONG len) {
+	PCR50_NV_ENTRY e;
+	UINT8* copy;
+
+	if (len > CR50_NV_MAX_PUBLIC)
+		return;
+
+	e = tpm_cr50_nv_entry(pDevice, index);
+	if (e->Public)
+		return;
+
+	if (!tpm_cr50_nv_reserve(pDevice, e, len))
+		return;
+
+	copy = ExAllocatePoolZero(NonPagedPoolNx, len, CR50_POOL_TAG);
+	if (!copy)
+		return;
+
+	RtlCopyMemory(copy, rsp, len);
+	e->Public = copy;
+	e->PublicLength = (UINT16)len;
+	pDevice->NvCacheBytes += len;
+}
+
+static void tpm_cr50_nv_store_data(PCR50_CONTEXT pDevice, PCR50_NV_READ read,
+	const UINT8* rsp, ULONG len) {
+	const UINT8* session;
+	PCR50_NV_ENTRY e;
+	UINT16 start, end;
+
+	/* parameterSize, the data as a TPM2B, then the password session */
+	if (len != 16u + read->Size + CR50_NV_SESSION_SIZE ||
+		tpm_cr50_nv_get32(rsp + 10) != 2u + read->Size ||
+		tpm_cr50_nv_get16(rsp + 14) != read->Size)
+		return;
+
+	session = rsp + 16 + read->Size;
+	e = tpm_cr50_nv_entry(pDevice, read->Index);
+
+	start = read->Offset;
+	end = read->Offset + read->Size;
+
+	/* Keep the cached range contiguous, read in chunks it grows */
+	if (e->ValidEnd && e->SessionAttributes == read->Attributes &&
+		RtlEqualMemory(e->SessionResponse, session, CR50_NV_SESSION_SIZE) &&
+		start <= e->ValidEnd && end >= e->ValidStart) {
+		start = min(start, e->ValidStart);
+		end = max(end, e->ValidEnd);
+	}
+
+	if (end > e->DataLength) {
+		UINT8* data;
+
+		if (!tpm_cr50_nv_reserve(pDevice, e, end - e->DataLength))
+			return;
+
+		data = ExAllocatePoolZero(NonPagedPoolNx, end, CR50_POOL_TAG);
+		if (!data)
+			return;
+
+		if (e->Data) {
+			RtlCopyMemory(data, e->Data, e->DataLength);
+			ExFreePoolWithTag(e->Data, CR50_POOL_TAG);
+		}
+		pDevice->NvCacheBytes += end - e->DataLength;
+		e->Data = data;
+		e->DataLength = end;
+	}
+
+	RtlCopyMemory(e->Data + read->Offset, rsp + 16, read->Size);
+	RtlCopyMemory(e->SessionResponse, session, CR50_NV_SESSION_SIZE);
+	e->SessionAttributes = read->Attributes;
+	e->ValidStart = start;
+	e->ValidEnd = end;
+}
+
+/**
+ * tpm_cr50_nv_lookup() - Answer a command from the NV cache.
+ *
+ * Returns TRUE if @rsp holds the response, in which case the command
+ * must not be sent.
+ */
+BOOLEAN tpm_cr50_nv_lookup(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len,
+	UINT8* rsp, size_t rsp_len) {
+	CR50_NV_READ read;
+	PCR50_NV_ENTRY e;
+	UINT32 index;
+
+	if (!pDevice->NvCacheBudget) {
+		return FALSE;
+	}
+
+	if (tpm_cr50_nv_parse_read_public(cmd, cmd_len, &index)) {
+		e = tpm_cr50_nv_find(pDevice, index);
+		if (!e || !e->Public || rsp_len < e->PublicLength) {
+			pDevice->NvMisses++;
+			return FALSE;
+		}
+
+		RtlCopyMemory(rsp, e->Public, e->PublicLength);
+	}
+	else if (tpm_cr50_nv_parse_read(cmd, cmd_len, &read)) {
+		ULONG len = 16 + read.Size + CR50_NV_SESSION_SIZE;
+
+		e = tpm_cr50_nv_find(pDevice, read.Index);
+		if (!e || !e->ValidEnd || e->SessionAttributes != read.Attributes ||
+			read.Offset < e->ValidStart || read.Offset + read.Size > e->ValidEnd ||
+			rsp_len < len) {
+			pDevice->NvMisses++;
+			return FALSE;
+		}
+
+		tpm_cr50_nv_put16(rsp, TPM2_ST_SESSIONS);
+		tpm_cr50_nv_put32(rsp + 2, len);
+		tpm_cr50_nv_put32(rsp + 6, TPM2_RC_SUCCESS);
+		tpm_cr50_nv_put32(rsp + 10, 2 + read.Size);
+		tpm_cr50_nv_put16(rsp + 14, read.Size);
+		RtlCopyMemory(rsp + 16, e->Data + read.Offset, read.Size);
+		RtlCopyMemory(rsp + 16 + read.Size, e->SessionResponse, CR50_NV_SESSION_SIZE);
+	}
+	else {
+		return FALSE;
+	}
+
+	e->LastUse = ++pDevice->NvCacheTick;
+	pDevice->NvHits++;
+	return TRUE;
+}
+
+/**
+ * tpm_cr50_nv_update() - Keep the NV cache in step with a command sent to the TPM.
+ * @status:	Result of sending the command; @rsp is only valid on success.
+ *
+ * Invalidation does not depend on the outcome, a command that failed
+ * may still have changed the index.
+ */
+void tpm_cr50_nv_update(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t cmd_len,
+	NTSTATUS status, const UINT8* rsp, size_t rsp_len) {
+	CR50_NV_READ read;
+	UINT32 index, len;
+
+	if (!pDevice->NvCacheBudget || cmd_len < TPM_HEADER_SIZE) {
+		return;
+	}
+
+	switch (tpm_cr50_nv_get32(cmd + 6)) {
+	case TPM2_CC_NV_WRITE:
+	case TPM2_CC_NV_INCREMENT:
+	case TPM2_CC_NV_EXTEND:
+	case TPM2_CC_NV_SET_BITS:
+	case TPM2_CC_NV_WRITE_LOCK:
+	case TPM2_CC_NV_READ_LOCK:
+	case TPM2_CC_NV_UNDEFINE_SPACE:
+		/* The index follows the authorization handle */
+		if (cmd_len >= 18)
+			tpm_cr50_nv_invalidate(pDevice, tpm_cr50_nv_get32(cmd + 14));
+		return;
+	case TPM2_CC_NV_UNDEFINE_SPACE_SPECIAL:
+	case TPM2_CC_NV_CHANGE_AUTH:
+		if (cmd_len >= 14)
+			tpm_cr50_nv_invalidate(pDevice, tpm_cr50_nv_get32(cmd + 10));
+		return;
+	case TPM2_CC_NV_DEFINE_SPACE:
+	case TPM2_CC_NV_GLOBAL_WRITE_LOCK:
+	case TPM2_CC_CLEAR:
+	case TPM2_CC_HIERARCHY_CONTROL:
+	case TPM2_CC_HIERARCHY_CHANGE_AUTH:
+	case TPM2_CC_CHANGE_EPS:
+	case TPM2_CC_CHANGE_PPS:
+	case TPM2_CC_STARTUP:
+		if (pDevice->NvCacheBytes)
+			pDevice->NvInvalidations++;
+		tpm_cr50_nv_flush(pDevice);
+		return;
+	}
+
+	if (!NT_SUCCESS(status) || rsp_len < TPM_HEADER_SIZE ||
+		tpm_cr50_nv_get32(rsp + 6) != TPM2_RC_SUCCESS) {
+		return;
+	}
+
+	len = tpm_cr50_nv_get32(rsp + 2);
+	if (len < TPM_HEADER_SIZE || len > rsp_len) {
+		return;
+	}
+
+	if (tpm_cr50_nv_parse_read_public(cmd, cmd_len, &index)) {
+		tpm_cr50_nv_store_public(pDevice, index, rsp, len);
+	}
+	else if (tpm_cr50_nv_parse_read(cmd, cmd_len, &read)) {
+		tpm_cr50_nv_store_data(pDevice, &read, rsp, len);
+	}
+}
@@ -0,0 +1,248 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+//
+// Bulk NV writes.
+//
+// An NV index larger than the TPM's NV buffer has to be written with one
+// NV_Write per chunk. IOCTL_CR50_NV_WRITE sends all of them from the
+// consumer thread under one power reference and one hold of the command
+// lock, keeping the locality and the SPI bus awake in between, like a
+// batch. The chunk size comes from the TPM's TPM_PT_NV_BUFFER_MAX and
+// TPM_PT_MAX_COMMAND_SIZE in the capability cache, and the data is
+// spread evenly over the fewest chunks that fit, so there is no short
+// tail command.
+//
+// Two command buffers are used in turn. The parts of NV_Write that do
+// not change between chunks are marshalled into both once; while the TPM
+// executes one chunk the next one is filled into the other buffer, so
+// the only work left between two commands is the bus traffic.
+//
+
+#define CR50_NV_WRITE_OVERHEAD	35	/* NV_Write with an empty password */
+#define CR50_NV_BUFFER_DEFAULT	512	/* Until the TPM has told its limit */
+
+#define TPM2_RH_OWNER		0x40000001
+#define TPM2_RH_PLATFORM	0x4000000C
+#define TPM2_HT_NV_INDEX	0x01
+
+typedef struct _CR50_NV_WRITER {
+	PCR50_NV_WRITE Input;
+	const UINT8* Data;
+	ULONG ChunkSize;
+	ULONG Chunks;
+	ULONG Built;			/* Chunks filled in so far */
+	UINT8* Buffers[2];
+	size_t Lengths[2];
+} CR50_NV_WRITER, *PCR50_NV_WRITER;
+
+/* Marshals everything up to the data, which is the same for every chunk */
+static void tpm_cr50_nv_write_prefix(PCR50_NV_WRITE in, UINT8* buf) {
+	ULONG pw = in->PasswordLength;
+
+	*((UINT16*)buf) = RtlUshortByteSwap(TPM2_ST_SESSIONS);
+	*((UINT32*)(buf + 6)) = RtlUlongByteSwap(TPM2_CC_NV_WRITE);
+	*((UINT32*)(buf + 10)) = RtlUlongByteSwap(in->AuthHandle);
+	*((UINT32*)(buf + 14)) = RtlUlongByteSwap(in->Index);
+	*((UINT32*)(buf + 18)) = RtlUlongByteSwap(9 + pw);	/* authorizationSize */
+	*((UINT32*)(buf + 22)) = RtlUlongByteSwap(TPM2_RS_PW);
+	*((UINT16*)(buf + 26)) = 0;				/* nonceCaller */
+	buf[28] = 0;						/* sessionAttributes */
+	*((UINT16*)(buf + 29)) = RtlUshortByteSwap((UINT16)pw);	/* hmac, the password */
+	RtlCopyMemory(buf + 31, in->Password, pw);
+}
+
+/* Fills the next chunk into the buffer it alternates to */
+static VOID tpm_cr50_nv_write_fill(PVOID Context) {
+	PCR50_NV_WRITER w = (PCR50_NV_WRITER)Context;
+	ULONG pw = w->Input->PasswordLength;
+	ULONG pos, size;
+	UINT8* buf;
+
+	if (w->Built >= w->Chunks) {
+		return;
+	}
+
+	pos = w->Built * w->ChunkSize;
+	size = min(w->ChunkSize, w->Input->Length - pos);
+	buf = w->Buffers[w->Built & 1];
+
+	*((UINT32*)(buf + 2)) = RtlUlongByteSwap(CR50_NV_WRITE_OVERHEAD + pw + size);
+	*((UINT16*)(buf + 31 + pw)) = RtlUshortByteSwap((UINT16)size);
+	RtlCopyMemory(buf + 33 + pw, w->Data + pos, size);
+	*((UINT16*)(buf + 33 + pw + size)) = RtlUshortByteSwap((UINT16)(w->Input->Offset + pos));
+
+	w->Lengths[w->Built & 1] = CR50_NV_WRITE_OVERHEAD + pw + size;
+	w->Built++;
+}
+
+/* Largest chunk of data one NV_Write can carry */
+static ULONG tpm_cr50_nv_write_limit(PCR50_CONTEXT pDevice, ULONG pw) {
+	UINT32 buffer, command;
+
+	if (!tpm_cr50_caps_property(pDevice, TPM2_PT_NV_BUFFER_MAX, &buffer) ||
+		!tpm_cr50_caps_property(pDevice, TPM2_PT_MAX_COMMAND_SIZE, &command) ||
+		!buffer || command <= CR50_NV_WRITE_OVERHEAD + CR50_NV_MAX_PASSWORD) {
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"NV buffer size is not known, using %d\n", CR50_NV_BUFFER_DEFAULT);
+		return CR50_NV_BUFFER_DEFAULT;
+	}
+
+	return min(buffer, min(command, CR50_MAX_COMMAND_SIZE) - CR50_NV_WRITE_OVERHEAD - pw);
+}
+
+/*
+ * Checks the request and hands it to the consumer. Returns
+ * STATUS_PENDING when it was queued.
+ */
+NTSTATUS tpm_cr50_nv_write_submit(PCR50_CONTEXT pDevice, WDFREQUEST Request) {
+	LONGLONG queued = tpm_cr50_timestamp();
+	PCR50_NV_WRITE input;
+	PVOID result;
+	size_t inLen;
+	NTSTATUS status;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(*input), (PVOID*)&input, &inLen);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CR50_NV_WRITE_RESULT), &result, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/* NV_Write offsets are 16 bits */
+	if (!input->Length || input->Length > inLen - sizeof(*input) ||
+		(ULONG64)input->Offset + input->Length > MAXUSHORT ||
+		input->PasswordLength > CR50_NV_MAX_PASSWORD ||
+		(input->Index >> 24) != TPM2_HT_NV_INDEX ||
+		(input->AuthHandle != input->Index && input->AuthHandle != TPM2_RH_OWNER &&
+		input->AuthHandle != TPM2_RH_PLATFORM)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	WDFFILEOBJECT fileObject = WdfRequestGetFileObject(Request);
+	UINT8 locality = fileObject ? GetFileContext(fileObject)->Locality : 0;
+
+	return tpm_cr50_ring_submit(pDevice, Request, queued, locality);
+}
+
+/**
+ * tpm_cr50_nv_write_execute() - Write the chunks of an NV write on the consumer thread.
+ * @locality:	Locality the submitting handle is bound to.
+ * @last:	No further command for @locality follows in the ring.
+ *
+ * Only fails as a whole if the TPM could not be powered up; how far the
+ * write got is in the CR50_NV_WRITE_RESULT.
+ */
+NTSTATUS tpm_cr50_nv_write_execute(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	LONGLONG queued, UINT8 locality, BOOLEAN last, size_t* bytesReturned) {
+	UINT8* rsp = pDevice->InternalResponse;
+	size_t rsp_len = sizeof(pDevice->InternalResponse);
+	PCR50_NV_WRITE_RESULT result;
+	CR50_NV_WRITER w = { 0 };
+	PCR50_NV_WRITE input;
+	ULONG sent = 0;
+	NTSTATUS status;
+	UINT32 rc = 0;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(*input), (PVOID*)&input, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*result), (PVOID*)&result, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	tpm_cr50_idle_arrival(pDevice, queued);
+
+	status = tpm_cr50_begin(pDevice);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/*
+	 * Input and output share the system buffer, so the input is only
+	 * read until the result is first written.
+	 */
+	w.Input = input;
+	w.Data = (const UINT8*)(input + 1);
+	w.ChunkSize = tpm_cr50_nv_write_limit(pDevice, input->PasswordLength);
+	w.Chunks = (input->Length + w.ChunkSize - 1) / w.ChunkSize;
+	w.ChunkSize = (input->Length + w.Chunks - 1) / w.Chunks;
+	w.Buffers[0] = pDevice->CommandBuffer;
+	w.Buffers[1] = pDevice->NvWriteBuffer;
+
+	tpm_cr50_nv_write_prefix(input, w.Buffers[0]);
+	tpm_cr50_nv_write_prefix(input, w.Buffers[1]);
+
+	pDevice->NvWriteIndex = input->Index;
+	pDevice->NvWriteTotal = input->Length;
+	pDevice->NvWriteWritten = 0;
+	pDevice->NvWriteActive = TRUE;
+
+	tpm_cr50_select_locality(pDevice, locality);
+	pDevice->BusHeld = TRUE;
+
+	for (ULONG i = 0; i < w.Chunks; i++) {
+		UINT8* cmd = w.Buffers[i & 1];
+		size_t len;
+
+		if (w.Built == i)
+			tpm_cr50_nv_write_fill(&w);
+		len = w.Lengths[i & 1];
+
+		pDevice->LocalityCommands[locality]++;
+		pDevice->HoldLocality = !last || i + 1 < w.Chunks;
+
+		/* The next chunk is filled in while this one executes */
+		status = tpm_cr50_transmit_overlap(pDevice, cmd, len, rsp, rsp_len,
+			i ? 0 : queued, tpm_cr50_nv_write_fill, &w);
+		rc = NT_SUCCESS(status) ? tpm2_response_code(rsp) : 0;
+		if (rc == TPM2_RC_YIELDED || rc == TPM2_RC_RETRY || rc == TPM2_RC_TESTING) {
+			status = tpm_cr50_transmit_retry(pDevice, cmd, len, rsp, rsp_len, 0);
+			rc = NT_SUCCESS(status) ? tpm2_response_code(rsp) : 0;
+		}
+		tpm_cr50_nv_update(pDevice, cmd, len, status, rsp, rsp_len);
+		pDevice->NvWriteChunks++;
+		sent++;
+
+		if (!NT_SUCCESS(status) || rc != TPM2_RC_SUCCESS) {
+			Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+				"NV_Write of 0x%x failed at %d: 0x%x, rc 0x%x\n", input->Index,
+				input->Offset + pDevice->NvWriteWritten, status, rc);
+			pDevice->NvWriteFailures++;
+			break;
+		}
+
+		pDevice->NvWriteWritten += (ULONG)len - CR50_NV_WRITE_OVERHEAD -
+			input->PasswordLength;
+	}
+
+	/* A chunk that was cut short left the locality held for the next command */
+	pDevice->BusHeld = FALSE;
+	if (last && pDevice->HoldLocality) {
+		pDevice->HoldLocality = FALSE;
+		tpm_cr50_release_locality(pDevice, FALSE);
+	}
+
+	pDevice->NvWriteActive = FALSE;
+	pDevice->NvWrites++;
+
+	result->Status = status;
+	result->ResponseCode = rc;
+	result->Written = pDevice->NvWriteWritten;
+	result->Chunks = sent;
+	result->ChunkSize = w.ChunkSize;
+	result->Reserved = 0;
+
+	tpm_cr50_end(pDevice);
+
+	*bytesReturned = sizeof(*result);
+	return STATUS_SUCCESS;
+}
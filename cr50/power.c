@@ -0,0 +1,114 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+/* Arrivals needed before the learned gap is trusted */
+#define CR50_IDLE_MIN_SAMPLES	4
+
+NTSTATUS tpm_cr50_idle_init(PCR50_CONTEXT pDevice) {
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDF_TIMER_CONFIG timerConfig;
+	NTSTATUS status;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = pDevice->FxDevice;
+
+	status = WdfSpinLockCreate(&attributes, &pDevice->IdleLock);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	WDF_TIMER_CONFIG_INIT(&timerConfig, Cr50EvtIdleHoldTimer);
+	timerConfig.AutomaticSerialization = FALSE;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = pDevice->FxDevice;
+
+	return WdfTimerCreate(&timerConfig, &attributes, &pDevice->IdleHoldTimer);
+}
+
+/*
+ * Called for every submitted command. The inter-arrival time is smoothed
+ * the same way TCP smooths round trip times: a mean with gain 1/8 and a
+ * mean deviation with gain 1/4. While mean + 2 * deviation stays below
+ * IdleHoldMaxMs the traffic is treated as periodic, and a power reference
+ * is held until one such window after the last command, so the TPM is
+ * not shut down and started again between commands. Irregular traffic
+ * and silence longer than the window leave idling to the framework.
+ *
+ * @now is when the command was queued. The consumer runs the ring grouped
+ * by locality, so a command can report a time older than one seen before;
+ * it adds no gap to the history.
+ */
+void tpm_cr50_idle_arrival(PCR50_CONTEXT pDevice, LONGLONG now) {
+	LONG gap, error;
+	ULONG window = 0;
+
+	WdfSpinLockAcquire(pDevice->IdleLock);
+
+	if (now < pDevice->LastArrival) {
+		/* Out of order, the arrival it follows was recorded already */
+		now = pDevice->LastArrival;
+	}
+	else if (pDevice->LastArrival) {
+		/* Clamp so one long silence does not swamp the history */
+		gap = (LONG)min((now - pDevice->LastArrival) / (10 * 1000),
+			2 * (LONGLONG)pDevice->IdleHoldMax);
+
+		error = gap - pDevice->ArrivalGap;
+		pDevice->ArrivalGap += error / 8;
+		pDevice->ArrivalJitter += (abs(error) - pDevice->ArrivalJitter) / 4;
+
+		if (pDevice->ArrivalSamples < CR50_IDLE_MIN_SAMPLES) {
+			pDevice->ArrivalSamples++;
+		}
+	}
+	pDevice->LastArrival = now;
+
+	if (pDevice->ArrivalSamples >= CR50_IDLE_MIN_SAMPLES) {
+		window = (ULONG)(pDevice->ArrivalGap + 2 * pDevice->ArrivalJitter);
+		if (window > pDevice->IdleHoldMax) {
+			window = 0;
+		}
+	}
+	pDevice->IdleHoldWindow = window;
+
+	if (window) {
+		/* Power references must be taken and dropped under the lock */
+		if (!pDevice->IdleHeld &&
+			NT_SUCCESS(WdfDeviceStopIdle(pDevice->FxDevice, FALSE))) {
+			pDevice->IdleHeld = TRUE;
+			pDevice->IdleHolds++;
+		}
+		if (pDevice->IdleHeld) {
+			WdfTimerStart(pDevice->IdleHoldTimer, WDF_REL_TIMEOUT_IN_MS(window));
+		}
+	}
+
+	WdfSpinLockRelease(pDevice->IdleLock);
+}
+
+static void tpm_cr50_idle_drop(PCR50_CONTEXT pDevice) {
+	WdfSpinLockAcquire(pDevice->IdleLock);
+	if (pDevice->IdleHeld) {
+		pDevice->IdleHeld = FALSE;
+		WdfDeviceResumeIdle(pDevice->FxDevice);
+	}
+	WdfSpinLockRelease(pDevice->IdleLock);
+}
+
+VOID Cr50EvtIdleHoldTimer(
+	_In_  WDFTIMER  Timer
+	)
+{
+	WDFDEVICE device = (WDFDEVICE)WdfTimerGetParentObject(Timer);
+
+	tpm_cr50_idle_drop(GetDeviceContext(device));
+}
+
+/* Drops the held reference, e.g. before the hardware goes away */
+void tpm_cr50_idle_release(PCR50_CONTEXT pDevice) {
+	WdfTimerStop(pDevice->IdleHoldTimer, TRUE);
+	tpm_cr50_idle_drop(pDevice);
+}
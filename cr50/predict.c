@@ -0,0 +1,199 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+//
+// Predictive completion waits.
+//
+// Polling TPM_STS from the moment GO is written wastes a bus transfer
+// every poll interval of a long command (and on I2C a ready interrupt
+// per read). The driver learns how long each kind of command executes:
+// an exponentially weighted mean and mean deviation per command code
+// and, for the commands that create keys, per key type and size. Once a
+// class has a few samples, the wait for dataAvail first sleeps until
+// shortly before the expected completion, then polls finely for a short
+// window and falls back to the normal polling.
+//
+// The system timer oversleeps by up to a tick, so the learned slack of
+// the sleeps is taken off the next one. A sample is the middle between
+// the last read that found the TPM busy and the read that found it done.
+//
+
+#define CR50_PREDICT_MIN_SLEEP_US	1000	/* Shorter sleeps are not worth a tick */
+#define CR50_PREDICT_FINE_MAX_US	2000
+#define CR50_PREDICT_SHIFT		3	/* Mean weight 1/8 */
+#define CR50_PREDICT_DEV_SHIFT		2	/* Deviation weight 1/4 */
+
+static UINT16 tpm_cr50_predict_be16(const UINT8* p) {
+	return RtlUshortByteSwap(*((UINT16*)p));
+}
+
+/*
+ * Key class of the object a command creates: its type and the RSA key
+ * bits or ECC curve of inPublic. 0 for other commands, whose key is
+ * referenced by a handle and cannot be told from the command itself.
+ */
+static UINT32 tpm_cr50_predict_variant(const UINT8* cmd, size_t len) {
+	UINT32 ordinal = RtlUlongByteSwap(*((UINT32*)(cmd + 6)));
+	UINT16 type, alg;
+	size_t pos;
+
+	if (ordinal != TPM2_CC_CREATE && ordinal != TPM2_CC_CREATE_PRIMARY &&
+		ordinal != TPM2_CC_CREATE_LOADED) {
+		return 0;
+	}
+
+	/* Header, parentHandle or primaryHandle, authorization area */
+	pos = TPM_HEADER_SIZE + 4;
+	if (tpm_cr50_predict_be16(cmd) != TPM2_ST_SESSIONS || pos + 4 > len)
+		return 0;
+	pos += 4 + RtlUlongByteSwap(*((UINT32*)(cmd + pos)));
+
+	/* inSensitive, then inPublic up to authPolicy */
+	if (pos + 2 > len)
+		return 0;
+	pos += 2 + tpm_cr50_predict_be16(cmd + pos);
+	if (pos + 12 > len)
+		return 0;
+	type = tpm_cr50_predict_be16(cmd + pos + 2);
+	pos += 10;
+	pos += 2 + tpm_cr50_predict_be16(cmd + pos);
+
+	if (type != TPM2_ALG_RSA && type != TPM2_ALG_ECC)
+		return (UINT32)type << 16;
+
+	/* symmetric and scheme, each an algorithm and its details unless NULL */
+	if (pos + 2 > len)
+		return (UINT32)type << 16;
+	alg = tpm_cr50_predict_be16(cmd + pos);
+	pos += alg == TPM2_ALG_NULL ? 2 : 6;
+	if (pos + 2 > len)
+		return (UINT32)type << 16;
+	alg = tpm_cr50_predict_be16(cmd + pos);
+	pos += alg == TPM2_ALG_NULL ? 2 : 4;
+
+	/* keyBits or curveID */
+	if (pos + 2 > len)
+		return (UINT32)type << 16;
+	return ((UINT32)type << 16) | tpm_cr50_predict_be16(cmd + pos);
+}
+
+/* Finds the estimate for a command class, taking over the least used one */
+static PCR50_PREDICT tpm_cr50_predict_entry(PCR50_CONTEXT pDevice, UINT32 ordinal,
+	UINT32 variant) {
+	PCR50_PREDICT entry, victim = &pDevice->Predict[0];
+
+	for (ULONG i = 0; i < CR50_PREDICT_ENTRIES; i++) {
+		entry = &pDevice->Predict[i];
+		if (entry->Ordinal == ordinal && entry->Variant == variant)
+			return entry;
+		if (!entry->Ordinal ? victim->Ordinal != 0 : entry->Samples < victim->Samples)
+			victim = entry;
+	}
+
+	RtlZeroMemory(victim, sizeof(*victim));
+	victim->Ordinal = ordinal;
+	victim->Variant = variant;
+	return victim;
+}
+
+/* Called from tis_send for the command about to be started */
+void tpm_cr50_predict_select(PCR50_CONTEXT pDevice, const UINT8* cmd, size_t len) {
+	UINT32 ordinal = RtlUlongByteSwap(*((UINT32*)(cmd + 6)));
+
+	pDevice->Inflight.Predict = pDevice->PredictEnabled ?
+		tpm_cr50_predict_entry(pDevice, ordinal, tpm_cr50_predict_variant(cmd, len)) : NULL;
+}
+
+/*
+ * Called right after GO. Sleeps through most of the expected execution
+ * time and opens the window in which get_burst_and_status polls finely.
+ */
+void tpm_cr50_predict_wait(PCR50_CONTEXT pDevice) {
+	PCR50_INFLIGHT inflight = &pDevice->Inflight;
+	PCR50_PREDICT entry = inflight->Predict;
+	LARGE_INTEGER interval;
+	LONGLONG start, target, sleep, fine;
+
+	inflight->MissesAtGo = inflight->Misses;
+	inflight->LastMiss = 0;
+	inflight->FineUntil = 0;
+
+	/*
+	 * A dataAvail interrupt already reports the completion, and a
+	 * Create of the key pool has been waited for by keygen.c already.
+	 */
+	if (!entry || entry->Samples < CR50_PREDICT_MIN_SAMPLES ||
+		(pDevice->TisIrqEnable & TPM_INTF_DATA_AVAIL_INT) || pDevice->KeygenActive) {
+		return;
+	}
+
+	start = tpm_cr50_timestamp();
+	target = inflight->Stamp[Cr50PhaseExecute] +
+		10 * ((LONGLONG)entry->MeanUs - 2 * (LONGLONG)entry->DevUs);
+	sleep = target - start - pDevice->PredictSlack;
+	fine = 4 * (LONGLONG)entry->DevUs + TPM_CR50_TIMEOUT_SHORT_MS * 1000;
+
+	if (sleep >= 10 * CR50_PREDICT_MIN_SLEEP_US) {
+		interval.QuadPart = -sleep;
+		KeDelayExecutionThread(KernelMode, FALSE, &interval);
+
+		/* Overslept time of this sleep, weighted like the deviation */
+		LONGLONG slack = tpm_cr50_timestamp() - start - sleep;
+		pDevice->PredictSlack += (max(slack, 0) - pDevice->PredictSlack) >>
+			CR50_PREDICT_DEV_SHIFT;
+
+		inflight->Slept = TRUE;
+		pDevice->PredictSleeps++;
+	}
+
+	inflight->FineUntil = tpm_cr50_timestamp() + 10 * min(fine, CR50_PREDICT_FINE_MAX_US);
+}
+
+/* Called once dataAvail was seen, with the Execute phase stamped */
+void tpm_cr50_predict_learn(PCR50_CONTEXT pDevice) {
+	PCR50_INFLIGHT inflight = &pDevice->Inflight;
+	PCR50_PREDICT entry = inflight->Predict;
+	LONGLONG go = inflight->Stamp[Cr50PhaseExecute];
+	LONGLONG done = inflight->Stamp[Cr50PhaseReceive];
+	ULONG misses = inflight->Misses - inflight->MissesAtGo;
+	LONG sample, error;
+
+	inflight->FineUntil = 0;
+	if (!go || done < go) {
+		return;
+	}
+
+	pDevice->PredictWaits++;
+	pDevice->PredictPolls += misses + 1;
+	pDevice->PredictWasted += misses;
+
+	if (inflight->LastMiss > go) {
+		pDevice->PredictDetectUs += (done - inflight->LastMiss) / 10;
+		pDevice->PredictDetected++;
+		sample = (LONG)min(((inflight->LastMiss + done) / 2 - go) / 10, MAXLONG);
+	}
+	else {
+		/* Done by the first read: only an upper bound */
+		if (inflight->Slept)
+			pDevice->PredictOverslept++;
+		sample = (LONG)min((done - go) / 10, MAXLONG);
+	}
+
+	if (!entry) {
+		return;
+	}
+
+	if (!entry->Samples) {
+		entry->MeanUs = sample;
+		entry->DevUs = sample / 2;
+	}
+	else {
+		error = sample - entry->MeanUs;
+		entry->MeanUs += error >> CR50_PREDICT_SHIFT;
+		entry->DevUs += ((error < 0 ? -error : error) - entry->DevUs) >> CR50_PREDICT_DEV_SHIFT;
+	}
+	if (entry->Samples < MAXULONG)
+		entry->Samples++;
+}
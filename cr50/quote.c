@@ -0,0 +1,672 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+//
+// Quote aggregation.
+//
+// A TPM2_Quote signs with an asymmetric key and takes the TPM tens to
+// hundreds of milliseconds, so a burst of attestation requests queues up
+// behind itself. IOCTL_CR50_QUOTE requests for the same key, scheme,
+// password and PCR selection from the same locality are collected for
+// QuoteWindow ms, or until CR50_QUOTE_MAX_REQUESTS arrived, into a group.
+// The group's first request is then handed to the consumer, which hashes
+// the nonces into a Merkle tree, quotes once with the root as
+// qualifyingData and completes every request of the group with the
+// shared response and the request's inclusion proof.
+//
+// A group belongs to the submitters while it is open and to whoever
+// queued it once it is closed; QuoteLock only guards the state changes.
+// Requests that do not fit in any group are rejected as busy, as the
+// ring does.
+//
+// The requests after the first wait in the group's manual queue, so they
+// can be cancelled while the group waits for its window, the ring or a
+// D0 entry; a cancelled one leaves the group. Once the consumer runs the
+// group it takes what is left out of the queue. When the first request
+// is cancelled in the ring, the next one still waiting leads the group
+// into the ring instead.
+//
+
+#define CR50_QUOTE_SLACK	10000	/* 1 ms, a timer may fire that early */
+
+#define TPM2_ALG_ECDAA		0x001A
+#define TPM2_HT_TRANSIENT	0x80
+
+/* Checks what the TPM would only reject after the others waited for it */
+static BOOLEAN tpm_cr50_quote_valid(PCR50_QUOTE in) {
+	ULONG pos = 4, banks;
+
+	if (!in->NonceLength || in->NonceLength > CR50_QUOTE_MAX_NONCE ||
+		in->PasswordLength > CR50_NV_MAX_PASSWORD ||
+		in->PcrSelectLength < pos || in->PcrSelectLength > CR50_QUOTE_MAX_PCR_SELECT ||
+		in->Scheme == TPM2_ALG_ECDAA ||
+		(in->Scheme != TPM2_ALG_NULL && in->HashAlg == TPM2_ALG_NULL) ||
+		((in->SignHandle >> 24) != TPM2_HT_TRANSIENT &&
+		(in->SignHandle >> 24) != TPM2_HT_PERSISTENT)) {
+		return FALSE;
+	}
+
+	/* count, then per bank hash, sizeofSelect and pcrSelect */
+	banks = RtlUlongByteSwap(*((UINT32*)in->PcrSelect));
+	for (ULONG i = 0; i < banks; i++) {
+		if (pos + 3 > in->PcrSelectLength)
+			return FALSE;
+		pos += 3 + in->PcrSelect[pos + 2];
+	}
+	return pos == in->PcrSelectLength;
+}
+
+/* Whether a request can be answered by the quote of group key @key */
+static BOOLEAN tpm_cr50_quote_match(PCR50_QUOTE key, PCR50_QUOTE in) {
+	return key->SignHandle == in->SignHandle && key->Scheme == in->Scheme &&
+		key->HashAlg == in->HashAlg && key->PasswordLength == in->PasswordLength &&
+		key->PcrSelectLength == in->PcrSelectLength &&
+		RtlEqualMemory(key->Password, in->Password, in->PasswordLength) &&
+		RtlEqualMemory(key->PcrSelect, in->PcrSelect, in->PcrSelectLength);
+}
+
+static NTSTATUS tpm_cr50_quote_hash(PCR50_CONTEXT pDevice, UINT8* buf, ULONG len,
+	UINT8* hash) {
+	return BCryptHash(pDevice->QuoteHash, NULL, 0, buf, len, hash, CR50_QUOTE_HASH_SIZE);
+}
+
+/*
+ * Builds the tree over the group's leaves level by level into QuoteTree.
+ * A node without a sibling is carried up as it is, which gives the tree
+ * of RFC 6962.
+ */
+static NTSTATUS tpm_cr50_quote_tree(PCR50_CONTEXT pDevice, PCR50_QUOTE_GROUP g,
+	UINT8** root) {
+	UINT8 node[1 + 2 * CR50_QUOTE_HASH_SIZE];
+	ULONG start = 0, count = g->Count;
+	NTSTATUS status;
+
+	RtlCopyMemory(pDevice->QuoteTree, g->Leaves, count * CR50_QUOTE_HASH_SIZE);
+	node[0] = 0x01;
+
+	while (count > 1) {
+		ULONG next = start + count;
+
+		for (ULONG i = 0; i < count; i += 2) {
+			if (i + 1 == count) {
+				RtlCopyMemory(pDevice->QuoteTree[next + i / 2],
+					pDevice->QuoteTree[start + i], CR50_QUOTE_HASH_SIZE);
+				continue;
+			}
+
+			RtlCopyMemory(node + 1, pDevice->QuoteTree[start + i], 2 * CR50_QUOTE_HASH_SIZE);
+			status = tpm_cr50_quote_hash(pDevice, node, sizeof(node),
+				pDevice->QuoteTree[next + i / 2]);
+			if (!NT_SUCCESS(status)) {
+				return status;
+			}
+		}
+
+		start = next;
+		count = (count + 1) / 2;
+	}
+
+	*root = pDevice->QuoteTree[start];
+	return STATUS_SUCCESS;
+}
+
+/* Sibling hashes from leaf @index of @count up to the root, returns how many */
+static ULONG tpm_cr50_quote_proof(PCR50_CONTEXT pDevice, ULONG count, ULONG index,
+	UINT8 (*proof)[CR50_QUOTE_HASH_SIZE]) {
+	ULONG start = 0, length = 0;
+
+	while (count > 1) {
+		if ((index ^ 1) < count)
+			RtlCopyMemory(proof[length++], pDevice->QuoteTree[start + (index ^ 1)],
+				CR50_QUOTE_HASH_SIZE);
+		start += count;
+		count = (count + 1) / 2;
+		index >>= 1;
+	}
+
+	return length;
+}
+
+/* Marshals TPM2_Quote of @in over @root, returns its size */
+static size_t tpm_cr50_quote_command(PCR50_QUOTE in, const UINT8* root, UINT8* buf) {
+	ULONG pw = in->PasswordLength;
+	size_t pos;
+
+	*((UINT16*)buf) = RtlUshortByteSwap(TPM2_ST_SESSIONS);
+	*((UINT32*)(buf + 6)) = RtlUlongByteSwap(TPM2_CC_QUOTE);
+	*((UINT32*)(buf + 10)) = RtlUlongByteSwap(in->SignHandle);
+	*((UINT32*)(buf + 14)) = RtlUlongByteSwap(9 + pw);	/* authorizationSize */
+	*((UINT32*)(buf + 18)) = RtlUlongByteSwap(TPM2_RS_PW);
+	*((UINT16*)(buf + 22)) = 0;				/* nonceCaller */
+	buf[24] = 0;						/* sessionAttributes */
+	*((UINT16*)(buf + 25)) = RtlUshortByteSwap((UINT16)pw);	/* hmac, the password */
+	RtlCopyMemory(buf + 27, in->Password, pw);
+	pos = 27 + pw;
+
+	/* qualifyingData */
+	*((UINT16*)(buf + pos)) = RtlUshortByteSwap(CR50_QUOTE_HASH_SIZE);
+	RtlCopyMemory(buf + pos + 2, root, CR50_QUOTE_HASH_SIZE);
+	pos += 2 + CR50_QUOTE_HASH_SIZE;
+
+	/* inScheme */
+	*((UINT16*)(buf + pos)) = RtlUshortByteSwap(in->Scheme);
+	pos += 2;
+	if (in->Scheme != TPM2_ALG_NULL) {
+		*((UINT16*)(buf + pos)) = RtlUshortByteSwap(in->HashAlg);
+		pos += 2;
+	}
+
+	RtlCopyMemory(buf + pos, in->PcrSelect, in->PcrSelectLength);
+	pos += in->PcrSelectLength;
+
+	*((UINT32*)(buf + 2)) = RtlUlongByteSwap((UINT32)pos);
+	return pos;
+}
+
+/* The queued group @Request leads, or NULL. Called with QuoteLock held. */
+static PCR50_QUOTE_GROUP tpm_cr50_quote_find(PCR50_CONTEXT pDevice, WDFREQUEST Request) {
+	for (ULONG i = 0; i < CR50_QUOTE_GROUPS; i++) {
+		PCR50_QUOTE_GROUP g = &pDevice->QuoteGroups[i];
+		if (g->State == Cr50QuoteQueued && g->Requests[0] == Request)
+			return g;
+	}
+	return NULL;
+}
+
+/* Called with QuoteLock held */
+static void tpm_cr50_quote_move(PCR50_QUOTE_GROUP g, ULONG from, ULONG to) {
+	g->Requests[to] = g->Requests[from];
+	g->Submitted[to] = g->Submitted[from];
+	RtlCopyMemory(g->Leaves[to], g->Leaves[from], CR50_QUOTE_HASH_SIZE);
+}
+
+/* Drops entry @index of the group, with QuoteLock held */
+static void tpm_cr50_quote_remove(PCR50_QUOTE_GROUP g, ULONG index) {
+	for (ULONG i = index; i + 1 < g->Count; i++) {
+		tpm_cr50_quote_move(g, i + 1, i);
+	}
+	g->Count--;
+}
+
+/*
+ * Takes the requests after the first out of the group's queue, with
+ * QuoteLock held. Cancelled ones have left the queue already and are
+ * dropped, even before their callback could remove them.
+ */
+static void tpm_cr50_quote_collect(PCR50_QUOTE_GROUP g) {
+	WDFREQUEST request;
+	ULONG count = 1;
+
+	g->State = Cr50QuoteRunning;
+
+	/* The queue keeps the order of the group */
+	while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(g->Queue, &request))) {
+		for (ULONG i = count; i < g->Count; i++) {
+			if (g->Requests[i] == request) {
+				tpm_cr50_quote_move(g, i, count);
+				break;
+			}
+		}
+		count++;
+	}
+	g->Count = count;
+}
+
+/* A request after the first was cancelled while its group waited */
+static VOID Cr50EvtQuoteCanceled(WDFQUEUE Queue, WDFREQUEST Request) {
+	PCR50_CONTEXT pDevice = GetDeviceContext(WdfIoQueueGetDevice(Queue));
+
+	WdfSpinLockAcquire(pDevice->QuoteLock);
+	for (ULONG i = 0; i < CR50_QUOTE_GROUPS; i++) {
+		PCR50_QUOTE_GROUP g = &pDevice->QuoteGroups[i];
+
+		/* A running group dropped it already */
+		if (g->Queue != Queue || g->State == Cr50QuoteRunning)
+			continue;
+
+		for (ULONG j = 1; j < g->Count; j++) {
+			if (g->Requests[j] == Request) {
+				tpm_cr50_quote_remove(g, j);
+				break;
+			}
+		}
+	}
+	WdfSpinLockRelease(pDevice->QuoteLock);
+
+	WdfRequestComplete(Request, STATUS_CANCELLED);
+}
+
+static void tpm_cr50_quote_release(PCR50_CONTEXT pDevice, PCR50_QUOTE_GROUP g) {
+	WdfSpinLockAcquire(pDevice->QuoteLock);
+	g->Count = 0;
+	g->State = Cr50QuoteFree;
+	WdfSpinLockRelease(pDevice->QuoteLock);
+}
+
+/*
+ * Completes every request of the group @Request leads with @status.
+ * Returns FALSE if @Request leads none.
+ */
+BOOLEAN tpm_cr50_quote_fail(PCR50_CONTEXT pDevice, WDFREQUEST Request, NTSTATUS status) {
+	PCR50_QUOTE_GROUP g;
+
+	WdfSpinLockAcquire(pDevice->QuoteLock);
+	g = tpm_cr50_quote_find(pDevice, Request);
+	if (g)
+		tpm_cr50_quote_collect(g);
+	WdfSpinLockRelease(pDevice->QuoteLock);
+
+	if (!g) {
+		return FALSE;
+	}
+
+	pDevice->QuoteFailures += g->Count;
+	for (ULONG i = 0; i < g->Count; i++) {
+		WdfRequestComplete(g->Requests[i], status);
+	}
+
+	tpm_cr50_quote_release(pDevice, g);
+	return TRUE;
+}
+
+/* Hands a closed group to the consumer as its first request */
+static void tpm_cr50_quote_dispatch(PCR50_CONTEXT pDevice, PCR50_QUOTE_GROUP g) {
+	NTSTATUS status;
+
+	status = tpm_cr50_ring_submit(pDevice, g->Requests[0], g->Closed, g->Locality);
+	if (status != STATUS_PENDING) {
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"Quote of %d requests not queued 0x%x\n", g->Count, status);
+		tpm_cr50_quote_fail(pDevice, g->Requests[0], status);
+	}
+}
+
+/*
+ * Completes @Request, cancelled while it waited in the ring, and lets the
+ * next request still waiting lead its group into the ring. Returns FALSE
+ * if @Request leads no group.
+ */
+BOOLEAN tpm_cr50_quote_cancel(PCR50_CONTEXT pDevice, WDFREQUEST Request) {
+	PCR50_QUOTE_GROUP g;
+	WDFREQUEST next = NULL;
+
+	WdfSpinLockAcquire(pDevice->QuoteLock);
+	g = tpm_cr50_quote_find(pDevice, Request);
+	if (g) {
+		tpm_cr50_quote_remove(g, 0);
+
+		/* Cancelled ones in between stay for their callback to remove */
+		if (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(g->Queue, &next))) {
+			for (ULONG i = 1; i < g->Count; i++) {
+				if (g->Requests[i] == next) {
+					WDFREQUEST first = g->Requests[0];
+					LONGLONG submitted = g->Submitted[0];
+					UINT8 leaf[CR50_QUOTE_HASH_SIZE];
+
+					RtlCopyMemory(leaf, g->Leaves[0], CR50_QUOTE_HASH_SIZE);
+					tpm_cr50_quote_move(g, i, 0);
+					g->Requests[i] = first;
+					g->Submitted[i] = submitted;
+					RtlCopyMemory(g->Leaves[i], leaf, CR50_QUOTE_HASH_SIZE);
+					break;
+				}
+			}
+		}
+		else {
+			g->Count = 0;
+			g->State = Cr50QuoteFree;
+		}
+	}
+	WdfSpinLockRelease(pDevice->QuoteLock);
+
+	if (!g) {
+		return FALSE;
+	}
+
+	WdfRequestComplete(Request, STATUS_CANCELLED);
+	if (next) {
+		tpm_cr50_quote_dispatch(pDevice, g);
+	}
+	return TRUE;
+}
+
+/*
+ * Closes the open groups whose window ends by @until into @closed.
+ * Returns the end of the next window, 0 when no group is open.
+ */
+static LONGLONG tpm_cr50_quote_close(PCR50_CONTEXT pDevice, LONGLONG until,
+	PCR50_QUOTE_GROUP* closed, ULONG* count) {
+	LONGLONG now = tpm_cr50_timestamp(), next = 0;
+
+	*count = 0;
+
+	WdfSpinLockAcquire(pDevice->QuoteLock);
+
+	for (ULONG i = 0; i < CR50_QUOTE_GROUPS; i++) {
+		PCR50_QUOTE_GROUP g = &pDevice->QuoteGroups[i];
+
+		if (g->State != Cr50QuoteOpen)
+			continue;
+
+		if (g->Deadline <= until) {
+			g->State = Cr50QuoteQueued;
+			g->Closed = now;
+			closed[(*count)++] = g;
+		}
+		else if (!next || g->Deadline < next) {
+			next = g->Deadline;
+		}
+	}
+	pDevice->QuoteTimerArmed = next != 0;
+
+	WdfSpinLockRelease(pDevice->QuoteLock);
+
+	return next;
+}
+
+VOID Cr50EvtQuoteTimer(WDFTIMER Timer) {
+	PCR50_CONTEXT pDevice = GetDeviceContext((WDFDEVICE)WdfTimerGetParentObject(Timer));
+	PCR50_QUOTE_GROUP closed[CR50_QUOTE_GROUPS];
+	LONGLONG now = tpm_cr50_timestamp(), next;
+	ULONG count;
+
+	next = tpm_cr50_quote_close(pDevice, now + CR50_QUOTE_SLACK, closed, &count);
+	if (next) {
+		WdfTimerStart(Timer, -max(next - now, CR50_QUOTE_SLACK));
+	}
+
+	for (ULONG i = 0; i < count; i++) {
+		tpm_cr50_quote_dispatch(pDevice, closed[i]);
+	}
+}
+
+/* Called from EvtDeviceAdd */
+NTSTATUS tpm_cr50_quote_init(PCR50_CONTEXT pDevice) {
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDF_TIMER_CONFIG timerConfig;
+	NTSTATUS status;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = pDevice->FxDevice;
+
+	status = WdfSpinLockCreate(&attributes, &pDevice->QuoteLock);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/* Windows are shorter than a clock tick */
+	WDF_TIMER_CONFIG_INIT(&timerConfig, Cr50EvtQuoteTimer);
+	timerConfig.AutomaticSerialization = FALSE;
+	timerConfig.UseHighResolutionTimer = WdfTrue;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = pDevice->FxDevice;
+
+	status = WdfTimerCreate(&timerConfig, &attributes, &pDevice->QuoteTimer);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	for (ULONG i = 0; i < CR50_QUOTE_GROUPS; i++) {
+		WDF_IO_QUEUE_CONFIG queueConfig;
+
+		WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+		queueConfig.PowerManaged = WdfFalse;
+		queueConfig.EvtIoCanceledOnQueue = Cr50EvtQuoteCanceled;
+
+		status = WdfIoQueueCreate(pDevice->FxDevice, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES,
+			&pDevice->QuoteGroups[i].Queue);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+	}
+
+	/* Leaves are hashed in the I/O callback, which may run at dispatch level */
+	return BCryptOpenAlgorithmProvider(&pDevice->QuoteHash, BCRYPT_SHA256_ALGORITHM,
+		NULL, BCRYPT_PROV_DISPATCH);
+}
+
+/* Called from the device's cleanup callback */
+void tpm_cr50_quote_cleanup(PCR50_CONTEXT pDevice) {
+	if (pDevice->QuoteHash) {
+		BCryptCloseAlgorithmProvider(pDevice->QuoteHash, 0);
+		pDevice->QuoteHash = NULL;
+	}
+}
+
+/*
+ * Called before the ring stops: queues what is still collected, so the
+ * consumer quotes it or fails it on its way out.
+ */
+void tpm_cr50_quote_flush(PCR50_CONTEXT pDevice) {
+	PCR50_QUOTE_GROUP closed[CR50_QUOTE_GROUPS];
+	ULONG count;
+
+	WdfTimerStop(pDevice->QuoteTimer, TRUE);
+
+	tpm_cr50_quote_close(pDevice, MAXLONGLONG, closed, &count);
+	for (ULONG i = 0; i < count; i++) {
+		tpm_cr50_quote_dispatch(pDevice, closed[i]);
+	}
+}
+
+/*
+ * Checks the request and adds it to a group. Returns STATUS_PENDING
+ * when it was, in which case the consumer completes it.
+ */
+NTSTATUS tpm_cr50_quote_submit(PCR50_CONTEXT pDevice, WDFREQUEST Request) {
+	LONGLONG queued = tpm_cr50_timestamp();
+	UINT8 nonce[1 + CR50_QUOTE_MAX_NONCE];
+	UINT8 leaf[CR50_QUOTE_HASH_SIZE];
+	PCR50_QUOTE_GROUP g = NULL, ready = NULL;
+	BOOLEAN arm = FALSE;
+	PCR50_QUOTE input;
+	PVOID result;
+	NTSTATUS status;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(*input), (PVOID*)&input, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(Request,
+		sizeof(CR50_QUOTE_RESULT) + TPM_HEADER_SIZE, &result, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (!tpm_cr50_quote_valid(input)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	/* Only the leaf is kept, the result overwrites the nonce */
+	nonce[0] = 0x00;
+	RtlCopyMemory(nonce + 1, input->Nonce, input->NonceLength);
+	status = tpm_cr50_quote_hash(pDevice, nonce, 1 + input->NonceLength, leaf);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	WDFFILEOBJECT fileObject = WdfRequestGetFileObject(Request);
+	UINT8 locality = fileObject ? GetFileContext(fileObject)->Locality : 0;
+
+	WdfSpinLockAcquire(pDevice->QuoteLock);
+
+	for (ULONG i = 0; i < CR50_QUOTE_GROUPS && !g; i++) {
+		PCR50_QUOTE_GROUP open = &pDevice->QuoteGroups[i];
+		if (open->State == Cr50QuoteOpen && open->Locality == locality &&
+			tpm_cr50_quote_match(&open->Key, input))
+			g = open;
+	}
+
+	for (ULONG i = 0; i < CR50_QUOTE_GROUPS && !g; i++) {
+		if (pDevice->QuoteGroups[i].State != Cr50QuoteFree)
+			continue;
+
+		g = &pDevice->QuoteGroups[i];
+		g->State = Cr50QuoteOpen;
+		g->Locality = locality;
+		g->Deadline = queued + 10000LL * pDevice->QuoteWindow;
+		g->Key = *input;
+		RtlZeroMemory(g->Key.Nonce, sizeof(g->Key.Nonce));
+		g->Key.NonceLength = 0;
+		g->Count = 0;
+	}
+
+	if (!g) {
+		WdfSpinLockRelease(pDevice->QuoteLock);
+		return STATUS_DEVICE_BUSY;
+	}
+
+	/* Under the lock, so a cancel callback finds it in the group */
+	if (g->Count) {
+		status = WdfRequestForwardToIoQueue(Request, g->Queue);
+		if (!NT_SUCCESS(status)) {
+			WdfSpinLockRelease(pDevice->QuoteLock);
+			return status;
+		}
+	}
+
+	g->Requests[g->Count] = Request;
+	g->Submitted[g->Count] = queued;
+	RtlCopyMemory(g->Leaves[g->Count], leaf, CR50_QUOTE_HASH_SIZE);
+	g->Count++;
+
+	if (g->Count == CR50_QUOTE_MAX_REQUESTS || !pDevice->QuoteWindow) {
+		g->State = Cr50QuoteQueued;
+		g->Closed = queued;
+		ready = g;
+	}
+	else if (!pDevice->QuoteTimerArmed) {
+		pDevice->QuoteTimerArmed = TRUE;
+		arm = TRUE;
+	}
+
+	WdfSpinLockRelease(pDevice->QuoteLock);
+
+	if (arm) {
+		WdfTimerStart(pDevice->QuoteTimer, WDF_REL_TIMEOUT_IN_MS(pDevice->QuoteWindow));
+	}
+	if (ready) {
+		tpm_cr50_quote_dispatch(pDevice, ready);
+	}
+
+	return STATUS_PENDING;
+}
+
+/* Fills the result of request @index of the group, returns its size */
+static size_t tpm_cr50_quote_result(PCR50_CONTEXT pDevice, PCR50_QUOTE_GROUP g,
+	ULONG index, const UINT8* root, UINT32 rc, const UINT8* rsp, size_t rsp_len,
+	LONGLONG done) {
+	PCR50_QUOTE_RESULT result;
+	size_t outLen;
+
+	if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(g->Requests[index], sizeof(*result),
+		(PVOID*)&result, &outLen))) {
+		return 0;
+	}
+
+	RtlZeroMemory(result, sizeof(*result));
+	result->ResponseLength = (ULONG)min(rsp_len, outLen - sizeof(*result));
+	result->Status = result->ResponseLength < rsp_len ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+	result->ResponseCode = rc;
+	result->Requests = g->Count;
+	result->LeafIndex = index;
+	result->ProofLength = tpm_cr50_quote_proof(pDevice, g->Count, index, result->Proof);
+	result->WaitUs = (ULONG)min((g->Closed - g->Submitted[index]) / 10, MAXULONG);
+	result->LatencyUs = (ULONG)min((done - g->Submitted[index]) / 10, MAXULONG);
+	RtlCopyMemory(result->Root, root, CR50_QUOTE_HASH_SIZE);
+	RtlCopyMemory(result + 1, rsp, result->ResponseLength);
+
+	pDevice->QuoteWaitUs += result->WaitUs;
+	pDevice->QuoteLatencyUs += result->LatencyUs;
+
+	return sizeof(*result) + result->ResponseLength;
+}
+
+/**
+ * tpm_cr50_quote_execute() - Quote once for the group @Request leads.
+ * @locality:	Locality the submitting handles are bound to.
+ * @last:	No further command for @locality follows in the ring.
+ *
+ * Completes the other requests of the group; the result of @Request is
+ * returned for the caller to complete it with.
+ */
+NTSTATUS tpm_cr50_quote_execute(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	LONGLONG queued, UINT8 locality, BOOLEAN last, size_t* bytesReturned) {
+	UINT8* rsp = pDevice->InternalResponse;
+	size_t len, rsp_len, returned;
+	PCR50_QUOTE_GROUP g;
+	NTSTATUS status;
+	UINT8* root;
+	UINT32 rc;
+
+	WdfSpinLockAcquire(pDevice->QuoteLock);
+	g = tpm_cr50_quote_find(pDevice, Request);
+	if (g)
+		tpm_cr50_quote_collect(g);
+	WdfSpinLockRelease(pDevice->QuoteLock);
+
+	if (!g) {
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
+
+	status = tpm_cr50_quote_tree(pDevice, g, &root);
+	if (NT_SUCCESS(status)) {
+		tpm_cr50_idle_arrival(pDevice, queued);
+		status = tpm_cr50_begin(pDevice);
+	}
+
+	if (!NT_SUCCESS(status)) {
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"Quote of %d requests failed 0x%x\n", g->Count, status);
+		pDevice->QuoteFailures += g->Count;
+		for (ULONG i = 1; i < g->Count; i++) {
+			WdfRequestComplete(g->Requests[i], status);
+		}
+		tpm_cr50_quote_release(pDevice, g);
+		return status;
+	}
+
+	len = tpm_cr50_quote_command(&g->Key, root, pDevice->CommandBuffer);
+
+	tpm_cr50_select_locality(pDevice, locality);
+	pDevice->LocalityCommands[locality]++;
+	pDevice->HoldLocality = !last;
+
+	status = tpm_cr50_transmit_retry(pDevice, pDevice->CommandBuffer, len,
+		rsp, sizeof(pDevice->InternalResponse), queued);
+
+	/* The response is only ours until the lock is given up */
+	if (NT_SUCCESS(status)) {
+		LONGLONG done = tpm_cr50_timestamp();
+
+		rc = tpm2_response_code(rsp);
+		rsp_len = min(RtlUlongByteSwap(*((UINT32*)(rsp + 2))), sizeof(pDevice->InternalResponse));
+
+		for (ULONG i = 0; i < g->Count; i++) {
+			returned = tpm_cr50_quote_result(pDevice, g, i, root, rc, rsp, rsp_len, done);
+			if (i)
+				WdfRequestCompleteWithInformation(g->Requests[i], STATUS_SUCCESS, returned);
+			else
+				*bytesReturned = returned;
+		}
+
+		pDevice->Quotes++;
+		pDevice->QuoteRequests += g->Count;
+		pDevice->QuoteMaxBatch = max(pDevice->QuoteMaxBatch, g->Count);
+	}
+	else {
+		pDevice->QuoteFailures += g->Count;
+		for (ULONG i = 1; i < g->Count; i++) {
+			WdfRequestComplete(g->Requests[i], status);
+		}
+	}
+
+	tpm_cr50_end(pDevice);
+
+	tpm_cr50_quote_release(pDevice, g);
+	return status;
+}
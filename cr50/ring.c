@@ -0,0 +1,377 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+//
+// Bounded multi-producer, single-consumer ring of submitted commands.
+//
+// Each slot carries a sequence number. A slot at position pos is free for
+// the producer that claims pos while its sequence equals pos, and holds a
+// published entry for the consumer once it equals pos + 1. Producers
+// claim positions with a compare-exchange on RingHead and never wait for
+// each other; only the consumer thread advances RingTail, and it is the
+// only code that sends client commands to the TPM.
+//
+// A request stays cancelable while it waits in the ring. Its slot's State
+// says who completes it: the cancel callback and the consumer race to
+// move it from queued to cancelled or claimed with a compare-exchange,
+// and only the winner completes the request. The state carries the
+// slot position, so a callback that lost the slot to the consumer cannot
+// take the next request queued in it. The slot also holds a reference on
+// the request, which the consumer drops once it is done with the slot.
+//
+// The consumer takes everything that is queued as one batch and runs it
+// grouped by locality, so the locality is switched at most once per
+// group. Each group is the locality of the oldest command still waiting,
+// which therefore never waits for a later one. Commands of one locality
+// keep their submission order.
+//
+
+#define CR50_RING_QUEUED	0
+#define CR50_RING_CLAIMED	1
+#define CR50_RING_CANCELLED	2
+
+#define CR50_RING_STATE(pos, owner)	((LONG)(((ULONG)(pos) << 2) | (owner)))
+
+static ULONG tpm_cr50_ring_bucket(ULONG64 ns) {
+	ULONG index;
+
+	if (ns > MAXULONG)
+		ns = MAXULONG;
+	if (!_BitScanReverse(&index, (ULONG)ns))
+		return 0;
+	return min(index, CR50_HISTOGRAM_BUCKETS - 1);
+}
+
+static BOOLEAN tpm_cr50_ring_push(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	LONGLONG queued, UINT8 locality) {
+	LARGE_INTEGER start = KeQueryPerformanceCounter(NULL);
+	PCR50_RING_SLOT slot;
+	LONG pos, seq, depth;
+
+	pos = ReadAcquire(&pDevice->RingHead);
+	for (;;) {
+		slot = &pDevice->Ring[pos & (CR50_RING_ENTRIES - 1)];
+		seq = ReadAcquire(&slot->Sequence);
+
+		if (seq == pos) {
+			LONG prev = InterlockedCompareExchange(&pDevice->RingHead, pos + 1, pos);
+			if (prev == pos)
+				break;
+			InterlockedIncrement64(&pDevice->RingContended);
+			pos = prev;
+		}
+		else if (seq - pos < 0) {
+			/* The consumer has not freed this slot yet: the ring is full */
+			InterlockedIncrement64(&pDevice->RingRejected);
+			return FALSE;
+		}
+		else {
+			pos = ReadAcquire(&pDevice->RingHead);
+		}
+	}
+
+	slot->Request = Request;
+	slot->Queued = queued;
+	slot->Locality = locality;
+	InterlockedExchange(&slot->State, CR50_RING_STATE(pos, CR50_RING_QUEUED));
+	InterlockedExchange(&slot->Sequence, pos + 1);
+
+	/* Only wake the consumer if it is about to sleep or sleeping */
+	if (InterlockedExchange(&pDevice->ConsumerIdle, 0)) {
+		KeSetEvent(&pDevice->RingEvent, IO_NO_INCREMENT, FALSE);
+	}
+
+	LARGE_INTEGER end = KeQueryPerformanceCounter(NULL);
+	ULONG64 ns = (ULONG64)(end.QuadPart - start.QuadPart) * 1000 * 1000 * 1000 /
+		pDevice->PerfFrequency;
+
+	InterlockedIncrement64(&pDevice->RingEnqueued);
+	InterlockedIncrement((LONG*)&pDevice->RingHistogram[tpm_cr50_ring_bucket(ns)]);
+
+	depth = pos + 1 - ReadAcquire(&pDevice->RingTail);
+	for (LONG max = pDevice->RingMaxDepth; depth > max;
+		max = pDevice->RingMaxDepth) {
+		if (InterlockedCompareExchange(&pDevice->RingMaxDepth, depth, max) == max)
+			break;
+	}
+	return TRUE;
+}
+
+/*
+ * Takes the oldest entry out of the ring into @entry. Its State is
+ * CR50_RING_CLAIMED if the consumer won the request from the cancel
+ * callback.
+ */
+static BOOLEAN tpm_cr50_ring_pop(PCR50_CONTEXT pDevice, PCR50_RING_SLOT entry) {
+	LONG pos = pDevice->RingTail;
+	PCR50_RING_SLOT slot = &pDevice->Ring[pos & (CR50_RING_ENTRIES - 1)];
+	LONG queued = CR50_RING_STATE(pos, CR50_RING_QUEUED);
+
+	if (ReadAcquire(&slot->Sequence) != pos + 1)
+		return FALSE;
+
+	entry->Request = slot->Request;
+	entry->Queued = slot->Queued;
+	entry->Locality = slot->Locality;
+	entry->State = InterlockedCompareExchange(&slot->State,
+		CR50_RING_STATE(pos, CR50_RING_CLAIMED), queued) == queued ?
+		CR50_RING_CLAIMED : CR50_RING_CANCELLED;
+
+	/* Hand the slot back to the producer one lap ahead */
+	InterlockedExchange(&slot->Sequence, pos + CR50_RING_ENTRIES);
+	InterlockedExchange(&pDevice->RingTail, pos + 1);
+	return TRUE;
+}
+
+static void tpm_cr50_ring_cancelled(PCR50_CONTEXT pDevice, WDFREQUEST Request) {
+	/* A quote hands the rest of its group to the next request */
+	if (!tpm_cr50_quote_cancel(pDevice, Request))
+		WdfRequestComplete(Request, STATUS_CANCELLED);
+}
+
+/*
+ * Completes a request cancelled while it waited in the ring, unless the
+ * consumer claimed it first. A request the callback does not find queued
+ * is left to whoever holds it.
+ */
+VOID Cr50EvtRingRequestCancel(WDFREQUEST Request) {
+	PCR50_CONTEXT pDevice = GetDeviceContext(WdfIoQueueGetDevice(WdfRequestGetIoQueue(Request)));
+
+	for (ULONG i = 0; i < CR50_RING_ENTRIES; i++) {
+		PCR50_RING_SLOT slot = &pDevice->Ring[i];
+		LONG state = ReadAcquire(&slot->State);
+
+		/* The state is read first: the producer sets it after the request */
+		if ((state & 3) != CR50_RING_QUEUED || slot->Request != Request)
+			continue;
+
+		if (InterlockedCompareExchange(&slot->State, state | CR50_RING_CANCELLED,
+			state) == state)
+			tpm_cr50_ring_cancelled(pDevice, Request);
+		return;
+	}
+}
+
+/*
+ * Takes a popped request back from the cancel path. Returns FALSE if the
+ * cancel callback won it and completed it, or if the request turned out
+ * to be cancelled, in which case it is completed here.
+ */
+static BOOLEAN tpm_cr50_ring_claim(PCR50_CONTEXT pDevice, PCR50_RING_SLOT entry) {
+	NTSTATUS status = STATUS_CANCELLED;
+
+	if (entry->State == CR50_RING_CLAIMED) {
+		status = WdfRequestUnmarkCancelable(entry->Request);
+
+		/* The callback runs, but found the request claimed */
+		if (status == STATUS_CANCELLED)
+			tpm_cr50_ring_cancelled(pDevice, entry->Request);
+	}
+
+	WdfObjectDereference(entry->Request);
+	return status != STATUS_CANCELLED;
+}
+
+static BOOLEAN tpm_cr50_ring_empty(PCR50_CONTEXT pDevice) {
+	LONG pos = pDevice->RingTail;
+	return ReadAcquire(&pDevice->Ring[pos & (CR50_RING_ENTRIES - 1)].Sequence) != pos + 1;
+}
+
+/* Whether a command waits in the ring, for work the consumer may cut short */
+BOOLEAN tpm_cr50_ring_waiting(PCR50_CONTEXT pDevice) {
+	return !tpm_cr50_ring_empty(pDevice);
+}
+
+static void tpm_cr50_run_batch(PCR50_CONTEXT pDevice) {
+	PCR50_RING_SLOT batch = pDevice->Batch;
+	BOOLEAN done[CR50_RING_ENTRIES] = { 0 };
+	ULONG count = 0, remaining;
+	UINT8 locality;
+
+	while (count < CR50_RING_ENTRIES && tpm_cr50_ring_pop(pDevice, &batch[count])) {
+		if (tpm_cr50_ring_claim(pDevice, &batch[count]))
+			count++;
+	}
+
+	if (!count)
+		return;
+
+	if (pDevice->RingStopping) {
+		for (ULONG i = 0; i < count; i++) {
+			/* A quote takes the requests collected with it along */
+			if (!tpm_cr50_quote_fail(pDevice, batch[i].Request, STATUS_DEVICE_REMOVED))
+				WdfRequestComplete(batch[i].Request, STATUS_DEVICE_REMOVED);
+		}
+		return;
+	}
+
+	locality = batch[0].Locality;
+	for (remaining = count; remaining; ) {
+		ULONG last = count;
+
+		for (ULONG i = 0; i < count; i++) {
+			if (!done[i] && batch[i].Locality == locality)
+				last = i;
+		}
+
+		for (ULONG i = 0; i < count && last != count; i++) {
+			if (done[i] || batch[i].Locality != locality)
+				continue;
+
+			done[i] = TRUE;
+			remaining--;
+			tpm_cr50_complete(pDevice, batch[i].Request, batch[i].Queued,
+				locality, i == last);
+		}
+
+		/* Next group: the oldest command still waiting */
+		for (ULONG i = 0; i < count; i++) {
+			if (!done[i]) {
+				locality = batch[i].Locality;
+				break;
+			}
+		}
+	}
+}
+
+static VOID tpm_cr50_consumer(PVOID Context) {
+	PCR50_CONTEXT pDevice = (PCR50_CONTEXT)Context;
+
+	for (;;) {
+		/* Start the TPM right after D0 entry, ahead of any command */
+		if (pDevice->StartupPending) {
+			WdfWaitLockAcquire(pDevice->CommandLock, NULL);
+			tpm_cr50_ensure_started(pDevice);
+			WdfWaitLockRelease(pDevice->CommandLock);
+		}
+
+		tpm_cr50_run_batch(pDevice);
+		tpm_cr50_shared_run(pDevice);
+		tpm_cr50_session_run(pDevice);
+		tpm_cr50_keygen_run(pDevice);
+
+		/*
+		 * Announce the sleep before checking the ring a last time, so a
+		 * producer that published after the check sees the flag and
+		 * sets the event.
+		 */
+		InterlockedExchange(&pDevice->ConsumerIdle, 1);
+		if (!tpm_cr50_ring_empty(pDevice) || pDevice->StartupPending ||
+			tpm_cr50_shared_pending(pDevice) || tpm_cr50_session_pending(pDevice) ||
+			tpm_cr50_keygen_pending(pDevice)) {
+			InterlockedExchange(&pDevice->ConsumerIdle, 0);
+			continue;
+		}
+
+		if (pDevice->RingStopping)
+			break;
+
+		KeWaitForSingleObject(&pDevice->RingEvent, Executive, KernelMode, FALSE, NULL);
+		InterlockedExchange(&pDevice->ConsumerIdle, 0);
+	}
+
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+/* Called from EvtDeviceAdd, before the ring can be started */
+void tpm_cr50_ring_init(PCR50_CONTEXT pDevice) {
+	LARGE_INTEGER frequency;
+
+	KeQueryPerformanceCounter(&frequency);
+	pDevice->PerfFrequency = frequency.QuadPart;
+
+	KeInitializeEvent(&pDevice->RingEvent, SynchronizationEvent, FALSE);
+	KeInitializeEvent(&pDevice->D0Event, NotificationEvent, FALSE);
+
+	/* Reject submissions until the consumer runs */
+	ExInitializeRundownProtection(&pDevice->RingRundown);
+	ExWaitForRundownProtectionRelease(&pDevice->RingRundown);
+}
+
+NTSTATUS tpm_cr50_ring_start(PCR50_CONTEXT pDevice) {
+	HANDLE thread;
+	NTSTATUS status;
+
+	for (LONG i = 0; i < CR50_RING_ENTRIES; i++) {
+		pDevice->Ring[i].Sequence = i;
+		pDevice->Ring[i].State = CR50_RING_CLAIMED;
+	}
+	pDevice->RingHead = 0;
+	pDevice->RingTail = 0;
+	pDevice->ConsumerIdle = 0;
+	pDevice->RingStopping = FALSE;
+	KeClearEvent(&pDevice->RingEvent);
+
+	status = PsCreateSystemThread(&thread, THREAD_ALL_ACCESS, NULL, NULL, NULL,
+		tpm_cr50_consumer, pDevice);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = ObReferenceObjectByHandle(thread, THREAD_ALL_ACCESS, NULL, KernelMode,
+		(PVOID*)&pDevice->ConsumerThread, NULL);
+	ZwClose(thread);
+	if (!NT_SUCCESS(status)) {
+		pDevice->RingStopping = TRUE;
+		KeSetEvent(&pDevice->RingEvent, IO_NO_INCREMENT, FALSE);
+		return status;
+	}
+
+	ExReInitializeRundownProtection(&pDevice->RingRundown);
+	return status;
+}
+
+/*
+ * Waits for producers to leave, then lets the consumer fail what is
+ * still queued and exit.
+ */
+void tpm_cr50_ring_stop(PCR50_CONTEXT pDevice) {
+	if (!pDevice->ConsumerThread) {
+		return;
+	}
+
+	ExWaitForRundownProtectionRelease(&pDevice->RingRundown);
+
+	pDevice->RingStopping = TRUE;
+	KeSetEvent(&pDevice->RingEvent, IO_NO_INCREMENT, FALSE);
+
+	KeWaitForSingleObject(pDevice->ConsumerThread, Executive, KernelMode, FALSE, NULL);
+	ObDereferenceObject(pDevice->ConsumerThread);
+	pDevice->ConsumerThread = NULL;
+}
+
+/* Returns STATUS_PENDING once the consumer owns the request */
+NTSTATUS tpm_cr50_ring_submit(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	LONGLONG queued, UINT8 locality) {
+	NTSTATUS status;
+
+	if (!ExAcquireRundownProtection(&pDevice->RingRundown)) {
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	/* Held by the slot until the consumer claims the request */
+	WdfObjectReference(Request);
+
+	status = WdfRequestMarkCancelableEx(Request, Cr50EvtRingRequestCancel);
+	if (NT_SUCCESS(status) && tpm_cr50_ring_push(pDevice, Request, queued, locality)) {
+		status = STATUS_PENDING;
+	}
+	else {
+		if (NT_SUCCESS(status)) {
+			/* The ring is full; a cancel callback does not find it queued */
+			status = NT_SUCCESS(WdfRequestUnmarkCancelable(Request)) ?
+				STATUS_DEVICE_BUSY : STATUS_CANCELLED;
+		}
+		WdfObjectDereference(Request);
+	}
+
+	ExReleaseRundownProtection(&pDevice->RingRundown);
+	return status;
+}
+
+/* Wakes the consumer for work that is not in the ring */
+void tpm_cr50_ring_kick(PCR50_CONTEXT pDevice) {
+	KeSetEvent(&pDevice->RingEvent, IO_NO_INCREMENT, FALSE);
+}
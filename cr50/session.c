@@ -0,0 +1,537 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+//
+// Authorization session pool.
+//
+// A client that starts a session for every operation sends a
+// StartAuthSession and a FlushContext around each one. The driver keeps
+// SessionPool HMAC sessions started instead, unsalted and unbound so
+// that they carry no secret, and IOCTL_CR50_SESSION_ACQUIRE hands one
+// out without a TPM command. A released session stays with the handle
+// that released it, which makes a per-handle cache of its HMAC and
+// policy sessions, until it authorized SessionMaxUses commands; then it
+// is flushed and a fresh one takes its place.
+//
+// The consumer flushes and starts sessions in the background, one
+// command per pass so queued requests keep their turn, and only while
+// the device is in D0. All of them are flushed when the device leaves
+// D0. Pooled sessions take up TPM session slots, so one is flushed when
+// a client command fails for the lack of room.
+//
+
+/* A slot for @FileObject: its own cached session first, then the pool */
+static PCR50_SESSION_SLOT tpm_cr50_session_take(PCR50_CONTEXT pDevice,
+	WDFFILEOBJECT FileObject, UCHAR type) {
+	PCR50_SESSION_SLOT slot, found = NULL;
+
+	for (ULONG i = 0; i < CR50_SESSION_SLOTS; i++) {
+		slot = &pDevice->Sessions[i];
+		if (slot->State != Cr50SessionReady || slot->Type != type)
+			continue;
+		if (slot->Owner == FileObject) {
+			found = slot;
+			break;
+		}
+		if (!slot->Owner && !found)
+			found = slot;
+	}
+
+	if (found) {
+		found->State = Cr50SessionAcquired;
+		found->Owner = FileObject;
+	}
+	return found;
+}
+
+static void tpm_cr50_session_fill(PCR50_SESSION_SLOT slot, PCR50_SESSION output,
+	BOOLEAN reused) {
+	output->Handle = slot->Handle;
+	output->Type = slot->Type;
+	output->Uses = slot->Uses;
+	output->Flags = reused ? CR50_SESSION_REUSED : 0;
+	RtlCopyMemory(output->NonceTpm, slot->NonceTpm, CR50_SESSION_NONCE_SIZE);
+}
+
+/* Flushes @handle with buffers of its own, the command buffer may be in use */
+static NTSTATUS tpm_cr50_session_flush_handle(PCR50_CONTEXT pDevice, ULONG handle) {
+	UINT8 cmd[TPM_HEADER_SIZE + 4], rsp[TPM_HEADER_SIZE];
+	ULONG_PTR arg = handle;
+	size_t len;
+	NTSTATUS status;
+	UINT32 rc;
+
+	len = tpm2_build(TPM2_CMD_FLUSH_CONTEXT, cmd, sizeof(cmd), &arg);
+	if (!len) {
+		return STATUS_INVALID_BUFFER_SIZE;
+	}
+
+	pDevice->SessionsFlushed++;
+
+	status = tpm_cr50_transmit_retry(pDevice, cmd, len, rsp, sizeof(rsp), 0);
+	if (NT_SUCCESS(status)) {
+		status = tpm2_parse(TPM2_CMD_FLUSH_CONTEXT, rsp, sizeof(rsp), &rc);
+	}
+	if (NT_SUCCESS(status) && rc != TPM2_RC_SUCCESS) {
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"FlushContext of 0x%x failed: rc 0x%x\n", handle, rc);
+		status = STATUS_TPM_FAIL;
+	}
+	return status;
+}
+
+/*
+ * Flushes the pooled or cached session that was used least recently.
+ * Called with the command lock held; FALSE if every session is handed out.
+ */
+BOOLEAN tpm_cr50_session_evict(PCR50_CONTEXT pDevice) {
+	PCR50_SESSION_SLOT slot, victim = NULL;
+
+	WdfSpinLockAcquire(pDevice->SessionLock);
+	for (ULONG i = 0; i < CR50_SESSION_SLOTS; i++) {
+		slot = &pDevice->Sessions[i];
+		if (slot->State == Cr50SessionReady &&
+			(!victim || slot->LastUsed < victim->LastUsed))
+			victim = slot;
+	}
+	if (victim) {
+		victim->State = Cr50SessionFlush;
+		victim->Owner = NULL;
+	}
+	WdfSpinLockRelease(pDevice->SessionLock);
+
+	if (!victim) {
+		return FALSE;
+	}
+
+	tpm_cr50_session_flush_handle(pDevice, victim->Handle);
+
+	WdfSpinLockAcquire(pDevice->SessionLock);
+	victim->State = Cr50SessionFree;
+	pDevice->SessionsEvicted++;
+	WdfSpinLockRelease(pDevice->SessionLock);
+	return TRUE;
+}
+
+static PCR50_SESSION_SLOT tpm_cr50_session_reserve(PCR50_CONTEXT pDevice) {
+	PCR50_SESSION_SLOT slot = NULL;
+
+	WdfSpinLockAcquire(pDevice->SessionLock);
+	for (ULONG i = 0; i < CR50_SESSION_SLOTS; i++) {
+		if (pDevice->Sessions[i].State == Cr50SessionFree) {
+			slot = &pDevice->Sessions[i];
+			slot->State = Cr50SessionStarting;
+			break;
+		}
+	}
+	WdfSpinLockRelease(pDevice->SessionLock);
+	return slot;
+}
+
+static BOOLEAN tpm_cr50_session_full(UINT32 rc) {
+	return rc == TPM2_RC_SESSION_MEMORY || rc == TPM2_RC_SESSION_HANDLES;
+}
+
+/*
+ * Starts a session of @type for @Owner, or for the pool if NULL. With
+ * @evict, the least recently used session makes room if there is none in
+ * the driver or the TPM. Called with the command lock held.
+ */
+static NTSTATUS tpm_cr50_session_start(PCR50_CONTEXT pDevice, UCHAR type,
+	WDFFILEOBJECT Owner, BOOLEAN evict, PCR50_SESSION_SLOT* started) {
+	UINT8 nonce[CR50_SESSION_NONCE_SIZE];
+	UINT8* rsp = pDevice->InternalResponse;
+	size_t rsp_len = sizeof(pDevice->InternalResponse);
+	PCR50_SESSION_SLOT slot;
+	const UINT8* nonceTpm = NULL;
+	ULONG_PTR args[2];
+	UINT16 size = 0;
+	NTSTATUS status;
+	UINT32 rc = 0;
+
+	slot = tpm_cr50_session_reserve(pDevice);
+	if (!slot && evict && tpm_cr50_session_evict(pDevice))
+		slot = tpm_cr50_session_reserve(pDevice);
+	if (!slot) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	status = BCryptGenRandom(NULL, nonce, sizeof(nonce), BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+	if (NT_SUCCESS(status)) {
+		args[0] = type;
+		args[1] = (ULONG_PTR)nonce;
+		status = tpm_cr50_internal(pDevice, TPM2_CMD_START_AUTH_SESSION, args, &rc);
+
+		/* Room for it is made once */
+		if (NT_SUCCESS(status) && tpm_cr50_session_full(rc) && evict &&
+			tpm_cr50_session_evict(pDevice))
+			status = tpm_cr50_internal(pDevice, TPM2_CMD_START_AUTH_SESSION, args, &rc);
+	}
+
+	if (NT_SUCCESS(status) && rc == TPM2_RC_SUCCESS) {
+		pDevice->SessionsStarted++;
+		nonceTpm = tpm2_field_bytes(TPM2_CMD_START_AUTH_SESSION, rsp, rsp_len,
+			TPM2_START_AUTH_SESSION_NONCE, &size);
+		if (!nonceTpm || size != CR50_SESSION_NONCE_SIZE) {
+			tpm_cr50_session_flush_handle(pDevice, tpm2_field(TPM2_CMD_START_AUTH_SESSION,
+				rsp, rsp_len, TPM2_START_AUTH_SESSION_HANDLE));
+			status = STATUS_DEVICE_PROTOCOL_ERROR;
+		}
+	}
+	else if (NT_SUCCESS(status)) {
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"StartAuthSession failed: rc 0x%x\n", rc);
+		status = STATUS_TPM_FAIL;
+	}
+
+	WdfSpinLockAcquire(pDevice->SessionLock);
+	if (NT_SUCCESS(status)) {
+		slot->Handle = tpm2_field(TPM2_CMD_START_AUTH_SESSION, rsp, rsp_len,
+			TPM2_START_AUTH_SESSION_HANDLE);
+		slot->Type = type;
+		slot->Stale = FALSE;
+		slot->Owner = Owner;
+		slot->Uses = 0;
+		slot->LastUsed = tpm_cr50_timestamp();
+		RtlCopyMemory(slot->NonceTpm, nonceTpm, CR50_SESSION_NONCE_SIZE);
+		slot->State = Owner ? Cr50SessionAcquired : Cr50SessionReady;
+	}
+	else {
+		slot->State = Cr50SessionFree;
+	}
+	WdfSpinLockRelease(pDevice->SessionLock);
+
+	*started = slot;
+	return status;
+}
+
+NTSTATUS tpm_cr50_session_init(PCR50_CONTEXT pDevice) {
+	WDF_OBJECT_ATTRIBUTES attributes;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = pDevice->FxDevice;
+
+	return WdfSpinLockCreate(&attributes, &pDevice->SessionLock);
+}
+
+/*
+ * Hands out a started session right away if there is one for the
+ * handle, or queues the request for the consumer to start one. Returns
+ * STATUS_PENDING when it was queued.
+ */
+NTSTATUS tpm_cr50_session_acquire(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	size_t* bytesReturned) {
+	LONGLONG queued = tpm_cr50_timestamp();
+	PCR50_SESSION_REQUEST input;
+	PCR50_SESSION output;
+	PCR50_SESSION_SLOT slot;
+	WDFFILEOBJECT fileObject;
+	NTSTATUS status;
+	UCHAR type;
+
+	*bytesReturned = 0;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(*input), (PVOID*)&input, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*output), (PVOID*)&output, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/* A session belongs to a handle, which releases it when closed */
+	fileObject = WdfRequestGetFileObject(Request);
+	if (!fileObject || (input->Type != TPM2_SE_HMAC && input->Type != TPM2_SE_POLICY)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	type = (UCHAR)input->Type;
+
+	WdfSpinLockAcquire(pDevice->SessionLock);
+	slot = tpm_cr50_session_take(pDevice, fileObject, type);
+	if (slot) {
+		pDevice->SessionHits++;
+		tpm_cr50_session_fill(slot, output, TRUE);
+	}
+	WdfSpinLockRelease(pDevice->SessionLock);
+
+	if (!slot) {
+		return tpm_cr50_ring_submit(pDevice, Request, queued,
+			GetFileContext(fileObject)->Locality);
+	}
+
+	/* The consumer starts a replacement while the device is idle */
+	tpm_cr50_ring_kick(pDevice);
+
+	*bytesReturned = sizeof(*output);
+	return STATUS_SUCCESS;
+}
+
+/**
+ * tpm_cr50_session_execute() - Start a session for an acquire that found none.
+ * @locality:	Locality the submitting handle is bound to.
+ * @last:	No further command for @locality follows in the ring.
+ */
+NTSTATUS tpm_cr50_session_execute(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	LONGLONG queued, UINT8 locality, BOOLEAN last, size_t* bytesReturned) {
+	WDFFILEOBJECT fileObject = WdfRequestGetFileObject(Request);
+	PCR50_SESSION_REQUEST input;
+	PCR50_SESSION output;
+	PCR50_SESSION_SLOT slot;
+	NTSTATUS status;
+	UCHAR type;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(*input), (PVOID*)&input, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*output), (PVOID*)&output, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+	type = (UCHAR)input->Type;
+
+	/* One may have been released or started since the request was queued */
+	WdfSpinLockAcquire(pDevice->SessionLock);
+	slot = tpm_cr50_session_take(pDevice, fileObject, type);
+	if (slot) {
+		pDevice->SessionHits++;
+		tpm_cr50_session_fill(slot, output, TRUE);
+	}
+	WdfSpinLockRelease(pDevice->SessionLock);
+
+	if (slot) {
+		*bytesReturned = sizeof(*output);
+		return STATUS_SUCCESS;
+	}
+
+	tpm_cr50_idle_arrival(pDevice, queued);
+
+	status = tpm_cr50_begin(pDevice);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	tpm_cr50_select_locality(pDevice, locality);
+	pDevice->LocalityCommands[locality]++;
+	pDevice->HoldLocality = !last;
+
+	status = tpm_cr50_session_start(pDevice, type, fileObject, TRUE, &slot);
+	if (NT_SUCCESS(status)) {
+		pDevice->SessionMisses++;
+		tpm_cr50_session_fill(slot, output, FALSE);
+		*bytesReturned = sizeof(*output);
+	}
+
+	tpm_cr50_end(pDevice);
+	return status;
+}
+
+/* Gives an acquired session back; completes without a TPM command */
+NTSTATUS tpm_cr50_session_release(PCR50_CONTEXT pDevice, WDFREQUEST Request) {
+	WDFFILEOBJECT fileObject = WdfRequestGetFileObject(Request);
+	PCR50_SESSION input;
+	PCR50_SESSION_SLOT slot;
+	NTSTATUS status;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(*input), (PVOID*)&input, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = STATUS_INVALID_PARAMETER;
+
+	WdfSpinLockAcquire(pDevice->SessionLock);
+	for (ULONG i = 0; i < CR50_SESSION_SLOTS; i++) {
+		slot = &pDevice->Sessions[i];
+		if (slot->State != Cr50SessionAcquired || slot->Owner != fileObject ||
+			slot->Handle != input->Handle)
+			continue;
+
+		slot->Uses = max(slot->Uses, input->Uses);
+		slot->LastUsed = tpm_cr50_timestamp();
+
+		if (slot->Stale || (input->Flags & CR50_SESSION_GONE)) {
+			slot->State = Cr50SessionFree;
+			slot->Owner = NULL;
+		}
+		else if ((input->Flags & CR50_SESSION_DISCARD) || slot->Uses >= pDevice->SessionMaxUses) {
+			if (!(input->Flags & CR50_SESSION_DISCARD))
+				pDevice->SessionsRefreshed++;
+			slot->State = Cr50SessionFlush;
+			slot->Owner = NULL;
+		}
+		else {
+			RtlCopyMemory(slot->NonceTpm, input->NonceTpm, CR50_SESSION_NONCE_SIZE);
+			slot->State = Cr50SessionReady;
+		}
+
+		/* A freed slot may let a failed refill go through */
+		pDevice->SessionRefillFailed = FALSE;
+		status = STATUS_SUCCESS;
+		break;
+	}
+	WdfSpinLockRelease(pDevice->SessionLock);
+
+	if (NT_SUCCESS(status)) {
+		tpm_cr50_ring_kick(pDevice);
+	}
+	return status;
+}
+
+/* Called when a handle is cleaned up: what it holds is flushed */
+void tpm_cr50_session_close(PCR50_CONTEXT pDevice, WDFFILEOBJECT FileObject) {
+	PCR50_SESSION_SLOT slot;
+	BOOLEAN found = FALSE;
+
+	WdfSpinLockAcquire(pDevice->SessionLock);
+	for (ULONG i = 0; i < CR50_SESSION_SLOTS; i++) {
+		slot = &pDevice->Sessions[i];
+		if (slot->Owner != FileObject || slot->State == Cr50SessionFree)
+			continue;
+
+		slot->State = slot->Stale ? Cr50SessionFree : Cr50SessionFlush;
+		slot->Owner = NULL;
+		found = TRUE;
+	}
+	WdfSpinLockRelease(pDevice->SessionLock);
+
+	if (found) {
+		tpm_cr50_ring_kick(pDevice);
+	}
+}
+
+/*
+ * Called on D0 exit with the command lock held, before TPM2_Shutdown.
+ * Sends nothing: the sessions do not outlive the power transition, so
+ * the slots are only forgotten. Sessions handed out stay with their
+ * owner until released, marked as stale.
+ */
+void tpm_cr50_session_forget_all(PCR50_CONTEXT pDevice) {
+	PCR50_SESSION_SLOT slot;
+
+	WdfSpinLockAcquire(pDevice->SessionLock);
+	for (ULONG i = 0; i < CR50_SESSION_SLOTS; i++) {
+		slot = &pDevice->Sessions[i];
+
+		if (slot->State == Cr50SessionAcquired) {
+			slot->Stale = TRUE;
+		}
+		else {
+			slot->State = Cr50SessionFree;
+			slot->Owner = NULL;
+		}
+	}
+	WdfSpinLockRelease(pDevice->SessionLock);
+
+	pDevice->SessionRefillFailed = FALSE;
+}
+
+/* Whether the consumer has a session to flush or to start for the pool */
+BOOLEAN tpm_cr50_session_pending(PCR50_CONTEXT pDevice) {
+	ULONG pooled = 0, free = 0;
+
+	if (pDevice->RingStopping) {
+		return FALSE;
+	}
+
+	for (ULONG i = 0; i < CR50_SESSION_SLOTS; i++) {
+		PCR50_SESSION_SLOT slot = &pDevice->Sessions[i];
+
+		if (slot->State == Cr50SessionFlush)
+			return TRUE;
+		if (slot->State == Cr50SessionReady && !slot->Owner)
+			pooled++;
+		else if (slot->State == Cr50SessionFree)
+			free++;
+	}
+
+	return pDevice->PoweredOn && !pDevice->SessionRefillFailed &&
+		pooled < pDevice->SessionPool && free;
+}
+
+/*
+ * Called by the consumer between requests: flushes one session that was
+ * given up, or starts one for the pool.
+ */
+void tpm_cr50_session_run(PCR50_CONTEXT pDevice) {
+	PCR50_SESSION_SLOT slot = NULL;
+	NTSTATUS status;
+
+	if (!tpm_cr50_session_pending(pDevice)) {
+		return;
+	}
+
+	status = tpm_cr50_begin(pDevice);
+	if (!NT_SUCCESS(status)) {
+		/* The TPM is gone, and the sessions with it */
+		WdfSpinLockAcquire(pDevice->SessionLock);
+		for (ULONG i = 0; i < CR50_SESSION_SLOTS; i++) {
+			if (pDevice->Sessions[i].State == Cr50SessionFlush)
+				pDevice->Sessions[i].State = Cr50SessionFree;
+		}
+		pDevice->SessionRefillFailed = TRUE;
+		WdfSpinLockRelease(pDevice->SessionLock);
+		return;
+	}
+
+	tpm_cr50_select_locality(pDevice, 0);
+	pDevice->HoldLocality = FALSE;
+
+	WdfSpinLockAcquire(pDevice->SessionLock);
+	for (ULONG i = 0; i < CR50_SESSION_SLOTS; i++) {
+		if (pDevice->Sessions[i].State == Cr50SessionFlush) {
+			slot = &pDevice->Sessions[i];
+			break;
+		}
+	}
+	WdfSpinLockRelease(pDevice->SessionLock);
+
+	if (slot) {
+		tpm_cr50_session_flush_handle(pDevice, slot->Handle);
+
+		WdfSpinLockAcquire(pDevice->SessionLock);
+		slot->State = Cr50SessionFree;
+		WdfSpinLockRelease(pDevice->SessionLock);
+	}
+	else if (tpm_cr50_session_pending(pDevice)) {
+		/* Client sessions are not flushed to grow the pool */
+		status = tpm_cr50_session_start(pDevice, TPM2_SE_HMAC, NULL, FALSE, &slot);
+		if (!NT_SUCCESS(status)) {
+			Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+				"Session pool refill failed: 0x%x\n", status);
+			pDevice->SessionRefillFailed = TRUE;
+		}
+	}
+
+	tpm_cr50_end(pDevice);
+}
+
+void tpm_cr50_session_stats(PCR50_CONTEXT pDevice, PCR50_SESSION_STATS stats) {
+	PCR50_SESSION_SLOT slot;
+
+	RtlZeroMemory(stats, sizeof(*stats));
+
+	WdfSpinLockAcquire(pDevice->SessionLock);
+	for (ULONG i = 0; i < CR50_SESSION_SLOTS; i++) {
+		slot = &pDevice->Sessions[i];
+		if (slot->State == Cr50SessionReady && !slot->Owner)
+			stats->Pooled++;
+		else if (slot->State == Cr50SessionReady)
+			stats->Cached++;
+		else if (slot->State == Cr50SessionAcquired)
+			stats->Acquired++;
+	}
+	stats->PoolTarget = pDevice->SessionPool;
+	stats->Hits = pDevice->SessionHits;
+	stats->Misses = pDevice->SessionMisses;
+	stats->Started = pDevice->SessionsStarted;
+	stats->Flushed = pDevice->SessionsFlushed;
+	stats->Refreshed = pDevice->SessionsRefreshed;
+	stats->Evicted = pDevice->SessionsEvicted;
+	WdfSpinLockRelease(pDevice->SessionLock);
+}
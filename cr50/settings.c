@@ -0,0 +1,124 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+static ULONG Cr50QuerySetting(WDFKEY Key, PCWSTR Name, ULONG Default) {
+	UNICODE_STRING valueName;
+	ULONG value;
+
+	if (!Key) {
+		return Default;
+	}
+
+	RtlInitUnicodeString(&valueName, Name);
+	if (!NT_SUCCESS(WdfRegistryQueryULong(Key, &valueName, &value))) {
+		return Default;
+	}
+	return value;
+}
+
+/* A duration class override, kept within what a TPM can take to answer */
+static ULONG Cr50QueryDuration(WDFKEY Key, PCWSTR Name, ULONG Default) {
+	ULONG value = Cr50QuerySetting(Key, Name, Default);
+
+	return min(TPM2_DURATION_MAX_MS, max(TPM2_DURATION_MIN_MS, value));
+}
+
+/*
+ * Loads the tunables from the "Settings" subkey of the device's hardware
+ * key (see Cr50_AddReg in cr50.inf). Missing values keep their defaults.
+ */
+void Cr50LoadSettings(
+	_In_  PCR50_CONTEXT  pDevice
+	)
+{
+	DECLARE_CONST_UNICODE_STRING(settingsName, L"Settings");
+	WDFKEY hwKey = NULL;
+	WDFKEY settingsKey = NULL;
+	NTSTATUS status;
+
+	status = WdfDeviceOpenRegistryKey(pDevice->FxDevice,
+		PLUGPLAY_REGKEY_DEVICE,
+		KEY_READ,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&hwKey);
+	if (NT_SUCCESS(status)) {
+		status = WdfRegistryOpenKey(hwKey,
+			&settingsName,
+			KEY_READ,
+			WDF_NO_OBJECT_ATTRIBUTES,
+			&settingsKey);
+		if (!NT_SUCCESS(status)) {
+			settingsKey = NULL;
+		}
+	}
+	else {
+		Cr50Print(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"Could not open device registry key 0x%x\n", status);
+		hwKey = NULL;
+	}
+
+	pDevice->Durations[TPM2_DURATION_SHORT] =
+		Cr50QueryDuration(settingsKey, L"DurationShortMs", TPM2_DURATION_SHORT_MS);
+	pDevice->Durations[TPM2_DURATION_MEDIUM] =
+		Cr50QueryDuration(settingsKey, L"DurationMediumMs", TPM2_DURATION_MEDIUM_MS);
+	pDevice->Durations[TPM2_DURATION_LONG] =
+		Cr50QueryDuration(settingsKey, L"DurationLongMs", TPM2_DURATION_LONG_MS);
+	pDevice->Durations[TPM2_DURATION_LONG_LONG] =
+		Cr50QueryDuration(settingsKey, L"DurationLongLongMs", TPM2_DURATION_LONG_LONG_MS);
+
+	pDevice->ShutdownTimeout =
+		Cr50QuerySetting(settingsKey, L"ShutdownTimeoutMs", CR50_SHUTDOWN_TIMEOUT_MS);
+
+	pDevice->IdleTimeout =
+		Cr50QuerySetting(settingsKey, L"IdleTimeoutMs", CR50_IDLE_TIMEOUT_MS);
+	pDevice->IdleHoldMax =
+		Cr50QuerySetting(settingsKey, L"IdleHoldMaxMs", CR50_IDLE_HOLD_MAX_MS);
+
+	pDevice->BusMaxTransfer =
+		Cr50QuerySetting(settingsKey, L"BusMaxTransfer", 0);
+
+	pDevice->HealthEnabled =
+		Cr50QuerySetting(settingsKey, L"BusHealth", 1) != 0;
+
+	pDevice->TisIrqAllowed =
+		Cr50QuerySetting(settingsKey, L"TisInterrupts", 1) != 0;
+
+	pDevice->PredictEnabled =
+		Cr50QuerySetting(settingsKey, L"PredictiveWait", 1) != 0;
+
+	pDevice->QuoteWindow = min(CR50_QUOTE_WINDOW_MAX_MS,
+		Cr50QuerySetting(settingsKey, L"QuoteWindowMs", CR50_QUOTE_WINDOW_MS));
+
+	pDevice->SessionPool = min(CR50_SESSION_SLOTS,
+		Cr50QuerySetting(settingsKey, L"SessionPool", CR50_SESSION_POOL));
+
+	pDevice->SessionMaxUses = max(1,
+		Cr50QuerySetting(settingsKey, L"SessionMaxUses", CR50_SESSION_MAX_USES));
+
+	pDevice->KeyCacheEntries = min(CR50_KEY_ENTRIES,
+		Cr50QuerySetting(settingsKey, L"KeyCacheEntries", CR50_KEY_CACHE));
+
+	pDevice->KeygenDepth = min(CR50_KEYGEN_MAX_DEPTH,
+		Cr50QuerySetting(settingsKey, L"KeyPoolDepth", 0));
+
+	pDevice->KeygenQuietMs =
+		Cr50QuerySetting(settingsKey, L"KeyPoolQuietMs", CR50_KEYGEN_QUIET_MS);
+
+	pDevice->NvCacheBudget =
+		Cr50QuerySetting(settingsKey, L"NvCacheBytes", CR50_NV_DEFAULT_BYTES);
+
+	pDevice->TraceEntries =
+		Cr50QuerySetting(settingsKey, L"TraceEntries", CR50_TRACE_DEFAULT_ENTRIES);
+
+	pDevice->TracePayload =
+		Cr50QuerySetting(settingsKey, L"TracePayload", 0) != 0;
+
+	if (settingsKey) {
+		WdfRegistryClose(settingsKey);
+	}
+	if (hwKey) {
+		WdfRegistryClose(hwKey);
+	}
+}
@@ -0,0 +1,345 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+//
+// Submission and completion rings in memory shared with one client.
+//
+// The client allocates the rings and an arena for the commands and
+// responses, and registers them with a request that stays pending, so
+// the pages stay locked and mapped into system space until the request
+// is cancelled. The consumer thread reads commands from the arena and
+// writes the responses back in place: a command costs no request and no
+// copy, only a doorbell when the client has queued new work.
+//
+// The ring indexes the driver owns are kept in the device context and
+// only published to the client, and every entry is copied and checked
+// against the arena before it is used. The registration can be
+// cancelled at any time; while the consumer is working on the ring the
+// cancellation is left for the consumer to finish.
+//
+
+static void tpm_cr50_shared_wake(PCR50_CONTEXT pDevice, NTSTATUS status) {
+	WDFREQUEST request;
+
+	while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(pDevice->SharedWaitQueue, &request))) {
+		WdfRequestComplete(request, status);
+	}
+}
+
+/* Called with SharedLock held */
+static WDFREQUEST tpm_cr50_shared_clear(PCR50_CONTEXT pDevice) {
+	WDFREQUEST request = pDevice->SharedRequest;
+
+	pDevice->SharedRequest = NULL;
+	pDevice->SharedClosing = FALSE;
+	pDevice->Shared = NULL;
+	pDevice->SharedSq = NULL;
+	pDevice->SharedCq = NULL;
+	pDevice->SharedArena = NULL;
+	return request;
+}
+
+static void tpm_cr50_shared_closed(PCR50_CONTEXT pDevice, WDFREQUEST request) {
+	WdfRequestComplete(request, STATUS_CANCELLED);
+	tpm_cr50_shared_wake(pDevice, STATUS_CANCELLED);
+}
+
+static VOID Cr50EvtSharedCanceled(WDFQUEUE Queue, WDFREQUEST Request) {
+	PCR50_CONTEXT pDevice = GetDeviceContext(WdfIoQueueGetDevice(Queue));
+	BOOLEAN active;
+
+	WdfSpinLockAcquire(pDevice->SharedLock);
+	active = pDevice->SharedActive;
+	if (active)
+		pDevice->SharedClosing = TRUE;
+	else
+		tpm_cr50_shared_clear(pDevice);
+	WdfSpinLockRelease(pDevice->SharedLock);
+
+	if (!active) {
+		tpm_cr50_shared_closed(pDevice, Request);
+	}
+}
+
+/* Called from EvtDeviceAdd */
+NTSTATUS tpm_cr50_shared_init(PCR50_CONTEXT pDevice) {
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDF_IO_QUEUE_CONFIG queueConfig;
+	NTSTATUS status;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = pDevice->FxDevice;
+
+	status = WdfSpinLockCreate(&attributes, &pDevice->SharedLock);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+	queueConfig.PowerManaged = WdfFalse;
+	queueConfig.EvtIoCanceledOnQueue = Cr50EvtSharedCanceled;
+
+	status = WdfIoQueueCreate(pDevice->FxDevice, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES,
+		&pDevice->SharedQueue);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+	queueConfig.PowerManaged = WdfFalse;
+
+	return WdfIoQueueCreate(pDevice->FxDevice, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES,
+		&pDevice->SharedWaitQueue);
+}
+
+/* IOCTL_CR50_SHARED_REGISTER. Returns STATUS_PENDING once the ring is in use. */
+NTSTATUS tpm_cr50_shared_register(PCR50_CONTEXT pDevice, WDFREQUEST Request) {
+	PCR50_SHARED_HEADER header;
+	WDFFILEOBJECT fileObject;
+	ULONG entries, arena;
+	size_t len;
+	NTSTATUS status;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*header), (PVOID*)&header, &len);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	entries = header->Entries;
+	arena = header->ArenaSize;
+	if (header->Magic != CR50_SHARED_MAGIC || header->Version != CR50_SHARED_VERSION ||
+		!entries || entries > CR50_SHARED_MAX_ENTRIES || (entries & (entries - 1)) ||
+		arena > CR50_SHARED_MAX_ARENA || len < CR50_SHARED_SIZE(entries, arena)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	fileObject = WdfRequestGetFileObject(Request);
+
+	WdfSpinLockAcquire(pDevice->SharedLock);
+	if (pDevice->SharedRequest) {
+		WdfSpinLockRelease(pDevice->SharedLock);
+		return STATUS_DEVICE_BUSY;
+	}
+
+	pDevice->SharedRequest = Request;
+	pDevice->Shared = header;
+	pDevice->SharedSq = (PCR50_SQ_ENTRY)(header + 1);
+	pDevice->SharedCq = (PCR50_CQ_ENTRY)(pDevice->SharedSq + entries);
+	pDevice->SharedArena = (UINT8*)(pDevice->SharedCq + entries);
+	pDevice->SharedEntries = entries;
+	pDevice->SharedArenaSize = arena;
+	pDevice->SharedSqHead = 0;
+	pDevice->SharedCqTail = 0;
+	pDevice->SharedLocality = fileObject ? GetFileContext(fileObject)->Locality : 0;
+	header->SqHead = 0;
+	header->CqTail = 0;
+	WdfSpinLockRelease(pDevice->SharedLock);
+
+	/* The cancel callback takes the lock, and may run from in here */
+	status = WdfRequestForwardToIoQueue(Request, pDevice->SharedQueue);
+	if (!NT_SUCCESS(status)) {
+		WdfSpinLockAcquire(pDevice->SharedLock);
+		tpm_cr50_shared_clear(pDevice);
+		WdfSpinLockRelease(pDevice->SharedLock);
+		return status;
+	}
+
+	Cr50Print(DEBUG_LEVEL_INFO, DBG_IOCTL,
+		"Shared ring registered, %d entries, %d byte arena\n", entries, arena);
+	return STATUS_PENDING;
+}
+
+static BOOLEAN tpm_cr50_shared_completed(PCR50_CONTEXT pDevice) {
+	BOOLEAN completed;
+
+	WdfSpinLockAcquire(pDevice->SharedLock);
+	completed = pDevice->Shared && pDevice->Shared->CqHead != ReadAcquire(&pDevice->SharedCqTail);
+	WdfSpinLockRelease(pDevice->SharedLock);
+	return completed;
+}
+
+static BOOLEAN tpm_cr50_shared_registered(PCR50_CONTEXT pDevice) {
+	BOOLEAN registered;
+
+	WdfSpinLockAcquire(pDevice->SharedLock);
+	registered = pDevice->SharedRequest && !pDevice->SharedClosing;
+	WdfSpinLockRelease(pDevice->SharedLock);
+	return registered;
+}
+
+/* IOCTL_CR50_SHARED_DOORBELL. Returns STATUS_PENDING for a waiting doorbell. */
+NTSTATUS tpm_cr50_shared_doorbell(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	size_t InputBufferLength) {
+	PCR50_DOORBELL input;
+	ULONG flags = 0;
+	NTSTATUS status;
+
+	if (InputBufferLength) {
+		status = WdfRequestRetrieveInputBuffer(Request, sizeof(*input), (PVOID*)&input, NULL);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+		flags = input->Flags;
+	}
+
+	if (!tpm_cr50_shared_registered(pDevice)) {
+		return STATUS_INVALID_DEVICE_STATE;
+	}
+
+	InterlockedIncrement64((LONG64*)&pDevice->SharedDoorbells);
+	InterlockedExchange(&pDevice->SharedPending, 1);
+	tpm_cr50_ring_kick(pDevice);
+
+	if (!(flags & CR50_DOORBELL_WAIT)) {
+		return STATUS_SUCCESS;
+	}
+
+	status = WdfRequestForwardToIoQueue(Request, pDevice->SharedWaitQueue);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/* The consumer may have published before the request was queued */
+	if (!tpm_cr50_shared_registered(pDevice)) {
+		tpm_cr50_shared_wake(pDevice, STATUS_CANCELLED);
+	}
+	else if (tpm_cr50_shared_completed(pDevice)) {
+		tpm_cr50_shared_wake(pDevice, STATUS_SUCCESS);
+	}
+	return STATUS_PENDING;
+}
+
+BOOLEAN tpm_cr50_shared_pending(PCR50_CONTEXT pDevice) {
+	return ReadAcquire(&pDevice->SharedPending) != 0;
+}
+
+/* Sends the command of a submission entry that was copied out of the ring */
+static NTSTATUS tpm_cr50_shared_send(PCR50_CONTEXT pDevice, PCR50_SQ_ENTRY e, ULONG* length) {
+	size_t rsp_len;
+	UINT8* rsp;
+	NTSTATUS status;
+
+	/* Both ranges are within the arena, so the sums cannot overflow */
+	if (e->CommandLength < TPM_HEADER_SIZE || e->CommandLength > CR50_MAX_COMMAND_SIZE ||
+		e->ResponseLength < TPM_HEADER_SIZE ||
+		(ULONG64)e->CommandOffset + e->CommandLength > pDevice->SharedArenaSize ||
+		(ULONG64)e->ResponseOffset + e->ResponseLength > pDevice->SharedArenaSize ||
+		(e->CommandOffset < e->ResponseOffset + e->ResponseLength &&
+		e->ResponseOffset < e->CommandOffset + e->CommandLength)) {
+		pDevice->SharedInvalid++;
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	/*
+	 * The client can rewrite the arena at any time, and the NV cache
+	 * acts on what it reads from the command and the response, so both
+	 * go through driver buffers.
+	 */
+	rsp = pDevice->InternalResponse;
+	rsp_len = min(e->ResponseLength, CR50_MAX_COMMAND_SIZE);
+	RtlCopyMemory(pDevice->CommandBuffer, pDevice->SharedArena + e->CommandOffset,
+		e->CommandLength);
+
+	pDevice->LocalityCommands[pDevice->SharedLocality]++;
+	status = tpm_cr50_transmit_retry(pDevice, pDevice->CommandBuffer, e->CommandLength,
+		rsp, rsp_len, 0);
+	if (NT_SUCCESS(status)) {
+		*length = min(RtlUlongByteSwap(*((UINT32*)(rsp + 2))), rsp_len);
+		RtlCopyMemory(pDevice->SharedArena + e->ResponseOffset, rsp, *length);
+	}
+	return status;
+}
+
+/*
+ * Called by the consumer after a doorbell. Sends what was submitted, at
+ * most one lap of the ring per call so queued requests get their turn,
+ * under one power reference and without giving up the locality or
+ * letting an SPI TPM fall asleep in between, like a batch.
+ */
+void tpm_cr50_shared_run(PCR50_CONTEXT pDevice) {
+	PCR50_SHARED_HEADER header;
+	WDFREQUEST closed = NULL;
+	ULONG mask, done = 0;
+	LONG tail;
+
+	if (!InterlockedExchange(&pDevice->SharedPending, 0)) {
+		return;
+	}
+
+	WdfSpinLockAcquire(pDevice->SharedLock);
+	if (!pDevice->SharedRequest || pDevice->SharedClosing) {
+		WdfSpinLockRelease(pDevice->SharedLock);
+		return;
+	}
+	pDevice->SharedActive = TRUE;
+	WdfSpinLockRelease(pDevice->SharedLock);
+
+	header = pDevice->Shared;
+	mask = pDevice->SharedEntries - 1;
+	tail = ReadAcquire(&header->SqTail);
+
+	if (tail != pDevice->SharedSqHead && !pDevice->RingStopping) {
+		tpm_cr50_idle_arrival(pDevice, tpm_cr50_timestamp());
+
+		if (NT_SUCCESS(tpm_cr50_begin(pDevice))) {
+			tpm_cr50_select_locality(pDevice, pDevice->SharedLocality);
+			pDevice->BusHeld = TRUE;
+			pDevice->HoldLocality = TRUE;
+
+			while (pDevice->SharedSqHead != tail && done < pDevice->SharedEntries) {
+				CR50_SQ_ENTRY e;
+				PCR50_CQ_ENTRY c;
+				ULONG length = 0;
+				NTSTATUS status;
+
+				if ((ULONG)(pDevice->SharedCqTail - ReadAcquire(&header->CqHead)) >=
+					pDevice->SharedEntries) {
+					pDevice->SharedCompletionsFull++;
+					break;
+				}
+
+				e = pDevice->SharedSq[pDevice->SharedSqHead & mask];
+				status = tpm_cr50_shared_send(pDevice, &e, &length);
+
+				c = &pDevice->SharedCq[pDevice->SharedCqTail & mask];
+				c->Tag = e.Tag;
+				c->Status = status;
+				c->ResponseLength = length;
+				c->Reserved = 0;
+
+				InterlockedExchange(&header->SqHead, ++pDevice->SharedSqHead);
+				InterlockedExchange(&header->CqTail, ++pDevice->SharedCqTail);
+				done++;
+
+				if (pDevice->SharedSqHead == tail)
+					tail = ReadAcquire(&header->SqTail);
+			}
+
+			pDevice->BusHeld = FALSE;
+			pDevice->HoldLocality = FALSE;
+			tpm_cr50_release_locality(pDevice, FALSE);
+			pDevice->SharedCommands += done;
+
+			tpm_cr50_end(pDevice);
+		}
+	}
+
+	if (done == pDevice->SharedEntries) {
+		InterlockedExchange(&pDevice->SharedPending, 1);
+	}
+
+	WdfSpinLockAcquire(pDevice->SharedLock);
+	pDevice->SharedActive = FALSE;
+	if (pDevice->SharedClosing)
+		closed = tpm_cr50_shared_clear(pDevice);
+	WdfSpinLockRelease(pDevice->SharedLock);
+
+	if (done) {
+		tpm_cr50_shared_wake(pDevice, STATUS_SUCCESS);
+	}
+	if (closed) {
+		tpm_cr50_shared_closed(pDevice, closed);
+	}
+}
@@ -3,34 +3,76 @@
 static ULONG Cr50DebugLevel = 100;
 static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
 
+//
+// TIS interrupts.
+//
+// When the TPM reports edge interrupts in TPM_INTF_CAPS that match the
+// platform's interrupt line, dataAvail, stsValid, commandReady and
+// localityChange are enabled, and waits for those conditions sleep on
+// TisEvent instead of polling TPM_STS every couple of milliseconds. The
+// ISR cannot read TPM_INT_STATUS itself: the consumer may hold the SPI
+// controller locked in the middle of a transfer. It only sets the event,
+// and the woken waiter acknowledges INT_STATUS on the bus it owns. The
+// waits still time out after TPM_CR50_TIMEOUT_NOIRQ_MS, so a lost
+// interrupt costs latency, never a command.
+//
+
 typedef struct {
 	UINT8 body[4];
 } spi_frame_header;
 
-static NTSTATUS spi_transaction(
-	_In_  PCR50_CONTEXT  pDevice,
-	_In_  BOOLEAN readWrite,
-	_In_  size_t bytes,
-	_In_  UINT32 addr
+/*
+ * Starts a transaction, which may chain several frames. The TPM is
+ * woken first unless the bus was just in use.
+ */
+static NTSTATUS spi_wake(
+	_In_  PCR50_CONTEXT  pDevice
 ) {
 	NTSTATUS status;
-	spi_frame_header header = { 0 };
 
-	status = SpbLockController(&pDevice->SPIContext);
-	if (!NT_SUCCESS(status)) {
-		return status;
+	tpm_cr50_stats_bus(pDevice);
+
+	/*
+	 * Wake the TPM with a short chip select pulse. Inside a batch the
+	 * previous transfer was just now, so it cannot have fallen asleep.
+	 */
+	if (pDevice->BusHeld) {
+		pDevice->WakesSaved++;
 	}
+	else {
+		status = SpbLockController(&pDevice->SPIContext);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
 
-	SpbWriteDataSynchronously(&pDevice->SPIContext, NULL, 0);
+		SpbWriteDataSynchronously(&pDevice->SPIContext, NULL, 0);
 
-	LARGE_INTEGER Interval;
-	Interval.QuadPart = -10 * (LONGLONG)1;
-	KeDelayExecutionThread(KernelMode, FALSE, &Interval);
+		LARGE_INTEGER Interval;
+		Interval.QuadPart = -10 * (LONGLONG)1;
+		KeDelayExecutionThread(KernelMode, FALSE, &Interval);
 
-	SpbUnlockController(&pDevice->SPIContext);
+		SpbUnlockController(&pDevice->SPIContext);
 
-	Interval.QuadPart = -10 * (LONGLONG)100;
-	KeDelayExecutionThread(KernelMode, FALSE, &Interval);
+		Interval.QuadPart = -10 * (LONGLONG)pDevice->Timing->WakeUs;
+		KeDelayExecutionThread(KernelMode, FALSE, &Interval);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+/*
+ * Starts one frame of up to TPM_CR50_SPI_MAX_FRAME bytes: selects the
+ * TPM, sends the header and waits out its flow control. On success the
+ * controller stays locked, keeping the TPM selected for the data.
+ */
+static NTSTATUS spi_frame(
+	_In_  PCR50_CONTEXT  pDevice,
+	_In_  BOOLEAN readWrite,
+	_In_  size_t bytes,
+	_In_  UINT32 addr
+) {
+	NTSTATUS status;
+	spi_frame_header header = { 0 };
 
 	status = SpbLockController(&pDevice->SPIContext);
 	if (!NT_SUCCESS(status)) {
@@ -74,18 +116,73 @@ static NTSTATUS spi_transaction(
 	return STATUS_SUCCESS;
 }
 
-NTSTATUS tpm2_write_reg_spi(
+/*
+ * Moves @bytes to or from one register. Longer transfers, of the data
+ * FIFO, are split into back to back frames without waking the TPM
+ * again. The controller is locked for one frame at a time, not for the
+ * whole transfer: while locked the TPM stays selected, and it only ends
+ * a frame when it is deselected. Other devices on the controller may
+ * use the bus between frames; each frame carries the register address,
+ * so the FIFO carries on where the previous one stopped. A frame whose
+ * header or flow control failed moved no data, so the timing tier may
+ * have it tried again.
+ */
+static NTSTATUS spi_transaction(
 	_In_  PCR50_CONTEXT  pDevice,
-	_In_  UINT32 regNumber,
-	_In_  UINT8* buffer,
+	_In_  BOOLEAN readWrite,
+	_In_  UINT32 addr,
+	_Inout_  UINT8* buffer,
 	_In_  size_t bytes
 ) {
-	NTSTATUS status = spi_transaction(pDevice, FALSE, bytes, regNumber);
+	NTSTATUS status;
+	size_t done, chunk;
+	LONGLONG start;
+	ULONG attempt;
+
+	status = spi_wake(pDevice);
 	if (!NT_SUCCESS(status)) {
 		return status;
 	}
-	status = SpbWriteDataSynchronously(&pDevice->SPIContext, buffer, bytes);
-	SpbUnlockController(&pDevice->SPIContext);
+
+	for (done = 0; done < bytes; done += chunk) {
+		chunk = min(bytes - done, TPM_CR50_SPI_MAX_FRAME);
+
+		attempt = 0;
+		do {
+			start = tpm_cr50_timestamp();
+			status = spi_frame(pDevice, readWrite, chunk, addr);
+			if (!NT_SUCCESS(status)) {
+				tpm_cr50_health_transfer(pDevice, chunk, status, start);
+			}
+		} while (tpm_cr50_health_retry(pDevice, status, attempt++));
+		if (!NT_SUCCESS(status)) {
+			break;
+		}
+
+		if (readWrite)
+			status = SpbReadDataSynchronously(&pDevice->SPIContext, buffer + done, chunk);
+		else
+			status = SpbWriteDataSynchronously(&pDevice->SPIContext, buffer + done, chunk);
+		SpbUnlockController(&pDevice->SPIContext);
+		tpm_cr50_health_transfer(pDevice, chunk, status, start);
+		if (!NT_SUCCESS(status)) {
+			break;
+		}
+	}
+	return status;
+}
+
+NTSTATUS tpm2_write_reg_spi(
+	_In_  PCR50_CONTEXT  pDevice,
+	_In_  UINT32 regNumber,
+	_In_  UINT8* buffer,
+	_In_  size_t bytes
+) {
+	LONGLONG start = tpm_cr50_timestamp();
+
+	NTSTATUS status = spi_transaction(pDevice, FALSE, regNumber, buffer, bytes);
+
+	tpm_cr50_trace(pDevice, Cr50TraceWrite, regNumber, buffer, bytes, status, start);
 	return status;
 }
 
@@ -95,20 +192,138 @@ NTSTATUS tpm2_read_reg_spi(
 	_Out_  UINT8* buffer,
 	_In_  size_t bytes
 ) {
-	NTSTATUS status = spi_transaction(pDevice, TRUE, bytes, regNumber);
-	if (!NT_SUCCESS(status)) {
-		return status;
-	}
-	status = SpbReadDataSynchronously(&pDevice->SPIContext, buffer, bytes);
-	SpbUnlockController(&pDevice->SPIContext);
+	LONGLONG start = tpm_cr50_timestamp();
+
+	NTSTATUS status = spi_transaction(pDevice, TRUE, regNumber, buffer, bytes);
+
+	tpm_cr50_trace(pDevice, Cr50TraceRead, regNumber, buffer, bytes, status, start);
 	return status;
 }
 
+/* TPM_INT_STATUS bits that report the TPM_STS bits in @sts */
+static UINT32 tpm_cr50_spi_irq_bits(UINT8 sts) {
+	UINT32 bits = 0;
+
+	if (sts & TPM_STS_DATA_AVAIL)
+		bits |= TPM_INTF_DATA_AVAIL_INT;
+	if (sts & (TPM_STS_VALID | TPM_STS_DATA_EXPECT))
+		bits |= TPM_INTF_STS_VALID_INT;
+	if (sts & TPM_STS_COMMAND_READY)
+		bits |= TPM_INTF_CMD_READY_INT;
+	return bits;
+}
+
+/*
+ * Sleeps until the TPM raises one of @bits, acknowledging what it
+ * raised, or for @us if those interrupts are not enabled. The caller
+ * reads the register it waits for again either way.
+ */
+static void tpm_cr50_spi_irq_wait(PCR50_CONTEXT pDevice, UINT32 bits, ULONG us) {
+	UINT32 reg = TPM_INT_STATUS(pDevice->Locality);
+	LARGE_INTEGER timeout;
+	UINT32 irq = 0;
+
+	if (!bits || (pDevice->TisIrqEnable & bits) != bits ||
+		!(pDevice->TisIrqLocalities & (1 << pDevice->Locality))) {
+		timeout.QuadPart = -10 * (LONGLONG)us;
+		KeDelayExecutionThread(KernelMode, FALSE, &timeout);
+		return;
+	}
+
+	timeout.QuadPart = -10 * 1000 * (LONGLONG)TPM_CR50_TIMEOUT_NOIRQ_MS;
+	if (KeWaitForSingleObject(&pDevice->TisEvent, Executive, KernelMode, FALSE,
+		&timeout) == STATUS_TIMEOUT) {
+		pDevice->TisFallbacks++;
+		return;
+	}
+	pDevice->TisWakes++;
+
+	/* Writing the raised bits back clears them and releases the line */
+	if (NT_SUCCESS(tpm2_read_reg_spi(pDevice, reg, (UINT8*)&irq, sizeof(irq))) && irq) {
+		tpm2_write_reg_spi(pDevice, reg, (UINT8*)&irq, sizeof(irq));
+	}
+}
+
+/* Enables the interrupts in the locality that was just granted */
+static void tpm_cr50_spi_irq_enable(PCR50_CONTEXT pDevice) {
+	UINT8 locality = pDevice->Locality;
+	UINT32 enable = pDevice->TisIrqEnable;
+	UINT32 irq = 0;
+
+	if (!enable || (pDevice->TisIrqLocalities & (1 << locality))) {
+		return;
+	}
+
+	if (!NT_SUCCESS(tpm2_write_reg_spi(pDevice, TPM_INT_ENABLE(locality),
+		(UINT8*)&enable, sizeof(enable)))) {
+		return;
+	}
+
+	/* Drop whatever was raised before the driver was listening */
+	if (NT_SUCCESS(tpm2_read_reg_spi(pDevice, TPM_INT_STATUS(locality),
+		(UINT8*)&irq, sizeof(irq))) && irq) {
+		tpm2_write_reg_spi(pDevice, TPM_INT_STATUS(locality), (UINT8*)&irq, sizeof(irq));
+	}
+	pDevice->TisIrqLocalities |= 1 << locality;
+}
+
+/*
+ * Picks the interrupts to use from TPM_INTF_CAPS, once per probe. They
+ * are written to TPM_INT_ENABLE as each locality is granted.
+ */
+void tpm_cr50_spi_irq_init(PCR50_CONTEXT pDevice) {
+	UINT32 caps = 0, type;
+
+	pDevice->TisIrqCaps = 0;
+	pDevice->TisIrqEnable = 0;
+	pDevice->TisIrqLocalities = 0;
+
+	if (!pDevice->TisIrqAllowed || !pDevice->InterruptFound) {
+		return;
+	}
+
+	if (!NT_SUCCESS(tpm2_read_reg_spi(pDevice, TPM_INTF_CAPS(pDevice->Locality),
+		(UINT8*)&caps, sizeof(caps)))) {
+		return;
+	}
+	pDevice->TisIrqCaps = caps;
+
+	/*
+	 * The ISR leaves the acknowledgement to the waiter, so a level
+	 * triggered line would keep firing until then. Only edges are used.
+	 */
+	if (!(pDevice->InterruptFlags & CM_RESOURCE_INTERRUPT_LATCHED)) {
+		type = 0;
+	}
+	else if ((pDevice->InterruptFlags & CM_RESOURCE_INTERRUPT_POLARITY_MASK) ==
+		CM_RESOURCE_INTERRUPT_ACTIVE_LOW) {
+		type = (caps & TPM_INTF_INT_EDGE_FALLING) ? TPM_INT_EDGE_FALLING : 0;
+	}
+	else {
+		type = (caps & TPM_INTF_INT_EDGE_RISING) ? TPM_INT_EDGE_RISING : 0;
+	}
+
+	if (!type || !(caps & TPM_INTF_DATA_AVAIL_INT)) {
+		Cr50Print(DEBUG_LEVEL_INFO, DBG_PNP,
+			"TIS interrupts not usable (caps 0x%x, line 0x%x), polling\n",
+			caps, pDevice->InterruptFlags);
+		return;
+	}
+
+	pDevice->TisIrqEnable = TPM_GLOBAL_INT_ENABLE | type | (caps &
+		(TPM_INTF_DATA_AVAIL_INT | TPM_INTF_STS_VALID_INT |
+		TPM_INTF_LOCALITY_CHANGE_INT | TPM_INTF_CMD_READY_INT));
+}
+
+void tpm_cr50_spi_tis_wait(PCR50_CONTEXT pDevice, UINT8 sts, ULONG us) {
+	tpm_cr50_spi_irq_wait(pDevice, tpm_cr50_spi_irq_bits(sts), us);
+}
+
 static NTSTATUS tpm2_read_access_reg_spi(
 	_In_  PCR50_CONTEXT  pDevice,
 	UINT8* access
 ) {
-	return tpm2_read_reg_spi(pDevice, TPM_ACCESS(0), access, sizeof(*access));
+	return tpm2_read_reg_spi(pDevice, TPM_ACCESS(pDevice->Locality), access, sizeof(*access));
 }
 
 static NTSTATUS tpm2_write_access_reg_spi(
@@ -116,7 +331,7 @@ static NTSTATUS tpm2_write_access_reg_spi(
 	UINT8 cmd
 )
 {
-	return tpm2_write_reg_spi(pDevice, TPM_ACCESS(0), &cmd, sizeof(cmd));
+	return tpm2_write_reg_spi(pDevice, TPM_ACCESS(pDevice->Locality), &cmd, sizeof(cmd));
 }
 
 static NTSTATUS tpm_cr50_check_locality(PCR50_CONTEXT pDevice) {
@@ -156,6 +371,7 @@ NTSTATUS tpm_cr50_spi_request_locality(PCR50_CONTEXT pDevice) {
 
 	NTSTATUS status = tpm_cr50_check_locality(pDevice);
 	if (NT_SUCCESS(status)) {
+		tpm_cr50_spi_irq_enable(pDevice);
 		return status;
 	}
 
@@ -164,16 +380,15 @@ NTSTATUS tpm_cr50_spi_request_locality(PCR50_CONTEXT pDevice) {
 		return status;
 	}
 
-	LARGE_INTEGER WaitInterval;
-	WaitInterval.QuadPart = -10 * 1000 * TPM_CR50_TIMEOUT_SHORT_MS;
-
 	for (int i = 0; i < 3; i++) {
 		status = tpm_cr50_check_locality(pDevice);
 		if (NT_SUCCESS(status)) {
+			tpm_cr50_spi_irq_enable(pDevice);
 			return status;
 		}
 
-		KeDelayExecutionThread(KernelMode, FALSE, &WaitInterval);
+		tpm_cr50_spi_irq_wait(pDevice, TPM_INTF_LOCALITY_CHANGE_INT,
+			pDevice->Timing->PollUs);
 	}
 	Cr50Print(DEBUG_LEVEL_ERROR, DBG_IOCTL,
 		"Setting locality timed out 0x%x\n", status);
@@ -181,21 +396,18 @@ NTSTATUS tpm_cr50_spi_request_locality(PCR50_CONTEXT pDevice) {
 }
 
 NTSTATUS tpm_cr50_spi_tis_status(PCR50_CONTEXT pDevice, UINT8* buf, size_t sz) {
-	return tpm2_read_reg_spi(pDevice, TPM_STS(0), buf, sz);
+	return tpm2_read_reg_spi(pDevice, TPM_STS(pDevice->Locality), buf, sz);
 }
 
 NTSTATUS tpm_cr50_spi_tis_status_write(PCR50_CONTEXT pDevice, UINT8* buf, size_t sz) {
-	return tpm2_write_reg_spi(pDevice, TPM_STS(0), buf, sz);
+	return tpm2_write_reg_spi(pDevice, TPM_STS(pDevice->Locality), buf, sz);
 }
 
 void tpm_cr50_spi_tis_set_ready(PCR50_CONTEXT pDevice)
 {
 	UINT8 buf[4] = { TPM_STS_COMMAND_READY };
 
-	tpm2_write_reg_spi(pDevice, TPM_STS(0), buf, sizeof(buf));
-
-	LARGE_INTEGER WaitInterval;
-	WaitInterval.QuadPart = -10 * 1000 * TPM_CR50_TIMEOUT_SHORT_MS;
+	tpm2_write_reg_spi(pDevice, TPM_STS(pDevice->Locality), buf, sizeof(buf));
 
-	KeDelayExecutionThread(KernelMode, FALSE, &WaitInterval);
+	tpm_cr50_spi_irq_wait(pDevice, TPM_INTF_CMD_READY_INT, pDevice->Timing->PollUs);
 }
\ No newline at end of file
@@ -0,0 +1,393 @@
+#include "driver.h"
+
+static ULONG Cr50DebugLevel = 100;
+static ULONG Cr50DebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
+
+static ULONG tpm_cr50_stats_slot(UINT32 ordinal) {
+	if (ordinal < TPM2_CC_FIRST || ordinal > TPM2_CC_LAST)
+		return 0;
+	return ordinal - TPM2_CC_FIRST + 1;
+}
+
+static ULONG tpm_cr50_stats_bucket(ULONG64 us) {
+	ULONG index;
+
+	if (us > MAXULONG)
+		us = MAXULONG;
+	if (!_BitScanReverse(&index, (ULONG)us))
+		return 0;
+	return min(index, CR50_HISTOGRAM_BUCKETS - 1);
+}
+
+NTSTATUS tpm_cr50_stats_init(PCR50_CONTEXT pDevice) {
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDFMEMORY memory;
+	NTSTATUS status;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = pDevice->FxDevice;
+
+	status = WdfMemoryCreate(&attributes,
+		NonPagedPoolNx,
+		CR50_POOL_TAG,
+		sizeof(CR50_COMMAND_STATS) * CR50_STATS_SLOTS,
+		&memory,
+		(PVOID*)&pDevice->CommandStats);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	RtlZeroMemory(pDevice->CommandStats, sizeof(CR50_COMMAND_STATS) * CR50_STATS_SLOTS);
+
+	LARGE_INTEGER CurrentTime;
+	KeQuerySystemTimePrecise(&CurrentTime);
+	pDevice->StatsResetTime = CurrentTime.QuadPart;
+	return status;
+}
+
+void tpm_cr50_stats_begin(PCR50_CONTEXT pDevice, UINT32 ordinal, LONGLONG queued) {
+	PCR50_INFLIGHT inflight = &pDevice->Inflight;
+	LARGE_INTEGER CurrentTime;
+
+	KeQuerySystemTimePrecise(&CurrentTime);
+
+	RtlZeroMemory(inflight, sizeof(*inflight));
+	inflight->Active = TRUE;
+	inflight->Ordinal = ordinal;
+	inflight->Stamp[Cr50PhaseQueue] = queued ? queued : CurrentTime.QuadPart;
+	inflight->Stamp[Cr50PhaseSend] = CurrentTime.QuadPart;
+}
+
+/* Marks the end of @phase for the command in flight */
+void tpm_cr50_stats_stamp(PCR50_CONTEXT pDevice, CR50_PHASE phase) {
+	LARGE_INTEGER CurrentTime;
+
+	KeQuerySystemTimePrecise(&CurrentTime);
+	pDevice->Inflight.Stamp[phase + 1] = CurrentTime.QuadPart;
+}
+
+void tpm_cr50_stats_bus(PCR50_CONTEXT pDevice) {
+	if (pDevice->Inflight.Active) {
+		pDevice->Inflight.BusTransactions++;
+	}
+	else {
+		InterlockedIncrement64(&pDevice->IdleBusTransactions);
+	}
+}
+
+void tpm_cr50_stats_end(PCR50_CONTEXT pDevice, NTSTATUS status) {
+	PCR50_INFLIGHT inflight = &pDevice->Inflight;
+	PCR50_COMMAND_STATS entry;
+	ULONG slot;
+
+	if (!inflight->Active || !pDevice->CommandStats) {
+		return;
+	}
+
+	tpm_cr50_stats_stamp(pDevice, Cr50PhaseReceive);
+	inflight->Active = FALSE;
+
+	slot = tpm_cr50_stats_slot(inflight->Ordinal);
+	entry = &pDevice->CommandStats[slot];
+
+	entry->CommandCode = slot ? inflight->Ordinal : 0;
+	InterlockedIncrement((LONG*)&entry->Count);
+	if (!NT_SUCCESS(status))
+		InterlockedIncrement((LONG*)&entry->Failures);
+	if (status == STATUS_TIMEOUT)
+		InterlockedIncrement((LONG*)&entry->Timeouts);
+
+	InterlockedAdd((LONG*)&entry->Retries, inflight->Retries);
+	InterlockedAdd((LONG*)&entry->StatusPolls, inflight->StatusPolls);
+	InterlockedAdd((LONG*)&entry->FifoBursts, inflight->FifoBursts);
+	InterlockedAdd((LONG*)&entry->BusTransactions, inflight->BusTransactions);
+	InterlockedAdd64((LONG64*)&entry->BytesSent, inflight->BytesSent);
+	InterlockedAdd64((LONG64*)&entry->BytesReceived, inflight->BytesReceived);
+
+	for (int phase = 0; phase < Cr50PhaseCount; phase++) {
+		/* Phases after a failure have no end stamp */
+		if (!inflight->Stamp[phase] || !inflight->Stamp[phase + 1] ||
+			inflight->Stamp[phase + 1] < inflight->Stamp[phase])
+			continue;
+
+		ULONG64 us = (inflight->Stamp[phase + 1] - inflight->Stamp[phase]) / 10;
+		InterlockedAdd64((LONG64*)&entry->TotalUs[phase], us);
+		InterlockedIncrement((LONG*)&entry->Histogram[phase][tpm_cr50_stats_bucket(us)]);
+	}
+}
+
+void tpm_cr50_stats_transition(PCR50_CONTEXT pDevice, CR50_TRANSITION transition,
+	WDF_POWER_DEVICE_STATE state, LONGLONG start, NTSTATUS status) {
+	PCR50_TRANSITION_STATS entry = &pDevice->Transitions[transition];
+	LONGLONG end = tpm_cr50_timestamp();
+	ULONG us = (ULONG)min((end - start) / 10, MAXULONG);
+
+	/* Power callbacks are serialized by the framework */
+	if (pDevice->PowerStateSince) {
+		if (transition == Cr50TransitionD0Entry)
+			pDevice->TimeInDx += start - pDevice->PowerStateSince;
+		else
+			pDevice->TimeInD0 += start - pDevice->PowerStateSince;
+	}
+	pDevice->PowerStateSince = start;
+	pDevice->PoweredOn = transition == Cr50TransitionD0Entry && NT_SUCCESS(status);
+
+	entry->Count++;
+	if (!NT_SUCCESS(status))
+		entry->Failures++;
+	entry->LastUs = us;
+	entry->MaxUs = max(entry->MaxUs, us);
+	entry->TotalUs += us;
+
+	tpm_cr50_trace(pDevice,
+		transition == Cr50TransitionD0Entry ? Cr50TraceD0Entry : Cr50TraceD0Exit,
+		(UINT32)state, NULL, 0, status, start);
+}
+
+NTSTATUS tpm_cr50_stats_query(PCR50_CONTEXT pDevice, WDFREQUEST Request,
+	size_t* bytesReturned) {
+	PCR50_STATS stats;
+	size_t outLen;
+	NTSTATUS status;
+	ULONG total = 0, returned = 0;
+
+	*bytesReturned = 0;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, FIELD_OFFSET(CR50_STATS, Commands),
+		(PVOID*)&stats, &outLen);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	LARGE_INTEGER CurrentTime;
+	KeQuerySystemTimePrecise(&CurrentTime);
+
+	for (ULONG slot = 0; slot < CR50_STATS_SLOTS; slot++) {
+		PCR50_COMMAND_STATS entry = &pDevice->CommandStats[slot];
+		if (!entry->Count)
+			continue;
+
+		total++;
+		if ((size_t)FIELD_OFFSET(CR50_STATS, Commands[returned + 1]) <= outLen) {
+			RtlCopyMemory(&stats->Commands[returned], entry, sizeof(*entry));
+			returned++;
+		}
+	}
+
+	stats->Version = CR50_STATS_VERSION;
+	stats->Size = FIELD_OFFSET(CR50_STATS, Commands[total]);
+	stats->Uptime100ns = CurrentTime.QuadPart - pDevice->StatsResetTime;
+	stats->IdleBusTransactions = pDevice->IdleBusTransactions;
+	RtlCopyMemory(stats->Transitions, pDevice->Transitions, sizeof(stats->Transitions));
+
+	stats->Power.TimeInD0 = pDevice->TimeInD0;
+	stats->Power.TimeInDx = pDevice->TimeInDx;
+	if (pDevice->PowerStateSince) {
+		if (pDevice->PoweredOn)
+			stats->Power.TimeInD0 += CurrentTime.QuadPart - pDevice->PowerStateSince;
+		else
+			stats->Power.TimeInDx += CurrentTime.QuadPart - pDevice->PowerStateSince;
+	}
+	stats->Power.IdleHolds = pDevice->IdleHolds;
+	stats->Power.IdleHoldMs = pDevice->IdleHoldWindow;
+	stats->Power.ArrivalGapMs = (ULONG)pDevice->ArrivalGap;
+	stats->Power.ArrivalJitterMs = (ULONG)pDevice->ArrivalJitter;
+	stats->Queue.Enqueued = pDevice->RingEnqueued;
+	stats->Queue.Rejected = pDevice->RingRejected;
+	stats->Queue.Contended = pDevice->RingContended;
+	stats->Queue.Capacity = CR50_RING_ENTRIES;
+	stats->Queue.MaxDepth = pDevice->RingMaxDepth;
+	RtlCopyMemory(stats->Queue.EnqueueHistogram, pDevice->RingHistogram,
+		sizeof(stats->Queue.EnqueueHistogram));
+	stats->Locality.HandshakesSaved = pDevice->HandshakesSaved;
+	RtlCopyMemory(stats->Locality.Commands, pDevice->LocalityCommands,
+		sizeof(stats->Locality.Commands));
+	RtlCopyMemory(stats->Locality.Switches, pDevice->LocalitySwitches,
+		sizeof(stats->Locality.Switches));
+	stats->Bus.Transport = pDevice->Transport;
+	stats->Bus.TransferMax = pDevice->BurstMax;
+	stats->Bus.BurstSeen = pDevice->BurstSeen;
+	stats->Batch.Batches = pDevice->Batches;
+	stats->Batch.Commands = pDevice->BatchCommands;
+	stats->Batch.Stopped = pDevice->BatchesStopped;
+	stats->Batch.TransitionsSaved = pDevice->BatchTransitionsSaved;
+	stats->Batch.WakesSaved = pDevice->WakesSaved;
+	stats->Shared.Registered = pDevice->SharedRequest != NULL;
+	stats->Shared.Entries = pDevice->SharedRequest ? pDevice->SharedEntries : 0;
+	stats->Shared.Doorbells = pDevice->SharedDoorbells;
+	stats->Shared.Commands = pDevice->SharedCommands;
+	stats->Shared.Invalid = pDevice->SharedInvalid;
+	stats->Shared.CompletionsFull = pDevice->SharedCompletionsFull;
+	stats->NvCache.Budget = pDevice->NvCacheBudget;
+	stats->NvCache.Bytes = pDevice->NvCacheBytes;
+	stats->NvCache.Entries = 0;
+	for (ULONG i = 0; i < CR50_NV_ENTRIES; i++) {
+		if (pDevice->NvCache[i].Index)
+			stats->NvCache.Entries++;
+	}
+	stats->NvCache.Reserved = 0;
+	stats->NvCache.Hits = pDevice->NvHits;
+	stats->NvCache.Misses = pDevice->NvMisses;
+	stats->NvCache.Invalidations = pDevice->NvInvalidations;
+	stats->NvCache.Evictions = pDevice->NvEvictions;
+	stats->NvWrite.Active = pDevice->NvWriteActive;
+	stats->NvWrite.Index = pDevice->NvWriteIndex;
+	stats->NvWrite.Written = pDevice->NvWriteWritten;
+	stats->NvWrite.Total = pDevice->NvWriteTotal;
+	stats->NvWrite.BufferMax = 0;
+	stats->NvWrite.CommandMax = 0;
+	tpm_cr50_caps_property(pDevice, TPM2_PT_NV_BUFFER_MAX, &stats->NvWrite.BufferMax);
+	tpm_cr50_caps_property(pDevice, TPM2_PT_MAX_COMMAND_SIZE, &stats->NvWrite.CommandMax);
+	stats->NvWrite.Writes = pDevice->NvWrites;
+	stats->NvWrite.Chunks = pDevice->NvWriteChunks;
+	stats->NvWrite.Failures = pDevice->NvWriteFailures;
+	stats->Caps.Source = pDevice->CapsSource;
+	stats->Caps.Properties = pDevice->Caps.PropertyCount;
+	stats->Caps.Algorithms = pDevice->Caps.AlgCount;
+	stats->Caps.Commands = pDevice->Caps.CommandCount;
+	stats->Caps.Firmware[0] = pDevice->Caps.Firmware[0];
+	stats->Caps.Firmware[1] = pDevice->Caps.Firmware[1];
+	stats->Caps.Hits = pDevice->CapsHits;
+	stats->Caps.Misses = pDevice->CapsMisses;
+	stats->Irq.Caps = pDevice->TisIrqCaps;
+	stats->Irq.Enable = pDevice->TisIrqEnable;
+	stats->Irq.Interrupts = pDevice->TisInterrupts;
+	stats->Irq.Wakes = pDevice->TisWakes;
+	stats->Irq.Fallbacks = pDevice->TisFallbacks;
+	stats->Predict.Classes = 0;
+	for (ULONG i = 0; i < CR50_PREDICT_ENTRIES; i++) {
+		if (pDevice->Predict[i].Samples >= CR50_PREDICT_MIN_SAMPLES)
+			stats->Predict.Classes++;
+	}
+	stats->Predict.SlackUs = (ULONG)(pDevice->PredictSlack / 10);
+	stats->Predict.Waits = pDevice->PredictWaits;
+	stats->Predict.Sleeps = pDevice->PredictSleeps;
+	stats->Predict.Polls = pDevice->PredictPolls;
+	stats->Predict.Wasted = pDevice->PredictWasted;
+	stats->Predict.Overslept = pDevice->PredictOverslept;
+	stats->Predict.DetectUs = pDevice->PredictDetectUs;
+	stats->Predict.Detected = pDevice->PredictDetected;
+	stats->Quote.WindowMs = pDevice->QuoteWindow;
+	stats->Quote.MaxBatch = pDevice->QuoteMaxBatch;
+	stats->Quote.Requests = pDevice->QuoteRequests;
+	stats->Quote.Quotes = pDevice->Quotes;
+	stats->Quote.Failures = pDevice->QuoteFailures;
+	stats->Quote.WaitUs = pDevice->QuoteWaitUs;
+	stats->Quote.LatencyUs = pDevice->QuoteLatencyUs;
+
+	tpm_cr50_session_stats(pDevice, &stats->Session);
+
+	stats->KeyCache.Capacity = pDevice->KeyCacheEntries;
+	stats->KeyCache.Entries = 0;
+	stats->KeyCache.Held = 0;
+	for (ULONG i = 0; i < CR50_KEY_ENTRIES; i++) {
+		if (pDevice->Keys[i].Valid)
+			stats->KeyCache.Entries++;
+		if (pDevice->Keys[i].Valid && pDevice->Keys[i].Users)
+			stats->KeyCache.Held++;
+	}
+	stats->KeyCache.Reserved = 0;
+	stats->KeyCache.Hits = pDevice->KeyHits;
+	stats->KeyCache.Misses = pDevice->KeyMisses;
+	stats->KeyCache.Stale = pDevice->KeyStale;
+	stats->KeyCache.Evictions = pDevice->KeyEvictions;
+	stats->KeyCache.FlushesAbsorbed = pDevice->KeyFlushesAbsorbed;
+
+	tpm_cr50_keygen_stats(pDevice, &stats->Keygen);
+	stats->CommandsReturned = returned;
+	stats->CommandsTotal = total;
+
+
+	*bytesReturned = FIELD_OFFSET(CR50_STATS, Commands[returned]);
+	return STATUS_SUCCESS;
+}
+
+/*
+ * Zeroes the counters. The command lock keeps the command path from
+ * folding a command into the table halfway through; counters updated
+ * without it, by the producers and the interrupt path, may still lose an
+ * increment racing with the reset, which is acceptable for statistics.
+ */
+NTSTATUS tpm_cr50_stats_reset(PCR50_CONTEXT pDevice) {
+	LARGE_INTEGER CurrentTime;
+
+	if (KeGetCurrentIrql() > PASSIVE_LEVEL) {
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
+
+	WdfWaitLockAcquire(pDevice->CommandLock, NULL);
+	KeQuerySystemTimePrecise(&CurrentTime);
+
+	RtlZeroMemory(pDevice->CommandStats, sizeof(CR50_COMMAND_STATS) * CR50_STATS_SLOTS);
+	InterlockedExchange64(&pDevice->IdleBusTransactions, 0);
+	RtlZeroMemory(pDevice->Transitions, sizeof(pDevice->Transitions));
+	pDevice->TimeInD0 = 0;
+	pDevice->TimeInDx = 0;
+	if (pDevice->PowerStateSince)
+		pDevice->PowerStateSince = CurrentTime.QuadPart;
+	pDevice->IdleHolds = 0;
+	InterlockedExchange64(&pDevice->RingEnqueued, 0);
+	InterlockedExchange64(&pDevice->RingRejected, 0);
+	InterlockedExchange64(&pDevice->RingContended, 0);
+	InterlockedExchange(&pDevice->RingMaxDepth, 0);
+	RtlZeroMemory(pDevice->RingHistogram, sizeof(pDevice->RingHistogram));
+	pDevice->HandshakesSaved = 0;
+	RtlZeroMemory(pDevice->LocalityCommands, sizeof(pDevice->LocalityCommands));
+	RtlZeroMemory(pDevice->LocalitySwitches, sizeof(pDevice->LocalitySwitches));
+	pDevice->Batches = 0;
+	pDevice->BatchCommands = 0;
+	pDevice->BatchesStopped = 0;
+	pDevice->BatchTransitionsSaved = 0;
+	pDevice->WakesSaved = 0;
+	pDevice->SharedDoorbells = 0;
+	pDevice->SharedCommands = 0;
+	pDevice->SharedInvalid = 0;
+	pDevice->SharedCompletionsFull = 0;
+	pDevice->NvHits = 0;
+	pDevice->NvMisses = 0;
+	pDevice->NvInvalidations = 0;
+	pDevice->NvEvictions = 0;
+	pDevice->NvWrites = 0;
+	pDevice->NvWriteChunks = 0;
+	pDevice->NvWriteFailures = 0;
+	pDevice->CapsHits = 0;
+	pDevice->CapsMisses = 0;
+	InterlockedExchange64(&pDevice->TisInterrupts, 0);
+	pDevice->TisWakes = 0;
+	pDevice->TisFallbacks = 0;
+	pDevice->PredictWaits = 0;
+	pDevice->PredictSleeps = 0;
+	pDevice->PredictPolls = 0;
+	pDevice->PredictWasted = 0;
+	pDevice->PredictOverslept = 0;
+	pDevice->PredictDetectUs = 0;
+	pDevice->PredictDetected = 0;
+	pDevice->QuoteMaxBatch = 0;
+	pDevice->QuoteRequests = 0;
+	pDevice->Quotes = 0;
+	pDevice->QuoteFailures = 0;
+	pDevice->QuoteWaitUs = 0;
+	pDevice->QuoteLatencyUs = 0;
+	WdfSpinLockAcquire(pDevice->SessionLock);
+	pDevice->SessionHits = 0;
+	pDevice->SessionMisses = 0;
+	pDevice->SessionsStarted = 0;
+	pDevice->SessionsFlushed = 0;
+	pDevice->SessionsRefreshed = 0;
+	pDevice->SessionsEvicted = 0;
+	WdfSpinLockRelease(pDevice->SessionLock);
+	pDevice->KeyHits = 0;
+	pDevice->KeyMisses = 0;
+	pDevice->KeyStale = 0;
+	pDevice->KeyEvictions = 0;
+	pDevice->KeyFlushesAbsorbed = 0;
+	pDevice->KeygenGenerated = 0;
+	pDevice->KeygenServed = 0;
+	pDevice->KeygenMisses = 0;
+	pDevice->KeygenCancels = 0;
+	pDevice->KeygenFailures = 0;
+	pDevice->KeygenUs = 0;
+	pDevice->StatsResetTime = CurrentTime.QuadPart;
+	WdfWaitLockRelease(pDevice->CommandLock);
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,350 @@
+#include "driver.h"
+
+static const struct {
+	UINT32 ordinal;
+	TPM2_DURATION duration;
+} tpm2_ordinal_durations[] = {
+	{ TPM2_CC_PCR_READ,			TPM2_DURATION_SHORT },
+	{ TPM2_CC_READ_PUBLIC,			TPM2_DURATION_SHORT },
+	{ TPM2_CC_NV_READ_PUBLIC,		TPM2_DURATION_SHORT },
+	{ TPM2_CC_FLUSH_CONTEXT,		TPM2_DURATION_SHORT },
+	{ TPM2_CC_GET_TEST_RESULT,		TPM2_DURATION_SHORT },
+	{ TPM2_CC_READ_CLOCK,			TPM2_DURATION_SHORT },
+
+	{ TPM2_CC_STARTUP,			TPM2_DURATION_MEDIUM },
+	{ TPM2_CC_SHUTDOWN,			TPM2_DURATION_MEDIUM },
+	{ TPM2_CC_GET_CAPABILITY,		TPM2_DURATION_MEDIUM },
+	{ TPM2_CC_PCR_EXTEND,			TPM2_DURATION_MEDIUM },
+	{ TPM2_CC_CONTEXT_SAVE,			TPM2_DURATION_MEDIUM },
+	{ TPM2_CC_CONTEXT_LOAD,			TPM2_DURATION_MEDIUM },
+	{ TPM2_CC_SEQUENCE_UPDATE,		TPM2_DURATION_MEDIUM },
+	{ TPM2_CC_SEQUENCE_COMPLETE,		TPM2_DURATION_MEDIUM },
+	{ TPM2_CC_EVENT_SEQUENCE_COMPLETE,	TPM2_DURATION_MEDIUM },
+	{ TPM2_CC_HASH_SEQUENCE_START,		TPM2_DURATION_MEDIUM },
+
+	{ TPM2_CC_SELF_TEST,			TPM2_DURATION_LONG },
+	{ TPM2_CC_INCREMENTAL_SELF_TEST,	TPM2_DURATION_LONG },
+	{ TPM2_CC_GET_RANDOM,			TPM2_DURATION_LONG },
+	{ TPM2_CC_NV_READ,			TPM2_DURATION_LONG },
+	{ TPM2_CC_HIERARCHY_CONTROL,		TPM2_DURATION_LONG },
+	{ TPM2_CC_HIERARCHY_CHANGE_AUTH,	TPM2_DURATION_LONG },
+	{ TPM2_CC_START_AUTH_SESSION,		TPM2_DURATION_LONG },
+	{ TPM2_CC_LOAD,				TPM2_DURATION_LONG },
+	{ TPM2_CC_SIGN,				TPM2_DURATION_LONG },
+
+	{ TPM2_CC_CREATE_PRIMARY,		TPM2_DURATION_LONG_LONG },
+	{ TPM2_CC_CREATE,			TPM2_DURATION_LONG_LONG },
+	{ TPM2_CC_CREATE_LOADED,		TPM2_DURATION_LONG_LONG },
+	{ TPM2_CC_VERIFY_SIGNATURE,		TPM2_DURATION_LONG_LONG }
+};
+
+/**
+ * tpm2_ordinal_duration() - Look up the duration class of a command.
+ * @ordinal:	TPM command code.
+ *
+ * Commands that are not listed get the long class, which matches the
+ * single timeout that was used for every command before.
+ */
+TPM2_DURATION tpm2_ordinal_duration(UINT32 ordinal)
+{
+	for (ULONG i = 0; i < ARRAYSIZE(tpm2_ordinal_durations); i++) {
+		if (tpm2_ordinal_durations[i].ordinal == ordinal)
+			return tpm2_ordinal_durations[i].duration;
+	}
+	return TPM2_DURATION_LONG;
+}
+
+/*
+ * Marshalling of the commands the driver sends itself.
+ *
+ * Every command is a template that is complete at compile time apart
+ * from a few fixed-size fields. Building one copies the template into a
+ * preallocated buffer and patches those fields in place; responses are
+ * decoded at fixed offsets straight out of the receive buffer. Nothing
+ * is allocated and no parameter is marshalled field by field.
+ */
+
+#define TPM2_FIELD_BYTES	0x01	/* Byte string: from a pointer, or a TPM2B */
+#define TPM2_FIELD_LE		0x02	/* Little endian, such as a PCR bitmap */
+#define TPM2_MAX_FIELDS		5
+
+typedef struct _TPM2_FIELD {
+	UINT8 Offset;
+	UINT8 Size;
+	UINT8 Flags;
+} TPM2_FIELD;
+
+typedef struct _TPM2_LAYOUT {
+	const UINT8* Bytes;	/* Template, commands only */
+	UINT8 Length;		/* Template length, or shortest successful response */
+	UINT8 FieldCount;
+	TPM2_FIELD Fields[TPM2_MAX_FIELDS];
+} TPM2_LAYOUT;
+
+static const UINT8 tpm2_startup_template[] = {
+	0x80, 0x01,		/* TPM_ST_NO_SESSIONS (0x8001) */
+	0, 0, 0, 12,	/* Length in bytes */
+	0, 0, 0x01, 0x44,	/* TPM_CC_Startup (0x144) */
+	0x00, 0x00		/* startupType */
+};
+
+static const UINT8 tpm2_shutdown_template[] = {
+	0x80, 0x01,		/* TPM_ST_NO_SESSIONS (0x8001) */
+	0, 0, 0, 12,	/* Length in bytes */
+	0, 0, 0x01, 0x45,	/* TPM_CC_Shutdown (0x145) */
+	0x00, 0x00		/* shutdownType */
+};
+
+/*
+ * The algorithms that the OS and the firmware use right after resume,
+ * so that their tests run in the background instead of inline with the
+ * first command that needs them.
+ */
+static const UINT8 tpm2_selftest_template[] = {
+	0x80, 0x01,		/* TPM_ST_NO_SESSIONS (0x8001) */
+	0, 0, 0, 26,	/* Length in bytes */
+	0, 0, 0x01, 0x42,	/* TPM_CC_IncrementalSelfTest (0x142) */
+	0, 0, 0, 6,		/* Algorithm count */
+	0x00, 0x04,		/* TPM_ALG_SHA1 */
+	0x00, 0x0B,		/* TPM_ALG_SHA256 */
+	0x00, 0x05,		/* TPM_ALG_HMAC */
+	0x00, 0x06,		/* TPM_ALG_AES */
+	0x00, 0x01,		/* TPM_ALG_RSA */
+	0x00, 0x23		/* TPM_ALG_ECC */
+};
+
+static const UINT8 tpm2_get_random_template[] = {
+	0x80, 0x01,		/* TPM_ST_NO_SESSIONS (0x8001) */
+	0, 0, 0, 12,	/* Length in bytes */
+	0, 0, 0x01, 0x7B,	/* TPM_CC_GetRandom (0x17B) */
+	0x00, 0x00		/* bytesRequested */
+};
+
+/* One bank, so the response has at most one digest */
+static const UINT8 tpm2_pcr_read_template[] = {
+	0x80, 0x01,		/* TPM_ST_NO_SESSIONS (0x8001) */
+	0, 0, 0, 20,	/* Length in bytes */
+	0, 0, 0x01, 0x7E,	/* TPM_CC_PCR_Read (0x17E) */
+	0, 0, 0, 1,		/* pcrSelectionIn.count */
+	0x00, 0x0B,		/* hash */
+	3,			/* sizeofSelect */
+	0x00, 0x00, 0x00	/* pcrSelect */
+};
+
+/* Authorized with an empty password, which is what PCRs 0-15 take */
+static const UINT8 tpm2_pcr_extend_template[65] = {
+	0x80, 0x02,		/* TPM_ST_SESSIONS (0x8002) */
+	0, 0, 0, 65,	/* Length in bytes */
+	0, 0, 0x01, 0x82,	/* TPM_CC_PCR_Extend (0x182) */
+	0, 0, 0, 0,		/* pcrHandle */
+	0, 0, 0, 9,		/* authorizationSize */
+	0x40, 0, 0, 0x09,	/* TPM_RS_PW */
+	0, 0,			/* nonceCaller */
+	0,			/* sessionAttributes */
+	0, 0,			/* hmac */
+	0, 0, 0, 1,		/* digests.count */
+	0x00, 0x0B		/* TPM_ALG_SHA256, the digest follows */
+};
+
+static const UINT8 tpm2_get_capability_template[] = {
+	0x80, 0x01,		/* TPM_ST_NO_SESSIONS (0x8001) */
+	0, 0, 0, 22,	/* Length in bytes */
+	0, 0, 0x01, 0x7A,	/* TPM_CC_GetCapability (0x17A) */
+	0, 0, 0, 0,		/* capability */
+	0, 0, 0, 0,		/* property */
+	0, 0, 0, 0		/* propertyCount */
+};
+
+/* Unsalted and unbound, so the session key is empty; SHA-256 only */
+static const UINT8 tpm2_start_auth_session_template[] = {
+	0x80, 0x01,		/* TPM_ST_NO_SESSIONS (0x8001) */
+	0, 0, 0, 59,	/* Length in bytes */
+	0, 0, 0x01, 0x76,	/* TPM_CC_StartAuthSession (0x176) */
+	0x40, 0, 0, 0x07,	/* tpmKey: TPM_RH_NULL */
+	0x40, 0, 0, 0x07,	/* bind: TPM_RH_NULL */
+	0x00, 0x20,		/* nonceCaller.size */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0x00, 0x00,		/* encryptedSalt */
+	0x00,			/* sessionType */
+	0x00, 0x10,		/* symmetric: TPM_ALG_NULL */
+	0x00, 0x0B		/* authHash: TPM_ALG_SHA256 */
+};
+
+static const UINT8 tpm2_flush_context_template[] = {
+	0x80, 0x01,		/* TPM_ST_NO_SESSIONS (0x8001) */
+	0, 0, 0, 14,	/* Length in bytes */
+	0, 0, 0x01, 0x65,	/* TPM_CC_FlushContext (0x165) */
+	0, 0, 0, 0		/* flushHandle */
+};
+
+/* Indexed by TPM2_CMD */
+static const TPM2_LAYOUT tpm2_commands[TPM2_CMD_COUNT] = {
+	{ tpm2_startup_template, sizeof(tpm2_startup_template), 1, { { 10, 2, 0 } } },
+	{ tpm2_shutdown_template, sizeof(tpm2_shutdown_template), 1, { { 10, 2, 0 } } },
+	{ tpm2_selftest_template, sizeof(tpm2_selftest_template), 0, { { 0 } } },
+	{ tpm2_get_random_template, sizeof(tpm2_get_random_template), 1, { { 10, 2, 0 } } },
+	{ tpm2_pcr_read_template, sizeof(tpm2_pcr_read_template), 2,
+		{ { 14, 2, 0 }, { 17, 3, TPM2_FIELD_LE } } },
+	{ tpm2_pcr_extend_template, sizeof(tpm2_pcr_extend_template), 2,
+		{ { 10, 4, 0 }, { 33, 32, TPM2_FIELD_BYTES } } },
+	{ tpm2_get_capability_template, sizeof(tpm2_get_capability_template), 3,
+		{ { 10, 4, 0 }, { 14, 4, 0 }, { 18, 4, 0 } } },
+	{ tpm2_start_auth_session_template, sizeof(tpm2_start_auth_session_template), 2,
+		{ { 54, 1, 0 }, { 20, 32, TPM2_FIELD_BYTES } } },
+	{ tpm2_flush_context_template, sizeof(tpm2_flush_context_template), 1, { { 10, 4, 0 } } }
+};
+
+/* Indexed by TPM2_CMD, fields as in enum tpm2_response_fields */
+static const TPM2_LAYOUT tpm2_responses[TPM2_CMD_COUNT] = {
+	{ NULL, TPM_HEADER_SIZE, 0, { { 0 } } },
+	{ NULL, TPM_HEADER_SIZE, 0, { { 0 } } },
+	/* toDoList.count */
+	{ NULL, 14, 1, { { 10, 4, 0 } } },
+	/* randomBytes */
+	{ NULL, 12, 1, { { 10, 2, TPM2_FIELD_BYTES } } },
+	/* pcrUpdateCounter, pcrValues.count, pcrValues.digests[0] */
+	{ NULL, 28, 3, { { 10, 4, 0 }, { 24, 4, 0 }, { 28, 2, TPM2_FIELD_BYTES } } },
+	/* Only the header is of interest */
+	{ NULL, TPM_HEADER_SIZE, 0, { { 0 } } },
+	/* moreData, capability, count, then the first tagged property */
+	{ NULL, 19, 5, { { 10, 1, 0 }, { 11, 4, 0 }, { 15, 4, 0 }, { 19, 4, 0 }, { 23, 4, 0 } } },
+	/* sessionHandle, nonceTPM */
+	{ NULL, 16, 2, { { 10, 4, 0 }, { 14, 2, TPM2_FIELD_BYTES } } },
+	{ NULL, TPM_HEADER_SIZE, 0, { { 0 } } }
+};
+
+static UINT32 tpm2_get(const UINT8* p, const TPM2_FIELD* f) {
+	UINT32 value = 0;
+
+	for (UINT8 i = 0; i < f->Size; i++) {
+		if (f->Flags & TPM2_FIELD_LE)
+			value |= (UINT32)p[i] << (8 * i);
+		else
+			value = (value << 8) | p[i];
+	}
+	return value;
+}
+
+static void tpm2_put(UINT8* p, const TPM2_FIELD* f, UINT32 value) {
+	for (UINT8 i = 0; i < f->Size; i++) {
+		if (f->Flags & TPM2_FIELD_LE)
+			p[i] = (UINT8)(value >> (8 * i));
+		else
+			p[f->Size - 1 - i] = (UINT8)(value >> (8 * i));
+	}
+}
+
+/**
+ * tpm2_build() - Marshal one of the driver's own commands.
+ * @cmd:	Command to build.
+ * @buf:	Preallocated command buffer.
+ * @args:	One value per variable field of @cmd, see TPM2_CMD. Byte
+ *		string fields are passed as a pointer.
+ *
+ * Returns the length of the command, or 0 if @buf is too small.
+ */
+size_t tpm2_build(TPM2_CMD cmd, UINT8* buf, size_t buf_len, const ULONG_PTR* args)
+{
+	const TPM2_LAYOUT* t = &tpm2_commands[cmd];
+
+	if (buf_len < t->Length)
+		return 0;
+
+	RtlCopyMemory(buf, t->Bytes, t->Length);
+	for (UINT8 i = 0; i < t->FieldCount; i++) {
+		const TPM2_FIELD* f = &t->Fields[i];
+
+		if (f->Flags & TPM2_FIELD_BYTES)
+			RtlCopyMemory(buf + f->Offset, (const UINT8*)args[i], f->Size);
+		else
+			tpm2_put(buf + f->Offset, f, (UINT32)args[i]);
+	}
+	return t->Length;
+}
+
+UINT32 tpm2_response_code(const UINT8* rsp)
+{
+	return RtlUlongByteSwap(*((UINT32*)(rsp + 6)));
+}
+
+/* Bytes of the response that are valid, as far as the header and @rsp_len agree */
+static size_t tpm2_response_size(const UINT8* rsp, size_t rsp_len)
+{
+	if (rsp_len < TPM_HEADER_SIZE)
+		return 0;
+	return min(rsp_len, RtlUlongByteSwap(*((UINT32*)(rsp + 2))));
+}
+
+/**
+ * tpm2_parse() - Check the response to one of the driver's own commands.
+ * @rc:		Receives the response code.
+ *
+ * Fails if the header is inconsistent, or if a successful response is
+ * too short to hold the fields that tpm2_field() decodes without
+ * further checks.
+ */
+NTSTATUS tpm2_parse(TPM2_CMD cmd, const UINT8* rsp, size_t rsp_len, UINT32* rc)
+{
+	size_t size;
+
+	if (rsp_len < TPM_HEADER_SIZE)
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	size = RtlUlongByteSwap(*((UINT32*)(rsp + 2)));
+	if (size < TPM_HEADER_SIZE || size > rsp_len)
+		return STATUS_DEVICE_PROTOCOL_ERROR;
+
+	*rc = tpm2_response_code(rsp);
+	if (*rc == TPM2_RC_SUCCESS && size < tpm2_responses[cmd].Length)
+		return STATUS_DEVICE_PROTOCOL_ERROR;
+
+	return STATUS_SUCCESS;
+}
+
+/**
+ * tpm2_field() - Decode an integer field of a response.
+ *
+ * Fields past the end of the response read as 0, which is also what a
+ * count of the optional parts of a response (a digest, a property)
+ * reads as when they are missing.
+ */
+UINT32 tpm2_field(TPM2_CMD cmd, const UINT8* rsp, size_t rsp_len, UINT32 field)
+{
+	const TPM2_LAYOUT* t = &tpm2_responses[cmd];
+	const TPM2_FIELD* f;
+
+	if (field >= t->FieldCount)
+		return 0;
+
+	f = &t->Fields[field];
+	if ((size_t)f->Offset + f->Size > tpm2_response_size(rsp, rsp_len))
+		return 0;
+	return tpm2_get(rsp + f->Offset, f);
+}
+
+/**
+ * tpm2_field_bytes() - Find a TPM2B field of a response.
+ * @size:	Receives the length of the buffer.
+ *
+ * Returns a pointer into @rsp, or NULL if the field does not fit.
+ */
+const UINT8* tpm2_field_bytes(TPM2_CMD cmd, const UINT8* rsp, size_t rsp_len, UINT32 field,
+	UINT16* size)
+{
+	const TPM2_LAYOUT* t = &tpm2_responses[cmd];
+	const TPM2_FIELD* f;
+	size_t valid = tpm2_response_size(rsp, rsp_len);
+
+	if (field >= t->FieldCount || !(t->Fields[field].Flags & TPM2_FIELD_BYTES))
+		return NULL;
+
+	f = &t->Fields[field];
+	if ((size_t)f->Offset + f->Size > valid)
+		return NULL;
+
+	*size = (UINT16)tpm2_get(rsp + f->Offset, f);
+	if ((size_t)f->Offset + f->Size + *size > valid)
+		return NULL;
+	return rsp + f->Offset + f->Size;
+}
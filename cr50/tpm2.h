@@ -0,0 +1,176 @@
+#ifndef __TPM2_H__
+#define __TPM2_H__
+
+/* TPM 2.0 command codes (TPM 2.0 Part 2, 6.5.2) */
+enum tpm2_command_codes {
+	TPM2_CC_FIRST = 0x011F,
+	TPM2_CC_NV_UNDEFINE_SPACE_SPECIAL = 0x011F,
+	TPM2_CC_EVICT_CONTROL = 0x0120,
+	TPM2_CC_HIERARCHY_CONTROL = 0x0121,
+	TPM2_CC_NV_UNDEFINE_SPACE = 0x0122,
+	TPM2_CC_CHANGE_EPS = 0x0124,
+	TPM2_CC_CHANGE_PPS = 0x0125,
+	TPM2_CC_CLEAR = 0x0126,
+	TPM2_CC_HIERARCHY_CHANGE_AUTH = 0x0129,
+	TPM2_CC_NV_DEFINE_SPACE = 0x012A,
+	TPM2_CC_PCR_ALLOCATE = 0x012B,
+	TPM2_CC_CREATE_PRIMARY = 0x0131,
+	TPM2_CC_NV_GLOBAL_WRITE_LOCK = 0x0132,
+	TPM2_CC_NV_INCREMENT = 0x0134,
+	TPM2_CC_NV_SET_BITS = 0x0135,
+	TPM2_CC_NV_EXTEND = 0x0136,
+	TPM2_CC_NV_WRITE = 0x0137,
+	TPM2_CC_NV_WRITE_LOCK = 0x0138,
+	TPM2_CC_NV_CHANGE_AUTH = 0x013B,
+	TPM2_CC_SEQUENCE_COMPLETE = 0x013E,
+	TPM2_CC_INCREMENTAL_SELF_TEST = 0x0142,
+	TPM2_CC_SELF_TEST = 0x0143,
+	TPM2_CC_STARTUP = 0x0144,
+	TPM2_CC_SHUTDOWN = 0x0145,
+	TPM2_CC_NV_READ = 0x014E,
+	TPM2_CC_NV_READ_LOCK = 0x014F,
+	TPM2_CC_CREATE = 0x0153,
+	TPM2_CC_LOAD = 0x0157,
+	TPM2_CC_QUOTE = 0x0158,
+	TPM2_CC_SEQUENCE_UPDATE = 0x015C,
+	TPM2_CC_SIGN = 0x015D,
+	TPM2_CC_CONTEXT_LOAD = 0x0161,
+	TPM2_CC_CONTEXT_SAVE = 0x0162,
+	TPM2_CC_FLUSH_CONTEXT = 0x0165,
+	TPM2_CC_NV_READ_PUBLIC = 0x0169,
+	TPM2_CC_READ_PUBLIC = 0x0173,
+	TPM2_CC_START_AUTH_SESSION = 0x0176,
+	TPM2_CC_VERIFY_SIGNATURE = 0x0177,
+	TPM2_CC_GET_CAPABILITY = 0x017A,
+	TPM2_CC_GET_RANDOM = 0x017B,
+	TPM2_CC_GET_TEST_RESULT = 0x017C,
+	TPM2_CC_PCR_READ = 0x017E,
+	TPM2_CC_READ_CLOCK = 0x0181,
+	TPM2_CC_PCR_EXTEND = 0x0182,
+	TPM2_CC_EVENT_SEQUENCE_COMPLETE = 0x0185,
+	TPM2_CC_HASH_SEQUENCE_START = 0x0186,
+	TPM2_CC_CREATE_LOADED = 0x0191,
+	TPM2_CC_LAST = 0x019F
+};
+
+/* Response codes the driver acts on (TPM 2.0 Part 2, 6.6.3) */
+enum tpm2_return_codes {
+	TPM2_RC_SUCCESS = 0x0000,
+	TPM2_RC_INITIALIZE = 0x0100,	/* Startup already issued */
+	TPM2_RC_OBJECT_MEMORY = 0x0902,	/* No room to load another object */
+	TPM2_RC_SESSION_MEMORY = 0x0903,	/* No room to load another session */
+	TPM2_RC_SESSION_HANDLES = 0x0905,	/* No handle left for another session */
+	TPM2_RC_OBJECT_HANDLES = 0x0906,	/* No handle left for another object */
+	TPM2_RC_YIELDED = 0x0908,	/* Command was yielded, send it again */
+	TPM2_RC_CANCELED = 0x0909,	/* Command was cancelled */
+	TPM2_RC_TESTING = 0x090A,	/* Self-test of a needed algorithm is running */
+	TPM2_RC_RETRY = 0x0922		/* TPM was busy */
+};
+
+enum tpm2_startup_types {
+	TPM2_SU_CLEAR = 0x0000,
+	TPM2_SU_STATE = 0x0001
+};
+
+enum tpm2_algorithms {
+	TPM2_ALG_RSA = 0x0001,
+	TPM2_ALG_SHA1 = 0x0004,
+	TPM2_ALG_HMAC = 0x0005,
+	TPM2_ALG_AES = 0x0006,
+	TPM2_ALG_SHA256 = 0x000B,
+	TPM2_ALG_NULL = 0x0010,
+	TPM2_ALG_ECC = 0x0023
+};
+
+enum tpm2_capabilities {
+	TPM2_CAP_ALGS = 0x00000000,
+	TPM2_CAP_HANDLES = 0x00000001,
+	TPM2_CAP_COMMANDS = 0x00000002,
+	TPM2_CAP_PCRS = 0x00000005,
+	TPM2_CAP_TPM_PROPERTIES = 0x00000006
+};
+
+/* TPM_CAP_TPM_PROPERTIES (TPM 2.0 Part 2, 6.13) */
+enum tpm2_properties {
+	TPM2_PT_FIXED = 0x0100,
+	TPM2_PT_FIRMWARE_VERSION_1 = 0x010B,
+	TPM2_PT_FIRMWARE_VERSION_2 = 0x010C,
+	TPM2_PT_MAX_COMMAND_SIZE = 0x011E,
+	TPM2_PT_NV_BUFFER_MAX = 0x012C,
+	TPM2_PT_VAR = 0x0200
+};
+
+#define TPM2_ST_NO_SESSIONS	0x8001
+#define TPM2_ST_SESSIONS	0x8002
+#define TPM2_RS_PW		0x40000009	/* Password authorization session */
+#define TPM2_HT_PERSISTENT	0x81		/* Top byte of a persistent handle */
+
+#define TPM2_SE_HMAC		0x00
+#define TPM2_SE_POLICY		0x01
+
+/*
+ * Commands the driver marshals itself. Each has a template that is
+ * built at compile time (see tpm2.c); tpm2_build() copies it and fills
+ * in the variable fields, given in the order listed here.
+ */
+typedef enum {
+	TPM2_CMD_STARTUP,		/* startupType */
+	TPM2_CMD_SHUTDOWN,		/* shutdownType */
+	TPM2_CMD_INCREMENTAL_SELF_TEST,	/* none, the algorithm list is fixed */
+	TPM2_CMD_GET_RANDOM,		/* bytesRequested */
+	TPM2_CMD_PCR_READ,		/* hashAlg, bitmap of PCRs 0-23 */
+	TPM2_CMD_PCR_EXTEND,		/* pcrHandle, pointer to a SHA-256 digest */
+	TPM2_CMD_GET_CAPABILITY,	/* capability, property, propertyCount */
+	TPM2_CMD_START_AUTH_SESSION,	/* sessionType, pointer to a 32 byte nonceCaller */
+	TPM2_CMD_FLUSH_CONTEXT,		/* flushHandle */
+	TPM2_CMD_COUNT
+} TPM2_CMD;
+
+/* Response fields, for tpm2_field() and tpm2_field_bytes() */
+enum tpm2_response_fields {
+	TPM2_SELF_TEST_TODO_COUNT = 0,
+	TPM2_GET_RANDOM_BYTES = 0,		/* TPM2B */
+	TPM2_PCR_READ_UPDATE_COUNTER = 0,
+	TPM2_PCR_READ_DIGEST_COUNT = 1,
+	TPM2_PCR_READ_DIGEST = 2,		/* TPM2B, first digest */
+	TPM2_GET_CAPABILITY_MORE_DATA = 0,
+	TPM2_GET_CAPABILITY_CAPABILITY = 1,
+	TPM2_GET_CAPABILITY_COUNT = 2,
+	TPM2_GET_CAPABILITY_PROPERTY = 3,	/* First TPMS_TAGGED_PROPERTY */
+	TPM2_GET_CAPABILITY_VALUE = 4,
+	TPM2_START_AUTH_SESSION_HANDLE = 0,
+	TPM2_START_AUTH_SESSION_NONCE = 1	/* TPM2B */
+};
+
+/*
+ * Command duration classes. The defaults are the maximum execution
+ * times from the TCG PC Client Platform TPM Profile, and may be
+ * overridden per device from the registry.
+ */
+typedef enum {
+	TPM2_DURATION_SHORT,
+	TPM2_DURATION_MEDIUM,
+	TPM2_DURATION_LONG,
+	TPM2_DURATION_LONG_LONG,
+	TPM2_DURATION_COUNT
+} TPM2_DURATION;
+
+#define TPM2_DURATION_SHORT_MS		20
+#define TPM2_DURATION_MEDIUM_MS		750
+#define TPM2_DURATION_LONG_MS		2000
+#define TPM2_DURATION_LONG_LONG_MS	300000
+
+/* Bounds of the registry overrides */
+#define TPM2_DURATION_MIN_MS		10
+#define TPM2_DURATION_MAX_MS		TPM2_DURATION_LONG_LONG_MS
+
+TPM2_DURATION tpm2_ordinal_duration(UINT32 ordinal);
+
+size_t tpm2_build(TPM2_CMD cmd, UINT8* buf, size_t buf_len, const ULONG_PTR* args);
+UINT32 tpm2_response_code(const UINT8* rsp);
+NTSTATUS tpm2_parse(TPM2_CMD cmd, const UINT8* rsp, size_t rsp_len, UINT32* rc);
+UINT32 tpm2_field(TPM2_CMD cmd, const UINT8* rsp, size_t rsp_len, UINT32 field);
+const UINT8* tpm2_field_bytes(TPM2_CMD cmd, const UINT8* rsp, size_t rsp_len, UINT32 field,
+	UINT16* size);
+
+#endif /* __TPM2_H__ */
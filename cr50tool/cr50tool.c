@@ -0,0 +1,1299 @@
+/*
+ * cr50tool - query and decode diagnostics from the Cr50 driver.
+ *
+ *   cr50tool stats [reset]     Print per command code statistics
+ *   cr50tool trace <file>      Save the bus trace ring to a file
+ *   cr50tool health            Print the bus timing tier and its history
+ *   cr50tool decode <file>     Decode a saved bus trace
+ *   cr50tool send <hex> [locality]
+ *                              Send a marshalled TPM2 command, print the response
+ *   cr50tool bench <threads> <seconds> [workload] [json]
+ *                              Submit one workload from many threads at once
+ *   cr50tool batch <count> [workload] [stop]
+ *                              Send a workload count times in one batch
+ *   cr50tool shared <count> [workload]
+ *                              Send a workload count times through a shared ring
+ *   cr50tool nvwrite <index> <file> [offset] [password]
+ *                              Write a file to an NV index
+ *   cr50tool quote <handle> <count> [password]
+ *                              Quote count nonces at once and check their proofs
+ */
+
+#include <windows.h>
+#include <winioctl.h>
+#include <initguid.h>
+#include <cfgmgr32.h>
+#include <bcrypt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "..\cr50\cr50ioctl.h"
+
+static HANDLE OpenCr50(DWORD flags) {
+	WCHAR* interfaces = NULL;
+	ULONG length = 0;
+	HANDLE device = INVALID_HANDLE_VALUE;
+
+	if (CM_Get_Device_Interface_List_SizeW(&length, (LPGUID)&GUID_DEVINTERFACE_CR50,
+		NULL, CM_GET_DEVICE_INTERFACE_LIST_PRESENT) != CR_SUCCESS || length <= 1) {
+		fprintf(stderr, "No Cr50 device found\n");
+		return INVALID_HANDLE_VALUE;
+	}
+
+	interfaces = calloc(length, sizeof(WCHAR));
+	if (!interfaces)
+		return INVALID_HANDLE_VALUE;
+
+	if (CM_Get_Device_Interface_ListW((LPGUID)&GUID_DEVINTERFACE_CR50, NULL, interfaces,
+		length, CM_GET_DEVICE_INTERFACE_LIST_PRESENT) == CR_SUCCESS) {
+		device = CreateFileW(interfaces, GENERIC_READ | GENERIC_WRITE,
+			FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, flags, NULL);
+	}
+	free(interfaces);
+
+	if (device == INVALID_HANDLE_VALUE)
+		fprintf(stderr, "Could not open Cr50 device (%lu)\n", GetLastError());
+	return device;
+}
+
+static void* Query(HANDLE device, DWORD ioctl, void* in, DWORD inLen, DWORD size, DWORD* outLen) {
+	void* out = calloc(1, size);
+	if (!out)
+		return NULL;
+
+	if (!DeviceIoControl(device, ioctl, in, inLen, out, size, outLen, NULL)) {
+		fprintf(stderr, "IOCTL 0x%lx failed (%lu)\n", ioctl, GetLastError());
+		free(out);
+		return NULL;
+	}
+	return out;
+}
+
+static const char* PhaseNames[Cr50PhaseCount] = { "queue", "send", "execute", "receive" };
+
+/* Upper bound in microseconds of the bucket that holds the given percentile */
+static ULONG64 Percentile(const ULONG* histogram, ULONG count, double pct) {
+	ULONG64 target = (ULONG64)(count * pct + 0.5), seen = 0;
+
+	for (int i = 0; i < CR50_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram[i];
+		if (seen >= target && seen)
+			return 1ULL << (i + 1);
+	}
+	return 1ULL << CR50_HISTOGRAM_BUCKETS;
+}
+
+static int CmdStats(HANDLE device, BOOL reset) {
+	DWORD outLen;
+	PCR50_STATS stats = Query(device, IOCTL_CR50_QUERY_STATS, NULL, 0, sizeof(CR50_STATS), &outLen);
+	if (!stats)
+		return 1;
+
+	/* Size the buffer for every entry, resetting only after the full read */
+	DWORD size = stats->Size + 16 * sizeof(CR50_COMMAND_STATS);
+	free(stats);
+
+	stats = Query(device, IOCTL_CR50_QUERY_STATS, NULL, 0, size, &outLen);
+	if (!stats)
+		return 1;
+
+	if (reset && !DeviceIoControl(device, IOCTL_CR50_RESET_STATS, NULL, 0, NULL, 0,
+		&outLen, NULL)) {
+		fprintf(stderr, "Could not reset the statistics (%lu)\n", GetLastError());
+		free(stats);
+		return 1;
+	}
+
+	printf("uptime %.3f s, idle bus transactions %llu\n",
+		stats->Uptime100ns / 1e7, stats->IdleBusTransactions);
+
+	for (int t = 0; t < Cr50TransitionCount; t++) {
+		PCR50_TRANSITION_STATS ts = &stats->Transitions[t];
+		printf("%-8s %lu transitions, %lu failed, last %lu us, max %lu us, avg %llu us\n",
+			t == Cr50TransitionD0Entry ? "D0 entry" : "D0 exit",
+			ts->Count, ts->Failures, ts->LastUs, ts->MaxUs,
+			ts->Count ? ts->TotalUs / ts->Count : 0);
+	}
+
+	printf("power: %.3f s in D0, %.3f s in Dx, %lu idle holds, hold window %lu ms "
+		"(gap %lu ms, jitter %lu ms)\n",
+		stats->Power.TimeInD0 / 1e7, stats->Power.TimeInDx / 1e7, stats->Power.IdleHolds,
+		stats->Power.IdleHoldMs, stats->Power.ArrivalGapMs, stats->Power.ArrivalJitterMs);
+
+	printf("localities: %llu handshakes saved", stats->Locality.HandshakesSaved);
+	for (int l = 0; l < CR50_LOCALITY_COUNT; l++) {
+		if (stats->Locality.Commands[l] || stats->Locality.Switches[l])
+			printf(", %d: %llu commands %llu switches", l,
+				stats->Locality.Commands[l], stats->Locality.Switches[l]);
+	}
+	printf("\n");
+
+	printf("batches: %llu, %llu commands, %llu stopped, %llu requests saved, "
+		"%llu SPI wakes saved\n", stats->Batch.Batches, stats->Batch.Commands,
+		stats->Batch.Stopped, stats->Batch.TransitionsSaved, stats->Batch.WakesSaved);
+
+	printf("shared ring: %s", stats->Shared.Registered ? "registered" : "not registered");
+	if (stats->Shared.Registered)
+		printf(", %lu entries", stats->Shared.Entries);
+	printf(", %llu doorbells, %llu commands, %llu invalid, completion ring full %llu times\n",
+		stats->Shared.Doorbells, stats->Shared.Commands, stats->Shared.Invalid,
+		stats->Shared.CompletionsFull);
+
+	if (stats->NvCache.Budget)
+		printf("nv cache: %lu indexes in %lu of %lu bytes, %llu hits, %llu misses, "
+			"%llu invalidations, %llu evictions\n",
+			stats->NvCache.Entries, stats->NvCache.Bytes, stats->NvCache.Budget,
+			stats->NvCache.Hits, stats->NvCache.Misses, stats->NvCache.Invalidations,
+			stats->NvCache.Evictions);
+	else
+		printf("nv cache: disabled\n");
+
+	printf("nv write: %llu writes in %llu chunks, %llu failed", stats->NvWrite.Writes,
+		stats->NvWrite.Chunks, stats->NvWrite.Failures);
+	if (stats->NvWrite.BufferMax)
+		printf(", NV buffer %lu bytes, commands up to %lu bytes", stats->NvWrite.BufferMax,
+			stats->NvWrite.CommandMax);
+	printf("\n");
+
+	if (stats->Caps.Source)
+		printf("caps: %lu properties, %lu algorithms, %lu commands from %s, firmware %08lx %08lx, "
+			"%llu hits, %llu misses\n", stats->Caps.Properties, stats->Caps.Algorithms,
+			stats->Caps.Commands, stats->Caps.Source == 2 ? "registry" : "TPM",
+			stats->Caps.Firmware[0], stats->Caps.Firmware[1], stats->Caps.Hits,
+			stats->Caps.Misses);
+	else
+		printf("caps: not cached, %llu misses\n", stats->Caps.Misses);
+
+	if (stats->Irq.Enable)
+		printf("irq: enable 0x%08lx, %llu interrupts, %llu waits woken, %llu timed out\n",
+			stats->Irq.Enable, stats->Irq.Interrupts, stats->Irq.Wakes, stats->Irq.Fallbacks);
+	else
+		printf("irq: polling (caps 0x%08lx)\n", stats->Irq.Caps);
+
+	printf("predict: %lu classes, %llu waits, %llu slept (%llu overslept), "
+		"%.2f polls/wait (%.2f wasted), detect <= %.0f us, timer slack %lu us\n",
+		stats->Predict.Classes, stats->Predict.Waits, stats->Predict.Sleeps,
+		stats->Predict.Overslept,
+		stats->Predict.Waits ? (double)stats->Predict.Polls / stats->Predict.Waits : 0.0,
+		stats->Predict.Waits ? (double)stats->Predict.Wasted / stats->Predict.Waits : 0.0,
+		stats->Predict.Detected ? (double)stats->Predict.DetectUs / stats->Predict.Detected : 0.0,
+		stats->Predict.SlackUs);
+
+	printf("quote: window %lu ms, %llu requests in %llu quotes (%.1f per quote, up to %lu), "
+		"%llu failed, avg wait %.0f us, avg latency %.0f us\n",
+		stats->Quote.WindowMs, stats->Quote.Requests, stats->Quote.Quotes,
+		stats->Quote.Quotes ? (double)stats->Quote.Requests / stats->Quote.Quotes : 0.0,
+		stats->Quote.MaxBatch, stats->Quote.Failures,
+		stats->Quote.Requests ? (double)stats->Quote.WaitUs / stats->Quote.Requests : 0.0,
+		stats->Quote.Requests ? (double)stats->Quote.LatencyUs / stats->Quote.Requests : 0.0);
+
+	ULONG64 acquires = stats->Session.Hits + stats->Session.Misses;
+	printf("sessions: %lu/%lu pooled, %lu cached, %lu acquired, hit rate %.1f%% of %llu, "
+		"%llu started, %llu flushed (%llu refreshed, %llu evicted)\n",
+		stats->Session.Pooled, stats->Session.PoolTarget, stats->Session.Cached,
+		stats->Session.Acquired, acquires ? 100.0 * stats->Session.Hits / acquires : 0.0,
+		acquires, stats->Session.Started, stats->Session.Flushed,
+		stats->Session.Refreshed, stats->Session.Evicted);
+
+	ULONG64 loads = stats->KeyCache.Hits + stats->KeyCache.Misses;
+	if (stats->KeyCache.Capacity)
+		printf("key cache: %lu of %lu keys loaded (%lu held), hit rate %.1f%% of %llu loads, "
+			"%llu stale, %llu evicted, %llu flushes absorbed\n",
+			stats->KeyCache.Entries, stats->KeyCache.Capacity, stats->KeyCache.Held,
+			loads ? 100.0 * stats->KeyCache.Hits / loads : 0.0, loads,
+			stats->KeyCache.Stale, stats->KeyCache.Evictions, stats->KeyCache.FlushesAbsorbed);
+	else
+		printf("key cache: disabled\n");
+
+	ULONG64 creates = stats->Keygen.Served + stats->Keygen.Misses;
+	if (stats->Keygen.MaxDepth)
+		printf("key pool: %lu ready for %lu templates (up to %lu each, after %lu ms quiet), "
+			"hit rate %.1f%% of %llu creates, %llu made (avg %.0f ms), %llu cancelled, "
+			"%llu failed\n",
+			stats->Keygen.Ready, stats->Keygen.Templates, stats->Keygen.MaxDepth,
+			stats->Keygen.QuietMs, creates ? 100.0 * stats->Keygen.Served / creates : 0.0,
+			creates, stats->Keygen.Generated,
+			stats->Keygen.Generated ? stats->Keygen.GenerateUs / 1000.0 / stats->Keygen.Generated : 0.0,
+			stats->Keygen.Cancels, stats->Keygen.Failures);
+	else
+		printf("key pool: disabled\n");
+
+	printf("bus: %s, up to %lu bytes per transfer (burst count up to %lu)",
+		stats->Bus.Transport ? "SPI" : "I2C", stats->Bus.TransferMax, stats->Bus.BurstSeen);
+	printf("\n");
+
+	for (ULONG i = 0; i < stats->CommandsReturned; i++) {
+		PCR50_COMMAND_STATS c = &stats->Commands[i];
+
+		printf("\nCC 0x%03lx: %lu commands, %lu failed, %lu timeouts, %lu retries\n",
+			c->CommandCode, c->Count, c->Failures, c->Timeouts, c->Retries);
+		printf("  per command: %.1f polls, %.1f bursts, %.1f transactions, %.1f bytes out, %.1f bytes in\n",
+			(double)c->StatusPolls / c->Count, (double)c->FifoBursts / c->Count,
+			(double)c->BusTransactions / c->Count,
+			(double)c->BytesSent / c->Count, (double)c->BytesReceived / c->Count);
+
+		for (int p = 0; p < Cr50PhaseCount; p++) {
+			printf("  %-8s avg %8llu us  p50 <%8llu us  p99 <%8llu us\n", PhaseNames[p],
+				c->TotalUs[p] / c->Count,
+				Percentile(c->Histogram[p], c->Count, 0.50),
+				Percentile(c->Histogram[p], c->Count, 0.99));
+		}
+	}
+
+	free(stats);
+	return 0;
+}
+
+static int CmdTrace(HANDLE device, const char* path) {
+	DWORD outLen;
+	PCR50_TRACE trace = Query(device, IOCTL_CR50_QUERY_TRACE, NULL, 0, sizeof(CR50_TRACE), &outLen);
+	FILE* f;
+
+	if (!trace)
+		return 1;
+
+	DWORD size = FIELD_OFFSET(CR50_TRACE, Entries) + trace->Capacity * sizeof(CR50_TRACE_ENTRY);
+	free(trace);
+
+	trace = Query(device, IOCTL_CR50_QUERY_TRACE, NULL, 0, size, &outLen);
+	if (!trace)
+		return 1;
+
+	if (fopen_s(&f, path, "wb") || !f) {
+		fprintf(stderr, "Could not create %s\n", path);
+		free(trace);
+		return 1;
+	}
+	fwrite(trace, 1, outLen, f);
+	fclose(f);
+
+	printf("Saved %lu of %lu entries to %s\n", trace->EntriesReturned, trace->Written, path);
+	free(trace);
+	return 0;
+}
+
+static const char* TierNames[Cr50TierCount] = { "fast", "normal", "safe" };
+
+static const char* HealthReason(UCHAR reason) {
+	switch (reason) {
+	case Cr50HealthErrors: return "errors";
+	case Cr50HealthErrorRun: return "errors in a row";
+	case Cr50HealthDrift: return "latency drift";
+	case Cr50HealthClean: return "clean";
+	}
+	return "?";
+}
+
+static int CmdHealth(HANDLE device) {
+	DWORD outLen;
+	PCR50_HEALTH health = Query(device, IOCTL_CR50_QUERY_HEALTH, NULL, 0, sizeof(CR50_HEALTH), &outLen);
+	FILETIME now;
+
+	if (!health)
+		return 1;
+
+	printf("%s bus, tier %s%s: poll %lu us, wake %lu us, %lu retries, %lu bytes per transfer\n",
+		health->Transport ? "SPI" : "I2C",
+		health->Tier < Cr50TierCount ? TierNames[health->Tier] : "?",
+		health->Enabled ? "" : " (fixed)", health->PollUs, health->WakeUs,
+		health->RetryLimit, health->ChunkMax);
+	printf("register access %lu us (baseline %lu us)\n", health->LatencyUs, health->BaselineUs);
+	printf("%llu transfers, %llu errors (%llu stall timeouts, %llu ready timeouts), %llu retries\n",
+		health->Transfers, health->Errors, health->StallTimeouts, health->ReadyTimeouts,
+		health->Retries);
+	printf("%llu windows; current %lu transfers, %lu errors; %lu of %lu clean windows to move up\n",
+		health->Windows, health->WindowTransfers, health->WindowErrors,
+		health->CleanWindows, health->PromoteWindows);
+
+	/* Transition times are system time, as FILETIME */
+	GetSystemTimePreciseAsFileTime(&now);
+	LONG64 now100ns = ((LONG64)now.dwHighDateTime << 32) | now.dwLowDateTime;
+
+	printf("%lu transitions\n", health->Transitions);
+	for (ULONG i = 0; i < health->TransitionsReturned; i++) {
+		PCR50_HEALTH_TRANSITION t = &health->History[i];
+
+		printf("  %10.1f s ago  %-6s -> %-6s  %-15s  %lu errors, %lu us (baseline %lu us)\n",
+			(now100ns - t->Time) / 1e7,
+			t->From < Cr50TierCount ? TierNames[t->From] : "?",
+			t->To < Cr50TierCount ? TierNames[t->To] : "?",
+			HealthReason(t->Reason), t->WindowErrors, t->LatencyUs, t->BaselineUs);
+	}
+
+	free(health);
+	return 0;
+}
+
+static const char* RegisterName(UCHAR transport, ULONG reg, ULONG* locality) {
+	if (transport == 0) {
+		*locality = (reg >> 4) & 0xf;
+		switch (reg & 0xf) {
+		case 0x0: return "ACCESS";
+		case 0x1: return "STS";
+		case 0x5: return "DATA_FIFO";
+		case 0x6: return "DID_VID";
+		}
+	}
+	else {
+		*locality = (reg >> 12) & 0xf;
+		switch (reg & 0xfff) {
+		case 0x000: return "ACCESS";
+		case 0x008: return "INT_ENABLE";
+		case 0x00c: return "INT_VECTOR";
+		case 0x010: return "INT_STATUS";
+		case 0x014: return "INTF_CAPS";
+		case 0x018: return "STS";
+		case 0x024: return "DATA_FIFO";
+		case 0xf00: return "DID_VID";
+		case 0xf04: return "RID";
+		case 0xf90: return "FW_VER";
+		}
+	}
+	return "?";
+}
+
+#define DECODE_DATA_BYTES 8
+
+static int CmdDecode(const char* path) {
+	FILE* f;
+	CR50_TRACE header;
+	LONG64 base = 0;
+
+	if (fopen_s(&f, path, "rb") || !f) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return 1;
+	}
+
+	if (fread(&header, 1, FIELD_OFFSET(CR50_TRACE, Entries), f) != FIELD_OFFSET(CR50_TRACE, Entries) ||
+		header.Magic != CR50_TRACE_MAGIC || header.Version != CR50_TRACE_VERSION ||
+		header.EntrySize != sizeof(CR50_TRACE_ENTRY)) {
+		fprintf(stderr, "%s is not a Cr50 trace\n", path);
+		fclose(f);
+		return 1;
+	}
+
+	printf("%lu entries (ring of %lu, %lu written)\n",
+		header.EntriesReturned, header.Capacity, header.Written);
+	printf("%10s %12s %9s  %-6s %-14s %5s  %-23s %s\n",
+		"seq", "start(us)", "dur(us)", "type", "register", "len", "data", "result");
+
+	for (ULONG i = 0; i < header.EntriesReturned; i++) {
+		CR50_TRACE_ENTRY e;
+		char name[32], data[3 * DECODE_DATA_BYTES + 1] = "";
+		ULONG locality = 0;
+
+		if (fread(&e, sizeof(e), 1, f) != 1)
+			break;
+		if (!base)
+			base = e.StartTime;
+
+		/* The column shows the first bytes; '+' marks a longer transfer */
+		for (int b = 0; b < DECODE_DATA_BYTES && b < e.Length; b++)
+			sprintf_s(data + 3 * b, sizeof(data) - 3 * b, "%02x ", e.Data[b]);
+		if (e.Length > DECODE_DATA_BYTES)
+			data[3 * DECODE_DATA_BYTES - 1] = '+';
+
+		switch (e.Type) {
+		case Cr50TraceRead:
+		case Cr50TraceWrite:
+			sprintf_s(name, sizeof(name), "%s(%lu)",
+				RegisterName(e.Transport, e.Register, &locality), locality);
+			break;
+		case Cr50TraceStatus:
+			sprintf_s(name, sizeof(name), "mask 0x%02lx", e.Register);
+			break;
+		case Cr50TraceD0Entry:
+		case Cr50TraceD0Exit:
+			sprintf_s(name, sizeof(name), "Dx state %lu", e.Register);
+			break;
+		default:
+			sprintf_s(name, sizeof(name), "CC 0x%03lx", e.Register);
+			break;
+		}
+
+		static const char* types[] = { "?", "read", "write", "status", "cmd>", "cmd<", "d0in", "d0out" };
+		printf("%10lu %12.1f %9.1f  %-6s %-14s %5u  %-23s 0x%08lx%s\n",
+			e.Sequence, (e.StartTime - base) / 10.0, (e.EndTime - e.StartTime) / 10.0,
+			e.Type < ARRAYSIZE(types) ? types[e.Type] : "?", name, e.Length, data,
+			(ULONG)e.Result, e.Type == Cr50TraceStatus && e.Result != 0 ? " (retry)" : "");
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static int CmdSend(HANDLE device, const char* hex, ULONG locality) {
+	UCHAR cmd[4096], rsp[4096];
+	DWORD len = 0, outLen;
+
+	if (locality) {
+		CR50_LOCALITY input = { locality };
+		if (!DeviceIoControl(device, IOCTL_CR50_SET_LOCALITY, &input, sizeof(input),
+			NULL, 0, &outLen, NULL)) {
+			fprintf(stderr, "Could not select locality %lu (%lu)\n", locality, GetLastError());
+			return 1;
+		}
+	}
+
+	while (hex[0] && hex[1] && len < sizeof(cmd)) {
+		unsigned int byte;
+		if (sscanf_s(hex, "%2x", &byte) != 1) {
+			fprintf(stderr, "Bad hex string\n");
+			return 1;
+		}
+		cmd[len++] = (UCHAR)byte;
+		hex += 2;
+	}
+
+	if (!DeviceIoControl(device, IOCTL_CR50_SUBMIT_COMMAND, cmd, len, rsp, sizeof(rsp),
+		&outLen, NULL)) {
+		fprintf(stderr, "Command failed (%lu)\n", GetLastError());
+		return 1;
+	}
+
+	for (DWORD i = 0; i < outLen; i++)
+		printf("%02x", rsp[i]);
+	printf("\n");
+	return 0;
+}
+
+/* Registers a TPM2_Create with the key pool, from the locality the driver uses for it */
+static int CmdKeyPool(HANDLE device, ULONG depth, const char* hex, ULONG locality) {
+	UCHAR input[sizeof(CR50_KEYGEN_TEMPLATE) + 4096];
+	PCR50_KEYGEN_TEMPLATE tmpl = (PCR50_KEYGEN_TEMPLATE)input;
+	UCHAR* cmd = input + sizeof(*tmpl);
+	DWORD len = 0, outLen;
+
+	if (locality) {
+		CR50_LOCALITY sel = { locality };
+		if (!DeviceIoControl(device, IOCTL_CR50_SET_LOCALITY, &sel, sizeof(sel),
+			NULL, 0, &outLen, NULL)) {
+			fprintf(stderr, "Could not select locality %lu (%lu)\n", locality, GetLastError());
+			return 1;
+		}
+	}
+
+	while (hex[0] && hex[1] && len < sizeof(input) - sizeof(*tmpl)) {
+		unsigned int byte;
+		if (sscanf_s(hex, "%2x", &byte) != 1) {
+			fprintf(stderr, "Bad hex string\n");
+			return 1;
+		}
+		cmd[len++] = (UCHAR)byte;
+		hex += 2;
+	}
+
+	tmpl->Depth = depth;
+	tmpl->Reserved = 0;
+	if (!DeviceIoControl(device, IOCTL_CR50_KEYGEN_TEMPLATE, input, sizeof(*tmpl) + len,
+		NULL, 0, &outLen, NULL)) {
+		fprintf(stderr, "Could not register the template (%lu)\n", GetLastError());
+		return 1;
+	}
+
+	printf(depth ? "Keeping up to %lu keys ready\n" : "Template removed\n", depth);
+	return 0;
+}
+
+typedef struct _BENCH_WORKLOAD {
+	const char* Name;
+	ULONG CommandCode;
+	ULONG Length;
+	UCHAR Command[16];
+} BENCH_WORKLOAD, *PBENCH_WORKLOAD;
+
+static const BENCH_WORKLOAD Workloads[] = {
+	/* TPM2_GetRandom(8) and (32) */
+	{ "random8", 0x17b, 12, { 0x80, 0x01, 0, 0, 0, 12, 0, 0, 0x01, 0x7b, 0x00, 0x08 } },
+	{ "random32", 0x17b, 12, { 0x80, 0x01, 0, 0, 0, 12, 0, 0, 0x01, 0x7b, 0x00, 0x20 } },
+	/* TPM2_IncrementalSelfTest with an empty list */
+	{ "selftest", 0x142, 14, { 0x80, 0x01, 0, 0, 0, 14, 0, 0, 0x01, 0x42, 0, 0, 0, 0 } },
+};
+
+typedef struct _BENCH_THREAD {
+	const BENCH_WORKLOAD* Workload;
+	HANDLE Thread;
+	LONGLONG Stop;
+	ULONG Completed;
+	ULONG Busy;
+	ULONG Failed;
+	ULONG Samples;
+	ULONG Capacity;
+	LONGLONG* Latency;		/* Performance counter ticks */
+} BENCH_THREAD, *PBENCH_THREAD;
+
+static DWORD WINAPI BenchThread(LPVOID param) {
+	PBENCH_THREAD t = param;
+	UCHAR cmd[sizeof(t->Workload->Command)];
+	UCHAR rsp[64];
+	LARGE_INTEGER start, end;
+	DWORD outLen;
+
+	/* One handle per thread, synchronous I/O on a shared handle is serialized */
+	HANDLE device = OpenCr50(0);
+	if (device == INVALID_HANDLE_VALUE)
+		return 1;
+
+	memcpy(cmd, t->Workload->Command, sizeof(cmd));
+
+	for (;;) {
+		QueryPerformanceCounter(&start);
+		if (start.QuadPart >= t->Stop)
+			break;
+
+		BOOL ok = DeviceIoControl(device, IOCTL_CR50_SUBMIT_COMMAND, cmd, t->Workload->Length,
+			rsp, sizeof(rsp), &outLen, NULL);
+		QueryPerformanceCounter(&end);
+
+		if (!ok) {
+			if (GetLastError() == ERROR_BUSY)
+				t->Busy++;
+			else
+				t->Failed++;
+			continue;
+		}
+
+		t->Completed++;
+		if (t->Samples == t->Capacity) {
+			ULONG capacity = t->Capacity ? 2 * t->Capacity : 1024;
+			LONGLONG* latency = realloc(t->Latency, capacity * sizeof(LONGLONG));
+			if (!latency)
+				continue;
+			t->Latency = latency;
+			t->Capacity = capacity;
+		}
+		t->Latency[t->Samples++] = end.QuadPart - start.QuadPart;
+	}
+
+	CloseHandle(device);
+	return 0;
+}
+
+static int CompareLongLong(const void* a, const void* b) {
+	LONGLONG x = *(const LONGLONG*)a, y = *(const LONGLONG*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Upper bound of the bucket holding the percentile of the after - before histogram */
+static ULONG64 DeltaPercentile(const ULONG* before, const ULONG* after, double pct) {
+	ULONG64 count = 0, seen = 0, target;
+
+	for (int i = 0; i < CR50_HISTOGRAM_BUCKETS; i++)
+		count += after[i] - (before ? before[i] : 0);
+
+	target = (ULONG64)(count * pct + 0.5);
+	for (int i = 0; i < CR50_HISTOGRAM_BUCKETS; i++) {
+		seen += after[i] - (before ? before[i] : 0);
+		if (seen >= target && seen)
+			return 1ULL << (i + 1);
+	}
+	return 1ULL << CR50_HISTOGRAM_BUCKETS;
+}
+
+/* Reads the stats with room for every command entry */
+static PCR50_STATS QueryStats(HANDLE device) {
+	DWORD outLen;
+	PCR50_STATS stats = Query(device, IOCTL_CR50_QUERY_STATS, NULL, 0, sizeof(CR50_STATS), &outLen);
+	if (!stats)
+		return NULL;
+
+	DWORD size = stats->Size + 16 * sizeof(CR50_COMMAND_STATS);
+	free(stats);
+	return Query(device, IOCTL_CR50_QUERY_STATS, NULL, 0, size, &outLen);
+}
+
+static PCR50_COMMAND_STATS FindCommand(PCR50_STATS stats, ULONG commandCode) {
+	for (ULONG i = 0; stats && i < stats->CommandsReturned; i++) {
+		if (stats->Commands[i].CommandCode == commandCode)
+			return &stats->Commands[i];
+	}
+	return NULL;
+}
+
+static int CmdBench(HANDLE device, int threads, int seconds, const BENCH_WORKLOAD* w,
+	BOOL json) {
+	PBENCH_THREAD t = calloc(threads, sizeof(BENCH_THREAD));
+	PCR50_STATS before, after;
+	LARGE_INTEGER frequency, now;
+	ULONG completed = 0, busy = 0, failed = 0, samples = 0;
+	double p50 = 0, p99 = 0, pmax = 0;
+
+	if (!t)
+		return 1;
+
+	before = QueryStats(device);
+	if (!before) {
+		free(t);
+		return 1;
+	}
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&now);
+
+	for (int i = 0; i < threads; i++) {
+		t[i].Workload = w;
+		t[i].Stop = now.QuadPart + seconds * frequency.QuadPart;
+		t[i].Thread = CreateThread(NULL, 0, BenchThread, &t[i], 0, NULL);
+	}
+	for (int i = 0; i < threads; i++) {
+		if (t[i].Thread) {
+			WaitForSingleObject(t[i].Thread, INFINITE);
+			CloseHandle(t[i].Thread);
+		}
+	}
+
+	after = QueryStats(device);
+
+	for (int i = 0; i < threads; i++) {
+		completed += t[i].Completed;
+		busy += t[i].Busy;
+		failed += t[i].Failed;
+		samples += t[i].Samples;
+	}
+
+	LONGLONG* all = calloc(samples ? samples : 1, sizeof(LONGLONG));
+	if (all) {
+		samples = 0;
+		for (int i = 0; i < threads; i++) {
+			memcpy(all + samples, t[i].Latency, t[i].Samples * sizeof(LONGLONG));
+			samples += t[i].Samples;
+		}
+		qsort(all, samples, sizeof(LONGLONG), CompareLongLong);
+	}
+	if (all && samples) {
+		p50 = all[samples / 2] * 1e6 / frequency.QuadPart;
+		p99 = all[(ULONG)(samples * 0.99)] * 1e6 / frequency.QuadPart;
+		pmax = all[samples - 1] * 1e6 / frequency.QuadPart;
+	}
+
+	/* What the driver saw of this command code during the run */
+	PCR50_COMMAND_STATS cb = FindCommand(before, w->CommandCode);
+	PCR50_COMMAND_STATS ca = FindCommand(after, w->CommandCode);
+	CR50_COMMAND_STATS d = { 0 };
+	if (ca) {
+		d.Count = ca->Count - (cb ? cb->Count : 0);
+		d.StatusPolls = ca->StatusPolls - (cb ? cb->StatusPolls : 0);
+		d.FifoBursts = ca->FifoBursts - (cb ? cb->FifoBursts : 0);
+		d.BusTransactions = ca->BusTransactions - (cb ? cb->BusTransactions : 0);
+		d.BytesSent = ca->BytesSent - (cb ? cb->BytesSent : 0);
+		d.BytesReceived = ca->BytesReceived - (cb ? cb->BytesReceived : 0);
+		for (int p = 0; p < Cr50PhaseCount; p++)
+			d.TotalUs[p] = ca->TotalUs[p] - (cb ? cb->TotalUs[p] : 0);
+	}
+	double n = d.Count ? d.Count : 1;
+
+	if (json) {
+		printf("{\"workload\": \"%s\", \"threads\": %d, \"seconds\": %d, "
+			"\"commands\": %lu, \"per_second\": %.1f, \"busy\": %lu, \"failed\": %lu,\n",
+			w->Name, threads, seconds, completed, (double)completed / seconds, busy, failed);
+		if (after) {
+			printf(" \"bus\": {\"transport\": \"%s\"},\n",
+				after->Bus.Transport ? "spi" : "i2c");
+		}
+		printf(" \"round_trip_us\": {\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f},\n",
+			p50, p99, pmax);
+		printf(" \"per_command\": {\"transactions\": %.2f, \"polls\": %.2f, \"bursts\": %.2f, "
+			"\"bytes_out\": %.2f, \"bytes_in\": %.2f},\n",
+			d.BusTransactions / n, d.StatusPolls / n, d.FifoBursts / n,
+			d.BytesSent / n, d.BytesReceived / n);
+		printf(" \"phases_us\": {");
+		for (int p = 0; p < Cr50PhaseCount; p++) {
+			printf("%s\"%s\": {\"avg\": %.1f, \"p50\": %llu, \"p99\": %llu}",
+				p ? ", " : "", PhaseNames[p], d.TotalUs[p] / n,
+				ca ? DeltaPercentile(cb ? cb->Histogram[p] : NULL, ca->Histogram[p], 0.50) : 0,
+				ca ? DeltaPercentile(cb ? cb->Histogram[p] : NULL, ca->Histogram[p], 0.99) : 0);
+		}
+		printf("}");
+		if (after) {
+			printf(",\n \"enqueue_ns\": {\"p50\": %llu, \"p99\": %llu, \"rejected\": %llu, "
+				"\"max_depth\": %lu}",
+				DeltaPercentile(before->Queue.EnqueueHistogram, after->Queue.EnqueueHistogram, 0.50),
+				DeltaPercentile(before->Queue.EnqueueHistogram, after->Queue.EnqueueHistogram, 0.99),
+				after->Queue.Rejected - before->Queue.Rejected, after->Queue.MaxDepth);
+		}
+		printf("}\n");
+	}
+	else {
+		printf("%s, %d threads, %d s: %lu commands (%.1f/s), %lu busy, %lu failed\n",
+			w->Name, threads, seconds, completed, (double)completed / seconds, busy, failed);
+		if (samples) {
+			printf("round trip: p50 %.1f us, p99 %.1f us, max %.1f us\n", p50, p99, pmax);
+		}
+		if (d.Count) {
+			printf("per command: %.1f transactions, %.1f polls, %.1f bursts, "
+				"%.1f bytes out, %.1f bytes in\n",
+				d.BusTransactions / n, d.StatusPolls / n, d.FifoBursts / n,
+				d.BytesSent / n, d.BytesReceived / n);
+		}
+		if (after) {
+			printf("enqueue: %llu queued, %llu rejected, %llu contended, max depth %lu of %lu, "
+				"p50 <%llu ns, p99 <%llu ns\n",
+				after->Queue.Enqueued - before->Queue.Enqueued,
+				after->Queue.Rejected - before->Queue.Rejected,
+				after->Queue.Contended - before->Queue.Contended,
+				after->Queue.MaxDepth, after->Queue.Capacity,
+				DeltaPercentile(before->Queue.EnqueueHistogram, after->Queue.EnqueueHistogram, 0.50),
+				DeltaPercentile(before->Queue.EnqueueHistogram, after->Queue.EnqueueHistogram, 0.99));
+		}
+	}
+
+	for (int i = 0; i < threads; i++)
+		free(t[i].Latency);
+	free(all);
+	free(after);
+	free(before);
+	free(t);
+	return 0;
+}
+
+/*
+ * Sends @count copies of a workload as one batch, then one by one, and
+ * compares the time taken.
+ */
+static int CmdBatch(HANDLE device, ULONG count, const BENCH_WORKLOAD* w, BOOL stop) {
+	DWORD inLen = sizeof(CR50_BATCH) + count * CR50_BATCH_ENTRY_SIZE(w->Length);
+	DWORD outSize = sizeof(CR50_BATCH_RESULT) + count * CR50_BATCH_ENTRY_SIZE(4096);
+	LARGE_INTEGER frequency, start, end;
+	UCHAR rsp[4096];
+	DWORD outLen, pos;
+	double batched, single;
+	int failed = 0;
+
+	PCR50_BATCH batch = calloc(1, inLen);
+	PCR50_BATCH_RESULT result = calloc(1, outSize);
+	if (!batch || !result) {
+		free(batch);
+		free(result);
+		return 1;
+	}
+
+	batch->Count = count;
+	pos = sizeof(*batch);
+	for (ULONG i = 0; i < count; i++) {
+		PCR50_BATCH_COMMAND c = (PCR50_BATCH_COMMAND)((UCHAR*)batch + pos);
+		c->Flags = stop ? CR50_BATCH_STOP_ON_ERROR : 0;
+		c->Length = w->Length;
+		memcpy(c + 1, w->Command, w->Length);
+		pos += CR50_BATCH_ENTRY_SIZE(w->Length);
+	}
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	if (!DeviceIoControl(device, IOCTL_CR50_SUBMIT_BATCH, batch, inLen, result, outSize,
+		&outLen, NULL)) {
+		fprintf(stderr, "Batch failed (%lu)\n", GetLastError());
+		free(batch);
+		free(result);
+		return 1;
+	}
+	QueryPerformanceCounter(&end);
+	batched = (end.QuadPart - start.QuadPart) * 1e6 / frequency.QuadPart;
+
+	pos = sizeof(*result);
+	for (ULONG i = 0; i < result->Count && pos + sizeof(CR50_BATCH_RESPONSE) <= outLen; i++) {
+		PCR50_BATCH_RESPONSE r = (PCR50_BATCH_RESPONSE)((UCHAR*)result + pos);
+		UCHAR* data = (UCHAR*)(r + 1);
+
+		if (r->Status || r->Length < 10) {
+			printf("%3lu: status 0x%08lx\n", i, (ULONG)r->Status);
+			failed++;
+		}
+		else {
+			printf("%3lu: rc 0x%03lx, %lu bytes\n", i,
+				(ULONG)data[6] << 24 | data[7] << 16 | data[8] << 8 | data[9], r->Length);
+		}
+		pos += CR50_BATCH_ENTRY_SIZE(r->Length);
+	}
+
+	QueryPerformanceCounter(&start);
+	for (ULONG i = 0; i < count; i++) {
+		DeviceIoControl(device, IOCTL_CR50_SUBMIT_COMMAND, (PVOID)w->Command, w->Length,
+			rsp, sizeof(rsp), &outLen, NULL);
+	}
+	QueryPerformanceCounter(&end);
+	single = (end.QuadPart - start.QuadPart) * 1e6 / frequency.QuadPart;
+
+	printf("%lu of %lu sent, %lu requests, %lu locality handshakes and %lu SPI wakes saved\n",
+		result->Executed, result->Count, result->TransitionsSaved, result->HandshakesSaved,
+		result->WakesSaved);
+	printf("batched %.1f us, one by one %.1f us\n", batched, single);
+
+	free(batch);
+	free(result);
+	return failed ? 1 : 0;
+}
+
+#define SHARED_ENTRIES	64
+#define SHARED_SLOT	128	/* Command, then room for the response */
+
+/* Ring doorbell and wait for at least one completion */
+static BOOL SharedDoorbell(HANDLE ring, OVERLAPPED* ov) {
+	CR50_DOORBELL doorbell = { CR50_DOORBELL_WAIT };
+	DWORD outLen;
+
+	if (!DeviceIoControl(ring, IOCTL_CR50_SHARED_DOORBELL, &doorbell, sizeof(doorbell),
+		NULL, 0, NULL, ov) && GetLastError() != ERROR_IO_PENDING)
+		return FALSE;
+	return GetOverlappedResult(ring, ov, &outLen, TRUE);
+}
+
+/*
+ * Sends @count copies of a workload through a shared ring, keeping it
+ * as full as possible, and reports the time per command and how many
+ * doorbells were needed.
+ */
+static int CmdShared(ULONG count, const BENCH_WORKLOAD* w) {
+	SIZE_T size = CR50_SHARED_SIZE(SHARED_ENTRIES, SHARED_ENTRIES * SHARED_SLOT);
+	OVERLAPPED reg = { 0 }, bell = { 0 };
+	LARGE_INTEGER frequency, start, end;
+	ULONG submitted = 0, completed = 0, doorbells = 0, failed = 0;
+	PCR50_SHARED_HEADER h;
+	PUCHAR arena;
+	HANDLE ring;
+	DWORD outLen;
+
+	ring = OpenCr50(FILE_FLAG_OVERLAPPED);
+	if (ring == INVALID_HANDLE_VALUE)
+		return 1;
+
+	h = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	reg.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	bell.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (!h || !reg.hEvent || !bell.hEvent) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+
+	h->Magic = CR50_SHARED_MAGIC;
+	h->Version = CR50_SHARED_VERSION;
+	h->Entries = SHARED_ENTRIES;
+	h->ArenaSize = SHARED_ENTRIES * SHARED_SLOT;
+
+	arena = CR50_SHARED_ARENA(h);
+	for (ULONG i = 0; i < SHARED_ENTRIES; i++)
+		memcpy(arena + i * SHARED_SLOT, w->Command, w->Length);
+
+	if (DeviceIoControl(ring, IOCTL_CR50_SHARED_REGISTER, NULL, 0, h, (DWORD)size,
+		NULL, &reg) || GetLastError() != ERROR_IO_PENDING) {
+		fprintf(stderr, "Could not register the ring (%lu)\n", GetLastError());
+		goto out;
+	}
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	while (completed < count) {
+		while (submitted < count && submitted - completed < SHARED_ENTRIES) {
+			ULONG slot = submitted % SHARED_ENTRIES;
+			PCR50_SQ_ENTRY e = &CR50_SHARED_SQ(h)[slot];
+
+			e->Tag = submitted;
+			e->CommandOffset = slot * SHARED_SLOT;
+			e->CommandLength = w->Length;
+			e->ResponseOffset = slot * SHARED_SLOT + 64;
+			e->ResponseLength = SHARED_SLOT - 64;
+			InterlockedExchange(&h->SqTail, ++submitted);
+		}
+
+		doorbells++;
+		if (!SharedDoorbell(ring, &bell)) {
+			fprintf(stderr, "Doorbell failed (%lu)\n", GetLastError());
+			break;
+		}
+
+		while (h->CqHead != h->CqTail) {
+			PCR50_CQ_ENTRY c = &CR50_SHARED_CQ(h)[h->CqHead % SHARED_ENTRIES];
+			PUCHAR rsp = arena + (c->Tag % SHARED_ENTRIES) * SHARED_SLOT + 64;
+
+			if (c->Status || c->ResponseLength < 10 || rsp[6] || rsp[7] || rsp[8] || rsp[9])
+				failed++;
+			completed++;
+			InterlockedExchange(&h->CqHead, h->CqHead + 1);
+		}
+	}
+	QueryPerformanceCounter(&end);
+
+	printf("%lu commands, %lu failed, %lu doorbells, %.1f us per command\n", completed, failed,
+		doorbells, completed ? (end.QuadPart - start.QuadPart) * 1e6 / frequency.QuadPart /
+		completed : 0.0);
+
+	CancelIoEx(ring, &reg);
+	GetOverlappedResult(ring, &reg, &outLen, TRUE);
+
+out:
+	if (reg.hEvent)
+		CloseHandle(reg.hEvent);
+	if (bell.hEvent)
+		CloseHandle(bell.hEvent);
+	CloseHandle(ring);
+	if (h)
+		VirtualFree(h, 0, MEM_RELEASE);
+	return completed == count && !failed ? 0 : 1;
+}
+
+/*
+ * Writes a file to an NV index with one request, authorized by the
+ * index's own password (empty unless given), printing the progress the
+ * driver reports while the write runs.
+ */
+static int CmdNvWrite(HANDLE device, ULONG index, const char* path, ULONG offset,
+	const char* password) {
+	CR50_NV_WRITE_RESULT result = { 0 };
+	OVERLAPPED ov = { 0 };
+	LARGE_INTEGER frequency, start, end;
+	PCR50_NV_WRITE input = NULL;
+	HANDLE writer = INVALID_HANDLE_VALUE;
+	DWORD outLen;
+	int ret = 1;
+	FILE* f;
+	long size;
+
+	if (fopen_s(&f, path, "rb") || !f) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	input = size > 0 ? calloc(1, sizeof(*input) + size) : NULL;
+	if (!input || fread(input + 1, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "Could not read %s\n", path);
+		fclose(f);
+		free(input);
+		return 1;
+	}
+	fclose(f);
+
+	input->Index = index;
+	input->AuthHandle = index;
+	input->Offset = offset;
+	input->Length = size;
+	if (password) {
+		input->PasswordLength = (ULONG)min(strlen(password), CR50_NV_MAX_PASSWORD);
+		memcpy(input->Password, password, input->PasswordLength);
+	}
+
+	writer = OpenCr50(FILE_FLAG_OVERLAPPED);
+	ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (writer == INVALID_HANDLE_VALUE || !ov.hEvent)
+		goto out;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	if (!DeviceIoControl(writer, IOCTL_CR50_NV_WRITE, input, sizeof(*input) + size,
+		&result, sizeof(result), NULL, &ov) && GetLastError() != ERROR_IO_PENDING) {
+		fprintf(stderr, "NV write failed (%lu)\n", GetLastError());
+		goto out;
+	}
+
+	while (WaitForSingleObject(ov.hEvent, 50) == WAIT_TIMEOUT) {
+		PCR50_STATS stats = Query(device, IOCTL_CR50_QUERY_STATS, NULL, 0,
+			sizeof(CR50_STATS), &outLen);
+
+		if (stats && stats->NvWrite.Active && stats->NvWrite.Index == index)
+			printf("\r%lu of %lu bytes", stats->NvWrite.Written, stats->NvWrite.Total);
+		free(stats);
+	}
+
+	if (!GetOverlappedResult(writer, &ov, &outLen, TRUE)) {
+		fprintf(stderr, "\nNV write failed (%lu)\n", GetLastError());
+		goto out;
+	}
+	QueryPerformanceCounter(&end);
+
+	printf("\r%lu of %ld bytes in %lu chunks of up to %lu, %.1f ms\n", result.Written, size,
+		result.Chunks, result.ChunkSize,
+		(end.QuadPart - start.QuadPart) * 1e3 / frequency.QuadPart);
+	if (result.Status || result.ResponseCode) {
+		printf("stopped at offset %lu: status 0x%08lx, rc 0x%03lx\n",
+			offset + result.Written, (ULONG)result.Status, result.ResponseCode);
+	}
+	else {
+		ret = 0;
+	}
+
+out:
+	if (ov.hEvent)
+		CloseHandle(ov.hEvent);
+	if (writer != INVALID_HANDLE_VALUE)
+		CloseHandle(writer);
+	free(input);
+	return ret;
+}
+
+typedef struct _QUOTE_OUTPUT {
+	CR50_QUOTE_RESULT Result;
+	UCHAR Response[1024];
+} QUOTE_OUTPUT, *PQUOTE_OUTPUT;
+
+/* Hashes the leaf of @nonce up along the proof and compares with Root */
+static BOOL VerifyProof(const UCHAR* nonce, ULONG nonceLength, PCR50_QUOTE_RESULT r) {
+	UCHAR buf[1 + 2 * CR50_QUOTE_HASH_SIZE], hash[CR50_QUOTE_HASH_SIZE];
+	ULONG index = r->LeafIndex, count = r->Requests, used = 0;
+
+	buf[0] = 0x00;
+	memcpy(buf + 1, nonce, nonceLength);
+	if (BCryptHash(BCRYPT_SHA256_ALG_HANDLE, NULL, 0, buf, 1 + nonceLength, hash, sizeof(hash)))
+		return FALSE;
+
+	for (; count > 1; count = (count + 1) / 2, index >>= 1) {
+		if ((index ^ 1) >= count)
+			continue;
+		if (used == r->ProofLength)
+			return FALSE;
+
+		/* The sibling is on the left of an odd index */
+		buf[0] = 0x01;
+		memcpy(buf + 1, index & 1 ? r->Proof[used] : hash, CR50_QUOTE_HASH_SIZE);
+		memcpy(buf + 1 + CR50_QUOTE_HASH_SIZE, index & 1 ? hash : r->Proof[used],
+			CR50_QUOTE_HASH_SIZE);
+		used++;
+		if (BCryptHash(BCRYPT_SHA256_ALG_HANDLE, NULL, 0, buf, sizeof(buf), hash, sizeof(hash)))
+			return FALSE;
+	}
+
+	return used == r->ProofLength && !memcmp(hash, r->Root, sizeof(hash));
+}
+
+/* Whether the extraData of the quoted TPMS_ATTEST is Root */
+static BOOL QuoteHasRoot(PQUOTE_OUTPUT out) {
+	const UCHAR* rsp = out->Response;
+	ULONG len = out->Result.ResponseLength;
+	/* Header, parameterSize, attestation size, magic and type */
+	ULONG pos = 10 + 4 + 2 + 4 + 2;
+
+	if (pos + 2 > len)
+		return FALSE;
+	pos += 2 + ((rsp[pos] << 8) | rsp[pos + 1]);	/* qualifiedSigner */
+	if (pos + 2 + CR50_QUOTE_HASH_SIZE > len ||
+		((rsp[pos] << 8) | rsp[pos + 1]) != CR50_QUOTE_HASH_SIZE)
+		return FALSE;
+	return !memcmp(rsp + pos + 2, out->Result.Root, CR50_QUOTE_HASH_SIZE);
+}
+
+/*
+ * Sends @count quotes of PCRs 0-7 of SHA-256 with key @handle at once,
+ * each over its own random nonce, and checks every inclusion proof.
+ */
+static int CmdQuote(ULONG handle, ULONG count, const char* password) {
+	PCR50_QUOTE inputs = calloc(count, sizeof(*inputs));
+	PQUOTE_OUTPUT outputs = calloc(count, sizeof(*outputs));
+	OVERLAPPED* ov = calloc(count, sizeof(*ov));
+	ULONG answered = 0, verified = 0, failed = 0, busy = 0;
+	ULONG64 waitUs = 0, latencyUs = 0;
+	double quotes = 0;
+	DWORD outLen;
+	HANDLE quoter = INVALID_HANDLE_VALUE;
+
+	if (!inputs || !outputs || !ov)
+		goto out;
+
+	quoter = OpenCr50(FILE_FLAG_OVERLAPPED);
+	if (quoter == INVALID_HANDLE_VALUE)
+		goto out;
+
+	for (ULONG i = 0; i < count; i++) {
+		PCR50_QUOTE in = &inputs[i];
+		static const UCHAR pcrs[] = { 0, 0, 0, 1, 0x00, 0x0b, 3, 0xff, 0, 0 };
+
+		in->SignHandle = handle;
+		in->Scheme = 0x0010;		/* TPM_ALG_NULL, the key's scheme */
+		in->HashAlg = 0x0010;
+		if (password) {
+			in->PasswordLength = (ULONG)min(strlen(password), CR50_NV_MAX_PASSWORD);
+			memcpy(in->Password, password, in->PasswordLength);
+		}
+		in->PcrSelectLength = sizeof(pcrs);
+		memcpy(in->PcrSelect, pcrs, sizeof(pcrs));
+		in->NonceLength = 32;
+		BCryptGenRandom(NULL, in->Nonce, in->NonceLength, BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+
+		ov[i].hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (!ov[i].hEvent ||
+			(!DeviceIoControl(quoter, IOCTL_CR50_QUOTE, in, sizeof(*in), &outputs[i],
+			sizeof(outputs[i]), NULL, &ov[i]) && GetLastError() != ERROR_IO_PENDING)) {
+			if (GetLastError() == ERROR_BUSY)
+				busy++;
+			else
+				failed++;
+			if (ov[i].hEvent)
+				CloseHandle(ov[i].hEvent);
+			ov[i].hEvent = NULL;
+		}
+	}
+
+	for (ULONG i = 0; i < count; i++) {
+		PCR50_QUOTE_RESULT r = &outputs[i].Result;
+
+		if (!ov[i].hEvent)
+			continue;
+		if (!GetOverlappedResult(quoter, &ov[i], &outLen, TRUE) || r->Status ||
+			r->ResponseCode) {
+			failed++;
+		}
+		else {
+			answered++;
+			quotes += 1.0 / r->Requests;
+			waitUs += r->WaitUs;
+			latencyUs += r->LatencyUs;
+			if (VerifyProof(inputs[i].Nonce, inputs[i].NonceLength, r) &&
+				QuoteHasRoot(&outputs[i]))
+				verified++;
+		}
+		CloseHandle(ov[i].hEvent);
+	}
+
+	printf("%lu requests answered by %.0f quotes, %lu proofs verified, %lu failed, %lu busy\n",
+		answered, quotes, verified, failed, busy);
+	if (answered)
+		printf("avg wait %llu us, avg latency %llu us\n", waitUs / answered,
+			latencyUs / answered);
+
+out:
+	if (quoter != INVALID_HANDLE_VALUE)
+		CloseHandle(quoter);
+	free(inputs);
+	free(outputs);
+	free(ov);
+	return answered && verified == answered && !failed ? 0 : 1;
+}
+
+static void Usage(void) {
+	fprintf(stderr,
+		"usage: cr50tool stats [reset]\n"
+		"       cr50tool trace <file>\n"
+		"       cr50tool health\n"
+		"       cr50tool decode <file>\n"
+		"       cr50tool send <hex> [locality]\n"
+		"       cr50tool keypool <depth> <create hex> [locality]\n"
+		"       cr50tool bench <threads> <seconds> [random8|random32|selftest] [json]\n"
+		"       cr50tool batch <count> [random8|random32|selftest] [stop]\n"
+		"       cr50tool shared <count> [random8|random32|selftest]\n"
+		"       cr50tool nvwrite <index> <file> [offset] [password]\n"
+		"       cr50tool quote <handle> <count> [password]\n");
+}
+
+int main(int argc, char** argv) {
+	HANDLE device;
+	int ret;
+
+	if (argc < 2) {
+		Usage();
+		return 1;
+	}
+
+	if (!strcmp(argv[1], "decode")) {
+		if (argc < 3) {
+			Usage();
+			return 1;
+		}
+		return CmdDecode(argv[2]);
+	}
+
+	device = OpenCr50(0);
+	if (device == INVALID_HANDLE_VALUE)
+		return 1;
+
+	if (!strcmp(argv[1], "stats")) {
+		ret = CmdStats(device, argc > 2 && !strcmp(argv[2], "reset"));
+	}
+	else if (!strcmp(argv[1], "trace") && argc > 2) {
+		ret = CmdTrace(device, argv[2]);
+	}
+	else if (!strcmp(argv[1], "health")) {
+		ret = CmdHealth(device);
+	}
+	else if (!strcmp(argv[1], "send") && argc > 2) {
+		ret = CmdSend(device, argv[2], argc > 3 ? strtoul(argv[3], NULL, 0) : 0);
+	}
+	else if (!strcmp(argv[1], "keypool") && argc > 3) {
+		ret = CmdKeyPool(device, strtoul(argv[2], NULL, 0), argv[3],
+			argc > 4 ? strtoul(argv[4], NULL, 0) : 0);
+	}
+	else if (!strcmp(argv[1], "bench") && argc > 3 && atoi(argv[2]) > 0 && atoi(argv[3]) > 0) {
+		const BENCH_WORKLOAD* w = &Workloads[0];
+		BOOL json = FALSE;
+
+		ret = 0;
+		for (int i = 4; i < argc; i++) {
+			if (!strcmp(argv[i], "json")) {
+				json = TRUE;
+				continue;
+			}
+			w = NULL;
+			for (int j = 0; j < ARRAYSIZE(Workloads); j++) {
+				if (!strcmp(argv[i], Workloads[j].Name))
+					w = &Workloads[j];
+			}
+			if (!w)
+				break;
+		}
+
+		if (w) {
+			ret = CmdBench(device, atoi(argv[2]), atoi(argv[3]), w, json);
+		}
+		else {
+			Usage();
+			ret = 1;
+		}
+	}
+	else if (!strcmp(argv[1], "batch") && argc > 2 && atoi(argv[2]) > 0 &&
+		atoi(argv[2]) <= CR50_BATCH_MAX_COMMANDS) {
+		const BENCH_WORKLOAD* w = &Workloads[0];
+		BOOL stop = FALSE;
+
+		for (int i = 3; i < argc && w; i++) {
+			if (!strcmp(argv[i], "stop")) {
+				stop = TRUE;
+				continue;
+			}
+			w = NULL;
+			for (int j = 0; j < ARRAYSIZE(Workloads); j++) {
+				if (!strcmp(argv[i], Workloads[j].Name))
+					w = &Workloads[j];
+			}
+		}
+
+		if (w) {
+			ret = CmdBatch(device, atoi(argv[2]), w, stop);
+		}
+		else {
+			Usage();
+			ret = 1;
+		}
+	}
+	else if (!strcmp(argv[1], "shared") && argc > 2 && atoi(argv[2]) > 0) {
+		const BENCH_WORKLOAD* w = &Workloads[0];
+
+		if (argc > 3) {
+			w = NULL;
+			for (int j = 0; j < ARRAYSIZE(Workloads); j++) {
+				if (!strcmp(argv[3], Workloads[j].Name))
+					w = &Workloads[j];
+			}
+		}
+
+		if (w) {
+			ret = CmdShared(atoi(argv[2]), w);
+		}
+		else {
+			Usage();
+			ret = 1;
+		}
+	}
+	else if (!strcmp(argv[1], "nvwrite") && argc > 3) {
+		ret = CmdNvWrite(device, strtoul(argv[2], NULL, 0), argv[3],
+			argc > 4 ? strtoul(argv[4], NULL, 0) : 0, argc > 5 ? argv[5] : NULL);
+	}
+	else if (!strcmp(argv[1], "quote") && argc > 3 && atoi(argv[3]) > 0) {
+		ret = CmdQuote(strtoul(argv[2], NULL, 0), atoi(argv[3]), argc > 4 ? argv[4] : NULL);
+	}
+	else {
+		Usage();
+		ret = 1;
+	}
+
+	CloseHandle(device);
+	return ret;
+}
@@ -0,0 +1,412 @@
+/*
+ * cr50bench - commands per second and bus cost per command of the
+ * driver, on the host against the chip model
+ *
+ *   cr50bench [model=<name>|all] [workload=<name>|all] [commands=<n>]
+ *             [idle_ms=<n>] [clock_khz=<n>] [overhead_us=<n>] [ready_us=<n>]
+ *             [irq_us=<n>] [exec_us=<n>] [sleep_ms=<n>] [wake_us=<n>]
+ *             [ti50] [json]
+ *
+ * Each workload is sent the given number of times, one at a time, after
+ * one command that starts the TPM up. idle_ms leaves the bus idle before
+ * each command, so that with sleep_ms below it every command pays the
+ * wake-up. Times are those of the model on the shim's virtual clock, so
+ * runs are repeatable and can be compared across changes; with json the
+ * results are a JSON array on stdout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cr50host.h"
+
+typedef struct _BENCH_MODEL {
+	const char* Name;
+	BOOLEAN Spi;
+	ULONG ClockKHz;
+} BENCH_MODEL;
+
+static const BENCH_MODEL Models[] = {
+	{ "i2c-100k", FALSE, 100 },
+	{ "i2c-400k", FALSE, 400 },
+	{ "i2c-1m", FALSE, 1000 },
+	{ "spi-1m", TRUE, 1000 },
+	{ "spi-4m", TRUE, 4000 },
+	{ "spi-10m", TRUE, 10000 },
+};
+
+/*
+ * Defaults of the rest of the model: a controller and driver stack cost
+ * per SPB request, the TPM's time to raise ready (or release flow
+ * control), interrupt delivery, execution of the small commands below
+ * and the wake-up of a chip that slept.
+ */
+#define BENCH_OVERHEAD_US	30
+#define BENCH_READY_US		40
+#define BENCH_IRQ_US		10
+#define BENCH_EXEC_US		250
+#define BENCH_SLEEP_MS		1000
+#define BENCH_WAKE_US		150
+
+#define BENCH_COMMANDS		200
+
+typedef struct _BENCH_WORKLOAD {
+	const char* Name;
+	ULONG CommandCode;
+	ULONG Length;
+	UCHAR Command[16];
+} BENCH_WORKLOAD;
+
+static const BENCH_WORKLOAD Workloads[] = {
+	/* TPM2_GetRandom(8) and (32) */
+	{ "random8", 0x17b, 12, { 0x80, 0x01, 0, 0, 0, 12, 0, 0, 0x01, 0x7b, 0x00, 0x08 } },
+	{ "random32", 0x17b, 12, { 0x80, 0x01, 0, 0, 0, 12, 0, 0, 0x01, 0x7b, 0x00, 0x20 } },
+	/* TPM2_IncrementalSelfTest with an empty list */
+	{ "selftest", 0x142, 14, { 0x80, 0x01, 0, 0, 0, 14, 0, 0, 0x01, 0x42, 0, 0, 0, 0 } },
+};
+
+static const char* PhaseNames[Cr50PhaseCount] = { "queue", "send", "execute", "receive" };
+
+/* Only the commands under test reach the TPM */
+static const CR50_HOST_SETTING Settings[] = {
+	{ "SessionPool", 0 },
+	{ "KeyPoolDepth", 0 },
+	{ NULL, 0 }
+};
+
+typedef struct _BENCH_OPTIONS {
+	const BENCH_MODEL* Model;	/* NULL for all */
+	const BENCH_WORKLOAD* Workload;	/* NULL for all */
+	ULONG Commands;
+	ULONG IdleMs;
+	CR50_SIM_CONFIG Config;		/* Besides the transport and clock */
+	BOOLEAN Json;
+} BENCH_OPTIONS;
+
+typedef struct _BENCH_RESULT {
+	ULONG Completed;
+	ULONG Failed;
+	LONGLONG* Latency;		/* 100ns units */
+	LONGLONG Elapsed;
+	CR50_SIM_COUNTERS Bus;		/* Over the measured commands */
+	CR50_COMMAND_STATS Driver;
+} BENCH_RESULT;
+
+static int CompareLongLong(const void* a, const void* b) {
+	LONGLONG x = *(const LONGLONG*)a, y = *(const LONGLONG*)b;
+	return x < y ? -1 : x > y;
+}
+
+static double Us(LONGLONG ticks) {
+	return ticks / 10.0;
+}
+
+static double Percentile(const LONGLONG* sorted, ULONG count, double pct) {
+	ULONG i = (ULONG)(count * pct);
+
+	return count ? Us(sorted[min(i, count - 1)]) : 0;
+}
+
+/* What the driver counted for @commandCode since the stats were reset */
+static NTSTATUS QueryCommand(CR50_HOST* host, ULONG commandCode, CR50_COMMAND_STATS* command) {
+	static UCHAR buf[64 * 1024];
+	PCR50_STATS stats = (PCR50_STATS)buf;
+	ULONG_PTR returned;
+	NTSTATUS status;
+
+	RtlZeroMemory(command, sizeof(*command));
+
+	status = cr50_shim_ioctl(host->File, IOCTL_CR50_QUERY_STATS, NULL, 0, buf, sizeof(buf),
+		&returned);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	for (ULONG i = 0; i < stats->CommandsReturned; i++) {
+		if (stats->Commands[i].CommandCode == commandCode) {
+			*command = stats->Commands[i];
+			break;
+		}
+	}
+	return STATUS_SUCCESS;
+}
+
+static void Delta(CR50_SIM_COUNTERS* d, const CR50_SIM_COUNTERS* before,
+	const CR50_SIM_COUNTERS* after) {
+	d->Requests = after->Requests - before->Requests;
+	d->BytesOut = after->BytesOut - before->BytesOut;
+	d->BytesIn = after->BytesIn - before->BytesIn;
+	d->Frames = after->Frames - before->Frames;
+	d->Polls = after->Polls - before->Polls;
+	d->ReadyPulses = after->ReadyPulses - before->ReadyPulses;
+	d->Wakes = after->Wakes - before->Wakes;
+	d->Commands = after->Commands - before->Commands;
+}
+
+static NTSTATUS Run(const BENCH_OPTIONS* o, const BENCH_MODEL* m, const BENCH_WORKLOAD* w,
+	BENCH_RESULT* r) {
+	CR50_SIM_CONFIG config = o->Config;
+	CR50_SIM_COUNTERS before, after;
+	CR50_HOST* host;
+	UCHAR rsp[64];
+	size_t len;
+	ULONG_PTR returned;
+	LONGLONG start;
+	NTSTATUS status;
+
+	RtlZeroMemory(r, sizeof(*r));
+	r->Latency = calloc(o->Commands ? o->Commands : 1, sizeof(LONGLONG));
+	if (!r->Latency) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	config.Spi = m->Spi;
+	if (!config.ClockKHz)
+		config.ClockKHz = m->ClockKHz;
+
+	status = cr50_host_open(&config, Settings, &host);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	/* Startup and self test happen with the first command */
+	status = cr50_host_transmit(host, w->Command, w->Length, rsp, sizeof(rsp), &len);
+	if (NT_SUCCESS(status)) {
+		status = cr50_shim_ioctl(host->File, IOCTL_CR50_RESET_STATS, NULL, 0, NULL, 0,
+			&returned);
+	}
+	if (!NT_SUCCESS(status)) {
+		cr50_host_close(host);
+		return status;
+	}
+
+	cr50_sim_counters(host->Sim, &before);
+	start = cr50_shim_now();
+
+	for (ULONG i = 0; i < o->Commands; i++) {
+		LONGLONG begin;
+
+		cr50_shim_advance(CR50_SHIM_MS(o->IdleMs));
+
+		begin = cr50_shim_now();
+		status = cr50_host_transmit(host, w->Command, w->Length, rsp, sizeof(rsp), &len);
+		if (!NT_SUCCESS(status) || len < TPM_HEADER_SIZE || rsp[6] || rsp[7] || rsp[8] || rsp[9]) {
+			r->Failed++;
+			continue;
+		}
+		r->Latency[r->Completed++] = cr50_shim_now() - begin;
+	}
+
+	r->Elapsed = cr50_shim_now() - start;
+	cr50_sim_counters(host->Sim, &after);
+	Delta(&r->Bus, &before, &after);
+	status = QueryCommand(host, w->CommandCode, &r->Driver);
+
+	cr50_host_close(host);
+
+	qsort(r->Latency, r->Completed, sizeof(LONGLONG), CompareLongLong);
+	return status;
+}
+
+static void Print(const BENCH_OPTIONS* o, const BENCH_MODEL* m, const BENCH_WORKLOAD* w,
+	const BENCH_RESULT* r, BOOLEAN first) {
+	double n = r->Completed ? r->Completed : 1;
+	double mean = 0;
+	/* Idle time between commands is not the driver's */
+	double busy = Us(r->Elapsed - CR50_SHIM_MS(o->IdleMs) * (LONGLONG)o->Commands);
+
+	for (ULONG i = 0; i < r->Completed; i++)
+		mean += Us(r->Latency[i]);
+	mean /= n;
+
+	if (o->Json) {
+		printf("%s{\"model\": \"%s\", \"transport\": \"%s\", \"chip\": \"%s\", "
+			"\"clock_khz\": %u, \"overhead_us\": %u, \"ready_us\": %u, \"irq_us\": %u, "
+			"\"exec_us\": %u, \"sleep_ms\": %u, \"wake_us\": %u, \"idle_ms\": %u,\n",
+			first ? "[" : ",\n", m->Name, m->Spi ? "spi" : "i2c", o->Config.Ti50 ? "ti50" : "cr50",
+			o->Config.ClockKHz ? o->Config.ClockKHz : m->ClockKHz, o->Config.OverheadUs,
+			o->Config.ReadyUs, o->Config.IrqUs, o->Config.ExecUs, o->Config.SleepMs,
+			o->Config.WakeUs, o->IdleMs);
+		printf(" \"workload\": \"%s\", \"commands\": %u, \"failed\": %u, "
+			"\"per_second\": %.1f,\n",
+			w->Name, r->Completed, r->Failed, busy > 0 ? r->Completed * 1e6 / busy : 0);
+		printf(" \"latency_us\": {\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, "
+			"\"p99\": %.1f, \"max\": %.1f},\n",
+			Percentile(r->Latency, r->Completed, 0), mean,
+			Percentile(r->Latency, r->Completed, 0.50),
+			Percentile(r->Latency, r->Completed, 0.90),
+			Percentile(r->Latency, r->Completed, 0.99),
+			Percentile(r->Latency, r->Completed, 1));
+		printf(" \"per_command\": {\"transactions\": %.2f, \"bytes_out\": %.2f, "
+			"\"bytes_in\": %.2f, \"status_polls\": %.2f, \"flow_polls\": %.2f, "
+			"\"ready_pulses\": %.2f, \"frames\": %.2f, \"wakes\": %.2f},\n",
+			r->Bus.Requests / n, r->Bus.BytesOut / n, r->Bus.BytesIn / n,
+			r->Driver.StatusPolls / n, r->Bus.Polls / n, r->Bus.ReadyPulses / n,
+			r->Bus.Frames / n, r->Bus.Wakes / n);
+		printf(" \"phases_us\": {");
+		for (int p = 0; p < Cr50PhaseCount; p++) {
+			printf("%s\"%s\": %.1f", p ? ", " : "", PhaseNames[p],
+				r->Driver.Count ? (double)r->Driver.TotalUs[p] / r->Driver.Count : 0);
+		}
+		printf("}}");
+		return;
+	}
+
+	printf("%s %s at %u kHz, %s: %u commands, %u failed, %.1f/s\n",
+		m->Name, o->Config.Ti50 ? "ti50" : "cr50",
+		o->Config.ClockKHz ? o->Config.ClockKHz : m->ClockKHz, w->Name,
+		r->Completed, r->Failed, busy > 0 ? r->Completed * 1e6 / busy : 0);
+	printf("  latency: min %.1f us, mean %.1f us, p50 %.1f us, p90 %.1f us, p99 %.1f us, "
+		"max %.1f us\n",
+		Percentile(r->Latency, r->Completed, 0), mean,
+		Percentile(r->Latency, r->Completed, 0.50),
+		Percentile(r->Latency, r->Completed, 0.90),
+		Percentile(r->Latency, r->Completed, 0.99),
+		Percentile(r->Latency, r->Completed, 1));
+	printf("  per command: %.1f transactions, %.1f bytes out, %.1f bytes in, "
+		"%.1f status polls, %.1f %s, %.2f wakes\n",
+		r->Bus.Requests / n, r->Bus.BytesOut / n, r->Bus.BytesIn / n,
+		r->Driver.StatusPolls / n,
+		m->Spi ? r->Bus.Polls / n : r->Bus.ReadyPulses / n,
+		m->Spi ? "flow control polls" : "ready pulses", r->Bus.Wakes / n);
+}
+
+static void Usage(void) {
+	fprintf(stderr,
+		"Usage: cr50bench [model=<name>|all] [workload=<name>|all] [commands=<n>]\n"
+		"                 [idle_ms=<n>] [clock_khz=<n>] [overhead_us=<n>] [ready_us=<n>]\n"
+		"                 [irq_us=<n>] [exec_us=<n>] [sleep_ms=<n>] [wake_us=<n>]\n"
+		"                 [ti50] [json]\n"
+		"Models:");
+	for (size_t i = 0; i < ARRAYSIZE(Models); i++)
+		fprintf(stderr, " %s", Models[i].Name);
+	fprintf(stderr, "\nWorkloads:");
+	for (size_t i = 0; i < ARRAYSIZE(Workloads); i++)
+		fprintf(stderr, " %s", Workloads[i].Name);
+	fprintf(stderr, "\n");
+}
+
+/* Parses "<name>=<value>" into @value if @arg names @name */
+static BOOLEAN Option(const char* arg, const char* name, const char** value) {
+	size_t len = strlen(name);
+
+	if (strncmp(arg, name, len) || arg[len] != '=')
+		return FALSE;
+	*value = arg + len + 1;
+	return TRUE;
+}
+
+int main(int argc, char** argv) {
+	BENCH_OPTIONS o = {
+		.Commands = BENCH_COMMANDS,
+		.Config = {
+			.OverheadUs = BENCH_OVERHEAD_US,
+			.ReadyUs = BENCH_READY_US,
+			.IrqUs = BENCH_IRQ_US,
+			.ExecUs = BENCH_EXEC_US,
+			.SleepMs = BENCH_SLEEP_MS,
+			.WakeUs = BENCH_WAKE_US,
+		},
+	};
+	BOOLEAN first = TRUE;
+	int ret = 0;
+
+	for (int i = 1; i < argc; i++) {
+		const char* v;
+
+		if (!strcmp(argv[i], "json")) {
+			o.Json = TRUE;
+		}
+		else if (!strcmp(argv[i], "ti50")) {
+			o.Config.Ti50 = TRUE;
+		}
+		else if (Option(argv[i], "model", &v)) {
+			o.Model = NULL;
+			for (size_t j = 0; j < ARRAYSIZE(Models); j++) {
+				if (!strcmp(v, Models[j].Name))
+					o.Model = &Models[j];
+			}
+			if (!o.Model && strcmp(v, "all")) {
+				Usage();
+				return 1;
+			}
+		}
+		else if (Option(argv[i], "workload", &v)) {
+			o.Workload = NULL;
+			for (size_t j = 0; j < ARRAYSIZE(Workloads); j++) {
+				if (!strcmp(v, Workloads[j].Name))
+					o.Workload = &Workloads[j];
+			}
+			if (!o.Workload && strcmp(v, "all")) {
+				Usage();
+				return 1;
+			}
+		}
+		else if (Option(argv[i], "commands", &v)) {
+			o.Commands = strtoul(v, NULL, 0);
+		}
+		else if (Option(argv[i], "idle_ms", &v)) {
+			o.IdleMs = strtoul(v, NULL, 0);
+		}
+		else if (Option(argv[i], "clock_khz", &v)) {
+			o.Config.ClockKHz = strtoul(v, NULL, 0);
+		}
+		else if (Option(argv[i], "overhead_us", &v)) {
+			o.Config.OverheadUs = strtoul(v, NULL, 0);
+		}
+		else if (Option(argv[i], "ready_us", &v)) {
+			o.Config.ReadyUs = strtoul(v, NULL, 0);
+		}
+		else if (Option(argv[i], "irq_us", &v)) {
+			o.Config.IrqUs = strtoul(v, NULL, 0);
+		}
+		else if (Option(argv[i], "exec_us", &v)) {
+			o.Config.ExecUs = strtoul(v, NULL, 0);
+		}
+		else if (Option(argv[i], "sleep_ms", &v)) {
+			o.Config.SleepMs = strtoul(v, NULL, 0);
+		}
+		else if (Option(argv[i], "wake_us", &v)) {
+			o.Config.WakeUs = strtoul(v, NULL, 0);
+		}
+		else {
+			Usage();
+			return 1;
+		}
+	}
+
+	for (size_t i = 0; i < ARRAYSIZE(Models); i++) {
+		const BENCH_MODEL* m = &Models[i];
+
+		if (o.Model && o.Model != m)
+			continue;
+
+		for (size_t j = 0; j < ARRAYSIZE(Workloads); j++) {
+			const BENCH_WORKLOAD* w = &Workloads[j];
+			BENCH_RESULT r;
+			NTSTATUS status;
+
+			if (o.Workload && o.Workload != w)
+				continue;
+
+			status = Run(&o, m, w, &r);
+			if (!NT_SUCCESS(status)) {
+				fprintf(stderr, "%s %s: failed with 0x%x\n", m->Name, w->Name,
+					(unsigned)status);
+				ret = 1;
+			}
+			else {
+				Print(&o, m, w, &r, first);
+				first = FALSE;
+				if (r.Failed)
+					ret = 1;
+			}
+			free(r.Latency);
+		}
+	}
+
+	if (o.Json)
+		printf(first ? "[]\n" : "]\n");
+	return ret;
+}
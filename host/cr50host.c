@@ -0,0 +1,100 @@
+#include "cr50host.h"
+
+#include <stdlib.h>
+
+NTSTATUS cr50_host_open(const CR50_SIM_CONFIG* Config, const CR50_HOST_SETTING* Settings,
+	CR50_HOST** Host) {
+	CR50_HOST* host;
+	NTSTATUS status;
+
+	*Host = NULL;
+
+	host = calloc(1, sizeof(*host));
+	if (!host) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	cr50_shim_registry_reset();
+	for (; Settings && Settings->Name; Settings++) {
+		cr50_shim_setting(Settings->Name, Settings->Value);
+	}
+
+	host->Sim = cr50_sim_create(Config);
+	if (!host->Sim) {
+		free(host);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	status = cr50_shim_add_device(DriverEntry, &host->Device);
+	if (!NT_SUCCESS(status)) {
+		goto fail_sim;
+	}
+	host->Context = GetDeviceContext(host->Device);
+
+	/* The ready pulse is only wired up on I2C boards */
+	cr50_sim_connection(host->Sim, &host->Resources[host->List.Count++]);
+	if (!Config->Spi) {
+		PCM_PARTIAL_RESOURCE_DESCRIPTOR irq = &host->Resources[host->List.Count++];
+
+		irq->Type = CmResourceTypeInterrupt;
+		irq->Flags = CM_RESOURCE_INTERRUPT_LATCHED;
+	}
+	host->List.Descriptors = host->Resources;
+
+	status = cr50_shim_prepare_hardware(host->Device, &host->List);
+	if (!NT_SUCCESS(status)) {
+		goto fail_device;
+	}
+
+	status = cr50_shim_d0_entry(host->Device, WdfPowerDeviceD3);
+	if (!NT_SUCCESS(status)) {
+		goto fail_hardware;
+	}
+
+	status = cr50_shim_open(host->Device, &host->File);
+	if (!NT_SUCCESS(status)) {
+		goto fail_d0;
+	}
+
+	*Host = host;
+	return STATUS_SUCCESS;
+
+fail_d0:
+	cr50_shim_d0_exit(host->Device, WdfPowerDeviceD3);
+fail_hardware:
+	cr50_shim_release_hardware(host->Device);
+fail_device:
+	cr50_shim_remove_device(host->Device);
+fail_sim:
+	cr50_sim_destroy(host->Sim);
+	free(host);
+	return status;
+}
+
+void cr50_host_close(CR50_HOST* Host) {
+	cr50_shim_close(Host->File);
+	cr50_shim_d0_exit(Host->Device, WdfPowerDeviceD3);
+	cr50_shim_release_hardware(Host->Device);
+	cr50_shim_remove_device(Host->Device);
+	cr50_sim_destroy(Host->Sim);
+	free(Host);
+}
+
+NTSTATUS cr50_host_transmit(CR50_HOST* Host, const UINT8* Command, size_t CommandLength,
+	UINT8* Response, size_t ResponseSize, size_t* ResponseLength) {
+	ULONG_PTR information = 0;
+	NTSTATUS status;
+
+	status = cr50_shim_ioctl(Host->File, IOCTL_CR50_SUBMIT_COMMAND,
+		(PVOID)Command, CommandLength, Response, ResponseSize, &information);
+	*ResponseLength = NT_SUCCESS(status) ? information : 0;
+	return status;
+}
+
+NTSTATUS cr50_host_sleep(CR50_HOST* Host) {
+	return cr50_shim_d0_exit(Host->Device, WdfPowerDeviceD3);
+}
+
+NTSTATUS cr50_host_wake(CR50_HOST* Host) {
+	return cr50_shim_d0_entry(Host->Device, WdfPowerDeviceD3);
+}
@@ -0,0 +1,42 @@
+/*
+ * One driver instance on the host: the shim plays PnP and the I/O
+ * manager, the chip model stands behind the SPB calls. Used by the
+ * unit tests and the host tools.
+ */
+
+#pragma once
+
+#include "driver.h"
+
+#include "cr50sim.h"
+#include "shim.h"
+
+typedef struct _CR50_HOST_SETTING {
+	PCSTR Name;		/* NULL ends a list */
+	ULONG Value;
+} CR50_HOST_SETTING;
+
+typedef struct _CR50_HOST {
+	CR50_SIM* Sim;
+	WDFDEVICE Device;
+	PCR50_CONTEXT Context;
+	WDFFILEOBJECT File;
+	CM_PARTIAL_RESOURCE_DESCRIPTOR Resources[2];
+	CR50_SHIM_RESOURCES List;
+} CR50_HOST;
+
+/*
+ * Adds a device for a chip modeled by @Config, with @Settings (may be
+ * NULL) in its registry key, starts it to D0 and opens a handle.
+ */
+NTSTATUS cr50_host_open(const CR50_SIM_CONFIG* Config, const CR50_HOST_SETTING* Settings,
+	CR50_HOST** Host);
+void cr50_host_close(CR50_HOST* Host);
+
+/* Sends a command through IOCTL_CR50_SUBMIT_COMMAND */
+NTSTATUS cr50_host_transmit(CR50_HOST* Host, const UINT8* Command, size_t CommandLength,
+	UINT8* Response, size_t ResponseSize, size_t* ResponseLength);
+
+/* D0 exit to D3 and entry again, as an idle timeout and the next request would */
+NTSTATUS cr50_host_sleep(CR50_HOST* Host);
+NTSTATUS cr50_host_wake(CR50_HOST* Host);
@@ -0,0 +1,802 @@
+#include "driver.h"
+
+#include <pthread.h>
+
+#include "cr50sim.h"
+#include "shim.h"
+
+/*
+ * Wire time. I2C spends 9 clocks a byte (8 data bits and the
+ * acknowledge) and sends the target address before the data of every
+ * request. SPI spends 8 clocks a byte; the frame header is data as far
+ * as the controller is concerned.
+ */
+#define CR50_SIM_I2C_BYTE_CLOCKS	9
+#define CR50_SIM_I2C_FRAMING		1
+#define CR50_SIM_SPI_BYTE_CLOCKS	8
+
+/* Burst count reported in STS, one less than the bus buffer like Cr50 */
+#define CR50_SIM_BURST		(TPM_CR50_MAX_BUFSIZE - 1)
+
+#define CR50_SIM_RC_COMMAND_CODE 0x0143
+
+#define CR50_SIM_SEED		0x9e3779b97f4a7c15ULL
+
+/* How far ahead a replayed transfer may be matched, polls can differ in number */
+#define CR50_SIM_REPLAY_WINDOW	64
+
+typedef enum {
+	Cr50SimIdle,
+	Cr50SimReady,
+	Cr50SimReception,
+	Cr50SimExecution,
+	Cr50SimCompletion
+} CR50_SIM_STATE;
+
+typedef enum {
+	CR50_SIM_REG_ACCESS,
+	CR50_SIM_REG_STS,
+	CR50_SIM_REG_DATA_FIFO,
+	CR50_SIM_REG_DID_VID,
+	CR50_SIM_REG_UNKNOWN
+} CR50_SIM_REG;
+
+struct _CR50_SIM {
+	CR50_SIM_CONFIG Config;
+	pthread_mutex_t Lock;
+	WDFDEVICE FxDevice;
+	CR50_SIM_COUNTERS Counters;
+
+	/* Bus */
+	UINT8 Pointer;			/* I2C register the next read returns */
+	ULONG DropReady;
+	BOOLEAN Selected;		/* SPI chip select, held by SpbLockController */
+	BOOLEAN Asleep;
+	LONGLONG LastAccess;
+	LONGLONG AwakeTime;		/* SPI: when the chip answers after a wake pulse */
+
+	/* SPI frame in progress */
+	BOOLEAN FrameActive;
+	BOOLEAN FrameRead;
+	BOOLEAN FrameAcked;		/* Flow control released the data phase */
+	BOOLEAN FrameDone;
+	BOOLEAN FrameNak;		/* Sent to a sleeping chip */
+	size_t FrameLength;
+	UINT32 FrameAddr;
+	LONGLONG FrameReady;
+
+	/* TIS */
+	CR50_SIM_STATE State;
+	UINT8 ActiveLocality;
+	UINT8 PendingLocalities;	/* Bit per locality */
+	BOOLEAN Started;
+	ULONG Received;
+	ULONG ResponseLength;
+	ULONG ResponseRead;
+	LONGLONG DoneTime;
+	ULONG64 Random;
+	UINT8 Buffer[CR50_MAX_COMMAND_SIZE];
+	UINT8 LastCommand[CR50_MAX_COMMAND_SIZE];
+	ULONG LastCommandLength;
+	CR50_SIM_HANDLER* Handler;
+	PVOID HandlerContext;
+
+	/* Replay */
+	const CR50_TRACE_ENTRY* Replay;
+	ULONG ReplayCount;
+	ULONG ReplayNext;
+	ULONG ReplaySpeedup;
+};
+
+static void cr50_sim_put16(UINT8* p, UINT16 v) {
+	p[0] = (UINT8)(v >> 8);
+	p[1] = (UINT8)v;
+}
+
+static void cr50_sim_put32(UINT8* p, UINT32 v) {
+	p[0] = (UINT8)(v >> 24);
+	p[1] = (UINT8)(v >> 16);
+	p[2] = (UINT8)(v >> 8);
+	p[3] = (UINT8)v;
+}
+
+static UINT32 cr50_sim_get32(const UINT8* p) {
+	return (UINT32)p[0] << 24 | (UINT32)p[1] << 16 | (UINT32)p[2] << 8 | p[3];
+}
+
+static UINT8 cr50_sim_random(CR50_SIM* sim) {
+	/* xorshift64, plenty for a stand-in */
+	sim->Random ^= sim->Random << 13;
+	sim->Random ^= sim->Random >> 7;
+	sim->Random ^= sim->Random << 17;
+	return (UINT8)sim->Random;
+}
+
+//
+// TPM
+//
+
+/* Runs the received command and leaves the response in the buffer */
+static void cr50_sim_execute(CR50_SIM* sim) {
+	UINT8* buf = sim->Buffer;
+	UINT32 ordinal = cr50_sim_get32(buf + 6);
+	UINT32 rc = TPM2_RC_SUCCESS;
+	ULONG len = TPM_HEADER_SIZE;
+
+	RtlCopyMemory(sim->LastCommand, buf, sim->Received);
+	sim->LastCommandLength = sim->Received;
+	sim->Counters.Commands++;
+
+	if (sim->Started && sim->Handler) {
+		size_t handled = sim->Handler(sim->HandlerContext, buf, sim->Received,
+			sizeof(sim->Buffer));
+
+		if (handled) {
+			sim->ResponseLength = (ULONG)handled;
+			sim->ResponseRead = 0;
+			return;
+		}
+	}
+
+	if (!sim->Started && ordinal != TPM2_CC_STARTUP) {
+		rc = TPM2_RC_INITIALIZE;
+	}
+	else switch (ordinal) {
+	case TPM2_CC_STARTUP:
+		if (sim->Started)
+			rc = TPM2_RC_INITIALIZE;
+		sim->Started = TRUE;
+		break;
+	case TPM2_CC_SHUTDOWN:
+		sim->Started = FALSE;
+		break;
+	case TPM2_CC_INCREMENTAL_SELF_TEST:
+		/* Empty toDoList: every algorithm has been tested */
+		cr50_sim_put32(buf + len, 0);
+		len += 4;
+		break;
+	case TPM2_CC_GET_RANDOM: {
+		UINT16 count = sim->Received >= TPM_HEADER_SIZE + 2 ?
+			(UINT16)(buf[TPM_HEADER_SIZE] << 8 | buf[TPM_HEADER_SIZE + 1]) : 0;
+
+		count = min(count, 32);
+		cr50_sim_put16(buf + len, count);
+		len += 2;
+		for (UINT16 i = 0; i < count; i++)
+			buf[len++] = cr50_sim_random(sim);
+		break;
+	}
+	default:
+		rc = CR50_SIM_RC_COMMAND_CODE;
+		break;
+	}
+
+	cr50_sim_put16(buf, TPM2_ST_NO_SESSIONS);
+	cr50_sim_put32(buf + 2, len);
+	cr50_sim_put32(buf + 6, rc);
+
+	sim->ResponseLength = len;
+	sim->ResponseRead = 0;
+}
+
+/* A cancelled command answers with nothing but TPM_RC_CANCELED */
+static void cr50_sim_cancel(CR50_SIM* sim) {
+	cr50_sim_put16(sim->Buffer, TPM2_ST_NO_SESSIONS);
+	cr50_sim_put32(sim->Buffer + 2, TPM_HEADER_SIZE);
+	cr50_sim_put32(sim->Buffer + 6, TPM2_RC_CANCELED);
+
+	sim->ResponseLength = TPM_HEADER_SIZE;
+	sim->ResponseRead = 0;
+	sim->State = Cr50SimCompletion;
+}
+
+static UINT32 cr50_sim_expected(CR50_SIM* sim) {
+	if (sim->Received < TPM_HEADER_SIZE)
+		return CR50_MAX_COMMAND_SIZE;
+	return cr50_sim_get32(sim->Buffer + 2);
+}
+
+static void cr50_sim_status(CR50_SIM* sim, LONGLONG now, UINT8* sts) {
+	UINT16 burst = (UINT16)sim->Config.Burst;
+
+	sts[0] = TPM_STS_VALID;
+
+	if (sim->State == Cr50SimExecution && now >= sim->DoneTime) {
+		sim->State = Cr50SimCompletion;
+	}
+
+	switch (sim->State) {
+	case Cr50SimReady:
+		sts[0] |= TPM_STS_COMMAND_READY;
+		break;
+	case Cr50SimReception:
+		if (sim->Received < cr50_sim_expected(sim)) {
+			sts[0] |= TPM_STS_DATA_EXPECT;
+		}
+		break;
+	case Cr50SimCompletion:
+		if (sim->ResponseRead < sim->ResponseLength) {
+			sts[0] |= TPM_STS_DATA_AVAIL;
+			burst = (UINT16)min(sim->ResponseLength - sim->ResponseRead, sim->Config.Burst);
+		}
+		break;
+	default:
+		break;
+	}
+
+	/* Burst count is little endian, as the TIS code reads it */
+	sts[1] = (UINT8)burst;
+	sts[2] = (UINT8)(burst >> 8);
+	sts[3] = 0;
+}
+
+static NTSTATUS cr50_sim_access(CR50_SIM* sim, UINT8 locality, BOOLEAN write,
+	UINT8* buf, size_t len) {
+	if (write) {
+		if (buf[0] & TPM_ACCESS_ACTIVE_LOCALITY) {
+			if (sim->ActiveLocality == locality) {
+				/* Grant the highest pending locality, as TIS does */
+				sim->ActiveLocality = CR50_NO_LOCALITY;
+				for (int l = CR50_LOCALITY_COUNT - 1; l >= 0; l--) {
+					if (sim->PendingLocalities & (1 << l)) {
+						sim->PendingLocalities &= ~(1 << l);
+						sim->ActiveLocality = (UINT8)l;
+						break;
+					}
+				}
+			}
+			else {
+				sim->PendingLocalities &= ~(1 << locality);
+			}
+		}
+		else if (buf[0] & TPM_ACCESS_REQUEST_USE) {
+			if (sim->ActiveLocality == CR50_NO_LOCALITY)
+				sim->ActiveLocality = locality;
+			else if (sim->ActiveLocality != locality)
+				sim->PendingLocalities |= 1 << locality;
+		}
+		return STATUS_SUCCESS;
+	}
+
+	RtlZeroMemory(buf, len);
+	buf[0] = TPM_ACCESS_VALID;
+	if (sim->ActiveLocality == locality)
+		buf[0] |= TPM_ACCESS_ACTIVE_LOCALITY;
+	if (sim->PendingLocalities & ~(1 << locality))
+		buf[0] |= TPM_ACCESS_REQUEST_PENDING;
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS cr50_sim_sts(CR50_SIM* sim, LONGLONG now, BOOLEAN write,
+	UINT8* buf, size_t len) {
+	UINT8 sts[4];
+
+	if (!write) {
+		cr50_sim_status(sim, now, sts);
+		RtlCopyMemory(buf, sts, min(len, sizeof(sts)));
+		return STATUS_SUCCESS;
+	}
+
+	if (len >= 4 && (buf[3] & TPM_STS_COMMAND_CANCEL)) {
+		cr50_sim_status(sim, now, sts);
+		if (sim->State == Cr50SimExecution) {
+			cr50_sim_cancel(sim);
+		}
+	}
+	else if (buf[0] & TPM_STS_COMMAND_READY) {
+		/* Aborts whatever was received or executing */
+		sim->State = Cr50SimReady;
+		sim->Received = 0;
+		sim->ResponseLength = 0;
+		sim->ResponseRead = 0;
+	}
+	else if (buf[0] & TPM_STS_GO) {
+		if (sim->State != Cr50SimReception ||
+			sim->Received != cr50_sim_expected(sim)) {
+			return STATUS_IO_DEVICE_ERROR;
+		}
+		cr50_sim_execute(sim);
+		sim->State = Cr50SimExecution;
+		sim->DoneTime = now + CR50_SHIM_US(sim->Config.ExecUs);
+	}
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS cr50_sim_fifo(CR50_SIM* sim, LONGLONG now, BOOLEAN write,
+	UINT8* buf, size_t len) {
+	UINT8 sts[4];
+
+	/*
+	 * The burst count is never zero, as on the real chips; it only says
+	 * how much one transfer may move. The chip NAKs (I2C) or drops (SPI)
+	 * anything longer.
+	 */
+	cr50_sim_status(sim, now, sts);
+	if (len > (size_t)(sts[1] | (sts[2] << 8))) {
+		return STATUS_IO_DEVICE_ERROR;
+	}
+
+	if (write) {
+		if (sim->State == Cr50SimReady) {
+			sim->State = Cr50SimReception;
+			sim->Received = 0;
+		}
+		if (sim->State != Cr50SimReception ||
+			sim->Received + len > cr50_sim_expected(sim) ||
+			sim->Received + len > sizeof(sim->Buffer)) {
+			return STATUS_IO_DEVICE_ERROR;
+		}
+		RtlCopyMemory(sim->Buffer + sim->Received, buf, len);
+		sim->Received += (ULONG)len;
+		return STATUS_SUCCESS;
+	}
+
+	if (sim->State != Cr50SimCompletion ||
+		sim->ResponseRead + len > sim->ResponseLength) {
+		return STATUS_IO_DEVICE_ERROR;
+	}
+	RtlCopyMemory(buf, sim->Buffer + sim->ResponseRead, len);
+	sim->ResponseRead += (ULONG)len;
+	return STATUS_SUCCESS;
+}
+
+static CR50_SIM_REG cr50_sim_decode(CR50_SIM* sim, UINT32 addr, UINT8* locality) {
+	if (!sim->Config.Spi) {
+		*locality = (UINT8)((addr >> 4) & 0xF);
+		switch (addr & 0xF) {
+		case TPM_I2C_ACCESS(0):
+			return CR50_SIM_REG_ACCESS;
+		case TPM_I2C_STS(0):
+			return CR50_SIM_REG_STS;
+		case TPM_I2C_DATA_FIFO(0):
+			return CR50_SIM_REG_DATA_FIFO;
+		case TPM_I2C_DID_VID(0):
+			return CR50_SIM_REG_DID_VID;
+		}
+		return CR50_SIM_REG_UNKNOWN;
+	}
+
+	*locality = (UINT8)((addr >> 12) & 0xF);
+	switch (addr & 0xFFF) {
+	case TPM_ACCESS(0):
+		return CR50_SIM_REG_ACCESS;
+	case TPM_STS(0):
+		return CR50_SIM_REG_STS;
+	case TPM_DATA_FIFO(0):
+		return CR50_SIM_REG_DATA_FIFO;
+	case TPM_DID_VID(0):
+		return CR50_SIM_REG_DID_VID;
+	}
+	return CR50_SIM_REG_UNKNOWN;
+}
+
+//
+// Replay
+//
+
+static BOOLEAN cr50_sim_replaying(CR50_SIM* sim) {
+	return sim->ReplayNext < sim->ReplayCount;
+}
+
+static NTSTATUS cr50_sim_replay_transfer(CR50_SIM* sim, BOOLEAN write, UINT32 addr,
+	UINT8* buf, size_t len) {
+	UCHAR type = write ? Cr50TraceWrite : Cr50TraceRead;
+	ULONG end = min(sim->ReplayCount, sim->ReplayNext + CR50_SIM_REPLAY_WINDOW);
+
+	for (ULONG i = sim->ReplayNext; i < end; i++) {
+		const CR50_TRACE_ENTRY* e = &sim->Replay[i];
+
+		/* Never match into the next command */
+		if (e->Type == Cr50TraceCommandStart)
+			break;
+		if (e->Type != type || e->Register != addr)
+			continue;
+
+		if (!write) {
+			RtlZeroMemory(buf, len);
+			RtlCopyMemory(buf, e->Data, min(len, min(e->Length, sizeof(e->Data))));
+		}
+		if (sim->ReplaySpeedup) {
+			cr50_shim_advance((e->EndTime - e->StartTime) / sim->ReplaySpeedup);
+		}
+		sim->ReplayNext = i + 1;
+		sim->Counters.Replayed++;
+		return e->Result;
+	}
+
+	sim->Counters.ReplayMisses++;
+	return write ? STATUS_SUCCESS : STATUS_IO_DEVICE_ERROR;
+}
+
+/* One register access, with sim->Lock held */
+static NTSTATUS cr50_sim_register(CR50_SIM* sim, BOOLEAN write, UINT32 addr,
+	UINT8* buf, size_t len) {
+	LONGLONG now = cr50_shim_now();
+	UINT8 locality;
+	CR50_SIM_REG reg = cr50_sim_decode(sim, addr, &locality);
+
+	if (cr50_sim_replaying(sim)) {
+		return cr50_sim_replay_transfer(sim, write, addr, buf, len);
+	}
+
+	if (locality >= CR50_LOCALITY_COUNT) {
+		return STATUS_IO_DEVICE_ERROR;
+	}
+	if (reg == CR50_SIM_REG_ACCESS) {
+		return cr50_sim_access(sim, locality, write, buf, len);
+	}
+	if (reg == CR50_SIM_REG_DID_VID && !write) {
+		/* Identifies the chip to every locality */
+		UINT32 vendor = sim->Config.Ti50 ? TPM_TI50_DID_VID : TPM_CR50_DID_VID;
+
+		RtlZeroMemory(buf, len);
+		RtlCopyMemory(buf, &vendor, min(len, sizeof(vendor)));
+		return STATUS_SUCCESS;
+	}
+	if (sim->ActiveLocality != locality) {
+		/* Other registers only respond to the active locality */
+		if (!write)
+			RtlFillMemory(buf, len, 0xFF);
+		return STATUS_SUCCESS;
+	}
+	if (reg == CR50_SIM_REG_STS) {
+		return cr50_sim_sts(sim, now, write, buf, len);
+	}
+	if (reg == CR50_SIM_REG_DATA_FIFO) {
+		return cr50_sim_fifo(sim, now, write, buf, len);
+	}
+
+	/* Registers the model does not keep read as zeros and ignore writes */
+	if (!write)
+		RtlZeroMemory(buf, len);
+	return STATUS_SUCCESS;
+}
+
+//
+// Bus
+//
+
+/* Charges one SPB request and notes whether the chip fell asleep before it */
+static void cr50_sim_request(CR50_SIM* sim, BOOLEAN write, size_t len) {
+	ULONG64 clocks;
+	LONGLONG now = cr50_shim_now();
+
+	if (sim->Config.SleepMs && sim->LastAccess &&
+		now - sim->LastAccess > CR50_SHIM_MS(sim->Config.SleepMs)) {
+		sim->Asleep = TRUE;
+	}
+
+	sim->Counters.Requests++;
+	if (write)
+		sim->Counters.BytesOut += len;
+	else
+		sim->Counters.BytesIn += len;
+
+	/* A replayed transfer takes its recorded time instead */
+	if (cr50_sim_replaying(sim)) {
+		sim->Asleep = FALSE;
+		sim->LastAccess = now;
+		return;
+	}
+
+	if (sim->Config.Spi) {
+		clocks = CR50_SIM_SPI_BYTE_CLOCKS * (ULONG64)len;
+	}
+	else {
+		clocks = CR50_SIM_I2C_BYTE_CLOCKS * (ULONG64)(len + CR50_SIM_I2C_FRAMING);
+	}
+
+	cr50_shim_advance(CR50_SHIM_US(sim->Config.OverheadUs) +
+		(LONGLONG)((clocks * 10000 + sim->Config.ClockKHz - 1) / sim->Config.ClockKHz));
+}
+
+/* The I2C chip wakes on its address and answers late */
+static void cr50_sim_i2c_wake(CR50_SIM* sim) {
+	if (sim->Asleep) {
+		sim->Asleep = FALSE;
+		sim->Counters.Wakes++;
+		cr50_shim_advance(CR50_SHIM_US(sim->Config.WakeUs));
+	}
+	sim->LastAccess = cr50_shim_now();
+}
+
+/* Raises the ready interrupt ReadyUs after a write, unless it was dropped */
+static void cr50_sim_i2c_ready(CR50_SIM* sim) {
+	if (!cr50_sim_replaying(sim))
+		cr50_shim_advance(CR50_SHIM_US(sim->Config.ReadyUs));
+
+	if (sim->DropReady) {
+		sim->DropReady--;
+		return;
+	}
+
+	sim->Counters.ReadyPulses++;
+	cr50_shim_advance(CR50_SHIM_US(sim->Config.IrqUs));
+	cr50_shim_interrupt(sim->FxDevice);
+}
+
+static NTSTATUS cr50_sim_i2c_write(CR50_SIM* sim, UINT8* data, size_t len) {
+	NTSTATUS status = STATUS_SUCCESS;
+
+	cr50_sim_request(sim, TRUE, len);
+	cr50_sim_i2c_wake(sim);
+
+	if (!len) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	sim->Pointer = data[0];
+	if (len > 1) {
+		status = cr50_sim_register(sim, TRUE, data[0], data + 1, len - 1);
+	}
+
+	if (NT_SUCCESS(status)) {
+		/* The interrupt runs unlocked, as it would on its own thread */
+		pthread_mutex_unlock(&sim->Lock);
+		cr50_sim_i2c_ready(sim);
+		pthread_mutex_lock(&sim->Lock);
+	}
+	return status;
+}
+
+static NTSTATUS cr50_sim_i2c_read(CR50_SIM* sim, UINT8* data, size_t len) {
+	cr50_sim_request(sim, FALSE, len);
+	cr50_sim_i2c_wake(sim);
+
+	return cr50_sim_register(sim, FALSE, sim->Pointer, data, len);
+}
+
+static NTSTATUS cr50_sim_spi_write(CR50_SIM* sim, UINT8* data, size_t len) {
+	LONGLONG now;
+
+	cr50_sim_request(sim, TRUE, len);
+	now = cr50_shim_now();
+
+	if (!sim->Selected) {
+		return STATUS_INVALID_DEVICE_STATE;
+	}
+
+	/* A chip select pulse without data wakes the chip */
+	if (!len) {
+		if (sim->Asleep) {
+			sim->Asleep = FALSE;
+			sim->Counters.Wakes++;
+			sim->AwakeTime = now + CR50_SHIM_US(sim->Config.WakeUs);
+		}
+		sim->LastAccess = now;
+		return STATUS_SUCCESS;
+	}
+
+	if (!sim->FrameActive) {
+		if (len != 4 || !(data[0] & 0x40) || data[1] != 0xd4) {
+			return STATUS_DEVICE_PROTOCOL_ERROR;
+		}
+
+		sim->Counters.Frames++;
+		sim->FrameActive = TRUE;
+		sim->FrameRead = (data[0] & 0x80) != 0;
+		sim->FrameLength = (data[0] & 0x3f) + 1;
+		sim->FrameAddr = (UINT32)data[2] << 8 | data[3];
+		sim->FrameAcked = FALSE;
+		sim->FrameDone = FALSE;
+		sim->FrameNak = sim->Asleep;
+		sim->FrameReady = cr50_sim_replaying(sim) ? now :
+			max(now, sim->AwakeTime) + CR50_SHIM_US(sim->Config.ReadyUs);
+		if (!sim->FrameNak) {
+			sim->LastAccess = now;
+		}
+		return STATUS_SUCCESS;
+	}
+
+	if (!sim->FrameAcked || sim->FrameDone || sim->FrameRead || len != sim->FrameLength) {
+		return STATUS_DEVICE_PROTOCOL_ERROR;
+	}
+
+	sim->FrameDone = TRUE;
+	sim->LastAccess = now;
+	return cr50_sim_register(sim, TRUE, sim->FrameAddr, data, len);
+}
+
+static NTSTATUS cr50_sim_spi_read(CR50_SIM* sim, UINT8* data, size_t len) {
+	LONGLONG now;
+
+	cr50_sim_request(sim, FALSE, len);
+	now = cr50_shim_now();
+
+	if (!sim->Selected || !sim->FrameActive || sim->FrameDone) {
+		return STATUS_DEVICE_PROTOCOL_ERROR;
+	}
+
+	/* Flow control: the TPM holds the frame until it can serve it */
+	if (!sim->FrameAcked) {
+		if (len != 1) {
+			return STATUS_DEVICE_PROTOCOL_ERROR;
+		}
+		if (sim->FrameNak || now < sim->FrameReady) {
+			sim->Counters.Polls++;
+			data[0] = 0;
+			return STATUS_SUCCESS;
+		}
+		sim->FrameAcked = TRUE;
+		data[0] = 1;
+		return STATUS_SUCCESS;
+	}
+
+	if (!sim->FrameRead || len != sim->FrameLength) {
+		return STATUS_DEVICE_PROTOCOL_ERROR;
+	}
+
+	sim->FrameDone = TRUE;
+	sim->LastAccess = now;
+	return cr50_sim_register(sim, FALSE, sim->FrameAddr, data, len);
+}
+
+//
+// SPB target, in place of spb.c
+//
+
+static CR50_SIM* cr50_sim_from(SPB_CONTEXT* SpbContext) {
+	return (CR50_SIM*)SpbContext->SpbIoTarget;
+}
+
+NTSTATUS SpbTargetInitialize(IN WDFDEVICE FxDevice, IN SPB_CONTEXT* SpbContext) {
+	CR50_SIM* sim = (CR50_SIM*)(ULONG_PTR)SpbContext->SpbResHubId.QuadPart;
+
+	if (!sim) {
+		return STATUS_INVALID_CONNECTION;
+	}
+
+	sim->FxDevice = FxDevice;
+	SpbContext->SpbIoTarget = (WDFIOTARGET)sim;
+	return STATUS_SUCCESS;
+}
+
+VOID SpbTargetDeinitialize(IN WDFDEVICE FxDevice, IN SPB_CONTEXT* SpbContext) {
+	UNREFERENCED_PARAMETER(FxDevice);
+	SpbContext->SpbIoTarget = NULL;
+}
+
+NTSTATUS SpbLockController(IN SPB_CONTEXT* SpbContext) {
+	CR50_SIM* sim = cr50_sim_from(SpbContext);
+
+	pthread_mutex_lock(&sim->Lock);
+	sim->Selected = TRUE;
+	pthread_mutex_unlock(&sim->Lock);
+	return STATUS_SUCCESS;
+}
+
+/* Deselecting the TPM ends the frame, finished or not */
+NTSTATUS SpbUnlockController(IN SPB_CONTEXT* SpbContext) {
+	CR50_SIM* sim = cr50_sim_from(SpbContext);
+
+	pthread_mutex_lock(&sim->Lock);
+	sim->Selected = FALSE;
+	sim->FrameActive = FALSE;
+	pthread_mutex_unlock(&sim->Lock);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS SpbWriteDataSynchronously(IN SPB_CONTEXT* SpbContext, IN PVOID Data, IN ULONG Length) {
+	CR50_SIM* sim = cr50_sim_from(SpbContext);
+	NTSTATUS status;
+
+	pthread_mutex_lock(&sim->Lock);
+	if (sim->Config.Spi)
+		status = cr50_sim_spi_write(sim, Data, Length);
+	else
+		status = cr50_sim_i2c_write(sim, Data, Length);
+	pthread_mutex_unlock(&sim->Lock);
+	return status;
+}
+
+NTSTATUS SpbReadDataSynchronously(_In_ SPB_CONTEXT* SpbContext, PVOID Data, _In_ ULONG Length) {
+	CR50_SIM* sim = cr50_sim_from(SpbContext);
+	NTSTATUS status;
+
+	pthread_mutex_lock(&sim->Lock);
+	if (sim->Config.Spi)
+		status = cr50_sim_spi_read(sim, Data, Length);
+	else
+		status = cr50_sim_i2c_read(sim, Data, Length);
+	pthread_mutex_unlock(&sim->Lock);
+	return status;
+}
+
+NTSTATUS SpbXferDataSynchronously(_In_ SPB_CONTEXT* SpbContext, _In_ PVOID SendData,
+	_In_ ULONG SendLength, PVOID Data, _In_ ULONG Length) {
+	NTSTATUS status = SpbWriteDataSynchronously(SpbContext, SendData, SendLength);
+
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+	return SpbReadDataSynchronously(SpbContext, Data, Length);
+}
+
+//
+// Harness interface
+//
+
+CR50_SIM* cr50_sim_create(const CR50_SIM_CONFIG* Config) {
+	CR50_SIM* sim = calloc(1, sizeof(*sim));
+
+	if (!sim) {
+		return NULL;
+	}
+
+	sim->Config = *Config;
+	if (!sim->Config.ClockKHz) {
+		sim->Config.ClockKHz = sim->Config.Spi ? CR50_SIM_SPI_KHZ : CR50_SIM_I2C_KHZ;
+	}
+	if (!sim->Config.Burst) {
+		sim->Config.Burst = CR50_SIM_BURST;
+	}
+	sim->Random = sim->Config.Seed ? sim->Config.Seed : CR50_SIM_SEED;
+
+	pthread_mutex_init(&sim->Lock, NULL);
+	sim->State = Cr50SimIdle;
+	sim->ActiveLocality = CR50_NO_LOCALITY;
+	return sim;
+}
+
+void cr50_sim_destroy(CR50_SIM* Sim) {
+	pthread_mutex_destroy(&Sim->Lock);
+	free(Sim);
+}
+
+void cr50_sim_connection(CR50_SIM* Sim, PCM_PARTIAL_RESOURCE_DESCRIPTOR Descriptor) {
+	ULONG64 id = (ULONG64)(ULONG_PTR)Sim;
+
+	RtlZeroMemory(Descriptor, sizeof(*Descriptor));
+	Descriptor->Type = CmResourceTypeConnection;
+	Descriptor->u.Connection.Class = CM_RESOURCE_CONNECTION_CLASS_SERIAL;
+	Descriptor->u.Connection.Type = Sim->Config.Spi ?
+		CM_RESOURCE_CONNECTION_TYPE_SERIAL_SPI : CM_RESOURCE_CONNECTION_TYPE_SERIAL_I2C;
+	Descriptor->u.Connection.IdLowPart = (ULONG)id;
+	Descriptor->u.Connection.IdHighPart = (ULONG)(id >> 32);
+}
+
+void cr50_sim_counters(CR50_SIM* Sim, CR50_SIM_COUNTERS* Counters) {
+	pthread_mutex_lock(&Sim->Lock);
+	*Counters = Sim->Counters;
+	pthread_mutex_unlock(&Sim->Lock);
+}
+
+void cr50_sim_drop_ready(CR50_SIM* Sim, ULONG Count) {
+	pthread_mutex_lock(&Sim->Lock);
+	Sim->DropReady = Count;
+	pthread_mutex_unlock(&Sim->Lock);
+}
+
+size_t cr50_sim_last_command(CR50_SIM* Sim, UINT8* Buffer, size_t Size) {
+	size_t len;
+
+	pthread_mutex_lock(&Sim->Lock);
+	len = Sim->LastCommandLength;
+	RtlCopyMemory(Buffer, Sim->LastCommand, min(len, Size));
+	pthread_mutex_unlock(&Sim->Lock);
+	return len;
+}
+
+void cr50_sim_handler(CR50_SIM* Sim, CR50_SIM_HANDLER* Handler, PVOID Context) {
+	pthread_mutex_lock(&Sim->Lock);
+	Sim->Handler = Handler;
+	Sim->HandlerContext = Context;
+	pthread_mutex_unlock(&Sim->Lock);
+}
+
+void cr50_sim_replay(CR50_SIM* Sim, const CR50_TRACE_ENTRY* Entries, ULONG Count,
+	ULONG Speedup) {
+	pthread_mutex_lock(&Sim->Lock);
+	Sim->Replay = Entries;
+	Sim->ReplayCount = Entries ? Count : 0;
+	Sim->ReplayNext = 0;
+	Sim->ReplaySpeedup = Speedup;
+	pthread_mutex_unlock(&Sim->Lock);
+}
+
+void cr50_sim_replay_seek(CR50_SIM* Sim, ULONG Index) {
+	pthread_mutex_lock(&Sim->Lock);
+	if (Sim->Replay)
+		Sim->ReplayNext = min(Index + 1, Sim->ReplayCount);
+	pthread_mutex_unlock(&Sim->Lock);
+}
@@ -0,0 +1,98 @@
+/*
+ * Cr50/Ti50 chip model behind the SPB calls of the driver.
+ *
+ * cr50sim.c stands in for spb.c: the driver's I2C and SPI code runs
+ * unchanged and every SpbRead/SpbWrite/SpbLock lands here, at the level
+ * of the bus transfers a controller would put on the wire. Behind them
+ * sits the TIS register set of each locality (ACCESS, STS, DATA_FIFO,
+ * DID_VID) and a TPM that answers Startup, Shutdown, IncrementalSelfTest
+ * and GetRandom; every other command fails with TPM_RC_COMMAND_CODE
+ * unless a test's handler answers it.
+ *
+ * Time is the shim's virtual clock. Each SPB request costs OverheadUs
+ * for the controller and driver stack plus its bytes on the wire at
+ * ClockKHz. On I2C the chip pulses the ready interrupt ReadyUs after a
+ * write, and the ISR runs IrqUs after the pulse; on SPI the chip holds
+ * each frame's flow control for ReadyUs. A
+ * command completes ExecUs after GO. After SleepMs without traffic the
+ * chip sleeps: the next I2C transfer pays WakeUs, and an SPI frame is
+ * not acknowledged unless a chip select pulse woke the chip first.
+ */
+
+#pragma once
+
+#include <wdm.h>
+
+typedef struct _CR50_SIM CR50_SIM;
+
+typedef struct _CR50_SIM_CONFIG {
+	BOOLEAN Ti50;		/* Report the Ti50 DID_VID instead of Cr50's */
+	BOOLEAN Spi;		/* SPI instead of I2C */
+	ULONG ClockKHz;		/* 0 for 400 kHz on I2C, 1 MHz on SPI */
+	ULONG OverheadUs;	/* Per SPB request */
+	ULONG ReadyUs;
+	ULONG IrqUs;		/* I2C: ready pulse to ISR */
+	ULONG ExecUs;
+	ULONG SleepMs;		/* 0 never sleeps */
+	ULONG WakeUs;
+	ULONG Burst;		/* Burst count in STS; 0 for 63, like Cr50 */
+	ULONG64 Seed;		/* GetRandom; 0 for a fixed default */
+} CR50_SIM_CONFIG;
+
+#define CR50_SIM_I2C_KHZ	400
+#define CR50_SIM_SPI_KHZ	1000
+
+typedef struct _CR50_SIM_COUNTERS {
+	ULONG64 Requests;	/* SPB reads and writes */
+	ULONG64 BytesOut;
+	ULONG64 BytesIn;
+	ULONG64 Frames;		/* SPI frame headers */
+	ULONG64 Polls;		/* SPI flow control reads that found the TPM busy */
+	ULONG64 ReadyPulses;	/* I2C ready interrupts raised */
+	ULONG64 Wakes;
+	ULONG64 Commands;
+	ULONG64 Replayed;	/* Register transfers answered from a recording */
+	ULONG64 ReplayMisses;	/* ... that had no recorded match */
+} CR50_SIM_COUNTERS;
+
+CR50_SIM* cr50_sim_create(const CR50_SIM_CONFIG* Config);
+void cr50_sim_destroy(CR50_SIM* Sim);
+
+/* Fills the SPB connection resource through which the driver finds the model */
+void cr50_sim_connection(CR50_SIM* Sim, PCM_PARTIAL_RESOURCE_DESCRIPTOR Descriptor);
+
+void cr50_sim_counters(CR50_SIM* Sim, CR50_SIM_COUNTERS* Counters);
+
+/* Leaves out the next @Count I2C ready pulses */
+void cr50_sim_drop_ready(CR50_SIM* Sim, ULONG Count);
+
+/* Copies the last command the TPM executed; returns its length */
+size_t cr50_sim_last_command(CR50_SIM* Sim, UINT8* Buffer, size_t Size);
+
+/*
+ * Answers the commands a started TPM receives before the model does:
+ * @Buffer holds the @Length byte command and takes the response, up to
+ * @Size bytes. Returns the response length, or 0 to leave the command
+ * to the model. Runs under the model's lock, so it must not call back
+ * into it.
+ */
+typedef size_t CR50_SIM_HANDLER(PVOID Context, UINT8* Buffer, size_t Length, size_t Size);
+
+/* Installs @Handler, or removes it with NULL */
+void cr50_sim_handler(CR50_SIM* Sim, CR50_SIM_HANDLER* Handler, PVOID Context);
+
+/*
+ * Replay of a bus trace saved with IOCTL_CR50_QUERY_TRACE. While entries
+ * are left, register transfers are matched to the next recorded one of
+ * the same direction and register, without crossing into the next
+ * command: reads return the recorded data and result, and every
+ * transfer takes its recorded time divided by @Speedup (0 for none)
+ * instead of the model's. Reads without a match fail. @Entries must
+ * stay valid until the replay is replaced; NULL hands the bus back to
+ * the model.
+ */
+void cr50_sim_replay(CR50_SIM* Sim, const struct _CR50_TRACE_ENTRY* Entries, ULONG Count,
+	ULONG Speedup);
+
+/* Continues the replay after entry @Index, the start of the next command */
+void cr50_sim_replay_seek(CR50_SIM* Sim, ULONG Index);
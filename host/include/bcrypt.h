@@ -0,0 +1,23 @@
+/*
+ * Host stand-in for the CNG routines the Cr50 driver uses, see shim.c.
+ * BCryptHash computes unkeyed SHA-256 only; random numbers come from a
+ * seeded generator.
+ */
+
+#pragma once
+
+#include <wdm.h>
+
+typedef PVOID BCRYPT_ALG_HANDLE;
+
+#define BCRYPT_SHA256_ALGORITHM		L"SHA256"
+#define BCRYPT_PROV_DISPATCH		0x00000001
+#define BCRYPT_USE_SYSTEM_PREFERRED_RNG	0x00000002
+
+NTSTATUS BCryptOpenAlgorithmProvider(BCRYPT_ALG_HANDLE* phAlgorithm, PCWSTR pszAlgId,
+	PCWSTR pszImplementation, ULONG dwFlags);
+NTSTATUS BCryptCloseAlgorithmProvider(BCRYPT_ALG_HANDLE hAlgorithm, ULONG dwFlags);
+NTSTATUS BCryptHash(BCRYPT_ALG_HANDLE hAlgorithm, PUCHAR pbSecret, ULONG cbSecret,
+	PUCHAR pbInput, ULONG cbInput, PUCHAR pbOutput, ULONG cbOutput);
+NTSTATUS BCryptGenRandom(BCRYPT_ALG_HANDLE hAlgorithm, PUCHAR pbBuffer, ULONG cbBuffer,
+	ULONG dwFlags);
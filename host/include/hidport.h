@@ -0,0 +1,3 @@
+/* Host stand-in for hidport.h, of which the Cr50 driver uses nothing */
+
+#pragma once
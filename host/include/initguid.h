@@ -0,0 +1,7 @@
+/* Host stand-in for initguid.h: DEFINE_GUID defines the GUID in each file */
+
+#pragma once
+
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+	static const GUID name __attribute__((unused)) = \
+		{ l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }
@@ -0,0 +1,15 @@
+/*
+ * Host stand-in for the security routines of ntifs.h the Cr50 driver
+ * uses. Every caller is treated as an administrator.
+ */
+
+#pragma once
+
+#include <wdm.h>
+
+VOID SeCaptureSubjectContext(PSECURITY_SUBJECT_CONTEXT SubjectContext);
+VOID SeLockSubjectContext(PSECURITY_SUBJECT_CONTEXT SubjectContext);
+VOID SeUnlockSubjectContext(PSECURITY_SUBJECT_CONTEXT SubjectContext);
+VOID SeReleaseSubjectContext(PSECURITY_SUBJECT_CONTEXT SubjectContext);
+PACCESS_TOKEN SeQuerySubjectContextToken(PSECURITY_SUBJECT_CONTEXT SubjectContext);
+BOOLEAN SeTokenIsAdmin(PACCESS_TOKEN Token);
@@ -0,0 +1,484 @@
+/*
+ * Host stand-in for the parts of KMDF the Cr50 driver uses.
+ *
+ * Objects are heap allocations with an optional typed context; the
+ * device is created by cr50_host_open() (see cr50host.c), which then
+ * plays the PnP manager: prepare hardware, D0 entry and back. Timers
+ * never fire and I/O queues hold no requests, so everything the tests
+ * exercise runs through the calls the harness makes directly.
+ */
+
+#pragma once
+
+#include <wdm.h>
+
+typedef PVOID WDFOBJECT;
+
+#define WDF_DECLARE_HANDLE(h)	typedef struct h##__* h
+
+WDF_DECLARE_HANDLE(WDFDRIVER);
+WDF_DECLARE_HANDLE(WDFDEVICE);
+WDF_DECLARE_HANDLE(WDFQUEUE);
+WDF_DECLARE_HANDLE(WDFREQUEST);
+WDF_DECLARE_HANDLE(WDFINTERRUPT);
+WDF_DECLARE_HANDLE(WDFMEMORY);
+WDF_DECLARE_HANDLE(WDFIOTARGET);
+WDF_DECLARE_HANDLE(WDFWAITLOCK);
+WDF_DECLARE_HANDLE(WDFSPINLOCK);
+WDF_DECLARE_HANDLE(WDFKEY);
+WDF_DECLARE_HANDLE(WDFCMRESLIST);
+WDF_DECLARE_HANDLE(WDFTIMER);
+WDF_DECLARE_HANDLE(WDFFILEOBJECT);
+
+typedef struct WDFDEVICE_INIT* PWDFDEVICE_INIT;
+
+typedef enum _WDF_TRI_STATE {
+	WdfFalse = FALSE,
+	WdfTrue = TRUE,
+	WdfUseDefault = 2
+} WDF_TRI_STATE;
+
+typedef enum _WDF_POWER_DEVICE_STATE {
+	WdfPowerDeviceInvalid = 0,
+	WdfPowerDeviceD0,
+	WdfPowerDeviceD1,
+	WdfPowerDeviceD2,
+	WdfPowerDeviceD3,
+	WdfPowerDeviceD3Final,
+	WdfPowerDevicePrepareForHibernation
+} WDF_POWER_DEVICE_STATE;
+
+#define WDF_NO_OBJECT_ATTRIBUTES	NULL
+#define WDF_NO_HANDLE			NULL
+#define WDF_NO_EVENT_CALLBACK		NULL
+
+#define WDF_REL_TIMEOUT_IN_MS(ms)	(-(LONGLONG)(ms) * 10000)
+#define WDF_REL_TIMEOUT_IN_US(us)	(-(LONGLONG)(us) * 10)
+
+//
+// Objects and contexts
+//
+
+typedef VOID EVT_WDF_OBJECT_CONTEXT_CLEANUP(WDFOBJECT Object);
+typedef VOID EVT_WDF_OBJECT_CONTEXT_DESTROY(WDFOBJECT Object);
+
+typedef struct _WDF_OBJECT_CONTEXT_TYPE_INFO {
+	PCSTR ContextName;
+	size_t ContextSize;
+} WDF_OBJECT_CONTEXT_TYPE_INFO;
+typedef const WDF_OBJECT_CONTEXT_TYPE_INFO* PCWDF_OBJECT_CONTEXT_TYPE_INFO;
+
+typedef enum _WDF_EXECUTION_LEVEL {
+	WdfExecutionLevelInvalid,
+	WdfExecutionLevelInheritFromParent,
+	WdfExecutionLevelPassive,
+	WdfExecutionLevelDispatch
+} WDF_EXECUTION_LEVEL;
+
+typedef enum _WDF_SYNCHRONIZATION_SCOPE {
+	WdfSynchronizationScopeInvalid,
+	WdfSynchronizationScopeInheritFromParent,
+	WdfSynchronizationScopeDevice,
+	WdfSynchronizationScopeQueue,
+	WdfSynchronizationScopeNone
+} WDF_SYNCHRONIZATION_SCOPE;
+
+typedef struct _WDF_OBJECT_ATTRIBUTES {
+	ULONG Size;
+	EVT_WDF_OBJECT_CONTEXT_CLEANUP* EvtCleanupCallback;
+	EVT_WDF_OBJECT_CONTEXT_DESTROY* EvtDestroyCallback;
+	WDF_EXECUTION_LEVEL ExecutionLevel;
+	WDF_SYNCHRONIZATION_SCOPE SynchronizationScope;
+	WDFOBJECT ParentObject;
+	size_t ContextSizeOverride;
+	PCWDF_OBJECT_CONTEXT_TYPE_INFO ContextTypeInfo;
+} WDF_OBJECT_ATTRIBUTES, *PWDF_OBJECT_ATTRIBUTES;
+
+FORCEINLINE VOID WDF_OBJECT_ATTRIBUTES_INIT(PWDF_OBJECT_ATTRIBUTES Attributes) {
+	RtlZeroMemory(Attributes, sizeof(*Attributes));
+	Attributes->Size = sizeof(*Attributes);
+	Attributes->ExecutionLevel = WdfExecutionLevelInheritFromParent;
+	Attributes->SynchronizationScope = WdfSynchronizationScopeInheritFromParent;
+}
+
+PVOID WdfObjectGetTypedContextWorker(WDFOBJECT Handle, PCWDF_OBJECT_CONTEXT_TYPE_INFO TypeInfo);
+
+#define WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(_contexttype, _castingfunction) \
+	static const WDF_OBJECT_CONTEXT_TYPE_INFO _WDF_##_contexttype##_TYPE_INFO \
+		__attribute__((unused)) = { #_contexttype, sizeof(_contexttype) }; \
+	static inline __attribute__((unused)) _contexttype* _castingfunction(WDFOBJECT Handle) { \
+		return (_contexttype*)WdfObjectGetTypedContextWorker(Handle, \
+			&_WDF_##_contexttype##_TYPE_INFO); \
+	}
+
+#define WDF_DECLARE_CONTEXT_TYPE(_contexttype) \
+	WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(_contexttype, WdfObjectGet_##_contexttype)
+
+#define WDF_OBJECT_ATTRIBUTES_SET_CONTEXT_TYPE(_attributes, _contexttype) \
+	((_attributes)->ContextTypeInfo = &_WDF_##_contexttype##_TYPE_INFO)
+
+#define WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(_attributes, _contexttype) \
+	(WDF_OBJECT_ATTRIBUTES_INIT(_attributes), \
+	 WDF_OBJECT_ATTRIBUTES_SET_CONTEXT_TYPE(_attributes, _contexttype))
+
+#define WdfObjectGetTypedContext(handle, type) \
+	((type*)WdfObjectGetTypedContextWorker((WDFOBJECT)(handle), &_WDF_##type##_TYPE_INFO))
+
+VOID WdfObjectDelete(WDFOBJECT Object);
+VOID WdfObjectReference(WDFOBJECT Handle);
+VOID WdfObjectDereference(WDFOBJECT Handle);
+
+//
+// Driver
+//
+
+typedef NTSTATUS EVT_WDF_DRIVER_DEVICE_ADD(WDFDRIVER Driver, PWDFDEVICE_INIT DeviceInit);
+typedef EVT_WDF_DRIVER_DEVICE_ADD* PFN_WDF_DRIVER_DEVICE_ADD;
+typedef VOID EVT_WDF_DRIVER_UNLOAD(WDFDRIVER Driver);
+
+typedef struct _WDF_DRIVER_CONFIG {
+	ULONG Size;
+	PFN_WDF_DRIVER_DEVICE_ADD EvtDriverDeviceAdd;
+	EVT_WDF_DRIVER_UNLOAD* EvtDriverUnload;
+	ULONG DriverInitFlags;
+	ULONG DriverPoolTag;
+} WDF_DRIVER_CONFIG, *PWDF_DRIVER_CONFIG;
+
+FORCEINLINE VOID WDF_DRIVER_CONFIG_INIT(PWDF_DRIVER_CONFIG Config,
+	PFN_WDF_DRIVER_DEVICE_ADD EvtDriverDeviceAdd) {
+	RtlZeroMemory(Config, sizeof(*Config));
+	Config->Size = sizeof(*Config);
+	Config->EvtDriverDeviceAdd = EvtDriverDeviceAdd;
+}
+
+NTSTATUS WdfDriverCreate(PDRIVER_OBJECT DriverObject, PCUNICODE_STRING RegistryPath,
+	PWDF_OBJECT_ATTRIBUTES DriverAttributes, PWDF_DRIVER_CONFIG DriverConfig,
+	WDFDRIVER* Driver);
+
+//
+// Device initialization and PnP/power callbacks
+//
+
+typedef NTSTATUS EVT_WDF_DEVICE_PREPARE_HARDWARE(WDFDEVICE Device,
+	WDFCMRESLIST ResourcesRaw, WDFCMRESLIST ResourcesTranslated);
+typedef NTSTATUS EVT_WDF_DEVICE_RELEASE_HARDWARE(WDFDEVICE Device,
+	WDFCMRESLIST ResourcesTranslated);
+typedef NTSTATUS EVT_WDF_DEVICE_D0_ENTRY(WDFDEVICE Device, WDF_POWER_DEVICE_STATE PreviousState);
+typedef NTSTATUS EVT_WDF_DEVICE_D0_EXIT(WDFDEVICE Device, WDF_POWER_DEVICE_STATE TargetState);
+
+typedef struct _WDF_PNPPOWER_EVENT_CALLBACKS {
+	ULONG Size;
+	EVT_WDF_DEVICE_D0_ENTRY* EvtDeviceD0Entry;
+	EVT_WDF_DEVICE_D0_EXIT* EvtDeviceD0Exit;
+	EVT_WDF_DEVICE_PREPARE_HARDWARE* EvtDevicePrepareHardware;
+	EVT_WDF_DEVICE_RELEASE_HARDWARE* EvtDeviceReleaseHardware;
+} WDF_PNPPOWER_EVENT_CALLBACKS, *PWDF_PNPPOWER_EVENT_CALLBACKS;
+
+FORCEINLINE VOID WDF_PNPPOWER_EVENT_CALLBACKS_INIT(PWDF_PNPPOWER_EVENT_CALLBACKS Callbacks) {
+	RtlZeroMemory(Callbacks, sizeof(*Callbacks));
+	Callbacks->Size = sizeof(*Callbacks);
+}
+
+VOID WdfDeviceInitSetPnpPowerEventCallbacks(PWDFDEVICE_INIT DeviceInit,
+	PWDF_PNPPOWER_EVENT_CALLBACKS PnpPowerEventCallbacks);
+
+typedef NTSTATUS EVT_WDFDEVICE_WDM_IRP_PREPROCESS(WDFDEVICE Device, PIRP Irp);
+
+NTSTATUS WdfDeviceInitAssignWdmIrpPreprocessCallback(PWDFDEVICE_INIT DeviceInit,
+	EVT_WDFDEVICE_WDM_IRP_PREPROCESS* EvtDeviceWdmIrpPreprocess, UCHAR MajorFunction,
+	PUCHAR MinorFunctions, ULONG NumMinorFunctions);
+NTSTATUS WdfDeviceInitAssignSDDLString(PWDFDEVICE_INIT DeviceInit, PCUNICODE_STRING SDDLString);
+
+typedef VOID EVT_WDF_DEVICE_FILE_CREATE(WDFDEVICE Device, WDFREQUEST Request,
+	WDFFILEOBJECT FileObject);
+typedef VOID EVT_WDF_FILE_CLOSE(WDFFILEOBJECT FileObject);
+typedef VOID EVT_WDF_FILE_CLEANUP(WDFFILEOBJECT FileObject);
+
+typedef struct _WDF_FILEOBJECT_CONFIG {
+	ULONG Size;
+	EVT_WDF_DEVICE_FILE_CREATE* EvtDeviceFileCreate;
+	EVT_WDF_FILE_CLOSE* EvtFileClose;
+	EVT_WDF_FILE_CLEANUP* EvtFileCleanup;
+} WDF_FILEOBJECT_CONFIG, *PWDF_FILEOBJECT_CONFIG;
+
+FORCEINLINE VOID WDF_FILEOBJECT_CONFIG_INIT(PWDF_FILEOBJECT_CONFIG FileEventCallbacks,
+	EVT_WDF_DEVICE_FILE_CREATE* EvtDeviceFileCreate, EVT_WDF_FILE_CLOSE* EvtFileClose,
+	EVT_WDF_FILE_CLEANUP* EvtFileCleanup) {
+	RtlZeroMemory(FileEventCallbacks, sizeof(*FileEventCallbacks));
+	FileEventCallbacks->Size = sizeof(*FileEventCallbacks);
+	FileEventCallbacks->EvtDeviceFileCreate = EvtDeviceFileCreate;
+	FileEventCallbacks->EvtFileClose = EvtFileClose;
+	FileEventCallbacks->EvtFileCleanup = EvtFileCleanup;
+}
+
+VOID WdfDeviceInitSetFileObjectConfig(PWDFDEVICE_INIT DeviceInit,
+	PWDF_FILEOBJECT_CONFIG FileObjectConfig, PWDF_OBJECT_ATTRIBUTES FileObjectAttributes);
+
+NTSTATUS WdfDeviceCreate(PWDFDEVICE_INIT* DeviceInit, PWDF_OBJECT_ATTRIBUTES DeviceAttributes,
+	WDFDEVICE* Device);
+NTSTATUS WdfDeviceCreateDeviceInterface(WDFDEVICE Device, const GUID* InterfaceClassGUID,
+	PCUNICODE_STRING ReferenceString);
+PDEVICE_OBJECT WdfDeviceWdmGetDeviceObject(WDFDEVICE Device);
+
+typedef enum _WDF_POWER_POLICY_S0_IDLE_CAPABILITIES {
+	IdleCapsInvalid = 0,
+	IdleCannotWakeFromS0,
+	IdleCanWakeFromS0,
+	IdleUsbSelectiveSuspend
+} WDF_POWER_POLICY_S0_IDLE_CAPABILITIES;
+
+typedef enum _WDF_POWER_POLICY_IDLE_TIMEOUT_TYPE {
+	DriverManagedIdleTimeout = 0,
+	SystemManagedIdleTimeout,
+	SystemManagedIdleTimeoutWithHint
+} WDF_POWER_POLICY_IDLE_TIMEOUT_TYPE;
+
+typedef enum _WDF_POWER_POLICY_S0_IDLE_USER_CONTROL {
+	IdleUserControlInvalid = 0,
+	IdleDoNotAllowUserControl,
+	IdleAllowUserControl
+} WDF_POWER_POLICY_S0_IDLE_USER_CONTROL;
+
+typedef struct _WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS {
+	ULONG Size;
+	WDF_POWER_POLICY_S0_IDLE_CAPABILITIES IdleCaps;
+	ULONG IdleTimeout;
+	WDF_POWER_POLICY_S0_IDLE_USER_CONTROL UserControlOfIdleSettings;
+	WDF_TRI_STATE Enabled;
+	WDF_POWER_POLICY_IDLE_TIMEOUT_TYPE IdleTimeoutType;
+} WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS, *PWDF_DEVICE_POWER_POLICY_IDLE_SETTINGS;
+
+FORCEINLINE VOID WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS_INIT(
+	PWDF_DEVICE_POWER_POLICY_IDLE_SETTINGS Settings,
+	WDF_POWER_POLICY_S0_IDLE_CAPABILITIES IdleCaps) {
+	RtlZeroMemory(Settings, sizeof(*Settings));
+	Settings->Size = sizeof(*Settings);
+	Settings->IdleCaps = IdleCaps;
+	Settings->IdleTimeout = 0;
+	Settings->UserControlOfIdleSettings = IdleAllowUserControl;
+	Settings->Enabled = WdfUseDefault;
+}
+
+NTSTATUS WdfDeviceAssignS0IdleSettings(WDFDEVICE Device,
+	PWDF_DEVICE_POWER_POLICY_IDLE_SETTINGS Settings);
+NTSTATUS WdfDeviceStopIdle(WDFDEVICE Device, BOOLEAN WaitForD0);
+VOID WdfDeviceResumeIdle(WDFDEVICE Device);
+
+typedef struct _WDF_DEVICE_STATE {
+	ULONG Size;
+	WDF_TRI_STATE Disabled;
+	WDF_TRI_STATE DontDisplayInUI;
+	WDF_TRI_STATE Failed;
+	WDF_TRI_STATE NotDisableable;
+	WDF_TRI_STATE Removed;
+	WDF_TRI_STATE ResourcesChanged;
+} WDF_DEVICE_STATE, *PWDF_DEVICE_STATE;
+
+FORCEINLINE VOID WDF_DEVICE_STATE_INIT(PWDF_DEVICE_STATE PnpDeviceState) {
+	RtlZeroMemory(PnpDeviceState, sizeof(*PnpDeviceState));
+	PnpDeviceState->Size = sizeof(*PnpDeviceState);
+	PnpDeviceState->Disabled = WdfUseDefault;
+	PnpDeviceState->DontDisplayInUI = WdfUseDefault;
+	PnpDeviceState->Failed = WdfUseDefault;
+	PnpDeviceState->NotDisableable = WdfUseDefault;
+	PnpDeviceState->Removed = WdfUseDefault;
+	PnpDeviceState->ResourcesChanged = WdfUseDefault;
+}
+
+VOID WdfDeviceSetDeviceState(WDFDEVICE Device, PWDF_DEVICE_STATE DeviceState);
+
+//
+// Resources
+//
+
+ULONG WdfCmResourceListGetCount(WDFCMRESLIST List);
+PCM_PARTIAL_RESOURCE_DESCRIPTOR WdfCmResourceListGetDescriptor(WDFCMRESLIST List, ULONG Index);
+
+//
+// Queues and requests
+//
+
+typedef enum _WDF_IO_QUEUE_DISPATCH_TYPE {
+	WdfIoQueueDispatchInvalid = 0,
+	WdfIoQueueDispatchSequential,
+	WdfIoQueueDispatchParallel,
+	WdfIoQueueDispatchManual
+} WDF_IO_QUEUE_DISPATCH_TYPE;
+
+typedef VOID EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL(WDFQUEUE Queue, WDFREQUEST Request,
+	size_t OutputBufferLength, size_t InputBufferLength, ULONG IoControlCode);
+typedef VOID EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL(WDFQUEUE Queue, WDFREQUEST Request,
+	size_t OutputBufferLength, size_t InputBufferLength, ULONG IoControlCode);
+typedef VOID EVT_WDF_REQUEST_CANCEL(WDFREQUEST Request);
+typedef VOID EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE(WDFQUEUE Queue, WDFREQUEST Request);
+
+typedef struct _WDF_IO_QUEUE_CONFIG {
+	ULONG Size;
+	WDF_IO_QUEUE_DISPATCH_TYPE DispatchType;
+	WDF_TRI_STATE PowerManaged;
+	BOOLEAN AllowZeroLengthRequests;
+	BOOLEAN DefaultQueue;
+	EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL* EvtIoDeviceControl;
+	EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL* EvtIoInternalDeviceControl;
+	EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE* EvtIoCanceledOnQueue;
+} WDF_IO_QUEUE_CONFIG, *PWDF_IO_QUEUE_CONFIG;
+
+FORCEINLINE VOID WDF_IO_QUEUE_CONFIG_INIT(PWDF_IO_QUEUE_CONFIG Config,
+	WDF_IO_QUEUE_DISPATCH_TYPE DispatchType) {
+	RtlZeroMemory(Config, sizeof(*Config));
+	Config->Size = sizeof(*Config);
+	Config->PowerManaged = WdfUseDefault;
+	Config->DispatchType = DispatchType;
+}
+
+FORCEINLINE VOID WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(PWDF_IO_QUEUE_CONFIG Config,
+	WDF_IO_QUEUE_DISPATCH_TYPE DispatchType) {
+	WDF_IO_QUEUE_CONFIG_INIT(Config, DispatchType);
+	Config->DefaultQueue = TRUE;
+}
+
+NTSTATUS WdfIoQueueCreate(WDFDEVICE Device, PWDF_IO_QUEUE_CONFIG Config,
+	PWDF_OBJECT_ATTRIBUTES QueueAttributes, WDFQUEUE* Queue);
+WDFDEVICE WdfIoQueueGetDevice(WDFQUEUE Queue);
+NTSTATUS WdfIoQueueRetrieveNextRequest(WDFQUEUE Queue, WDFREQUEST* OutRequest);
+
+typedef enum _WDF_REQUEST_TYPE {
+	WdfRequestTypeCreate = 0x0,
+	WdfRequestTypeClose = 0x2,
+	WdfRequestTypeRead = 0x3,
+	WdfRequestTypeWrite = 0x4,
+	WdfRequestTypeDeviceControl = 0xE,
+	WdfRequestTypeDeviceControlInternal = 0xF
+} WDF_REQUEST_TYPE;
+
+typedef struct _WDF_REQUEST_PARAMETERS {
+	USHORT Size;
+	UCHAR MinorFunction;
+	WDF_REQUEST_TYPE Type;
+	union {
+		struct {
+			size_t OutputBufferLength;
+			size_t InputBufferLength;
+			ULONG IoControlCode;
+			PVOID Type3InputBuffer;
+		} DeviceIoControl;
+	} Parameters;
+} WDF_REQUEST_PARAMETERS, *PWDF_REQUEST_PARAMETERS;
+
+FORCEINLINE VOID WDF_REQUEST_PARAMETERS_INIT(PWDF_REQUEST_PARAMETERS Parameters) {
+	RtlZeroMemory(Parameters, sizeof(*Parameters));
+	Parameters->Size = sizeof(*Parameters);
+}
+
+VOID WdfRequestGetParameters(WDFREQUEST Request, PWDF_REQUEST_PARAMETERS Parameters);
+NTSTATUS WdfRequestRetrieveInputBuffer(WDFREQUEST Request, size_t MinimumRequiredSize,
+	PVOID* Buffer, size_t* Length);
+NTSTATUS WdfRequestRetrieveOutputBuffer(WDFREQUEST Request, size_t MinimumRequiredSize,
+	PVOID* Buffer, size_t* Length);
+VOID WdfRequestComplete(WDFREQUEST Request, NTSTATUS Status);
+VOID WdfRequestCompleteWithInformation(WDFREQUEST Request, NTSTATUS Status,
+	ULONG_PTR Information);
+KPROCESSOR_MODE WdfRequestGetRequestorMode(WDFREQUEST Request);
+WDFFILEOBJECT WdfRequestGetFileObject(WDFREQUEST Request);
+WDFQUEUE WdfRequestGetIoQueue(WDFREQUEST Request);
+NTSTATUS WdfRequestForwardToIoQueue(WDFREQUEST Request, WDFQUEUE DestinationQueue);
+NTSTATUS WdfRequestMarkCancelableEx(WDFREQUEST Request, EVT_WDF_REQUEST_CANCEL* EvtRequestCancel);
+NTSTATUS WdfRequestUnmarkCancelable(WDFREQUEST Request);
+
+WDFDEVICE WdfFileObjectGetDevice(WDFFILEOBJECT FileObject);
+
+//
+// Interrupts
+//
+
+typedef BOOLEAN EVT_WDF_INTERRUPT_ISR(WDFINTERRUPT Interrupt, ULONG MessageID);
+typedef VOID EVT_WDF_INTERRUPT_DPC(WDFINTERRUPT Interrupt, WDFOBJECT AssociatedObject);
+
+typedef struct _WDF_INTERRUPT_CONFIG {
+	ULONG Size;
+	WDFSPINLOCK SpinLock;
+	WDF_TRI_STATE ShareVector;
+	BOOLEAN FloatingSave;
+	BOOLEAN AutomaticSerialization;
+	EVT_WDF_INTERRUPT_ISR* EvtInterruptIsr;
+	EVT_WDF_INTERRUPT_DPC* EvtInterruptDpc;
+	BOOLEAN PassiveHandling;
+} WDF_INTERRUPT_CONFIG, *PWDF_INTERRUPT_CONFIG;
+
+FORCEINLINE VOID WDF_INTERRUPT_CONFIG_INIT(PWDF_INTERRUPT_CONFIG Configuration,
+	EVT_WDF_INTERRUPT_ISR* EvtInterruptIsr, EVT_WDF_INTERRUPT_DPC* EvtInterruptDpc) {
+	RtlZeroMemory(Configuration, sizeof(*Configuration));
+	Configuration->Size = sizeof(*Configuration);
+	Configuration->ShareVector = WdfUseDefault;
+	Configuration->EvtInterruptIsr = EvtInterruptIsr;
+	Configuration->EvtInterruptDpc = EvtInterruptDpc;
+}
+
+NTSTATUS WdfInterruptCreate(WDFDEVICE Device, PWDF_INTERRUPT_CONFIG Configuration,
+	PWDF_OBJECT_ATTRIBUTES Attributes, WDFINTERRUPT* Interrupt);
+VOID WdfInterruptEnable(WDFINTERRUPT Interrupt);
+VOID WdfInterruptDisable(WDFINTERRUPT Interrupt);
+WDFDEVICE WdfInterruptGetDevice(WDFINTERRUPT Interrupt);
+
+//
+// Memory
+//
+
+NTSTATUS WdfMemoryCreate(PWDF_OBJECT_ATTRIBUTES Attributes, POOL_TYPE PoolType, ULONG PoolTag,
+	size_t BufferSize, WDFMEMORY* Memory, PVOID* Buffer);
+PVOID WdfMemoryGetBuffer(WDFMEMORY Memory, size_t* BufferSize);
+
+//
+// Locks
+//
+
+NTSTATUS WdfWaitLockCreate(PWDF_OBJECT_ATTRIBUTES LockAttributes, WDFWAITLOCK* Lock);
+NTSTATUS WdfWaitLockAcquire(WDFWAITLOCK Lock, PLONGLONG Timeout);
+VOID WdfWaitLockRelease(WDFWAITLOCK Lock);
+NTSTATUS WdfSpinLockCreate(PWDF_OBJECT_ATTRIBUTES SpinLockAttributes, WDFSPINLOCK* SpinLock);
+VOID WdfSpinLockAcquire(WDFSPINLOCK SpinLock);
+VOID WdfSpinLockRelease(WDFSPINLOCK SpinLock);
+
+//
+// Timers
+//
+
+typedef VOID EVT_WDF_TIMER(WDFTIMER Timer);
+
+typedef struct _WDF_TIMER_CONFIG {
+	ULONG Size;
+	EVT_WDF_TIMER* EvtTimerFunc;
+	ULONG Period;
+	BOOLEAN AutomaticSerialization;
+	ULONG TolerableDelay;
+	BOOLEAN UseHighResolutionTimer;
+} WDF_TIMER_CONFIG, *PWDF_TIMER_CONFIG;
+
+FORCEINLINE VOID WDF_TIMER_CONFIG_INIT(PWDF_TIMER_CONFIG Config, EVT_WDF_TIMER* EvtTimerFunc) {
+	RtlZeroMemory(Config, sizeof(*Config));
+	Config->Size = sizeof(*Config);
+	Config->EvtTimerFunc = EvtTimerFunc;
+	Config->AutomaticSerialization = TRUE;
+}
+
+NTSTATUS WdfTimerCreate(PWDF_TIMER_CONFIG Config, PWDF_OBJECT_ATTRIBUTES Attributes,
+	WDFTIMER* Timer);
+BOOLEAN WdfTimerStart(WDFTIMER Timer, LONGLONG DueTime);
+BOOLEAN WdfTimerStop(WDFTIMER Timer, BOOLEAN Wait);
+WDFOBJECT WdfTimerGetParentObject(WDFTIMER Timer);
+
+//
+// Registry
+//
+
+NTSTATUS WdfDeviceOpenRegistryKey(WDFDEVICE Device, ULONG DeviceInstanceKeyType,
+	ACCESS_MASK DesiredAccess, PWDF_OBJECT_ATTRIBUTES KeyAttributes, WDFKEY* Key);
+NTSTATUS WdfRegistryOpenKey(WDFKEY ParentKey, PCUNICODE_STRING KeyName,
+	ACCESS_MASK DesiredAccess, PWDF_OBJECT_ATTRIBUTES KeyAttributes, WDFKEY* Key);
+VOID WdfRegistryClose(WDFKEY Key);
+NTSTATUS WdfRegistryQueryULong(WDFKEY Key, PCUNICODE_STRING ValueName, PULONG Value);
+NTSTATUS WdfRegistryQueryValue(WDFKEY Key, PCUNICODE_STRING ValueName, ULONG ValueLength,
+	PVOID Value, PULONG ValueLengthQueried, PULONG ValueType);
+NTSTATUS WdfRegistryAssignValue(WDFKEY Key, PCUNICODE_STRING ValueName, ULONG ValueType,
+	ULONG ValueLength, PVOID Value);
+NTSTATUS WdfRegistryRemoveValue(WDFKEY Key, PCUNICODE_STRING ValueName);
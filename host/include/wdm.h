@@ -0,0 +1,456 @@
+/*
+ * Host stand-in for the parts of wdm.h the Cr50 driver uses.
+ *
+ * Only what the driver sources need to compile and run in a Linux
+ * process is here. The implementations are in shim.c: pool allocations
+ * are heap allocations, dispatcher objects are backed by one mutex and
+ * condition variable, and the clock is virtual (see shim.c).
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+typedef void VOID, *PVOID;
+typedef char CHAR, *PCHAR;
+typedef const char* PCSTR;
+typedef uint8_t UCHAR, UINT8, BYTE, *PUCHAR, *PUINT8;
+typedef uint16_t USHORT, UINT16, WCHAR, *PUSHORT, *PWCHAR, *PWCH, *PWSTR;
+typedef const WCHAR* PCWSTR;
+typedef int16_t SHORT;
+typedef int32_t LONG, INT32, *PLONG;
+typedef uint32_t ULONG, UINT32, DWORD, *PULONG, *PUINT32;
+typedef int INT;
+typedef unsigned int UINT;
+typedef int64_t LONGLONG, LONG64, INT64, *PLONGLONG, *PLONG64;
+typedef uint64_t ULONGLONG, ULONG64, UINT64, *PULONGLONG, *PULONG64;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR, *PULONG_PTR, SIZE_T;
+typedef UCHAR BOOLEAN, *PBOOLEAN;
+typedef LONG NTSTATUS;
+typedef PVOID HANDLE, *PHANDLE;
+typedef ULONG ACCESS_MASK;
+typedef UCHAR KIRQL;
+typedef CHAR KPROCESSOR_MODE;
+
+#define TRUE	1
+#define FALSE	0
+
+typedef union _LARGE_INTEGER {
+	struct {
+		ULONG LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _LUID {
+	ULONG LowPart;
+	LONG HighPart;
+} LUID, *PLUID;
+
+typedef struct _GUID {
+	ULONG Data1;
+	USHORT Data2;
+	USHORT Data3;
+	UCHAR Data4[8];
+} GUID, *LPGUID;
+typedef const GUID* LPCGUID;
+
+typedef struct _UNICODE_STRING {
+	USHORT Length;
+	USHORT MaximumLength;
+	PWCH Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+typedef const UNICODE_STRING* PCUNICODE_STRING;
+
+/* SAL annotations and MSVC keywords */
+#define IN
+#define OUT
+#define __in
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _In_reads_bytes_(x)
+#define _Out_writes_bytes_(x)
+#define _IRQL_requires_max_(x)
+#define _Must_inspect_result_
+#define _Use_decl_annotations_
+#define __forceinline	inline __attribute__((always_inline))
+#define FORCEINLINE	static inline
+#define DECLSPEC_CACHEALIGN	__attribute__((aligned(64)))
+
+#define UNREFERENCED_PARAMETER(p)	((void)(p))
+#define PAGED_CODE()
+#define NT_ASSERT(e)
+#define ASSERTMSG(m, e)
+#define C_ASSERT(e)	_Static_assert(e, #e)
+
+#ifndef min
+#define min(a, b)	(((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b)	(((a) > (b)) ? (a) : (b))
+#endif
+
+#define ARRAYSIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define RTL_NUMBER_OF(a)	ARRAYSIZE(a)
+#define FIELD_OFFSET(t, f)	((LONG)offsetof(t, f))
+#define CONTAINING_RECORD(a, t, f)	((t*)((PCHAR)(a) - offsetof(t, f)))
+
+#define MAXUSHORT	0xffff
+#define MAXULONG	0xffffffffUL
+#define MAXLONG		0x7fffffffL
+#define MAXLONGLONG	0x7fffffffffffffffLL
+
+//
+// Status codes
+//
+
+#define NT_SUCCESS(s)	(((NTSTATUS)(s)) >= 0)
+
+#define STATUS_SUCCESS			((NTSTATUS)0x00000000L)
+#define STATUS_WAIT_0			((NTSTATUS)0x00000000L)
+#define STATUS_WAIT_1			((NTSTATUS)0x00000001L)
+#define STATUS_ALERTED			((NTSTATUS)0x00000101L)
+#define STATUS_TIMEOUT			((NTSTATUS)0x00000102L)
+#define STATUS_PENDING			((NTSTATUS)0x00000103L)
+#define STATUS_BUFFER_OVERFLOW		((NTSTATUS)0x80000005L)
+#define STATUS_DEVICE_BUSY		((NTSTATUS)0x80000011L)
+#define STATUS_NO_MORE_ENTRIES		((NTSTATUS)0x8000001AL)
+#define STATUS_UNSUCCESSFUL		((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER	((NTSTATUS)0xC000000DL)
+#define STATUS_INVALID_DEVICE_REQUEST	((NTSTATUS)0xC0000010L)
+#define STATUS_END_OF_FILE		((NTSTATUS)0xC0000011L)
+#define STATUS_NO_MEMORY		((NTSTATUS)0xC0000017L)
+#define STATUS_ACCESS_DENIED		((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL		((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_TYPE_MISMATCH	((NTSTATUS)0xC0000024L)
+#define STATUS_OBJECT_NAME_NOT_FOUND	((NTSTATUS)0xC0000034L)
+#define STATUS_DATA_ERROR		((NTSTATUS)0xC000003EL)
+#define STATUS_QUOTA_EXCEEDED		((NTSTATUS)0xC0000044L)
+#define STATUS_PRIVILEGE_NOT_HELD	((NTSTATUS)0xC0000061L)
+#define STATUS_INSUFFICIENT_RESOURCES	((NTSTATUS)0xC000009AL)
+#define STATUS_MEMORY_NOT_ALLOCATED	((NTSTATUS)0xC00000A0L)
+#define STATUS_DEVICE_NOT_READY		((NTSTATUS)0xC00000A3L)
+#define STATUS_IO_TIMEOUT		((NTSTATUS)0xC00000B5L)
+#define STATUS_NOT_SUPPORTED		((NTSTATUS)0xC00000BBL)
+#define STATUS_INVALID_USER_BUFFER	((NTSTATUS)0xC00000E8L)
+#define STATUS_CANCELLED		((NTSTATUS)0xC0000120L)
+#define STATUS_INVALID_CONNECTION	((NTSTATUS)0xC0000140L)
+#define STATUS_INVALID_DEVICE_STATE	((NTSTATUS)0xC0000184L)
+#define STATUS_IO_DEVICE_ERROR		((NTSTATUS)0xC0000185L)
+#define STATUS_DEVICE_PROTOCOL_ERROR	((NTSTATUS)0xC0000186L)
+#define STATUS_INVALID_BUFFER_SIZE	((NTSTATUS)0xC0000206L)
+#define STATUS_NOT_FOUND		((NTSTATUS)0xC0000225L)
+#define STATUS_RETRY			((NTSTATUS)0xC000022DL)
+#define STATUS_REQUEST_ABORTED		((NTSTATUS)0xC0000240L)
+#define STATUS_DEVICE_REMOVED		((NTSTATUS)0xC00002B6L)
+#define STATUS_DEVICE_FEATURE_NOT_SUPPORTED	((NTSTATUS)0xC0000463L)
+#define STATUS_DEVICE_POWERED_OFF	((NTSTATUS)0xC000048FL)
+#define STATUS_ALREADY_REGISTERED	((NTSTATUS)0xC0000718L)
+#define STATUS_TPM_FAIL			((NTSTATUS)0xC0290101L)
+#define IO_ERROR_IO_HARDWARE_ERROR	((NTSTATUS)0xC0040004L)
+
+//
+// Memory and byte order
+//
+
+#define RtlZeroMemory(d, l)		memset((d), 0, (l))
+#define RtlFillMemory(d, l, f)		memset((d), (f), (l))
+#define RtlCopyMemory(d, s, l)		memcpy((d), (s), (l))
+#define RtlMoveMemory(d, s, l)		memmove((d), (s), (l))
+#define RtlEqualMemory(a, b, l)		(!memcmp((a), (b), (l)))
+
+FORCEINLINE USHORT RtlUshortByteSwap(USHORT v) { return __builtin_bswap16(v); }
+FORCEINLINE ULONG RtlUlongByteSwap(ULONG v) { return __builtin_bswap32(v); }
+FORCEINLINE ULONGLONG RtlUlonglongByteSwap(ULONGLONG v) { return __builtin_bswap64(v); }
+
+VOID RtlInitUnicodeString(PUNICODE_STRING Destination, PCWSTR Source);
+VOID RtlInitEmptyUnicodeString(PUNICODE_STRING Destination, PWCHAR Buffer, USHORT Size);
+LUID RtlConvertLongToLuid(LONG Long);
+
+#define DECLARE_CONST_UNICODE_STRING(name, s) \
+	const UNICODE_STRING name = { sizeof(s) - sizeof(WCHAR), sizeof(s), (PWCH)(s) }
+
+//
+// Interlocked operations and barriers
+//
+
+FORCEINLINE LONG InterlockedIncrement(volatile LONG* p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedDecrement(volatile LONG* p) { return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedAdd(volatile LONG* p, LONG v) { return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedExchange(volatile LONG* p, LONG v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedCompareExchange(volatile LONG* p, LONG v, LONG c) {
+	__atomic_compare_exchange_n(p, &c, v, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return c;
+}
+FORCEINLINE LONG64 InterlockedIncrement64(volatile LONG64* p) { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedAdd64(volatile LONG64* p, LONG64 v) { return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedExchange64(volatile LONG64* p, LONG64 v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedCompareExchange64(volatile LONG64* p, LONG64 v, LONG64 c) {
+	__atomic_compare_exchange_n(p, &c, v, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return c;
+}
+
+#define ReadAcquire(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ReadNoFence(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#define WriteRelease(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define WriteNoFence(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define MemoryBarrier()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define KeMemoryBarrier()	MemoryBarrier()
+#define YieldProcessor()	__atomic_signal_fence(__ATOMIC_SEQ_CST)
+
+FORCEINLINE BOOLEAN _BitScanReverse(ULONG* index, ULONG mask) {
+	if (!mask)
+		return FALSE;
+	*index = 31 - __builtin_clz(mask);
+	return TRUE;
+}
+
+FORCEINLINE BOOLEAN _BitScanForward(ULONG* index, ULONG mask) {
+	if (!mask)
+		return FALSE;
+	*index = __builtin_ctz(mask);
+	return TRUE;
+}
+
+//
+// Pool
+//
+
+typedef enum _POOL_TYPE {
+	NonPagedPool,
+	PagedPool,
+	NonPagedPoolNx = 512
+} POOL_TYPE;
+
+#define POOL_FLAG_NON_PAGED	0x0000000000000040ULL
+
+PVOID ExAllocatePoolZero(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag);
+PVOID ExAllocatePool2(ULONG64 Flags, SIZE_T NumberOfBytes, ULONG Tag);
+VOID ExFreePoolWithTag(PVOID P, ULONG Tag);
+VOID ExFreePool(PVOID P);
+
+typedef enum _DRIVER_RUNTIME_INIT_FLAGS {
+	DrvRtPoolNxOptIn = 1
+} DRIVER_RUNTIME_INIT_FLAGS;
+
+VOID ExInitializeDriverRuntime(ULONG Flags);
+
+//
+// Time, IRQL and waits
+//
+
+#define PASSIVE_LEVEL	0
+#define APC_LEVEL	1
+#define DISPATCH_LEVEL	2
+
+#define KernelMode	0
+#define UserMode	1
+
+KIRQL KeGetCurrentIrql(void);
+VOID KeQuerySystemTimePrecise(PLARGE_INTEGER CurrentTime);
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency);
+NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Interval);
+VOID KeStallExecutionProcessor(ULONG MicroSeconds);
+
+typedef struct _DISPATCHER_HEADER {
+	LONG Type;
+	volatile LONG SignalState;
+} DISPATCHER_HEADER;
+
+typedef enum _EVENT_TYPE {
+	NotificationEvent,
+	SynchronizationEvent
+} EVENT_TYPE;
+
+typedef struct _KEVENT {
+	DISPATCHER_HEADER Header;
+} KEVENT, *PKEVENT, *PRKEVENT;
+
+typedef enum _KWAIT_REASON {
+	Executive
+} KWAIT_REASON;
+
+typedef enum _WAIT_TYPE {
+	WaitAll,
+	WaitAny
+} WAIT_TYPE;
+
+#define IO_NO_INCREMENT	0
+
+VOID KeInitializeEvent(PRKEVENT Event, EVENT_TYPE Type, BOOLEAN State);
+LONG KeSetEvent(PRKEVENT Event, LONG Increment, BOOLEAN Wait);
+VOID KeClearEvent(PRKEVENT Event);
+LONG KeResetEvent(PRKEVENT Event);
+LONG KeReadStateEvent(PRKEVENT Event);
+NTSTATUS KeWaitForSingleObject(PVOID Object, KWAIT_REASON WaitReason,
+	KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Timeout);
+NTSTATUS KeWaitForMultipleObjects(ULONG Count, PVOID Object[], WAIT_TYPE WaitType,
+	KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode, BOOLEAN Alertable,
+	PLARGE_INTEGER Timeout, PVOID WaitBlockArray);
+
+typedef struct _EX_RUNDOWN_REF {
+	volatile ULONG_PTR Count;
+} EX_RUNDOWN_REF, *PEX_RUNDOWN_REF;
+
+VOID ExInitializeRundownProtection(PEX_RUNDOWN_REF RunRef);
+VOID ExReInitializeRundownProtection(PEX_RUNDOWN_REF RunRef);
+BOOLEAN ExAcquireRundownProtection(PEX_RUNDOWN_REF RunRef);
+VOID ExReleaseRundownProtection(PEX_RUNDOWN_REF RunRef);
+VOID ExWaitForRundownProtectionRelease(PEX_RUNDOWN_REF RunRef);
+
+//
+// System threads
+//
+
+typedef VOID KSTART_ROUTINE(PVOID StartContext);
+typedef KSTART_ROUTINE* PKSTART_ROUTINE;
+typedef struct _KTHREAD* PKTHREAD;
+typedef struct _OBJECT_ATTRIBUTES* POBJECT_ATTRIBUTES;
+typedef struct _CLIENT_ID* PCLIENT_ID;
+
+#define SYNCHRONIZE		0x00100000L
+#define THREAD_ALL_ACCESS	0x001FFFFFL
+
+NTSTATUS PsCreateSystemThread(PHANDLE ThreadHandle, ULONG DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes, HANDLE ProcessHandle, PCLIENT_ID ClientId,
+	PKSTART_ROUTINE StartRoutine, PVOID StartContext);
+NTSTATUS PsTerminateSystemThread(NTSTATUS ExitStatus);
+NTSTATUS ObReferenceObjectByHandle(HANDLE Handle, ACCESS_MASK DesiredAccess,
+	PVOID ObjectType, KPROCESSOR_MODE AccessMode, PVOID* Object, PVOID HandleInformation);
+VOID ObDereferenceObject(PVOID Object);
+NTSTATUS ZwClose(HANDLE Handle);
+
+//
+// Security
+//
+
+typedef PVOID PACCESS_TOKEN;
+
+typedef struct _SECURITY_SUBJECT_CONTEXT {
+	PACCESS_TOKEN ClientToken;
+	PACCESS_TOKEN PrimaryToken;
+} SECURITY_SUBJECT_CONTEXT, *PSECURITY_SUBJECT_CONTEXT;
+
+#define SE_TCB_PRIVILEGE	7
+
+BOOLEAN SeSinglePrivilegeCheck(LUID PrivilegeValue, KPROCESSOR_MODE PreviousMode);
+
+//
+// Devices, IRPs and resources
+//
+
+typedef struct _DEVICE_OBJECT DEVICE_OBJECT, *PDEVICE_OBJECT;
+typedef struct _DRIVER_OBJECT DRIVER_OBJECT, *PDRIVER_OBJECT;
+typedef struct _FILE_OBJECT FILE_OBJECT, *PFILE_OBJECT;
+
+typedef NTSTATUS DRIVER_INITIALIZE(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath);
+
+typedef enum _BUS_QUERY_ID_TYPE {
+	BusQueryDeviceID,
+	BusQueryHardwareIDs,
+	BusQueryCompatibleIDs,
+	BusQueryInstanceID
+} BUS_QUERY_ID_TYPE;
+
+typedef struct _IO_STACK_LOCATION {
+	UCHAR MajorFunction;
+	UCHAR MinorFunction;
+	union {
+		struct {
+			BUS_QUERY_ID_TYPE IdType;
+		} QueryId;
+	} Parameters;
+	PDEVICE_OBJECT DeviceObject;
+} IO_STACK_LOCATION, *PIO_STACK_LOCATION;
+
+typedef struct _IO_STATUS_BLOCK {
+	NTSTATUS Status;
+	ULONG_PTR Information;
+} IO_STATUS_BLOCK;
+
+typedef struct _IRP {
+	IO_STATUS_BLOCK IoStatus;
+	IO_STACK_LOCATION Stack;
+} IRP, *PIRP;
+
+#define IRP_MJ_PNP		0x1b
+#define IRP_MN_QUERY_ID		0x13
+
+PIO_STACK_LOCATION IoGetCurrentIrpStackLocation(PIRP Irp);
+VOID IoCompleteRequest(PIRP Irp, CHAR PriorityBoost);
+
+#define CmResourceTypeInterrupt		2
+#define CmResourceTypeConnection	132
+
+#define CM_RESOURCE_INTERRUPT_LEVEL_SENSITIVE	0x0000
+#define CM_RESOURCE_INTERRUPT_LATCHED		0x0001
+#define CM_RESOURCE_INTERRUPT_POLARITY_MASK	0x000C
+#define CM_RESOURCE_INTERRUPT_ACTIVE_HIGH	0x0000
+#define CM_RESOURCE_INTERRUPT_ACTIVE_LOW	0x0004
+
+#define CM_RESOURCE_CONNECTION_CLASS_SERIAL	0x01
+#define CM_RESOURCE_CONNECTION_TYPE_SERIAL_I2C	0x01
+#define CM_RESOURCE_CONNECTION_TYPE_SERIAL_SPI	0x02
+
+typedef struct _CM_PARTIAL_RESOURCE_DESCRIPTOR {
+	UCHAR Type;
+	UCHAR ShareDisposition;
+	USHORT Flags;
+	union {
+		struct {
+			ULONG Level;
+			ULONG Vector;
+			ULONG_PTR Affinity;
+		} Interrupt;
+		struct {
+			UCHAR Class;
+			UCHAR Type;
+			UCHAR Reserved1;
+			UCHAR Reserved2;
+			ULONG IdLowPart;
+			ULONG IdHighPart;
+		} Connection;
+	} u;
+} CM_PARTIAL_RESOURCE_DESCRIPTOR, *PCM_PARTIAL_RESOURCE_DESCRIPTOR;
+
+#define FILE_DEVICE_UNKNOWN	0x00000022
+#define METHOD_BUFFERED		0
+#define METHOD_IN_DIRECT	1
+#define METHOD_OUT_DIRECT	2
+#define METHOD_NEITHER		3
+#define FILE_ANY_ACCESS		0
+#define FILE_READ_ACCESS	0x0001
+#define FILE_WRITE_ACCESS	0x0002
+
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+	(((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+//
+// Registry
+//
+
+#define KEY_QUERY_VALUE		0x0001
+#define KEY_SET_VALUE		0x0002
+#define KEY_READ		0x20019
+#define KEY_WRITE		0x20006
+#define KEY_ALL_ACCESS		0xF003F
+
+#define REG_BINARY		3
+#define REG_DWORD		4
+
+#define PLUGPLAY_REGKEY_DEVICE	1
+#define PLUGPLAY_REGKEY_DRIVER	2
+
+//
+// Debug output, printed when CR50_HOST_DEBUG is set in the environment
+//
+
+ULONG DbgPrint(PCSTR Format, ...);
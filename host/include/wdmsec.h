@@ -0,0 +1,7 @@
+/* Host stand-in for wdmsec.h */
+
+#pragma once
+
+#include <wdm.h>
+
+extern const UNICODE_STRING SDDL_DEVOBJ_SYS_ALL_ADM_ALL;
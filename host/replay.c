@@ -0,0 +1,258 @@
+/*
+ * cr50replay - replays a bus trace saved on a field device
+ *
+ *   cr50replay <file> [speedup=<n>] [ti50]
+ *
+ * The trace is one saved with "cr50tool trace <file>". The driver runs
+ * on the host against the chip model; the model answers its register
+ * transfers from the recording, with the recorded result and time
+ * divided by the speedup (0 for no time at all), so the TIS code sees
+ * what it saw in the field. The commands are rebuilt from their
+ * recorded DATA_FIFO writes and submitted in order, with the recorded
+ * gaps between them, and the time each took is printed next to the
+ * recorded one. A change to the driver can so be measured against the
+ * traces of the devices that showed a problem.
+ *
+ * The driver keeps FIFO data out of the trace unless the TracePayload
+ * setting, which only an administrator can set, was on when the trace
+ * was recorded. Without it commands cannot be rebuilt and are skipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cr50host.h"
+
+/* Startup and Shutdown are the driver's own, it sends them again */
+#define REPLAY_OWN_COMMAND(cc)	((cc) == TPM2_CC_STARTUP || (cc) == TPM2_CC_SHUTDOWN)
+
+static const UINT8 GetRandom8[] = {
+	0x80, 0x01, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x01, 0x7b, 0x00, 0x08
+};
+
+static const CR50_HOST_SETTING Settings[] = {
+	{ "SessionPool", 0 },
+	{ "KeyPoolDepth", 0 },
+	{ NULL, 0 }
+};
+
+static UINT32 Get32(const UINT8* p) {
+	return (UINT32)p[0] << 24 | (UINT32)p[1] << 16 | (UINT32)p[2] << 8 | p[3];
+}
+
+/* TRUE for the DATA_FIFO of any locality, which is stored in @locality */
+static BOOLEAN IsFifo(const CR50_TRACE_ENTRY* e, ULONG* locality) {
+	if (e->Transport) {
+		*locality = (e->Register >> 12) & 0xF;
+		return (e->Register & 0xFFF) == TPM_DATA_FIFO(0);
+	}
+	*locality = (e->Register >> 4) & 0xF;
+	return (e->Register & 0xF) == TPM_I2C_DATA_FIFO(0);
+}
+
+static PCR50_TRACE Load(const char* path, size_t* size) {
+	PCR50_TRACE trace;
+	FILE* f = fopen(path, "rb");
+	long len;
+
+	if (!f) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	trace = calloc(1, len > 0 ? len : 1);
+	if (!trace || len < (long)FIELD_OFFSET(CR50_TRACE, Entries) ||
+		fread(trace, 1, len, f) != (size_t)len) {
+		fprintf(stderr, "Could not read %s\n", path);
+		fclose(f);
+		free(trace);
+		return NULL;
+	}
+	fclose(f);
+
+	if (trace->Magic != CR50_TRACE_MAGIC || trace->Version != CR50_TRACE_VERSION ||
+		trace->EntrySize != sizeof(CR50_TRACE_ENTRY) ||
+		trace->EntriesReturned > (len - FIELD_OFFSET(CR50_TRACE, Entries)) /
+		sizeof(CR50_TRACE_ENTRY)) {
+		fprintf(stderr, "%s is not a Cr50 trace\n", path);
+		free(trace);
+		return NULL;
+	}
+
+	*size = len;
+	return trace;
+}
+
+int main(int argc, char** argv) {
+	static UINT8 cmd[CR50_MAX_COMMAND_SIZE], rsp[CR50_MAX_COMMAND_SIZE];
+	CR50_SIM_CONFIG config = { 0 };
+	CR50_SIM_COUNTERS counters;
+	CR50_HOST* host;
+	PCR50_TRACE trace;
+	size_t size, len;
+	ULONG speedup = 1, current = 0, commands = 0, failed = 0, unrebuilt = 0;
+	ULONG start = 0, cmdLen = 0, locality = 0;
+	LONG64 lastEnd = 0;
+	double recordedTotal = 0, replayedTotal = 0;
+	BOOLEAN inCommand = FALSE, transportSeen = FALSE;
+	NTSTATUS status;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: cr50replay <file> [speedup=<n>] [ti50]\n");
+		return 1;
+	}
+	for (int i = 2; i < argc; i++) {
+		if (!strncmp(argv[i], "speedup=", 8)) {
+			speedup = strtoul(argv[i] + 8, NULL, 0);
+		}
+		else if (!strcmp(argv[i], "ti50")) {
+			config.Ti50 = TRUE;
+		}
+		else {
+			fprintf(stderr, "Usage: cr50replay <file> [speedup=<n>] [ti50]\n");
+			return 1;
+		}
+	}
+
+	trace = Load(argv[1], &size);
+	if (!trace)
+		return 1;
+
+	/* Register addresses only mean something on the bus they were recorded on */
+	for (ULONG i = 0; i < trace->EntriesReturned; i++) {
+		const CR50_TRACE_ENTRY* e = &trace->Entries[i];
+
+		if (e->Type != Cr50TraceRead && e->Type != Cr50TraceWrite)
+			continue;
+		if (transportSeen && config.Spi != (e->Transport != 0)) {
+			fprintf(stderr, "%s mixes transports\n", argv[1]);
+			free(trace);
+			return 1;
+		}
+		config.Spi = e->Transport != 0;
+		transportSeen = TRUE;
+	}
+
+	status = cr50_host_open(&config, Settings, &host);
+	if (!NT_SUCCESS(status)) {
+		fprintf(stderr, "Could not start the driver (0x%x)\n", (unsigned)status);
+		free(trace);
+		return 1;
+	}
+
+	/* The TPM is started up by the model, Startup is not replayed */
+	status = cr50_host_transmit(host, GetRandom8, sizeof(GetRandom8), rsp, sizeof(rsp), &len);
+	if (!NT_SUCCESS(status)) {
+		fprintf(stderr, "Could not start the TPM (0x%x)\n", (unsigned)status);
+		cr50_host_close(host);
+		free(trace);
+		return 1;
+	}
+
+	cr50_sim_replay(host->Sim, trace->Entries, trace->EntriesReturned, speedup);
+
+	printf("%-9s %5s %5s %14s %14s  %s\n", "CC", "loc", "bytes", "recorded(us)",
+		"replayed(us)", "result");
+
+	for (ULONG i = 0; i < trace->EntriesReturned; i++) {
+		const CR50_TRACE_ENTRY* e = &trace->Entries[i];
+		const CR50_TRACE_ENTRY* s;
+		ULONG l;
+
+		if (e->Type == Cr50TraceCommandStart) {
+			inCommand = TRUE;
+			start = i;
+			cmdLen = 0;
+			continue;
+		}
+
+		if (e->Type == Cr50TraceWrite && inCommand && IsFifo(e, &l) &&
+			e->Length <= CR50_TRACE_DATA_BYTES && cmdLen + e->Length <= sizeof(cmd)) {
+			memcpy(cmd + cmdLen, e->Data, e->Length);
+			cmdLen += e->Length;
+			locality = l;
+			continue;
+		}
+
+		if (e->Type != Cr50TraceCommandEnd || !inCommand)
+			continue;
+		inCommand = FALSE;
+		s = &trace->Entries[start];
+
+		if (REPLAY_OWN_COMMAND(e->Register)) {
+			lastEnd = e->EndTime;
+			continue;
+		}
+
+		/* Only the header is kept of a command recorded without its payload */
+		if (cmdLen < TPM_HEADER_SIZE || Get32(cmd + 2) != cmdLen ||
+			memcmp(cmd, s->Data, TPM_HEADER_SIZE)) {
+			unrebuilt++;
+			lastEnd = e->EndTime;
+			continue;
+		}
+
+		if (speedup && lastEnd && s->StartTime > lastEnd)
+			cr50_shim_advance((s->StartTime - lastEnd) / speedup);
+
+		if (locality != current) {
+			CR50_LOCALITY input = { locality };
+			ULONG_PTR returned;
+
+			status = cr50_shim_ioctl(host->File, IOCTL_CR50_SET_LOCALITY, &input,
+				sizeof(input), NULL, 0, &returned);
+			if (!NT_SUCCESS(status)) {
+				fprintf(stderr, "Could not select locality %u (0x%x)\n", locality,
+					(unsigned)status);
+				break;
+			}
+			current = locality;
+		}
+
+		cr50_sim_replay_seek(host->Sim, start);
+
+		LONGLONG begin = cr50_shim_now();
+		status = cr50_host_transmit(host, cmd, cmdLen, rsp, sizeof(rsp), &len);
+		double replayed = (cr50_shim_now() - begin) / 10.0;
+		double recorded = (e->EndTime - s->StartTime) / 10.0;
+
+		commands++;
+		recordedTotal += recorded;
+		replayedTotal += replayed;
+
+		printf("CC 0x%03x %5u %5u %14.1f %14.1f  ", e->Register, locality, cmdLen,
+			recorded, replayed);
+		if (NT_SUCCESS(status) && len >= TPM_HEADER_SIZE) {
+			printf("rc 0x%x", Get32(rsp + 6));
+			if (NT_SUCCESS(e->Result) && Get32(rsp + 6) != Get32(e->Data + 6))
+				printf(" (recorded 0x%x)", Get32(e->Data + 6));
+			printf("\n");
+		}
+		else {
+			failed++;
+			printf("failed (0x%x)\n", (unsigned)status);
+		}
+
+		lastEnd = e->EndTime;
+	}
+
+	cr50_sim_counters(host->Sim, &counters);
+	cr50_sim_replay(host->Sim, NULL, 0, 0);
+	cr50_host_close(host);
+
+	printf("%u commands replayed, %u failed, %.1f us recorded, %.1f us replayed, "
+		"%llu bus transfers unmatched\n",
+		commands, failed, recordedTotal, replayedTotal,
+		(unsigned long long)counters.ReplayMisses);
+	if (unrebuilt) {
+		printf("%u commands skipped: their FIFO data is only recorded with the "
+			"TracePayload setting\n", unrebuilt);
+	}
+
+	free(trace);
+	return failed ? 1 : 0;
+}
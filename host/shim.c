@@ -0,0 +1,1666 @@
+/*
+ * WDF and kernel routines for running the Cr50 driver in a Linux process.
+ *
+ * Dispatcher objects (events and threads) share one mutex and condition
+ * variable. A wait without a timeout blocks for real; a wait with one
+ * blocks for at most CR50_SHIM_WAIT_MS of real time and then moves the
+ * virtual clock past the timeout, so a test never sleeps for as long as
+ * the driver would. Timers never fire on their own; the harness fires
+ * one with cr50_shim_fire_timer().
+ */
+
+#include <ntifs.h>
+#include <wdmsec.h>
+#include <bcrypt.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "shim.h"
+
+#define CR50_SHIM_WAIT_MS	50
+
+static pthread_mutex_t shim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shim_cond = PTHREAD_COND_INITIALIZER;
+
+/* 2020-01-01 as a system time, so that no timestamp the driver takes is 0 */
+static volatile LONGLONG shim_clock = 132223104000000000LL;
+
+LONGLONG cr50_shim_now(void) {
+	return __atomic_add_fetch(&shim_clock, 1, __ATOMIC_SEQ_CST);
+}
+
+void cr50_shim_advance(LONGLONG Ticks) {
+	if (Ticks > 0) {
+		__atomic_add_fetch(&shim_clock, Ticks, __ATOMIC_SEQ_CST);
+	}
+}
+
+static void shim_advance_to(LONGLONG Time) {
+	LONGLONG now = __atomic_load_n(&shim_clock, __ATOMIC_SEQ_CST);
+
+	while (now < Time &&
+		!__atomic_compare_exchange_n(&shim_clock, &now, Time, FALSE,
+			__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+	}
+}
+
+/* Applies a relative (negative) or absolute (positive) kernel timeout */
+static void shim_advance_by_timeout(LONGLONG Timeout) {
+	if (Timeout < 0) {
+		cr50_shim_advance(-Timeout);
+	}
+	else {
+		shim_advance_to(Timeout);
+	}
+}
+
+//
+// Runtime library
+//
+
+VOID RtlInitUnicodeString(PUNICODE_STRING Destination, PCWSTR Source) {
+	size_t len = 0;
+
+	if (Source) {
+		while (Source[len]) {
+			len++;
+		}
+	}
+	Destination->Length = (USHORT)(len * sizeof(WCHAR));
+	Destination->MaximumLength = Source ? (USHORT)((len + 1) * sizeof(WCHAR)) : 0;
+	Destination->Buffer = (PWCH)Source;
+}
+
+VOID RtlInitEmptyUnicodeString(PUNICODE_STRING Destination, PWCHAR Buffer, USHORT Size) {
+	Destination->Length = 0;
+	Destination->MaximumLength = Size;
+	Destination->Buffer = Buffer;
+}
+
+LUID RtlConvertLongToLuid(LONG Long) {
+	LUID luid = { (ULONG)Long, Long < 0 ? -1 : 0 };
+	return luid;
+}
+
+ULONG DbgPrint(PCSTR Format, ...) {
+	va_list args;
+
+	if (!getenv("CR50_HOST_DEBUG")) {
+		return 0;
+	}
+
+	va_start(args, Format);
+	vfprintf(stderr, Format, args);
+	va_end(args);
+	return 0;
+}
+
+//
+// Pool
+//
+
+PVOID ExAllocatePoolZero(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag) {
+	UNREFERENCED_PARAMETER(PoolType);
+	UNREFERENCED_PARAMETER(Tag);
+	return calloc(1, NumberOfBytes ? NumberOfBytes : 1);
+}
+
+PVOID ExAllocatePool2(ULONG64 Flags, SIZE_T NumberOfBytes, ULONG Tag) {
+	UNREFERENCED_PARAMETER(Flags);
+	return ExAllocatePoolZero(NonPagedPoolNx, NumberOfBytes, Tag);
+}
+
+VOID ExFreePoolWithTag(PVOID P, ULONG Tag) {
+	UNREFERENCED_PARAMETER(Tag);
+	free(P);
+}
+
+VOID ExFreePool(PVOID P) {
+	free(P);
+}
+
+VOID ExInitializeDriverRuntime(ULONG Flags) {
+	UNREFERENCED_PARAMETER(Flags);
+}
+
+//
+// Time
+//
+
+KIRQL KeGetCurrentIrql(void) {
+	return PASSIVE_LEVEL;
+}
+
+VOID KeQuerySystemTimePrecise(PLARGE_INTEGER CurrentTime) {
+	CurrentTime->QuadPart = cr50_shim_now();
+}
+
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency) {
+	LARGE_INTEGER counter;
+
+	if (PerformanceFrequency) {
+		PerformanceFrequency->QuadPart = 10000000;
+	}
+	counter.QuadPart = cr50_shim_now();
+	return counter;
+}
+
+NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE WaitMode, BOOLEAN Alertable,
+	PLARGE_INTEGER Interval) {
+	UNREFERENCED_PARAMETER(WaitMode);
+	UNREFERENCED_PARAMETER(Alertable);
+
+	shim_advance_by_timeout(Interval->QuadPart);
+	sched_yield();
+	return STATUS_SUCCESS;
+}
+
+VOID KeStallExecutionProcessor(ULONG MicroSeconds) {
+	cr50_shim_advance(CR50_SHIM_US(MicroSeconds));
+}
+
+//
+// Dispatcher objects
+//
+
+VOID KeInitializeEvent(PRKEVENT Event, EVENT_TYPE Type, BOOLEAN State) {
+	Event->Header.Type = Type;
+	Event->Header.SignalState = State;
+}
+
+LONG KeSetEvent(PRKEVENT Event, LONG Increment, BOOLEAN Wait) {
+	LONG previous;
+
+	UNREFERENCED_PARAMETER(Increment);
+	UNREFERENCED_PARAMETER(Wait);
+
+	pthread_mutex_lock(&shim_lock);
+	previous = Event->Header.SignalState;
+	Event->Header.SignalState = 1;
+	pthread_cond_broadcast(&shim_cond);
+	pthread_mutex_unlock(&shim_lock);
+	return previous;
+}
+
+VOID KeClearEvent(PRKEVENT Event) {
+	pthread_mutex_lock(&shim_lock);
+	Event->Header.SignalState = 0;
+	pthread_mutex_unlock(&shim_lock);
+}
+
+LONG KeResetEvent(PRKEVENT Event) {
+	LONG previous;
+
+	pthread_mutex_lock(&shim_lock);
+	previous = Event->Header.SignalState;
+	Event->Header.SignalState = 0;
+	pthread_mutex_unlock(&shim_lock);
+	return previous;
+}
+
+LONG KeReadStateEvent(PRKEVENT Event) {
+	return __atomic_load_n(&Event->Header.SignalState, __ATOMIC_SEQ_CST);
+}
+
+/* Called with shim_lock held */
+static void shim_satisfy(DISPATCHER_HEADER* Header) {
+	if (Header->Type == SynchronizationEvent) {
+		Header->SignalState = 0;
+	}
+}
+
+/* Called with shim_lock held; returns the satisfying index or -1 */
+static LONG shim_wait_check(ULONG Count, PVOID Object[], WAIT_TYPE WaitType) {
+	ULONG signaled = 0;
+
+	for (ULONG i = 0; i < Count; i++) {
+		DISPATCHER_HEADER* header = Object[i];
+
+		if (!header->SignalState) {
+			continue;
+		}
+		if (WaitType == WaitAny) {
+			shim_satisfy(header);
+			return (LONG)i;
+		}
+		signaled++;
+	}
+
+	if (WaitType == WaitAll && signaled == Count) {
+		for (ULONG i = 0; i < Count; i++) {
+			shim_satisfy(Object[i]);
+		}
+		return 0;
+	}
+	return -1;
+}
+
+NTSTATUS KeWaitForMultipleObjects(ULONG Count, PVOID Object[], WAIT_TYPE WaitType,
+	KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode, BOOLEAN Alertable,
+	PLARGE_INTEGER Timeout, PVOID WaitBlockArray) {
+	struct timespec deadline;
+	LONG index;
+
+	UNREFERENCED_PARAMETER(WaitReason);
+	UNREFERENCED_PARAMETER(WaitMode);
+	UNREFERENCED_PARAMETER(Alertable);
+	UNREFERENCED_PARAMETER(WaitBlockArray);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += CR50_SHIM_WAIT_MS * 1000000L;
+	deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+	deadline.tv_nsec %= 1000000000L;
+
+	pthread_mutex_lock(&shim_lock);
+	while ((index = shim_wait_check(Count, Object, WaitType)) < 0) {
+		if (!Timeout) {
+			pthread_cond_wait(&shim_cond, &shim_lock);
+			continue;
+		}
+
+		if (Timeout->QuadPart == 0 ||
+			pthread_cond_timedwait(&shim_cond, &shim_lock, &deadline) == ETIMEDOUT) {
+			index = shim_wait_check(Count, Object, WaitType);
+			if (index >= 0) {
+				break;
+			}
+			pthread_mutex_unlock(&shim_lock);
+			shim_advance_by_timeout(Timeout->QuadPart);
+			return STATUS_TIMEOUT;
+		}
+	}
+	pthread_mutex_unlock(&shim_lock);
+
+	return STATUS_WAIT_0 + index;
+}
+
+NTSTATUS KeWaitForSingleObject(PVOID Object, KWAIT_REASON WaitReason,
+	KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Timeout) {
+	return KeWaitForMultipleObjects(1, &Object, WaitAny, WaitReason, WaitMode,
+		Alertable, Timeout, NULL);
+}
+
+//
+// Rundown protection: bit 0 of the count is set once a rundown started,
+// each reference adds 2.
+//
+
+VOID ExInitializeRundownProtection(PEX_RUNDOWN_REF RunRef) {
+	RunRef->Count = 0;
+}
+
+VOID ExReInitializeRundownProtection(PEX_RUNDOWN_REF RunRef) {
+	__atomic_store_n(&RunRef->Count, 0, __ATOMIC_SEQ_CST);
+}
+
+BOOLEAN ExAcquireRundownProtection(PEX_RUNDOWN_REF RunRef) {
+	ULONG_PTR count = __atomic_load_n(&RunRef->Count, __ATOMIC_SEQ_CST);
+
+	do {
+		if (count & 1) {
+			return FALSE;
+		}
+	} while (!__atomic_compare_exchange_n(&RunRef->Count, &count, count + 2, FALSE,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	return TRUE;
+}
+
+VOID ExReleaseRundownProtection(PEX_RUNDOWN_REF RunRef) {
+	__atomic_sub_fetch(&RunRef->Count, 2, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&shim_lock);
+	pthread_cond_broadcast(&shim_cond);
+	pthread_mutex_unlock(&shim_lock);
+}
+
+VOID ExWaitForRundownProtectionRelease(PEX_RUNDOWN_REF RunRef) {
+	__atomic_or_fetch(&RunRef->Count, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&shim_lock);
+	while (__atomic_load_n(&RunRef->Count, __ATOMIC_SEQ_CST) != 1) {
+		pthread_cond_wait(&shim_cond, &shim_lock);
+	}
+	pthread_mutex_unlock(&shim_lock);
+}
+
+//
+// System threads. The thread object is signaled when the thread exits and
+// freed with its last reference: the handle, the thread itself and each
+// ObReferenceObjectByHandle hold one.
+//
+
+typedef struct _SHIM_THREAD {
+	DISPATCHER_HEADER Header;
+	volatile LONG Refs;
+	pthread_t Thread;
+	PKSTART_ROUTINE StartRoutine;
+	PVOID StartContext;
+} SHIM_THREAD;
+
+static __thread SHIM_THREAD* shim_current_thread;
+
+VOID ObDereferenceObject(PVOID Object) {
+	SHIM_THREAD* thread = Object;
+
+	if (__atomic_sub_fetch(&thread->Refs, 1, __ATOMIC_SEQ_CST) == 0) {
+		free(thread);
+	}
+}
+
+static void shim_thread_exit(void) {
+	SHIM_THREAD* thread = shim_current_thread;
+
+	pthread_mutex_lock(&shim_lock);
+	thread->Header.SignalState = 1;
+	pthread_cond_broadcast(&shim_cond);
+	pthread_mutex_unlock(&shim_lock);
+
+	ObDereferenceObject(thread);
+}
+
+static void* shim_thread_start(void* Context) {
+	SHIM_THREAD* thread = Context;
+
+	shim_current_thread = thread;
+	thread->StartRoutine(thread->StartContext);
+	shim_thread_exit();
+	return NULL;
+}
+
+NTSTATUS PsCreateSystemThread(PHANDLE ThreadHandle, ULONG DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes, HANDLE ProcessHandle, PCLIENT_ID ClientId,
+	PKSTART_ROUTINE StartRoutine, PVOID StartContext) {
+	SHIM_THREAD* thread;
+
+	UNREFERENCED_PARAMETER(DesiredAccess);
+	UNREFERENCED_PARAMETER(ObjectAttributes);
+	UNREFERENCED_PARAMETER(ProcessHandle);
+	UNREFERENCED_PARAMETER(ClientId);
+
+	thread = calloc(1, sizeof(*thread));
+	if (!thread) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	thread->Header.Type = NotificationEvent;
+	thread->Refs = 2;
+	thread->StartRoutine = StartRoutine;
+	thread->StartContext = StartContext;
+
+	if (pthread_create(&thread->Thread, NULL, shim_thread_start, thread)) {
+		free(thread);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	pthread_detach(thread->Thread);
+
+	*ThreadHandle = thread;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS PsTerminateSystemThread(NTSTATUS ExitStatus) {
+	UNREFERENCED_PARAMETER(ExitStatus);
+
+	shim_thread_exit();
+	pthread_exit(NULL);
+}
+
+NTSTATUS ObReferenceObjectByHandle(HANDLE Handle, ACCESS_MASK DesiredAccess,
+	PVOID ObjectType, KPROCESSOR_MODE AccessMode, PVOID* Object, PVOID HandleInformation) {
+	SHIM_THREAD* thread = Handle;
+
+	UNREFERENCED_PARAMETER(DesiredAccess);
+	UNREFERENCED_PARAMETER(ObjectType);
+	UNREFERENCED_PARAMETER(AccessMode);
+	UNREFERENCED_PARAMETER(HandleInformation);
+
+	__atomic_add_fetch(&thread->Refs, 1, __ATOMIC_SEQ_CST);
+	*Object = thread;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS ZwClose(HANDLE Handle) {
+	ObDereferenceObject(Handle);
+	return STATUS_SUCCESS;
+}
+
+//
+// Security: the host process is trusted like SYSTEM
+//
+
+const UNICODE_STRING SDDL_DEVOBJ_SYS_ALL_ADM_ALL = {
+	sizeof(L"D:P(A;;GA;;;SY)(A;;GA;;;BA)") - sizeof(WCHAR),
+	sizeof(L"D:P(A;;GA;;;SY)(A;;GA;;;BA)"),
+	(PWCH)L"D:P(A;;GA;;;SY)(A;;GA;;;BA)"
+};
+
+VOID SeCaptureSubjectContext(PSECURITY_SUBJECT_CONTEXT SubjectContext) {
+	RtlZeroMemory(SubjectContext, sizeof(*SubjectContext));
+}
+
+VOID SeLockSubjectContext(PSECURITY_SUBJECT_CONTEXT SubjectContext) {
+	UNREFERENCED_PARAMETER(SubjectContext);
+}
+
+VOID SeUnlockSubjectContext(PSECURITY_SUBJECT_CONTEXT SubjectContext) {
+	UNREFERENCED_PARAMETER(SubjectContext);
+}
+
+VOID SeReleaseSubjectContext(PSECURITY_SUBJECT_CONTEXT SubjectContext) {
+	UNREFERENCED_PARAMETER(SubjectContext);
+}
+
+PACCESS_TOKEN SeQuerySubjectContextToken(PSECURITY_SUBJECT_CONTEXT SubjectContext) {
+	return SubjectContext->ClientToken;
+}
+
+BOOLEAN SeTokenIsAdmin(PACCESS_TOKEN Token) {
+	UNREFERENCED_PARAMETER(Token);
+	return TRUE;
+}
+
+BOOLEAN SeSinglePrivilegeCheck(LUID PrivilegeValue, KPROCESSOR_MODE PreviousMode) {
+	UNREFERENCED_PARAMETER(PrivilegeValue);
+	UNREFERENCED_PARAMETER(PreviousMode);
+	return TRUE;
+}
+
+//
+// IRPs
+//
+
+PIO_STACK_LOCATION IoGetCurrentIrpStackLocation(PIRP Irp) {
+	return &Irp->Stack;
+}
+
+VOID IoCompleteRequest(PIRP Irp, CHAR PriorityBoost) {
+	UNREFERENCED_PARAMETER(Irp);
+	UNREFERENCED_PARAMETER(PriorityBoost);
+}
+
+//
+// CNG: SHA-256 and a seeded generator
+//
+
+typedef struct _SHIM_SHA256 {
+	UINT32 State[8];
+	UINT8 Block[64];
+	UINT64 Length;
+} SHIM_SHA256;
+
+static const UINT32 shim_sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHIM_ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void shim_sha256_block(SHIM_SHA256* ctx) {
+	UINT32 w[64], s[8];
+
+	for (int i = 0; i < 16; i++) {
+		w[i] = (UINT32)ctx->Block[i * 4] << 24 | (UINT32)ctx->Block[i * 4 + 1] << 16 |
+			(UINT32)ctx->Block[i * 4 + 2] << 8 | ctx->Block[i * 4 + 3];
+	}
+	for (int i = 16; i < 64; i++) {
+		UINT32 s0 = SHIM_ROR(w[i - 15], 7) ^ SHIM_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		UINT32 s1 = SHIM_ROR(w[i - 2], 17) ^ SHIM_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	memcpy(s, ctx->State, sizeof(s));
+	for (int i = 0; i < 64; i++) {
+		UINT32 t1 = s[7] + (SHIM_ROR(s[4], 6) ^ SHIM_ROR(s[4], 11) ^ SHIM_ROR(s[4], 25)) +
+			((s[4] & s[5]) ^ (~s[4] & s[6])) + shim_sha256_k[i] + w[i];
+		UINT32 t2 = (SHIM_ROR(s[0], 2) ^ SHIM_ROR(s[0], 13) ^ SHIM_ROR(s[0], 22)) +
+			((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(s + 1, s, 7 * sizeof(UINT32));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for (int i = 0; i < 8; i++) {
+		ctx->State[i] += s[i];
+	}
+}
+
+static void shim_sha256(const UINT8* data, size_t len, UINT8 out[32]) {
+	static const UINT32 init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	SHIM_SHA256 ctx;
+	size_t fill = 0;
+
+	memcpy(ctx.State, init, sizeof(init));
+	ctx.Length = (UINT64)len * 8;
+
+	for (size_t i = 0; i < len; i++) {
+		ctx.Block[fill++] = data[i];
+		if (fill == 64) {
+			shim_sha256_block(&ctx);
+			fill = 0;
+		}
+	}
+
+	ctx.Block[fill++] = 0x80;
+	if (fill > 56) {
+		memset(ctx.Block + fill, 0, 64 - fill);
+		shim_sha256_block(&ctx);
+		fill = 0;
+	}
+	memset(ctx.Block + fill, 0, 56 - fill);
+	for (int i = 0; i < 8; i++) {
+		ctx.Block[56 + i] = (UINT8)(ctx.Length >> (56 - 8 * i));
+	}
+	shim_sha256_block(&ctx);
+
+	for (int i = 0; i < 8; i++) {
+		out[i * 4] = (UINT8)(ctx.State[i] >> 24);
+		out[i * 4 + 1] = (UINT8)(ctx.State[i] >> 16);
+		out[i * 4 + 2] = (UINT8)(ctx.State[i] >> 8);
+		out[i * 4 + 3] = (UINT8)ctx.State[i];
+	}
+}
+
+NTSTATUS BCryptOpenAlgorithmProvider(BCRYPT_ALG_HANDLE* phAlgorithm, PCWSTR pszAlgId,
+	PCWSTR pszImplementation, ULONG dwFlags) {
+	static const WCHAR sha256[] = BCRYPT_SHA256_ALGORITHM;
+
+	UNREFERENCED_PARAMETER(pszImplementation);
+	UNREFERENCED_PARAMETER(dwFlags);
+
+	if (memcmp(pszAlgId, sha256, sizeof(sha256))) {
+		return STATUS_NOT_FOUND;
+	}
+	*phAlgorithm = (BCRYPT_ALG_HANDLE)sha256;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS BCryptCloseAlgorithmProvider(BCRYPT_ALG_HANDLE hAlgorithm, ULONG dwFlags) {
+	UNREFERENCED_PARAMETER(hAlgorithm);
+	UNREFERENCED_PARAMETER(dwFlags);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS BCryptHash(BCRYPT_ALG_HANDLE hAlgorithm, PUCHAR pbSecret, ULONG cbSecret,
+	PUCHAR pbInput, ULONG cbInput, PUCHAR pbOutput, ULONG cbOutput) {
+	UNREFERENCED_PARAMETER(hAlgorithm);
+	UNREFERENCED_PARAMETER(pbSecret);
+
+	/* Only plain hashes: the driver opens no HMAC provider */
+	if (cbSecret || cbOutput != 32) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	shim_sha256(pbInput, cbInput, pbOutput);
+	return STATUS_SUCCESS;
+}
+
+static UINT64 shim_random_state = 0x2545f4914f6cdd1dULL;
+
+NTSTATUS BCryptGenRandom(BCRYPT_ALG_HANDLE hAlgorithm, PUCHAR pbBuffer, ULONG cbBuffer,
+	ULONG dwFlags) {
+	UNREFERENCED_PARAMETER(hAlgorithm);
+	UNREFERENCED_PARAMETER(dwFlags);
+
+	pthread_mutex_lock(&shim_lock);
+	for (ULONG i = 0; i < cbBuffer; i++) {
+		shim_random_state ^= shim_random_state << 13;
+		shim_random_state ^= shim_random_state >> 7;
+		shim_random_state ^= shim_random_state << 17;
+		pbBuffer[i] = (UCHAR)shim_random_state;
+	}
+	pthread_mutex_unlock(&shim_lock);
+	return STATUS_SUCCESS;
+}
+
+//
+// Framework objects. Every object starts with SHIM_OBJECT; children are
+// deleted with their parent, the parent's cleanup callback running last.
+//
+
+typedef enum _SHIM_KIND {
+	ShimDriver,
+	ShimDevice,
+	ShimQueue,
+	ShimRequest,
+	ShimFile,
+	ShimInterrupt,
+	ShimMemory,
+	ShimWaitLock,
+	ShimSpinLock,
+	ShimTimer,
+	ShimKey
+} SHIM_KIND;
+
+typedef struct _SHIM_OBJECT SHIM_OBJECT;
+
+struct _SHIM_OBJECT {
+	SHIM_KIND Kind;
+	volatile LONG Refs;
+	BOOLEAN Deleted;
+	SHIM_OBJECT* Parent;
+	SHIM_OBJECT* Children;
+	SHIM_OBJECT* Sibling;
+	EVT_WDF_OBJECT_CONTEXT_CLEANUP* Cleanup;
+	PCWDF_OBJECT_CONTEXT_TYPE_INFO ContextType;
+	PVOID Context;
+};
+
+typedef struct _SHIM_QUEUE SHIM_QUEUE;
+typedef struct _SHIM_REQUEST SHIM_REQUEST;
+
+struct WDFDEVICE_INIT {
+	WDF_PNPPOWER_EVENT_CALLBACKS PnpPower;
+	WDF_FILEOBJECT_CONFIG FileConfig;
+	PCWDF_OBJECT_CONTEXT_TYPE_INFO FileContextType;
+};
+
+typedef struct _SHIM_DEVICE {
+	SHIM_OBJECT Object;
+	struct WDFDEVICE_INIT Init;
+	SHIM_QUEUE* DefaultQueue;
+	WDFINTERRUPT Interrupt;
+} SHIM_DEVICE;
+
+struct _SHIM_QUEUE {
+	SHIM_OBJECT Object;
+	SHIM_DEVICE* Device;
+	WDF_IO_QUEUE_CONFIG Config;
+	SHIM_REQUEST* Head;
+	SHIM_REQUEST* Tail;
+};
+
+typedef struct _SHIM_FILE {
+	SHIM_OBJECT Object;
+	SHIM_DEVICE* Device;
+} SHIM_FILE;
+
+struct _SHIM_REQUEST {
+	SHIM_OBJECT Object;
+	SHIM_QUEUE* Queue;
+	SHIM_REQUEST* Next;
+	SHIM_FILE* File;
+	WDF_REQUEST_PARAMETERS Parameters;
+	PVOID Input;
+	PVOID Output;
+	NTSTATUS Status;
+	ULONG_PTR Information;
+	BOOLEAN Completed;
+	EVT_WDF_REQUEST_CANCEL* CancelRoutine;
+};
+
+typedef struct _SHIM_INTERRUPT {
+	SHIM_OBJECT Object;
+	SHIM_DEVICE* Device;
+	EVT_WDF_INTERRUPT_ISR* Isr;
+	volatile LONG Enabled;
+} SHIM_INTERRUPT;
+
+typedef struct _SHIM_MEMORY {
+	SHIM_OBJECT Object;
+	PVOID Buffer;
+	size_t Size;
+} SHIM_MEMORY;
+
+typedef struct _SHIM_LOCK {
+	SHIM_OBJECT Object;
+	pthread_mutex_t Mutex;
+} SHIM_LOCK;
+
+typedef struct _SHIM_TIMER {
+	SHIM_OBJECT Object;
+	WDF_TIMER_CONFIG Config;
+} SHIM_TIMER;
+
+typedef enum _SHIM_KEY_ID {
+	ShimKeyDevice,
+	ShimKeySettings
+} SHIM_KEY_ID;
+
+typedef struct _SHIM_KEY {
+	SHIM_OBJECT Object;
+	SHIM_KEY_ID Id;
+} SHIM_KEY;
+
+static pthread_mutex_t shim_object_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static PVOID shim_object_create(SHIM_KIND Kind, size_t Size, PWDF_OBJECT_ATTRIBUTES Attributes,
+	PVOID DefaultParent) {
+	SHIM_OBJECT* object = calloc(1, Size);
+	SHIM_OBJECT* parent = DefaultParent;
+
+	if (!object) {
+		return NULL;
+	}
+
+	object->Kind = Kind;
+	object->Refs = 1;
+
+	if (Attributes) {
+		object->Cleanup = Attributes->EvtCleanupCallback;
+		object->ContextType = Attributes->ContextTypeInfo;
+		if (Attributes->ParentObject) {
+			parent = Attributes->ParentObject;
+		}
+	}
+
+	if (object->ContextType) {
+		object->Context = calloc(1, object->ContextType->ContextSize);
+		if (!object->Context) {
+			free(object);
+			return NULL;
+		}
+	}
+
+	if (parent) {
+		pthread_mutex_lock(&shim_object_lock);
+		object->Parent = parent;
+		object->Sibling = parent->Children;
+		parent->Children = object;
+		pthread_mutex_unlock(&shim_object_lock);
+	}
+	return object;
+}
+
+static void shim_object_free(SHIM_OBJECT* Object) {
+	switch (Object->Kind) {
+	case ShimMemory:
+		free(((SHIM_MEMORY*)Object)->Buffer);
+		break;
+	case ShimWaitLock:
+	case ShimSpinLock:
+		pthread_mutex_destroy(&((SHIM_LOCK*)Object)->Mutex);
+		break;
+	default:
+		break;
+	}
+	free(Object->Context);
+	free(Object);
+}
+
+PVOID WdfObjectGetTypedContextWorker(WDFOBJECT Handle, PCWDF_OBJECT_CONTEXT_TYPE_INFO TypeInfo) {
+	SHIM_OBJECT* object = Handle;
+
+	UNREFERENCED_PARAMETER(TypeInfo);
+	return object->Context;
+}
+
+VOID WdfObjectReference(WDFOBJECT Handle) {
+	SHIM_OBJECT* object = Handle;
+
+	__atomic_add_fetch(&object->Refs, 1, __ATOMIC_SEQ_CST);
+}
+
+VOID WdfObjectDereference(WDFOBJECT Handle) {
+	SHIM_OBJECT* object = Handle;
+
+	if (__atomic_sub_fetch(&object->Refs, 1, __ATOMIC_SEQ_CST) == 0) {
+		shim_object_free(object);
+	}
+}
+
+VOID WdfObjectDelete(WDFOBJECT Object) {
+	SHIM_OBJECT* object = Object;
+	SHIM_OBJECT* child;
+
+	pthread_mutex_lock(&shim_object_lock);
+	if (object->Deleted) {
+		pthread_mutex_unlock(&shim_object_lock);
+		return;
+	}
+	object->Deleted = TRUE;
+	pthread_mutex_unlock(&shim_object_lock);
+
+	for (;;) {
+		pthread_mutex_lock(&shim_object_lock);
+		child = object->Children;
+		if (child) {
+			object->Children = child->Sibling;
+			child->Parent = NULL;
+		}
+		pthread_mutex_unlock(&shim_object_lock);
+		if (!child) {
+			break;
+		}
+		WdfObjectDelete(child);
+	}
+
+	if (object->Cleanup) {
+		object->Cleanup(object);
+	}
+
+	pthread_mutex_lock(&shim_object_lock);
+	if (object->Parent) {
+		SHIM_OBJECT** link = &object->Parent->Children;
+
+		while (*link != object) {
+			link = &(*link)->Sibling;
+		}
+		*link = object->Sibling;
+		object->Parent = NULL;
+	}
+	pthread_mutex_unlock(&shim_object_lock);
+
+	WdfObjectDereference(object);
+}
+
+//
+// Driver and device
+//
+
+static PFN_WDF_DRIVER_DEVICE_ADD shim_device_add;
+static SHIM_DEVICE* shim_new_device;
+
+NTSTATUS WdfDriverCreate(PDRIVER_OBJECT DriverObject, PCUNICODE_STRING RegistryPath,
+	PWDF_OBJECT_ATTRIBUTES DriverAttributes, PWDF_DRIVER_CONFIG DriverConfig,
+	WDFDRIVER* Driver) {
+	UNREFERENCED_PARAMETER(DriverObject);
+	UNREFERENCED_PARAMETER(RegistryPath);
+	UNREFERENCED_PARAMETER(DriverAttributes);
+
+	shim_device_add = DriverConfig->EvtDriverDeviceAdd;
+	if (Driver) {
+		*Driver = NULL;
+	}
+	return STATUS_SUCCESS;
+}
+
+VOID WdfDeviceInitSetPnpPowerEventCallbacks(PWDFDEVICE_INIT DeviceInit,
+	PWDF_PNPPOWER_EVENT_CALLBACKS PnpPowerEventCallbacks) {
+	DeviceInit->PnpPower = *PnpPowerEventCallbacks;
+}
+
+NTSTATUS WdfDeviceInitAssignWdmIrpPreprocessCallback(PWDFDEVICE_INIT DeviceInit,
+	EVT_WDFDEVICE_WDM_IRP_PREPROCESS* EvtDeviceWdmIrpPreprocess, UCHAR MajorFunction,
+	PUCHAR MinorFunctions, ULONG NumMinorFunctions) {
+	UNREFERENCED_PARAMETER(DeviceInit);
+	UNREFERENCED_PARAMETER(EvtDeviceWdmIrpPreprocess);
+	UNREFERENCED_PARAMETER(MajorFunction);
+	UNREFERENCED_PARAMETER(MinorFunctions);
+	UNREFERENCED_PARAMETER(NumMinorFunctions);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfDeviceInitAssignSDDLString(PWDFDEVICE_INIT DeviceInit, PCUNICODE_STRING SDDLString) {
+	UNREFERENCED_PARAMETER(DeviceInit);
+	UNREFERENCED_PARAMETER(SDDLString);
+	return STATUS_SUCCESS;
+}
+
+VOID WdfDeviceInitSetFileObjectConfig(PWDFDEVICE_INIT DeviceInit,
+	PWDF_FILEOBJECT_CONFIG FileObjectConfig, PWDF_OBJECT_ATTRIBUTES FileObjectAttributes) {
+	DeviceInit->FileConfig = *FileObjectConfig;
+	DeviceInit->FileContextType = FileObjectAttributes ?
+		FileObjectAttributes->ContextTypeInfo : NULL;
+}
+
+NTSTATUS WdfDeviceCreate(PWDFDEVICE_INIT* DeviceInit, PWDF_OBJECT_ATTRIBUTES DeviceAttributes,
+	WDFDEVICE* Device) {
+	SHIM_DEVICE* device = shim_object_create(ShimDevice, sizeof(*device), DeviceAttributes, NULL);
+
+	if (!device) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	device->Init = **DeviceInit;
+	*DeviceInit = NULL;
+	shim_new_device = device;
+	*Device = (WDFDEVICE)device;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfDeviceCreateDeviceInterface(WDFDEVICE Device, const GUID* InterfaceClassGUID,
+	PCUNICODE_STRING ReferenceString) {
+	UNREFERENCED_PARAMETER(Device);
+	UNREFERENCED_PARAMETER(InterfaceClassGUID);
+	UNREFERENCED_PARAMETER(ReferenceString);
+	return STATUS_SUCCESS;
+}
+
+PDEVICE_OBJECT WdfDeviceWdmGetDeviceObject(WDFDEVICE Device) {
+	return (PDEVICE_OBJECT)Device;
+}
+
+NTSTATUS WdfDeviceAssignS0IdleSettings(WDFDEVICE Device,
+	PWDF_DEVICE_POWER_POLICY_IDLE_SETTINGS Settings) {
+	UNREFERENCED_PARAMETER(Device);
+	UNREFERENCED_PARAMETER(Settings);
+	return STATUS_SUCCESS;
+}
+
+/* The harness keeps the device in D0 while it sends I/O */
+NTSTATUS WdfDeviceStopIdle(WDFDEVICE Device, BOOLEAN WaitForD0) {
+	UNREFERENCED_PARAMETER(Device);
+	UNREFERENCED_PARAMETER(WaitForD0);
+	return STATUS_SUCCESS;
+}
+
+VOID WdfDeviceResumeIdle(WDFDEVICE Device) {
+	UNREFERENCED_PARAMETER(Device);
+}
+
+VOID WdfDeviceSetDeviceState(WDFDEVICE Device, PWDF_DEVICE_STATE DeviceState) {
+	UNREFERENCED_PARAMETER(Device);
+	UNREFERENCED_PARAMETER(DeviceState);
+}
+
+ULONG WdfCmResourceListGetCount(WDFCMRESLIST List) {
+	return ((CR50_SHIM_RESOURCES*)List)->Count;
+}
+
+PCM_PARTIAL_RESOURCE_DESCRIPTOR WdfCmResourceListGetDescriptor(WDFCMRESLIST List, ULONG Index) {
+	CR50_SHIM_RESOURCES* resources = (CR50_SHIM_RESOURCES*)List;
+
+	return Index < resources->Count ? &resources->Descriptors[Index] : NULL;
+}
+
+NTSTATUS cr50_shim_add_device(DRIVER_INITIALIZE* DriverEntry, WDFDEVICE* Device) {
+	struct WDFDEVICE_INIT init;
+	UNICODE_STRING registryPath;
+	NTSTATUS status;
+
+	RtlInitUnicodeString(&registryPath,
+		L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\cr50");
+	status = DriverEntry(NULL, &registryPath);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	RtlZeroMemory(&init, sizeof(init));
+	shim_new_device = NULL;
+	status = shim_device_add(NULL, &init);
+	if (!NT_SUCCESS(status)) {
+		/* As the framework does, a device created before the failure goes */
+		if (shim_new_device) {
+			WdfObjectDelete(shim_new_device);
+		}
+		return status;
+	}
+
+	*Device = (WDFDEVICE)shim_new_device;
+	return status;
+}
+
+NTSTATUS cr50_shim_prepare_hardware(WDFDEVICE Device, CR50_SHIM_RESOURCES* Resources) {
+	SHIM_DEVICE* device = (SHIM_DEVICE*)Device;
+
+	return device->Init.PnpPower.EvtDevicePrepareHardware(Device,
+		(WDFCMRESLIST)Resources, (WDFCMRESLIST)Resources);
+}
+
+NTSTATUS cr50_shim_release_hardware(WDFDEVICE Device) {
+	SHIM_DEVICE* device = (SHIM_DEVICE*)Device;
+	CR50_SHIM_RESOURCES none = { 0, NULL };
+
+	return device->Init.PnpPower.EvtDeviceReleaseHardware(Device, (WDFCMRESLIST)&none);
+}
+
+NTSTATUS cr50_shim_d0_entry(WDFDEVICE Device, WDF_POWER_DEVICE_STATE PreviousState) {
+	SHIM_DEVICE* device = (SHIM_DEVICE*)Device;
+
+	return device->Init.PnpPower.EvtDeviceD0Entry(Device, PreviousState);
+}
+
+NTSTATUS cr50_shim_d0_exit(WDFDEVICE Device, WDF_POWER_DEVICE_STATE TargetState) {
+	SHIM_DEVICE* device = (SHIM_DEVICE*)Device;
+
+	return device->Init.PnpPower.EvtDeviceD0Exit(Device, TargetState);
+}
+
+void cr50_shim_remove_device(WDFDEVICE Device) {
+	WdfObjectDelete(Device);
+}
+
+//
+// Queues and requests
+//
+
+NTSTATUS WdfIoQueueCreate(WDFDEVICE Device, PWDF_IO_QUEUE_CONFIG Config,
+	PWDF_OBJECT_ATTRIBUTES QueueAttributes, WDFQUEUE* Queue) {
+	SHIM_DEVICE* device = (SHIM_DEVICE*)Device;
+	SHIM_QUEUE* queue = shim_object_create(ShimQueue, sizeof(*queue), QueueAttributes, device);
+
+	if (!queue) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	queue->Device = device;
+	queue->Config = *Config;
+	if (Config->DefaultQueue) {
+		device->DefaultQueue = queue;
+	}
+	if (Queue) {
+		*Queue = (WDFQUEUE)queue;
+	}
+	return STATUS_SUCCESS;
+}
+
+WDFDEVICE WdfIoQueueGetDevice(WDFQUEUE Queue) {
+	return (WDFDEVICE)((SHIM_QUEUE*)Queue)->Device;
+}
+
+NTSTATUS WdfIoQueueRetrieveNextRequest(WDFQUEUE Queue, WDFREQUEST* OutRequest) {
+	SHIM_QUEUE* queue = (SHIM_QUEUE*)Queue;
+	SHIM_REQUEST* request;
+
+	pthread_mutex_lock(&shim_lock);
+	request = queue->Head;
+	if (request) {
+		queue->Head = request->Next;
+		if (!queue->Head) {
+			queue->Tail = NULL;
+		}
+		request->Next = NULL;
+	}
+	pthread_mutex_unlock(&shim_lock);
+
+	if (!request) {
+		return STATUS_NO_MORE_ENTRIES;
+	}
+	*OutRequest = (WDFREQUEST)request;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfRequestForwardToIoQueue(WDFREQUEST Request, WDFQUEUE DestinationQueue) {
+	SHIM_REQUEST* request = (SHIM_REQUEST*)Request;
+	SHIM_QUEUE* queue = (SHIM_QUEUE*)DestinationQueue;
+
+	if (queue->Config.DispatchType != WdfIoQueueDispatchManual) {
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	pthread_mutex_lock(&shim_lock);
+	request->Queue = queue;
+	request->Next = NULL;
+	if (queue->Tail) {
+		queue->Tail->Next = request;
+	}
+	else {
+		queue->Head = request;
+	}
+	queue->Tail = request;
+	pthread_mutex_unlock(&shim_lock);
+	return STATUS_SUCCESS;
+}
+
+VOID WdfRequestGetParameters(WDFREQUEST Request, PWDF_REQUEST_PARAMETERS Parameters) {
+	*Parameters = ((SHIM_REQUEST*)Request)->Parameters;
+}
+
+static NTSTATUS shim_request_buffer(PVOID Buffer, size_t Length, size_t MinimumRequiredSize,
+	PVOID* OutBuffer, size_t* OutLength) {
+	if (!Buffer || !Length || Length < MinimumRequiredSize) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	*OutBuffer = Buffer;
+	if (OutLength) {
+		*OutLength = Length;
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfRequestRetrieveInputBuffer(WDFREQUEST Request, size_t MinimumRequiredSize,
+	PVOID* Buffer, size_t* Length) {
+	SHIM_REQUEST* request = (SHIM_REQUEST*)Request;
+
+	return shim_request_buffer(request->Input,
+		request->Parameters.Parameters.DeviceIoControl.InputBufferLength,
+		MinimumRequiredSize, Buffer, Length);
+}
+
+NTSTATUS WdfRequestRetrieveOutputBuffer(WDFREQUEST Request, size_t MinimumRequiredSize,
+	PVOID* Buffer, size_t* Length) {
+	SHIM_REQUEST* request = (SHIM_REQUEST*)Request;
+
+	return shim_request_buffer(request->Output,
+		request->Parameters.Parameters.DeviceIoControl.OutputBufferLength,
+		MinimumRequiredSize, Buffer, Length);
+}
+
+VOID WdfRequestCompleteWithInformation(WDFREQUEST Request, NTSTATUS Status,
+	ULONG_PTR Information) {
+	SHIM_REQUEST* request = (SHIM_REQUEST*)Request;
+
+	pthread_mutex_lock(&shim_lock);
+	request->Status = Status;
+	request->Information = Information;
+	request->Completed = TRUE;
+	pthread_cond_broadcast(&shim_cond);
+	pthread_mutex_unlock(&shim_lock);
+}
+
+VOID WdfRequestComplete(WDFREQUEST Request, NTSTATUS Status) {
+	WdfRequestCompleteWithInformation(Request, Status, ((SHIM_REQUEST*)Request)->Information);
+}
+
+KPROCESSOR_MODE WdfRequestGetRequestorMode(WDFREQUEST Request) {
+	UNREFERENCED_PARAMETER(Request);
+	return UserMode;
+}
+
+WDFFILEOBJECT WdfRequestGetFileObject(WDFREQUEST Request) {
+	return (WDFFILEOBJECT)((SHIM_REQUEST*)Request)->File;
+}
+
+WDFQUEUE WdfRequestGetIoQueue(WDFREQUEST Request) {
+	return (WDFQUEUE)((SHIM_REQUEST*)Request)->Queue;
+}
+
+/* Nothing cancels a request on the host; the routine is only recorded */
+NTSTATUS WdfRequestMarkCancelableEx(WDFREQUEST Request, EVT_WDF_REQUEST_CANCEL* EvtRequestCancel) {
+	((SHIM_REQUEST*)Request)->CancelRoutine = EvtRequestCancel;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfRequestUnmarkCancelable(WDFREQUEST Request) {
+	((SHIM_REQUEST*)Request)->CancelRoutine = NULL;
+	return STATUS_SUCCESS;
+}
+
+WDFDEVICE WdfFileObjectGetDevice(WDFFILEOBJECT FileObject) {
+	return (WDFDEVICE)((SHIM_FILE*)FileObject)->Device;
+}
+
+static SHIM_REQUEST* shim_request_create(SHIM_FILE* File, SHIM_QUEUE* Queue) {
+	SHIM_REQUEST* request = shim_object_create(ShimRequest, sizeof(*request), NULL, NULL);
+
+	if (request) {
+		request->File = File;
+		request->Queue = Queue;
+		WDF_REQUEST_PARAMETERS_INIT(&request->Parameters);
+	}
+	return request;
+}
+
+static void shim_request_wait(SHIM_REQUEST* Request) {
+	pthread_mutex_lock(&shim_lock);
+	while (!Request->Completed) {
+		pthread_cond_wait(&shim_cond, &shim_lock);
+	}
+	pthread_mutex_unlock(&shim_lock);
+}
+
+NTSTATUS cr50_shim_open(WDFDEVICE Device, WDFFILEOBJECT* FileObject) {
+	SHIM_DEVICE* device = (SHIM_DEVICE*)Device;
+	WDF_OBJECT_ATTRIBUTES attributes;
+	SHIM_REQUEST* request;
+	SHIM_FILE* file;
+	NTSTATUS status;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ContextTypeInfo = device->Init.FileContextType;
+	file = shim_object_create(ShimFile, sizeof(*file), &attributes, device);
+	if (!file) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	file->Device = device;
+
+	if (device->Init.FileConfig.EvtDeviceFileCreate) {
+		request = shim_request_create(file, NULL);
+		if (!request) {
+			WdfObjectDelete(file);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		request->Parameters.Type = WdfRequestTypeCreate;
+
+		device->Init.FileConfig.EvtDeviceFileCreate(Device, (WDFREQUEST)request,
+			(WDFFILEOBJECT)file);
+		shim_request_wait(request);
+		status = request->Status;
+		WdfObjectDereference(request);
+
+		if (!NT_SUCCESS(status)) {
+			WdfObjectDelete(file);
+			return status;
+		}
+	}
+
+	*FileObject = (WDFFILEOBJECT)file;
+	return STATUS_SUCCESS;
+}
+
+void cr50_shim_close(WDFFILEOBJECT FileObject) {
+	SHIM_FILE* file = (SHIM_FILE*)FileObject;
+
+	if (file->Device->Init.FileConfig.EvtFileCleanup) {
+		file->Device->Init.FileConfig.EvtFileCleanup(FileObject);
+	}
+	if (file->Device->Init.FileConfig.EvtFileClose) {
+		file->Device->Init.FileConfig.EvtFileClose(FileObject);
+	}
+	WdfObjectDelete(file);
+}
+
+/*
+ * METHOD_BUFFERED requests share one system buffer for input and output,
+ * as they do on Windows; the direct methods get separate buffers.
+ */
+NTSTATUS cr50_shim_ioctl(WDFFILEOBJECT FileObject, ULONG IoControlCode,
+	PVOID Input, size_t InputLength, PVOID Output, size_t OutputLength,
+	ULONG_PTR* Information) {
+	SHIM_FILE* file = (SHIM_FILE*)FileObject;
+	SHIM_QUEUE* queue = file->Device->DefaultQueue;
+	BOOLEAN buffered = (IoControlCode & 3) == METHOD_BUFFERED;
+	PVOID system = NULL;
+	SHIM_REQUEST* request;
+	NTSTATUS status;
+
+	if (!queue || !queue->Config.EvtIoDeviceControl) {
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
+
+	request = shim_request_create(file, queue);
+	if (!request) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	request->Parameters.Type = WdfRequestTypeDeviceControl;
+	request->Parameters.Parameters.DeviceIoControl.IoControlCode = IoControlCode;
+	request->Parameters.Parameters.DeviceIoControl.InputBufferLength = InputLength;
+	request->Parameters.Parameters.DeviceIoControl.OutputBufferLength = OutputLength;
+
+	if (buffered) {
+		size_t length = max(InputLength, OutputLength);
+
+		if (length) {
+			system = calloc(1, length);
+			if (!system) {
+				WdfObjectDereference(request);
+				return STATUS_INSUFFICIENT_RESOURCES;
+			}
+			if (InputLength) {
+				memcpy(system, Input, InputLength);
+			}
+		}
+		request->Input = InputLength ? system : NULL;
+		request->Output = OutputLength ? system : NULL;
+	}
+	else {
+		request->Input = InputLength ? Input : NULL;
+		request->Output = OutputLength ? Output : NULL;
+	}
+
+	queue->Config.EvtIoDeviceControl((WDFQUEUE)queue, (WDFREQUEST)request,
+		OutputLength, InputLength, IoControlCode);
+	shim_request_wait(request);
+
+	status = request->Status;
+	if (Information) {
+		*Information = request->Information;
+	}
+	if (buffered && system && NT_SUCCESS(status)) {
+		memcpy(Output, system, min((size_t)request->Information, OutputLength));
+	}
+
+	free(system);
+	WdfObjectDereference(request);
+	return status;
+}
+
+//
+// Interrupts
+//
+
+NTSTATUS WdfInterruptCreate(WDFDEVICE Device, PWDF_INTERRUPT_CONFIG Configuration,
+	PWDF_OBJECT_ATTRIBUTES Attributes, WDFINTERRUPT* Interrupt) {
+	SHIM_DEVICE* device = (SHIM_DEVICE*)Device;
+	SHIM_INTERRUPT* interrupt = shim_object_create(ShimInterrupt, sizeof(*interrupt),
+		Attributes, device);
+
+	if (!interrupt) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	interrupt->Device = device;
+	interrupt->Isr = Configuration->EvtInterruptIsr;
+	interrupt->Enabled = TRUE;
+	device->Interrupt = (WDFINTERRUPT)interrupt;
+	*Interrupt = (WDFINTERRUPT)interrupt;
+	return STATUS_SUCCESS;
+}
+
+VOID WdfInterruptEnable(WDFINTERRUPT Interrupt) {
+	__atomic_store_n(&((SHIM_INTERRUPT*)Interrupt)->Enabled, TRUE, __ATOMIC_SEQ_CST);
+}
+
+VOID WdfInterruptDisable(WDFINTERRUPT Interrupt) {
+	__atomic_store_n(&((SHIM_INTERRUPT*)Interrupt)->Enabled, FALSE, __ATOMIC_SEQ_CST);
+}
+
+WDFDEVICE WdfInterruptGetDevice(WDFINTERRUPT Interrupt) {
+	return (WDFDEVICE)((SHIM_INTERRUPT*)Interrupt)->Device;
+}
+
+BOOLEAN cr50_shim_interrupt(WDFDEVICE Device) {
+	SHIM_INTERRUPT* interrupt = (SHIM_INTERRUPT*)((SHIM_DEVICE*)Device)->Interrupt;
+
+	if (!interrupt || !__atomic_load_n(&interrupt->Enabled, __ATOMIC_SEQ_CST)) {
+		return FALSE;
+	}
+	return interrupt->Isr((WDFINTERRUPT)interrupt, 0);
+}
+
+//
+// Memory and locks
+//
+
+NTSTATUS WdfMemoryCreate(PWDF_OBJECT_ATTRIBUTES Attributes, POOL_TYPE PoolType, ULONG PoolTag,
+	size_t BufferSize, WDFMEMORY* Memory, PVOID* Buffer) {
+	SHIM_MEMORY* memory = shim_object_create(ShimMemory, sizeof(*memory), Attributes, NULL);
+
+	UNREFERENCED_PARAMETER(PoolType);
+	UNREFERENCED_PARAMETER(PoolTag);
+
+	if (!memory) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	memory->Buffer = calloc(1, BufferSize ? BufferSize : 1);
+	if (!memory->Buffer) {
+		WdfObjectDelete(memory);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	memory->Size = BufferSize;
+
+	*Memory = (WDFMEMORY)memory;
+	if (Buffer) {
+		*Buffer = memory->Buffer;
+	}
+	return STATUS_SUCCESS;
+}
+
+PVOID WdfMemoryGetBuffer(WDFMEMORY Memory, size_t* BufferSize) {
+	SHIM_MEMORY* memory = (SHIM_MEMORY*)Memory;
+
+	if (BufferSize) {
+		*BufferSize = memory->Size;
+	}
+	return memory->Buffer;
+}
+
+static NTSTATUS shim_lock_create(SHIM_KIND Kind, PWDF_OBJECT_ATTRIBUTES Attributes,
+	PVOID* Lock) {
+	SHIM_LOCK* lock = shim_object_create(Kind, sizeof(*lock), Attributes, NULL);
+
+	if (!lock) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	pthread_mutex_init(&lock->Mutex, NULL);
+	*Lock = lock;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfWaitLockCreate(PWDF_OBJECT_ATTRIBUTES LockAttributes, WDFWAITLOCK* Lock) {
+	return shim_lock_create(ShimWaitLock, LockAttributes, (PVOID*)Lock);
+}
+
+/* Only infinite and zero timeouts are used by the driver */
+NTSTATUS WdfWaitLockAcquire(WDFWAITLOCK Lock, PLONGLONG Timeout) {
+	SHIM_LOCK* lock = (SHIM_LOCK*)Lock;
+
+	if (Timeout) {
+		return pthread_mutex_trylock(&lock->Mutex) ? STATUS_TIMEOUT : STATUS_SUCCESS;
+	}
+	pthread_mutex_lock(&lock->Mutex);
+	return STATUS_SUCCESS;
+}
+
+VOID WdfWaitLockRelease(WDFWAITLOCK Lock) {
+	pthread_mutex_unlock(&((SHIM_LOCK*)Lock)->Mutex);
+}
+
+NTSTATUS WdfSpinLockCreate(PWDF_OBJECT_ATTRIBUTES SpinLockAttributes, WDFSPINLOCK* SpinLock) {
+	return shim_lock_create(ShimSpinLock, SpinLockAttributes, (PVOID*)SpinLock);
+}
+
+VOID WdfSpinLockAcquire(WDFSPINLOCK SpinLock) {
+	pthread_mutex_lock(&((SHIM_LOCK*)SpinLock)->Mutex);
+}
+
+VOID WdfSpinLockRelease(WDFSPINLOCK SpinLock) {
+	pthread_mutex_unlock(&((SHIM_LOCK*)SpinLock)->Mutex);
+}
+
+//
+// Timers
+//
+
+NTSTATUS WdfTimerCreate(PWDF_TIMER_CONFIG Config, PWDF_OBJECT_ATTRIBUTES Attributes,
+	WDFTIMER* Timer) {
+	SHIM_TIMER* timer = shim_object_create(ShimTimer, sizeof(*timer), Attributes, NULL);
+
+	if (!timer) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	timer->Config = *Config;
+	*Timer = (WDFTIMER)timer;
+	return STATUS_SUCCESS;
+}
+
+BOOLEAN WdfTimerStart(WDFTIMER Timer, LONGLONG DueTime) {
+	UNREFERENCED_PARAMETER(Timer);
+	UNREFERENCED_PARAMETER(DueTime);
+	return FALSE;
+}
+
+BOOLEAN WdfTimerStop(WDFTIMER Timer, BOOLEAN Wait) {
+	UNREFERENCED_PARAMETER(Timer);
+	UNREFERENCED_PARAMETER(Wait);
+	return FALSE;
+}
+
+WDFOBJECT WdfTimerGetParentObject(WDFTIMER Timer) {
+	return ((SHIM_OBJECT*)Timer)->Parent;
+}
+
+void cr50_shim_fire_timer(WDFTIMER Timer) {
+	SHIM_TIMER* timer = (SHIM_TIMER*)Timer;
+
+	timer->Config.EvtTimerFunc(Timer);
+}
+
+//
+// Registry: the device key keeps what the driver writes to it for the
+// life of the process; the "Settings" subkey holds what the harness set.
+//
+
+typedef struct _SHIM_VALUE SHIM_VALUE;
+
+struct _SHIM_VALUE {
+	SHIM_VALUE* Next;
+	SHIM_KEY_ID Key;
+	char Name[64];
+	ULONG Type;
+	ULONG Length;
+	UCHAR Data[];
+};
+
+static SHIM_VALUE* shim_values;
+
+static void shim_value_name(PCUNICODE_STRING Name, char* Out, size_t Size) {
+	size_t len = min((size_t)Name->Length / sizeof(WCHAR), Size - 1);
+
+	for (size_t i = 0; i < len; i++) {
+		Out[i] = (char)Name->Buffer[i];
+	}
+	Out[len] = 0;
+}
+
+/* Called with shim_object_lock held */
+static SHIM_VALUE** shim_value_find(SHIM_KEY_ID Key, const char* Name) {
+	SHIM_VALUE** link = &shim_values;
+
+	while (*link && ((*link)->Key != Key || strcmp((*link)->Name, Name))) {
+		link = &(*link)->Next;
+	}
+	return link;
+}
+
+static NTSTATUS shim_value_set(SHIM_KEY_ID Key, const char* Name, ULONG Type, ULONG Length,
+	const void* Data) {
+	SHIM_VALUE* value = calloc(1, sizeof(*value) + Length);
+	SHIM_VALUE** link;
+
+	if (!value) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	value->Key = Key;
+	snprintf(value->Name, sizeof(value->Name), "%s", Name);
+	value->Type = Type;
+	value->Length = Length;
+	memcpy(value->Data, Data, Length);
+
+	pthread_mutex_lock(&shim_object_lock);
+	link = shim_value_find(Key, value->Name);
+	if (*link) {
+		SHIM_VALUE* old = *link;
+
+		*link = old->Next;
+		free(old);
+	}
+	value->Next = shim_values;
+	shim_values = value;
+	pthread_mutex_unlock(&shim_object_lock);
+	return STATUS_SUCCESS;
+}
+
+void cr50_shim_registry_reset(void) {
+	pthread_mutex_lock(&shim_object_lock);
+	while (shim_values) {
+		SHIM_VALUE* value = shim_values;
+
+		shim_values = value->Next;
+		free(value);
+	}
+	pthread_mutex_unlock(&shim_object_lock);
+}
+
+void cr50_shim_setting(PCSTR Name, ULONG Value) {
+	shim_value_set(ShimKeySettings, Name, REG_DWORD, sizeof(Value), &Value);
+}
+
+static NTSTATUS shim_key_create(SHIM_KEY_ID Id, WDFKEY* Key) {
+	SHIM_KEY* key = shim_object_create(ShimKey, sizeof(*key), NULL, NULL);
+
+	if (!key) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	key->Id = Id;
+	*Key = (WDFKEY)key;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfDeviceOpenRegistryKey(WDFDEVICE Device, ULONG DeviceInstanceKeyType,
+	ACCESS_MASK DesiredAccess, PWDF_OBJECT_ATTRIBUTES KeyAttributes, WDFKEY* Key) {
+	UNREFERENCED_PARAMETER(Device);
+	UNREFERENCED_PARAMETER(DesiredAccess);
+	UNREFERENCED_PARAMETER(KeyAttributes);
+
+	if (DeviceInstanceKeyType != PLUGPLAY_REGKEY_DEVICE) {
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	}
+	return shim_key_create(ShimKeyDevice, Key);
+}
+
+NTSTATUS WdfRegistryOpenKey(WDFKEY ParentKey, PCUNICODE_STRING KeyName,
+	ACCESS_MASK DesiredAccess, PWDF_OBJECT_ATTRIBUTES KeyAttributes, WDFKEY* Key) {
+	char name[64];
+
+	UNREFERENCED_PARAMETER(DesiredAccess);
+	UNREFERENCED_PARAMETER(KeyAttributes);
+
+	shim_value_name(KeyName, name, sizeof(name));
+	if (((SHIM_KEY*)ParentKey)->Id != ShimKeyDevice || strcmp(name, "Settings")) {
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	}
+	return shim_key_create(ShimKeySettings, Key);
+}
+
+VOID WdfRegistryClose(WDFKEY Key) {
+	WdfObjectDelete(Key);
+}
+
+NTSTATUS WdfRegistryQueryValue(WDFKEY Key, PCUNICODE_STRING ValueName, ULONG ValueLength,
+	PVOID Value, PULONG ValueLengthQueried, PULONG ValueType) {
+	NTSTATUS status = STATUS_SUCCESS;
+	SHIM_VALUE* value;
+	char name[64];
+
+	shim_value_name(ValueName, name, sizeof(name));
+
+	pthread_mutex_lock(&shim_object_lock);
+	value = *shim_value_find(((SHIM_KEY*)Key)->Id, name);
+	if (!value) {
+		status = STATUS_OBJECT_NAME_NOT_FOUND;
+	}
+	else {
+		if (ValueLengthQueried) {
+			*ValueLengthQueried = value->Length;
+		}
+		if (ValueType) {
+			*ValueType = value->Type;
+		}
+		if (ValueLength < value->Length) {
+			status = STATUS_BUFFER_OVERFLOW;
+		}
+		else if (Value) {
+			memcpy(Value, value->Data, value->Length);
+		}
+	}
+	pthread_mutex_unlock(&shim_object_lock);
+	return status;
+}
+
+NTSTATUS WdfRegistryQueryULong(WDFKEY Key, PCUNICODE_STRING ValueName, PULONG Value) {
+	ULONG length, type;
+	NTSTATUS status;
+
+	status = WdfRegistryQueryValue(Key, ValueName, sizeof(*Value), Value, &length, &type);
+	if (NT_SUCCESS(status) && (type != REG_DWORD || length != sizeof(*Value))) {
+		status = STATUS_OBJECT_TYPE_MISMATCH;
+	}
+	return status;
+}
+
+NTSTATUS WdfRegistryAssignValue(WDFKEY Key, PCUNICODE_STRING ValueName, ULONG ValueType,
+	ULONG ValueLength, PVOID Value) {
+	char name[64];
+
+	shim_value_name(ValueName, name, sizeof(name));
+	return shim_value_set(((SHIM_KEY*)Key)->Id, name, ValueType, ValueLength, Value);
+}
+
+NTSTATUS WdfRegistryRemoveValue(WDFKEY Key, PCUNICODE_STRING ValueName) {
+	NTSTATUS status = STATUS_OBJECT_NAME_NOT_FOUND;
+	SHIM_VALUE** link;
+	char name[64];
+
+	shim_value_name(ValueName, name, sizeof(name));
+
+	pthread_mutex_lock(&shim_object_lock);
+	link = shim_value_find(((SHIM_KEY*)Key)->Id, name);
+	if (*link) {
+		SHIM_VALUE* value = *link;
+
+		*link = value->Next;
+		free(value);
+		status = STATUS_SUCCESS;
+	}
+	pthread_mutex_unlock(&shim_object_lock);
+	return status;
+}
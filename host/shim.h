@@ -0,0 +1,68 @@
+/*
+ * Host side of the WDF shim: what the harness uses to play the PnP
+ * manager, the I/O manager and the clock for a driver instance.
+ */
+
+#pragma once
+
+#include <wdm.h>
+#include <wdf.h>
+
+//
+// Virtual clock, in 100ns units. Every read advances it by one unit so
+// that the driver's polling loops make progress; delays and the bus
+// model advance it by what they stand for.
+//
+
+LONGLONG cr50_shim_now(void);
+void cr50_shim_advance(LONGLONG Ticks);
+
+#define CR50_SHIM_US(us)	((LONGLONG)(us) * 10)
+#define CR50_SHIM_MS(ms)	((LONGLONG)(ms) * 10000)
+
+/* Runs the callback of @Timer as if it expired; started or not, none fires by itself */
+void cr50_shim_fire_timer(WDFTIMER Timer);
+
+//
+// Registry: values of the device's "Settings" subkey, see settings.c.
+// The table is global and read when a device is added.
+//
+
+void cr50_shim_registry_reset(void);
+void cr50_shim_setting(PCSTR Name, ULONG Value);
+
+//
+// Device lifetime
+//
+
+typedef struct _CR50_SHIM_RESOURCES {
+	ULONG Count;
+	PCM_PARTIAL_RESOURCE_DESCRIPTOR Descriptors;
+} CR50_SHIM_RESOURCES;
+
+/* Runs DriverEntry, then EvtDriverDeviceAdd for one device */
+NTSTATUS cr50_shim_add_device(DRIVER_INITIALIZE* DriverEntry, WDFDEVICE* Device);
+NTSTATUS cr50_shim_prepare_hardware(WDFDEVICE Device, CR50_SHIM_RESOURCES* Resources);
+NTSTATUS cr50_shim_release_hardware(WDFDEVICE Device);
+NTSTATUS cr50_shim_d0_entry(WDFDEVICE Device, WDF_POWER_DEVICE_STATE PreviousState);
+NTSTATUS cr50_shim_d0_exit(WDFDEVICE Device, WDF_POWER_DEVICE_STATE TargetState);
+/* Runs the cleanup callbacks of the device and its children and frees them */
+void cr50_shim_remove_device(WDFDEVICE Device);
+
+/* Calls the ISR if the device's interrupt is enabled */
+BOOLEAN cr50_shim_interrupt(WDFDEVICE Device);
+
+//
+// I/O: handles and device controls sent as from user mode
+//
+
+NTSTATUS cr50_shim_open(WDFDEVICE Device, WDFFILEOBJECT* FileObject);
+void cr50_shim_close(WDFFILEOBJECT FileObject);
+
+/*
+ * Sends a device control through the default queue and waits for the
+ * driver to complete it, however many threads that takes.
+ */
+NTSTATUS cr50_shim_ioctl(WDFFILEOBJECT FileObject, ULONG IoControlCode,
+	PVOID Input, size_t InputLength, PVOID Output, size_t OutputLength,
+	ULONG_PTR* Information);
@@ -0,0 +1,69 @@
+/*
+ * Minimal test helpers: each test is a function returning 0 on success,
+ * and each CHECK reports the failing line.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <time.h>
+
+#include "cr50host.h"
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+		return 1; \
+	} \
+} while (0)
+
+#define CHECK_STATUS(expr) do { \
+	NTSTATUS _status = (expr); \
+	if (!NT_SUCCESS(_status)) { \
+		fprintf(stderr, "%s:%d: %s failed with 0x%x\n", __FILE__, __LINE__, #expr, \
+			(unsigned)_status); \
+		return 1; \
+	} \
+} while (0)
+
+/*
+ * For what the consumer thread does between requests: waits up to a
+ * second of real time for @cond, then checks it.
+ */
+#define CHECK_SOON(cond) do { \
+	for (int _i = 0; _i < 1000 && !(cond); _i++) \
+		cr50_test_pause(); \
+	CHECK(cond); \
+} while (0)
+
+static inline void cr50_test_pause(void) {
+	struct timespec ts = { 0, 1000 * 1000 };
+
+	nanosleep(&ts, NULL);
+}
+
+typedef struct _CR50_TEST {
+	const char* Name;
+	int (*Run)(void);
+} CR50_TEST;
+
+static inline int cr50_test_main(const CR50_TEST* Tests) {
+	int failed = 0;
+
+	for (; Tests->Name; Tests++) {
+		int rc = Tests->Run();
+
+		printf("%s %s\n", rc ? "FAIL" : "ok  ", Tests->Name);
+		failed |= rc;
+	}
+	return failed;
+}
+
+static inline UINT32 cr50_test_get32(const UINT8* p) {
+	return (UINT32)p[0] << 24 | (UINT32)p[1] << 16 | (UINT32)p[2] << 8 | p[3];
+}
+
+/* Response code of a response at least a header long */
+static inline UINT32 cr50_test_rc(const UINT8* Response) {
+	return cr50_test_get32(Response + 6);
+}
@@ -0,0 +1,248 @@
+/*
+ * Command batches: commands after a failed CR50_BATCH_STOP_ON_ERROR one
+ * are not sent, responses are cut to what the output holds after the
+ * room kept for the rest, and on SPI the wakes and locality requests
+ * between the commands are skipped.
+ */
+
+#include <string.h>
+
+#include "test.h"
+
+#define BATCH_MAX	8
+#define RANDOM_RESPONSE	(TPM_HEADER_SIZE + 2 + 16)
+
+static const UINT8 get_random[] = {
+	0x80, 0x01, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x01, 0x7b, 0x00, 0x10
+};
+
+/* An ordinal the model does not know, answered with an error code */
+static const UINT8 unknown[] = {
+	0x80, 0x01, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x01, 0x99
+};
+
+static const CR50_HOST_SETTING settings[] = {
+	{ "SessionPool", 0 },
+	{ "KeyPoolDepth", 0 },
+	{ NULL, 0 }
+};
+
+typedef struct _BATCH_BUFFER {
+	union {
+		CR50_BATCH Batch;
+		UINT64 Align;
+		UINT8 Bytes[sizeof(CR50_BATCH) + BATCH_MAX * CR50_BATCH_ENTRY_SIZE(64)];
+	};
+	size_t Length;
+} BATCH_BUFFER;
+
+typedef union _BATCH_OUTPUT {
+	CR50_BATCH_RESULT Result;
+	UINT64 Align;
+	UINT8 Bytes[sizeof(CR50_BATCH_RESULT) + BATCH_MAX * CR50_BATCH_ENTRY_SIZE(128)];
+} BATCH_OUTPUT;
+
+static void batch_init(BATCH_BUFFER* Buffer) {
+	memset(Buffer, 0, sizeof(*Buffer));
+	Buffer->Length = sizeof(CR50_BATCH);
+}
+
+static void batch_add(BATCH_BUFFER* Buffer, ULONG Flags, const UINT8* Command, size_t Length) {
+	PCR50_BATCH_COMMAND c = (PCR50_BATCH_COMMAND)(Buffer->Bytes + Buffer->Length);
+
+	c->Flags = Flags;
+	c->Length = (ULONG)Length;
+	memcpy(c + 1, Command, Length);
+	Buffer->Length += CR50_BATCH_ENTRY_SIZE(Length);
+	Buffer->Batch.Count++;
+}
+
+static NTSTATUS batch_submit(CR50_HOST* Host, BATCH_BUFFER* Buffer, BATCH_OUTPUT* Output,
+	size_t OutputLength, ULONG_PTR* Information) {
+	memset(Output, 0xcc, sizeof(*Output));
+	return cr50_shim_ioctl(Host->File, IOCTL_CR50_SUBMIT_BATCH, Buffer->Bytes, Buffer->Length,
+		Output->Bytes, OutputLength, Information);
+}
+
+/* The response to command @Index, walking the entries before it */
+static PCR50_BATCH_RESPONSE batch_response(BATCH_OUTPUT* Output, ULONG Index) {
+	size_t pos = sizeof(CR50_BATCH_RESULT);
+
+	for (ULONG i = 0; i < Index; i++)
+		pos += CR50_BATCH_ENTRY_SIZE(((PCR50_BATCH_RESPONSE)(Output->Bytes + pos))->Length);
+	return (PCR50_BATCH_RESPONSE)(Output->Bytes + pos);
+}
+
+static int batch_open(BOOLEAN Spi, CR50_HOST** Host) {
+	CR50_SIM_CONFIG config = { .Spi = Spi };
+	UINT8 response[64];
+	size_t len;
+
+	CHECK_STATUS(cr50_host_open(&config, settings, Host));
+
+	/* Starts the TPM, so the batches only see their own commands */
+	CHECK_STATUS(cr50_host_transmit(*Host, get_random, sizeof(get_random),
+		response, sizeof(response), &len));
+	return 0;
+}
+
+static int test_stop_on_error(void) {
+	PCR50_BATCH_RESPONSE r;
+	CR50_SIM_COUNTERS before, after;
+	BATCH_BUFFER batch;
+	BATCH_OUTPUT output;
+	ULONG_PTR information;
+	CR50_HOST* host;
+	ULONG64 stopped;
+
+	if (batch_open(FALSE, &host))
+		return 1;
+
+	batch_init(&batch);
+	batch_add(&batch, 0, get_random, sizeof(get_random));
+	batch_add(&batch, CR50_BATCH_STOP_ON_ERROR, unknown, sizeof(unknown));
+	batch_add(&batch, 0, get_random, sizeof(get_random));
+	batch_add(&batch, CR50_BATCH_STOP_ON_ERROR, get_random, sizeof(get_random));
+
+	stopped = host->Context->BatchesStopped;
+	cr50_sim_counters(host->Sim, &before);
+	CHECK_STATUS(batch_submit(host, &batch, &output, sizeof(output), &information));
+	cr50_sim_counters(host->Sim, &after);
+
+	CHECK(output.Result.Count == 4);
+	CHECK(output.Result.Executed == 2);
+	CHECK(after.Commands - before.Commands == 2);
+	CHECK(host->Context->BatchesStopped == stopped + 1);
+
+	r = batch_response(&output, 0);
+	CHECK(r->Status == STATUS_SUCCESS);
+	CHECK(r->Length == RANDOM_RESPONSE);
+	CHECK(cr50_test_rc((UINT8*)(r + 1)) == TPM2_RC_SUCCESS);
+
+	r = batch_response(&output, 1);
+	CHECK(r->Status == STATUS_SUCCESS);
+	CHECK(r->Length == TPM_HEADER_SIZE);
+	CHECK(cr50_test_rc((UINT8*)(r + 1)) != TPM2_RC_SUCCESS);
+
+	/* Neither of the rest is sent, whatever its own flags */
+	for (ULONG i = 2; i < 4; i++) {
+		r = batch_response(&output, i);
+		CHECK(r->Status == STATUS_CANCELLED);
+		CHECK(r->Length == 0);
+	}
+	CHECK((UINT8*)(r + 1) - output.Bytes == (ptrdiff_t)information);
+
+	/* Without the flag an error does not stop the batch */
+	batch_init(&batch);
+	batch_add(&batch, 0, unknown, sizeof(unknown));
+	batch_add(&batch, 0, get_random, sizeof(get_random));
+	CHECK_STATUS(batch_submit(host, &batch, &output, sizeof(output), &information));
+	CHECK(output.Result.Executed == 2);
+	CHECK(batch_response(&output, 1)->Length == RANDOM_RESPONSE);
+	CHECK(host->Context->BatchesStopped == stopped + 1);
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static int test_output_room(void) {
+	const size_t entry = CR50_BATCH_ENTRY_SIZE(RANDOM_RESPONSE);
+	PCR50_BATCH_RESPONSE r;
+	BATCH_BUFFER batch;
+	BATCH_OUTPUT output;
+	ULONG_PTR information;
+	CR50_HOST* host;
+	size_t len;
+
+	if (batch_open(FALSE, &host))
+		return 1;
+
+	batch_init(&batch);
+	batch_add(&batch, 0, get_random, sizeof(get_random));
+	batch_add(&batch, 0, get_random, sizeof(get_random));
+
+	/* Just enough for both */
+	CHECK_STATUS(batch_submit(host, &batch, &output,
+		sizeof(CR50_BATCH_RESULT) + 2 * entry, &information));
+	CHECK(information == sizeof(CR50_BATCH_RESULT) + 2 * entry);
+	CHECK(output.Result.Executed == 2);
+	for (ULONG i = 0; i < 2; i++) {
+		r = batch_response(&output, i);
+		CHECK(r->Status == STATUS_SUCCESS);
+		CHECK(r->Length == RANDOM_RESPONSE);
+	}
+
+	/*
+	 * Enough for the first, and an empty response kept for the second,
+	 * which then has no room for even a header.
+	 */
+	CHECK_STATUS(batch_submit(host, &batch, &output,
+		sizeof(CR50_BATCH_RESULT) + entry + sizeof(CR50_BATCH_RESPONSE), &information));
+	CHECK(information == sizeof(CR50_BATCH_RESULT) + entry + sizeof(CR50_BATCH_RESPONSE));
+	CHECK(output.Result.Executed == 1);
+	r = batch_response(&output, 0);
+	CHECK(r->Status == STATUS_SUCCESS);
+	CHECK(r->Length == RANDOM_RESPONSE);
+	r = batch_response(&output, 1);
+	CHECK(r->Status == STATUS_BUFFER_TOO_SMALL);
+	CHECK(r->Length == 0);
+
+	/* A byte short, the first is cut to keep that room, and nothing overruns */
+	len = sizeof(CR50_BATCH_RESULT) + entry + sizeof(CR50_BATCH_RESPONSE) - 1;
+	CHECK_STATUS(batch_submit(host, &batch, &output, len, &information));
+	CHECK(information <= len);
+	CHECK(batch_response(&output, 0)->Length < RANDOM_RESPONSE);
+	CHECK(output.Bytes[len] == 0xcc);
+
+	/* Less than an empty response each is refused up front */
+	CHECK(batch_submit(host, &batch, &output,
+		sizeof(CR50_BATCH_RESULT) + 2 * sizeof(CR50_BATCH_RESPONSE) - 1,
+		&information) == STATUS_BUFFER_TOO_SMALL);
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static int test_spi_savings(void) {
+	const ULONG count = 4;
+	CR50_SIM_COUNTERS before, after;
+	BATCH_BUFFER batch;
+	BATCH_OUTPUT output;
+	ULONG_PTR information;
+	CR50_HOST* host;
+
+	if (batch_open(TRUE, &host))
+		return 1;
+
+	batch_init(&batch);
+	for (ULONG i = 0; i < count; i++)
+		batch_add(&batch, 0, get_random, sizeof(get_random));
+
+	cr50_sim_counters(host->Sim, &before);
+	CHECK_STATUS(batch_submit(host, &batch, &output, sizeof(output), &information));
+	cr50_sim_counters(host->Sim, &after);
+
+	CHECK(output.Result.Executed == count);
+	CHECK(after.Commands - before.Commands == count);
+	for (ULONG i = 0; i < count; i++)
+		CHECK(batch_response(&output, i)->Length == RANDOM_RESPONSE);
+
+	/* The locality is requested at most once, and no transfer wakes the TPM */
+	CHECK(output.Result.TransitionsSaved == count - 1);
+	CHECK(output.Result.HandshakesSaved >= count - 1);
+	CHECK(output.Result.WakesSaved >= count);
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static const CR50_TEST tests[] = {
+	{ "stop_on_error", test_stop_on_error },
+	{ "output_room", test_output_room },
+	{ "spi_savings", test_spi_savings },
+	{ NULL, NULL }
+};
+
+int main(void) {
+	return cr50_test_main(tests);
+}
@@ -0,0 +1,326 @@
+/*
+ * Key cache: Load answered with the handle already loaded, checked with
+ * ReadPublic first, and FlushContext kept from the TPM while the object
+ * may be loaded again.
+ */
+
+#include <string.h>
+
+#include "test.h"
+
+#define KEY_PARENT	0x81000001
+#define KEY_RC_HANDLE	0x18B	/* TPM_RC_HANDLE for the first handle */
+#define KEY_SLOTS	4
+
+static const UINT8 get_random[] = {
+	0x80, 0x01, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x01, 0x7b, 0x00, 0x10
+};
+
+static const CR50_HOST_SETTING settings[] = {
+	{ "SessionPool", 0 },
+	{ "KeyPoolDepth", 0 },
+	{ "KeyCacheEntries", KEY_SLOTS },
+	{ NULL, 0 }
+};
+
+/*
+ * Transient objects of the TPM. An object's name is its blob's byte and
+ * the generation of its slot, so reloading a slot changes the name.
+ */
+typedef struct _KEY_OBJECT {
+	BOOLEAN Loaded;
+	UINT8 Blob;
+	UINT8 Generation;
+} KEY_OBJECT;
+
+typedef struct _KEY_TPM {
+	KEY_OBJECT Objects[KEY_SLOTS];
+	ULONG Slots;		/* Objects that fit, up to KEY_SLOTS */
+	ULONG Loads;
+	ULONG ReadPublics;
+	ULONG Flushes;
+} KEY_TPM;
+
+static void put16(UINT8* p, UINT16 v) {
+	p[0] = (UINT8)(v >> 8);
+	p[1] = (UINT8)v;
+}
+
+static void put32(UINT8* p, UINT32 v) {
+	p[0] = (UINT8)(v >> 24);
+	p[1] = (UINT8)(v >> 16);
+	p[2] = (UINT8)(v >> 8);
+	p[3] = (UINT8)v;
+}
+
+static size_t key_respond(UINT8* Buffer, UINT16 Tag, UINT32 Rc, size_t Length) {
+	put16(Buffer, Tag);
+	put32(Buffer + 2, (UINT32)Length);
+	put32(Buffer + 6, Rc);
+	return Length;
+}
+
+/* TPM2B name of object @Slot at @p; returns its size */
+static size_t key_name(const KEY_TPM* Tpm, ULONG Slot, UINT8* p) {
+	put16(p, 4);
+	put16(p + 2, 0x000B);
+	p[4] = Tpm->Objects[Slot].Blob;
+	p[5] = Tpm->Objects[Slot].Generation;
+	return 6;
+}
+
+static KEY_OBJECT* key_object(KEY_TPM* Tpm, UINT32 Handle, ULONG* Slot) {
+	*Slot = Handle - 0x80000000;
+	if (*Slot >= Tpm->Slots || !Tpm->Objects[*Slot].Loaded)
+		return NULL;
+	return &Tpm->Objects[*Slot];
+}
+
+static size_t key_handler(PVOID Context, UINT8* Buffer, size_t Length, size_t Size) {
+	KEY_TPM* tpm = Context;
+	KEY_OBJECT* object;
+	size_t len;
+	ULONG slot;
+
+	UNREFERENCED_PARAMETER(Length);
+	UNREFERENCED_PARAMETER(Size);
+
+	switch (cr50_test_get32(Buffer + 6)) {
+	case TPM2_CC_LOAD:
+		tpm->Loads++;
+		for (slot = 0; slot < tpm->Slots && tpm->Objects[slot].Loaded; slot++)
+			;
+		if (slot == tpm->Slots)
+			return key_respond(Buffer, TPM2_ST_NO_SESSIONS, TPM2_RC_OBJECT_MEMORY,
+				TPM_HEADER_SIZE);
+
+		/* inPrivate follows the authorization, its byte tells the keys apart */
+		tpm->Objects[slot].Loaded = TRUE;
+		tpm->Objects[slot].Blob = Buffer[18 + cr50_test_get32(Buffer + 14) + 2];
+		tpm->Objects[slot].Generation++;
+
+		/* objectHandle, parameterSize, name, then the password session */
+		put32(Buffer + TPM_HEADER_SIZE, 0x80000000 + slot);
+		len = 18 + key_name(tpm, slot, Buffer + 18);
+		put32(Buffer + 14, (UINT32)(len - 18));
+		memset(Buffer + len, 0, 5);
+		Buffer[len + 2] = 0x01;
+		return key_respond(Buffer, TPM2_ST_SESSIONS, TPM2_RC_SUCCESS, len + 5);
+	case TPM2_CC_READ_PUBLIC:
+		tpm->ReadPublics++;
+		object = key_object(tpm, cr50_test_get32(Buffer + TPM_HEADER_SIZE), &slot);
+		if (!object)
+			return key_respond(Buffer, TPM2_ST_NO_SESSIONS, KEY_RC_HANDLE, TPM_HEADER_SIZE);
+
+		/* outPublic, name, qualifiedName */
+		len = TPM_HEADER_SIZE;
+		put16(Buffer + len, 2);
+		put16(Buffer + len + 2, 0x0001);
+		len += 4;
+		len += key_name(tpm, slot, Buffer + len);
+		len += key_name(tpm, slot, Buffer + len);
+		return key_respond(Buffer, TPM2_ST_NO_SESSIONS, TPM2_RC_SUCCESS, len);
+	case TPM2_CC_FLUSH_CONTEXT:
+		tpm->Flushes++;
+		object = key_object(tpm, cr50_test_get32(Buffer + TPM_HEADER_SIZE), &slot);
+		if (!object)
+			return key_respond(Buffer, TPM2_ST_NO_SESSIONS, KEY_RC_HANDLE, TPM_HEADER_SIZE);
+		object->Loaded = FALSE;
+		return key_respond(Buffer, TPM2_ST_NO_SESSIONS, TPM2_RC_SUCCESS, TPM_HEADER_SIZE);
+	}
+	return 0;
+}
+
+static int key_open(KEY_TPM* Tpm, ULONG Slots, CR50_HOST** Host) {
+	UINT8 response[64];
+	size_t len;
+
+	memset(Tpm, 0, sizeof(*Tpm));
+	Tpm->Slots = Slots;
+	CHECK_STATUS(cr50_host_open(&(CR50_SIM_CONFIG) { 0 }, settings, Host));
+	cr50_sim_handler((*Host)->Sim, key_handler, Tpm);
+
+	/* Startup forgets the cache, get it out of the way */
+	CHECK_STATUS(cr50_host_transmit(*Host, get_random, sizeof(get_random),
+		response, sizeof(response), &len));
+	return 0;
+}
+
+/* Loads key @Blob under KEY_PARENT with an empty password; 0 on failure */
+static UINT32 key_load(CR50_HOST* Host, UINT8 Blob) {
+	UINT8 command[64], response[64];
+	size_t len = 0;
+
+	put16(command, TPM2_ST_SESSIONS);
+	put32(command + 6, TPM2_CC_LOAD);
+	put32(command + 10, KEY_PARENT);
+	put32(command + 14, 9);
+	put32(command + 18, TPM2_RS_PW);
+	put16(command + 22, 0);
+	command[24] = 0;
+	put16(command + 25, 0);
+	len = 27;
+	/* inPrivate, then inPublic */
+	put16(command + len, 1);
+	command[len + 2] = Blob;
+	len += 3;
+	put16(command + len, 2);
+	put16(command + len + 2, 0x0001);
+	len += 4;
+	put32(command + 2, (UINT32)len);
+
+	if (!NT_SUCCESS(cr50_host_transmit(Host, command, len,
+		response, sizeof(response), &len)) ||
+		len < TPM_HEADER_SIZE + 4 || cr50_test_rc(response) != TPM2_RC_SUCCESS)
+		return 0;
+	return cr50_test_get32(response + TPM_HEADER_SIZE);
+}
+
+static UINT32 key_flush(CR50_HOST* Host, UINT32 Handle) {
+	UINT8 command[TPM_HEADER_SIZE + 4], response[64];
+	size_t len;
+
+	put16(command, TPM2_ST_NO_SESSIONS);
+	put32(command + 2, sizeof(command));
+	put32(command + 6, TPM2_CC_FLUSH_CONTEXT);
+	put32(command + 10, Handle);
+	if (!NT_SUCCESS(cr50_host_transmit(Host, command, sizeof(command),
+		response, sizeof(response), &len)) || len < TPM_HEADER_SIZE)
+		return (UINT32)-1;
+	return cr50_test_rc(response);
+}
+
+static int test_repeat_load(void) {
+	CR50_HOST* host;
+	KEY_TPM tpm;
+	UINT32 handle;
+
+	if (key_open(&tpm, KEY_SLOTS, &host))
+		return 1;
+
+	handle = key_load(host, 0xA1);
+	CHECK(handle == 0x80000000);
+	CHECK(tpm.Loads == 1);
+
+	/* Checked with ReadPublic, not loaded again */
+	CHECK(key_load(host, 0xA1) == handle);
+	CHECK(key_load(host, 0xA1) == handle);
+	CHECK(tpm.Loads == 1);
+	CHECK(tpm.ReadPublics == 2);
+	CHECK(host->Context->KeyHits == 2);
+
+	/* Another key is another object */
+	CHECK(key_load(host, 0xB2) == 0x80000001);
+	CHECK(tpm.Loads == 2);
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static int test_stale_handle(void) {
+	CR50_HOST* host;
+	KEY_TPM tpm;
+	UINT32 handle;
+
+	if (key_open(&tpm, KEY_SLOTS, &host))
+		return 1;
+
+	/* Flushed behind the cache: loaded again */
+	handle = key_load(host, 0xA1);
+	tpm.Objects[0].Loaded = FALSE;
+	CHECK(key_load(host, 0xA1) == handle);
+	CHECK(tpm.Loads == 2);
+	CHECK(host->Context->KeyStale == 1);
+	CHECK(host->Context->KeyHits == 0);
+
+	/* Replaced behind the cache: same handle, another name */
+	tpm.Objects[0].Generation++;
+	tpm.Objects[0].Blob = 0xC3;
+	CHECK(key_load(host, 0xA1) == 0x80000001);
+	CHECK(tpm.Loads == 3);
+	CHECK(host->Context->KeyStale == 2);
+	CHECK(host->Context->KeyHits == 0);
+
+	/* And the new object is cached in turn */
+	CHECK(key_load(host, 0xA1) == 0x80000001);
+	CHECK(tpm.Loads == 3);
+	CHECK(host->Context->KeyHits == 1);
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static int test_evict_lru(void) {
+	CR50_HOST* host;
+	KEY_TPM tpm;
+	UINT32 a, b, c;
+
+	if (key_open(&tpm, 2, &host))
+		return 1;
+
+	/* Both kept loaded for later, nobody holds them */
+	a = key_load(host, 0xA1);
+	b = key_load(host, 0xB2);
+	CHECK(key_flush(host, a) == TPM2_RC_SUCCESS);
+	CHECK(key_flush(host, b) == TPM2_RC_SUCCESS);
+	CHECK(tpm.Flushes == 0);
+
+	/* The TPM is full: the least recently used makes room */
+	c = key_load(host, 0xC3);
+	CHECK(c == a);
+	CHECK(tpm.Flushes == 1);
+	CHECK(tpm.Loads == 4);
+	CHECK(host->Context->KeyEvictions == 1);
+	CHECK(tpm.Objects[1].Loaded && tpm.Objects[1].Blob == 0xB2);
+
+	/* B is the older now; C is held and stays */
+	CHECK(key_load(host, 0xA1) == b);
+	CHECK(tpm.Flushes == 2);
+	CHECK(host->Context->KeyEvictions == 2);
+	CHECK(tpm.Objects[0].Loaded && tpm.Objects[0].Blob == 0xC3);
+
+	/* Nothing left to evict: the caller gets OBJECT_MEMORY */
+	CHECK(key_load(host, 0xD4) == 0);
+	CHECK(host->Context->KeyEvictions == 2);
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static int test_flush_absorbed(void) {
+	CR50_HOST* host;
+	KEY_TPM tpm;
+	UINT32 handle;
+	ULONG64 absorbed;
+
+	if (key_open(&tpm, KEY_SLOTS, &host))
+		return 1;
+
+	handle = key_load(host, 0xA1);
+	CHECK(key_load(host, 0xA1) == handle);
+
+	/* The other user still holds it */
+	absorbed = host->Context->KeyFlushesAbsorbed;
+	CHECK(key_flush(host, handle) == TPM2_RC_SUCCESS);
+	CHECK(host->Context->KeyFlushesAbsorbed == absorbed + 1);
+	CHECK(tpm.Flushes == 0);
+	CHECK(tpm.Objects[0].Loaded);
+
+	CHECK(key_load(host, 0xA1) == handle);
+	CHECK(tpm.Loads == 1);
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static const CR50_TEST tests[] = {
+	{ "repeat_load", test_repeat_load },
+	{ "stale_handle", test_stale_handle },
+	{ "evict_lru", test_evict_lru },
+	{ "flush_absorbed", test_flush_absorbed },
+	{ NULL, NULL }
+};
+
+int main(void) {
+	return cr50_test_main(tests);
+}
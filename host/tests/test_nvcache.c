@@ -0,0 +1,261 @@
+/*
+ * NV cache: which NV_Read responses are answered from memory, and which
+ * commands and power transitions drop them.
+ */
+
+#include <string.h>
+
+#include "test.h"
+
+#define NV_INDEX	0x01500010
+#define NV_SIZE		16
+
+static const UINT8 get_random[] = {
+	0x80, 0x01, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x01, 0x7b, 0x00, 0x10
+};
+
+static const CR50_HOST_SETTING settings[] = {
+	{ "SessionPool", 0 },
+	{ "KeyPoolDepth", 0 },
+	{ NULL, 0 }
+};
+
+/* The NV commands that reach the TPM, by ordinal */
+typedef struct _NV_TPM {
+	ULONG Reads;
+	ULONG Others;
+} NV_TPM;
+
+static void put16(UINT8* p, UINT16 v) {
+	p[0] = (UINT8)(v >> 8);
+	p[1] = (UINT8)v;
+}
+
+static void put32(UINT8* p, UINT32 v) {
+	p[0] = (UINT8)(v >> 24);
+	p[1] = (UINT8)(v >> 16);
+	p[2] = (UINT8)(v >> 8);
+	p[3] = (UINT8)v;
+}
+
+/* Header, parameterSize and an empty password session in the response */
+static size_t nv_respond(UINT8* Buffer, size_t Parameters) {
+	size_t len = TPM_HEADER_SIZE + 4 + Parameters;
+
+	put16(Buffer, TPM2_ST_SESSIONS);
+	put32(Buffer + 6, TPM2_RC_SUCCESS);
+	put32(Buffer + TPM_HEADER_SIZE, (UINT32)Parameters);
+	Buffer[len++] = 0;
+	Buffer[len++] = 0;
+	Buffer[len++] = 0x01;	/* continueSession */
+	Buffer[len++] = 0;
+	Buffer[len++] = 0;
+	put32(Buffer + 2, (UINT32)len);
+	return len;
+}
+
+static size_t nv_handler(PVOID Context, UINT8* Buffer, size_t Length, size_t Size) {
+	NV_TPM* tpm = Context;
+	UINT16 size, offset;
+
+	UNREFERENCED_PARAMETER(Size);
+
+	switch (cr50_test_get32(Buffer + 6)) {
+	case TPM2_CC_NV_READ:
+		/* The data is the offset of each byte, so any range checks itself */
+		tpm->Reads++;
+		size = (UINT16)(Buffer[Length - 4] << 8 | Buffer[Length - 3]);
+		offset = (UINT16)(Buffer[Length - 2] << 8 | Buffer[Length - 1]);
+		put16(Buffer + TPM_HEADER_SIZE + 4, size);
+		for (UINT16 i = 0; i < size; i++)
+			Buffer[TPM_HEADER_SIZE + 6 + i] = (UINT8)(offset + i);
+		return nv_respond(Buffer, 2 + size);
+	case TPM2_CC_NV_WRITE:
+	case TPM2_CC_NV_INCREMENT:
+	case TPM2_CC_NV_EXTEND:
+	case TPM2_CC_NV_SET_BITS:
+	case TPM2_CC_NV_UNDEFINE_SPACE:
+	case TPM2_CC_NV_WRITE_LOCK:
+		tpm->Others++;
+		return nv_respond(Buffer, 0);
+	}
+	return 0;
+}
+
+/*
+ * NV_Read(@Auth, NV_INDEX) of NV_SIZE bytes at 0 with a password
+ * session; @Password makes it one the TPM has to check.
+ */
+static size_t nv_read(UINT8* Command, UINT32 Auth, BOOLEAN Password) {
+	size_t len = 0;
+
+	put16(Command, TPM2_ST_SESSIONS);
+	put32(Command + 6, TPM2_CC_NV_READ);
+	put32(Command + 10, Auth);
+	put32(Command + 14, NV_INDEX);
+	put32(Command + 18, Password ? 13 : 9);
+	put32(Command + 22, TPM2_RS_PW);
+	len = 26;
+	put16(Command + len, 0);	/* nonceCaller */
+	len += 2;
+	Command[len++] = 0;		/* sessionAttributes */
+	if (Password) {
+		put16(Command + len, 4);
+		memcpy(Command + len + 2, "pass", 4);
+		len += 6;
+	}
+	else {
+		put16(Command + len, 0);
+		len += 2;
+	}
+	put16(Command + len, NV_SIZE);
+	put16(Command + len + 2, 0);
+	len += 4;
+	put32(Command + 2, (UINT32)len);
+	return len;
+}
+
+/* An NV command with the index after its authorization handle */
+static size_t nv_command(UINT8* Command, UINT32 Ordinal) {
+	size_t len = 31;
+
+	memset(Command, 0, len);
+	put16(Command, TPM2_ST_SESSIONS);
+	put32(Command + 2, (UINT32)len);
+	put32(Command + 6, Ordinal);
+	put32(Command + 10, Ordinal == TPM2_CC_NV_UNDEFINE_SPACE ? 0x40000001 : NV_INDEX);
+	put32(Command + 14, NV_INDEX);
+	put32(Command + 18, 9);
+	put32(Command + 22, TPM2_RS_PW);
+	return len;
+}
+
+static int nv_open(NV_TPM* Tpm, CR50_HOST** Host) {
+	UINT8 response[64];
+	size_t len;
+
+	memset(Tpm, 0, sizeof(*Tpm));
+	CHECK_STATUS(cr50_host_open(&(CR50_SIM_CONFIG) { 0 }, settings, Host));
+	cr50_sim_handler((*Host)->Sim, nv_handler, Tpm);
+
+	/* Startup empties the cache, get it out of the way */
+	CHECK_STATUS(cr50_host_transmit(*Host, get_random, sizeof(get_random),
+		response, sizeof(response), &len));
+	return 0;
+}
+
+/* Reads NV_INDEX and checks the data; @Reads is what the TPM saw after */
+static int nv_check_read(CR50_HOST* Host, NV_TPM* Tpm, BOOLEAN Password, ULONG Reads) {
+	UINT8 command[64], response[128];
+	size_t len;
+
+	len = nv_read(command, NV_INDEX, Password);
+	CHECK_STATUS(cr50_host_transmit(Host, command, len, response, sizeof(response), &len));
+	CHECK(cr50_test_rc(response) == TPM2_RC_SUCCESS);
+	CHECK(len == TPM_HEADER_SIZE + 6 + NV_SIZE + 5);
+	for (UINT8 i = 0; i < NV_SIZE; i++)
+		CHECK(response[TPM_HEADER_SIZE + 6 + i] == i);
+	CHECK(Tpm->Reads == Reads);
+	return 0;
+}
+
+static int test_repeat_hits(void) {
+	CR50_HOST* host;
+	NV_TPM tpm;
+	ULONG64 hits;
+
+	if (nv_open(&tpm, &host))
+		return 1;
+
+	CHECK(!nv_check_read(host, &tpm, FALSE, 1));
+	hits = host->Context->NvHits;
+	CHECK(!nv_check_read(host, &tpm, FALSE, 1));
+	CHECK(!nv_check_read(host, &tpm, FALSE, 1));
+	CHECK(host->Context->NvHits == hits + 2);
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static int test_writes_invalidate(void) {
+	static const UINT32 ordinals[] = {
+		TPM2_CC_NV_WRITE, TPM2_CC_NV_INCREMENT, TPM2_CC_NV_EXTEND,
+		TPM2_CC_NV_SET_BITS, TPM2_CC_NV_UNDEFINE_SPACE, TPM2_CC_NV_WRITE_LOCK
+	};
+	UINT8 command[64], response[64];
+	CR50_HOST* host;
+	NV_TPM tpm;
+	ULONG reads = 1;
+	size_t len;
+
+	if (nv_open(&tpm, &host))
+		return 1;
+
+	CHECK(!nv_check_read(host, &tpm, FALSE, reads));
+	for (ULONG i = 0; i < ARRAYSIZE(ordinals); i++) {
+		len = nv_command(command, ordinals[i]);
+		CHECK_STATUS(cr50_host_transmit(host, command, len,
+			response, sizeof(response), &len));
+		CHECK(tpm.Others == i + 1);
+
+		/* Missed once, then cached again */
+		CHECK(!nv_check_read(host, &tpm, FALSE, ++reads));
+		CHECK(!nv_check_read(host, &tpm, FALSE, reads));
+	}
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static int test_authorized_uncached(void) {
+	CR50_HOST* host;
+	NV_TPM tpm;
+
+	if (nv_open(&tpm, &host))
+		return 1;
+
+	CHECK(!nv_check_read(host, &tpm, TRUE, 1));
+	CHECK(!nv_check_read(host, &tpm, TRUE, 2));
+	CHECK(host->Context->NvCacheBytes == 0);
+
+	/* Nor answered from what an unauthorized read cached */
+	CHECK(!nv_check_read(host, &tpm, FALSE, 3));
+	CHECK(!nv_check_read(host, &tpm, TRUE, 4));
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static int test_d0_exit_empties(void) {
+	CR50_HOST* host;
+	NV_TPM tpm;
+
+	if (nv_open(&tpm, &host))
+		return 1;
+
+	CHECK(!nv_check_read(host, &tpm, FALSE, 1));
+	CHECK(host->Context->NvCacheBytes != 0);
+
+	CHECK_STATUS(cr50_host_sleep(host));
+	CHECK(host->Context->NvCacheBytes == 0);
+	for (ULONG i = 0; i < CR50_NV_ENTRIES; i++)
+		CHECK(host->Context->NvCache[i].Index == 0);
+
+	CHECK_STATUS(cr50_host_wake(host));
+	CHECK(!nv_check_read(host, &tpm, FALSE, 2));
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static const CR50_TEST tests[] = {
+	{ "repeat_hits", test_repeat_hits },
+	{ "writes_invalidate", test_writes_invalidate },
+	{ "authorized_uncached", test_authorized_uncached },
+	{ "d0_exit_empties", test_d0_exit_empties },
+	{ NULL, NULL }
+};
+
+int main(void) {
+	return cr50_test_main(tests);
+}
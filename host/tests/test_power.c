@@ -0,0 +1,64 @@
+/*
+ * D0 exit and entry: the TPM is shut down and started again, and a
+ * command after a sleep wakes the chip.
+ */
+
+#include "test.h"
+
+static const UINT8 get_random[] = {
+	0x80, 0x01, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x01, 0x7b, 0x00, 0x08
+};
+
+static const CR50_HOST_SETTING settings[] = {
+	{ "SessionPool", 0 },
+	{ "KeyPoolDepth", 0 },
+	{ NULL, 0 }
+};
+
+static int sleep_on(BOOLEAN Spi) {
+	CR50_SIM_CONFIG config = { .Spi = Spi, .SleepMs = 100, .WakeUs = 2000 };
+	CR50_SIM_COUNTERS before, after;
+	CR50_HOST* host;
+	UINT8 response[64];
+	size_t len;
+
+	CHECK_STATUS(cr50_host_open(&config, settings, &host));
+	CHECK_STATUS(cr50_host_transmit(host, get_random, sizeof(get_random),
+		response, sizeof(response), &len));
+
+	cr50_sim_counters(host->Sim, &before);
+	CHECK_STATUS(cr50_host_sleep(host));
+	cr50_shim_advance(CR50_SHIM_MS(1000));
+	CHECK_STATUS(cr50_host_wake(host));
+
+	CHECK_STATUS(cr50_host_transmit(host, get_random, sizeof(get_random),
+		response, sizeof(response), &len));
+	CHECK(cr50_test_rc(response) == TPM2_RC_SUCCESS);
+	CHECK(len == TPM_HEADER_SIZE + 2 + 8);
+
+	/* Shutdown on the way down, Startup on the way up, then the command */
+	cr50_sim_counters(host->Sim, &after);
+	CHECK(after.Wakes > before.Wakes);
+	CHECK(after.Commands >= before.Commands + 3);
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static int test_sleep_i2c(void) {
+	return sleep_on(FALSE);
+}
+
+static int test_sleep_spi(void) {
+	return sleep_on(TRUE);
+}
+
+static const CR50_TEST tests[] = {
+	{ "sleep_i2c", test_sleep_i2c },
+	{ "sleep_spi", test_sleep_spi },
+	{ NULL, NULL }
+};
+
+int main(void) {
+	return cr50_test_main(tests);
+}
@@ -0,0 +1,254 @@
+/*
+ * Quote aggregation: requests collected within QuoteWindow are answered
+ * by one TPM2_Quote over the root of their nonces, and each inclusion
+ * proof leads from the request's nonce to that root.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "test.h"
+
+#define QUOTE_KEY	0x81000002
+#define QUOTE_WINDOW_MS	10
+#define QUOTE_MAX	5
+#define QUOTE_RESPONSE	128
+
+static const UINT8 get_random[] = {
+	0x80, 0x01, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x01, 0x7b, 0x00, 0x10
+};
+
+static const CR50_HOST_SETTING settings[] = {
+	{ "SessionPool", 0 },
+	{ "KeyPoolDepth", 0 },
+	{ "QuoteWindowMs", QUOTE_WINDOW_MS },
+	{ NULL, 0 }
+};
+
+/* sha256: bitmap of PCR 0 */
+static const UINT8 pcr_select[] = { 0, 0, 0, 1, 0x00, 0x0B, 3, 0x01, 0, 0 };
+
+typedef struct _QUOTE_TPM {
+	ULONG Quotes;
+	UINT8 QualifyingData[CR50_QUOTE_HASH_SIZE];
+} QUOTE_TPM;
+
+typedef struct _QUOTE_CALL {
+	pthread_t Thread;
+	CR50_HOST* Host;
+	CR50_QUOTE Input;
+	NTSTATUS Status;
+	ULONG_PTR Information;
+	union {
+		CR50_QUOTE_RESULT Result;
+		UINT8 Output[sizeof(CR50_QUOTE_RESULT) + QUOTE_RESPONSE];
+	};
+} QUOTE_CALL;
+
+static void put16(UINT8* p, UINT16 v) {
+	p[0] = (UINT8)(v >> 8);
+	p[1] = (UINT8)v;
+}
+
+static void put32(UINT8* p, UINT32 v) {
+	p[0] = (UINT8)(v >> 24);
+	p[1] = (UINT8)(v >> 16);
+	p[2] = (UINT8)(v >> 8);
+	p[3] = (UINT8)v;
+}
+
+/*
+ * Answers TPM2_Quote with a TPMS_ATTEST cut after extraData, which is
+ * the qualifyingData of the command, and a null signature.
+ */
+static size_t quote_handler(PVOID Context, UINT8* Buffer, size_t Length, size_t Size) {
+	QUOTE_TPM* tpm = Context;
+	size_t pos;
+
+	UNREFERENCED_PARAMETER(Length);
+	UNREFERENCED_PARAMETER(Size);
+
+	if (cr50_test_get32(Buffer + 6) != TPM2_CC_QUOTE)
+		return 0;
+
+	tpm->Quotes++;
+	pos = 18 + cr50_test_get32(Buffer + 14);
+	if (Buffer[pos] != 0 || Buffer[pos + 1] != CR50_QUOTE_HASH_SIZE)
+		return 0;
+	memcpy(tpm->QualifyingData, Buffer + pos + 2, CR50_QUOTE_HASH_SIZE);
+
+	/* parameterSize, quoted, signature */
+	pos = 14;
+	put16(Buffer + pos, 2 + 4 + 2 + 2 + 2 + CR50_QUOTE_HASH_SIZE);
+	pos += 2;
+	put32(Buffer + pos, 0xff544347);	/* TPM_GENERATED_VALUE */
+	put16(Buffer + pos + 4, 0x8018);	/* TPM_ST_ATTEST_QUOTE */
+	put16(Buffer + pos + 6, 0);		/* qualifiedSigner */
+	put16(Buffer + pos + 8, CR50_QUOTE_HASH_SIZE);
+	memcpy(Buffer + pos + 10, tpm->QualifyingData, CR50_QUOTE_HASH_SIZE);
+	pos += 10 + CR50_QUOTE_HASH_SIZE;
+	put16(Buffer + pos, TPM2_ALG_NULL);
+	pos += 2;
+	put32(Buffer + TPM_HEADER_SIZE, (UINT32)(pos - 14));
+
+	/* Password session */
+	memset(Buffer + pos, 0, 5);
+	Buffer[pos + 2] = 0x01;
+	pos += 5;
+
+	put16(Buffer, TPM2_ST_SESSIONS);
+	put32(Buffer + 2, (UINT32)pos);
+	put32(Buffer + 6, TPM2_RC_SUCCESS);
+	return pos;
+}
+
+static void* quote_thread(void* Context) {
+	QUOTE_CALL* call = Context;
+
+	call->Status = cr50_shim_ioctl(call->Host->File, IOCTL_CR50_QUOTE,
+		&call->Input, sizeof(call->Input), call->Output, sizeof(call->Output),
+		&call->Information);
+	return NULL;
+}
+
+static ULONG quote_collected(CR50_HOST* Host) {
+	ULONG count = 0;
+
+	for (ULONG i = 0; i < CR50_QUOTE_GROUPS; i++) {
+		if (Host->Context->QuoteGroups[i].State == Cr50QuoteOpen)
+			count += Host->Context->QuoteGroups[i].Count;
+	}
+	return count;
+}
+
+static BOOLEAN quote_hash(CR50_HOST* Host, const UINT8* Data, ULONG Length, UINT8* Hash) {
+	return NT_SUCCESS(BCryptHash(Host->Context->QuoteHash, NULL, 0, (PUCHAR)Data, Length,
+		Hash, CR50_QUOTE_HASH_SIZE));
+}
+
+/* Walks the proof of @Call up from its nonce, as a caller would */
+static int quote_verify(CR50_HOST* Host, QUOTE_CALL* Call) {
+	PCR50_QUOTE_RESULT result = &Call->Result;
+	UINT8 node[1 + 2 * CR50_QUOTE_HASH_SIZE];
+	UINT8 hash[CR50_QUOTE_HASH_SIZE];
+	ULONG count = result->Requests, index = result->LeafIndex, used = 0;
+
+	node[0] = 0x00;
+	memcpy(node + 1, Call->Input.Nonce, Call->Input.NonceLength);
+	CHECK(quote_hash(Host, node, 1 + Call->Input.NonceLength, hash));
+
+	node[0] = 0x01;
+	while (count > 1) {
+		if ((index ^ 1) < count) {
+			CHECK(used < result->ProofLength);
+			if (index & 1) {
+				memcpy(node + 1, result->Proof[used], CR50_QUOTE_HASH_SIZE);
+				memcpy(node + 1 + CR50_QUOTE_HASH_SIZE, hash, CR50_QUOTE_HASH_SIZE);
+			}
+			else {
+				memcpy(node + 1, hash, CR50_QUOTE_HASH_SIZE);
+				memcpy(node + 1 + CR50_QUOTE_HASH_SIZE, result->Proof[used],
+					CR50_QUOTE_HASH_SIZE);
+			}
+			used++;
+			CHECK(quote_hash(Host, node, sizeof(node), hash));
+		}
+		count = (count + 1) / 2;
+		index >>= 1;
+	}
+
+	CHECK(used == result->ProofLength);
+	CHECK(!memcmp(hash, result->Root, CR50_QUOTE_HASH_SIZE));
+	return 0;
+}
+
+static int quote_requests(ULONG Count) {
+	QUOTE_CALL calls[QUOTE_MAX];
+	ULONG seen = 0;
+	CR50_HOST* host;
+	QUOTE_TPM tpm = { 0 };
+	UINT8 response[64];
+	size_t len;
+
+	CHECK_STATUS(cr50_host_open(&(CR50_SIM_CONFIG) { 0 }, settings, &host));
+	cr50_sim_handler(host->Sim, quote_handler, &tpm);
+	CHECK_STATUS(cr50_host_transmit(host, get_random, sizeof(get_random),
+		response, sizeof(response), &len));
+
+	memset(calls, 0, sizeof(calls));
+	for (ULONG i = 0; i < Count; i++) {
+		QUOTE_CALL* call = &calls[i];
+
+		call->Host = host;
+		call->Input.SignHandle = QUOTE_KEY;
+		call->Input.Scheme = TPM2_ALG_NULL;
+		call->Input.PcrSelectLength = sizeof(pcr_select);
+		memcpy(call->Input.PcrSelect, pcr_select, sizeof(pcr_select));
+		call->Input.NonceLength = 8 + i;
+		memset(call->Input.Nonce, 0x40 + (int)i, call->Input.NonceLength);
+		CHECK(!pthread_create(&call->Thread, NULL, quote_thread, call));
+	}
+
+	/* All collected before the window ends */
+	CHECK_SOON(quote_collected(host) == Count);
+	CHECK(tpm.Quotes == 0);
+
+	cr50_shim_advance(CR50_SHIM_MS(QUOTE_WINDOW_MS));
+	cr50_shim_fire_timer(host->Context->QuoteTimer);
+
+	for (ULONG i = 0; i < Count; i++) {
+		CHECK(!pthread_join(calls[i].Thread, NULL));
+	}
+	CHECK(tpm.Quotes == 1);
+
+	for (ULONG i = 0; i < Count; i++) {
+		PCR50_QUOTE_RESULT result = &calls[i].Result;
+		const UINT8* rsp = (const UINT8*)(result + 1);
+
+		CHECK_STATUS(calls[i].Status);
+		CHECK(result->Status == STATUS_SUCCESS);
+		CHECK(result->ResponseCode == TPM2_RC_SUCCESS);
+		CHECK(result->Requests == Count);
+		CHECK(result->LeafIndex < Count && !(seen & (1u << result->LeafIndex)));
+		seen |= 1u << result->LeafIndex;
+
+		/* The root is what the TPM signed */
+		CHECK(!memcmp(result->Root, tpm.QualifyingData, CR50_QUOTE_HASH_SIZE));
+		CHECK(result->ResponseLength > 26 + CR50_QUOTE_HASH_SIZE);
+		CHECK(!memcmp(rsp + 26, result->Root, CR50_QUOTE_HASH_SIZE));
+
+		if (quote_verify(host, &calls[i]))
+			return 1;
+	}
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static int test_one(void) {
+	return quote_requests(1);
+}
+
+static int test_two(void) {
+	return quote_requests(2);
+}
+
+static int test_three(void) {
+	return quote_requests(3);
+}
+
+static int test_five(void) {
+	return quote_requests(5);
+}
+
+static const CR50_TEST tests[] = {
+	{ "one", test_one },
+	{ "two", test_two },
+	{ "three", test_three },
+	{ "five", test_five },
+	{ NULL, NULL }
+};
+
+int main(void) {
+	return cr50_test_main(tests);
+}
@@ -0,0 +1,149 @@
+/*
+ * Bus traces: what they keep of command data, and replaying one into a
+ * model that would answer differently.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+static const UINT8 get_random[] = {
+	0x80, 0x01, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x01, 0x7b, 0x00, 0x10
+};
+
+#define TRACE_BUFFER	(1024 * 1024)
+
+static PCR50_TRACE query_trace(CR50_HOST* host) {
+	PCR50_TRACE trace = calloc(1, TRACE_BUFFER);
+	ULONG_PTR returned;
+
+	if (trace && !NT_SUCCESS(cr50_shim_ioctl(host->File, IOCTL_CR50_QUERY_TRACE, NULL, 0,
+		trace, TRACE_BUFFER, &returned))) {
+		free(trace);
+		return NULL;
+	}
+	return trace;
+}
+
+static BOOLEAN is_fifo(const CR50_TRACE_ENTRY* e) {
+	return (e->Register & 0xF) == TPM_I2C_DATA_FIFO(0);
+}
+
+static BOOLEAN all_zero(const UCHAR* p, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		if (p[i])
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Without TracePayload neither FIFO data nor command parameters are kept */
+static int test_payload_hidden(void) {
+	static const CR50_HOST_SETTING settings[] = {
+		{ "SessionPool", 0 },
+		{ "KeyPoolDepth", 0 },
+		{ NULL, 0 }
+	};
+	CR50_SIM_CONFIG config = { 0 };
+	CR50_HOST* host;
+	PCR50_TRACE trace;
+	UINT8 response[64];
+	size_t len;
+	ULONG fifo = 0, commands = 0;
+
+	CHECK_STATUS(cr50_host_open(&config, settings, &host));
+	CHECK_STATUS(cr50_host_transmit(host, get_random, sizeof(get_random),
+		response, sizeof(response), &len));
+	CHECK((trace = query_trace(host)) != NULL);
+	cr50_host_close(host);
+
+	for (ULONG i = 0; i < trace->EntriesReturned; i++) {
+		const CR50_TRACE_ENTRY* e = &trace->Entries[i];
+
+		if ((e->Type == Cr50TraceRead || e->Type == Cr50TraceWrite) && is_fifo(e)) {
+			CHECK(e->Length);
+			CHECK(all_zero(e->Data, sizeof(e->Data)));
+			fifo++;
+		}
+		if (e->Type == Cr50TraceCommandStart && e->Register == 0x17b) {
+			CHECK(e->Length == sizeof(get_random));
+			CHECK(!memcmp(e->Data, get_random, TPM_HEADER_SIZE));
+			CHECK(all_zero(e->Data + TPM_HEADER_SIZE, sizeof(e->Data) - TPM_HEADER_SIZE));
+			commands++;
+		}
+	}
+	CHECK(fifo && commands == 1);
+
+	free(trace);
+	return 0;
+}
+
+/*
+ * A trace recorded with TracePayload, replayed into a model seeded
+ * differently, gives the recorded responses and not the model's.
+ */
+static int test_replay(void) {
+	static const CR50_HOST_SETTING settings[] = {
+		{ "SessionPool", 0 },
+		{ "KeyPoolDepth", 0 },
+		{ "TracePayload", 1 },
+		{ NULL, 0 }
+	};
+	CR50_SIM_CONFIG recorded = { .Seed = 1, .ExecUs = 300 };
+	CR50_SIM_CONFIG replayed = { .Seed = 2 };
+	CR50_SIM_COUNTERS counters;
+	CR50_HOST* host;
+	PCR50_TRACE trace;
+	UINT8 expected[3][64], response[64];
+	size_t len;
+	ULONG found = 0;
+
+	CHECK_STATUS(cr50_host_open(&recorded, settings, &host));
+	for (int i = 0; i < 3; i++) {
+		CHECK_STATUS(cr50_host_transmit(host, get_random, sizeof(get_random),
+			expected[i], sizeof(expected[i]), &len));
+		CHECK(len == TPM_HEADER_SIZE + 2 + 16);
+	}
+	CHECK((trace = query_trace(host)) != NULL);
+	cr50_host_close(host);
+
+	CHECK_STATUS(cr50_host_open(&replayed, settings, &host));
+	CHECK_STATUS(cr50_host_transmit(host, get_random, sizeof(get_random),
+		response, sizeof(response), &len));
+	CHECK(memcmp(response, expected[0], len));
+
+	cr50_sim_replay(host->Sim, trace->Entries, trace->EntriesReturned, 1);
+	for (ULONG i = 0; i < trace->EntriesReturned; i++) {
+		const CR50_TRACE_ENTRY* e = &trace->Entries[i];
+
+		if (e->Type != Cr50TraceCommandStart || e->Register != 0x17b)
+			continue;
+
+		cr50_sim_replay_seek(host->Sim, i);
+		CHECK_STATUS(cr50_host_transmit(host, get_random, sizeof(get_random),
+			response, sizeof(response), &len));
+		CHECK(found < 3 && len == TPM_HEADER_SIZE + 2 + 16);
+		CHECK(!memcmp(response, expected[found], len));
+		found++;
+	}
+	CHECK(found == 3);
+
+	cr50_sim_counters(host->Sim, &counters);
+	CHECK(counters.Replayed && !counters.ReplayMisses);
+
+	cr50_sim_replay(host->Sim, NULL, 0, 0);
+	cr50_host_close(host);
+	free(trace);
+	return 0;
+}
+
+static const CR50_TEST tests[] = {
+	{ "payload_hidden", test_payload_hidden },
+	{ "replay", test_replay },
+	{ NULL, NULL }
+};
+
+int main(void) {
+	return cr50_test_main(tests);
+}
@@ -0,0 +1,281 @@
+/*
+ * Session pool: sessions started ahead of time, kept per handle between
+ * acquire and release, refreshed after SessionMaxUses and given up for a
+ * client command that needs the room.
+ */
+
+#include <string.h>
+
+#include "test.h"
+
+#define SESSION_FIRST	0x02000000
+#define SESSION_MAX	8
+#define SESSION_USES	3
+
+static const UINT8 get_random[] = {
+	0x80, 0x01, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x01, 0x7b, 0x00, 0x10
+};
+
+static const CR50_HOST_SETTING settings[] = {
+	{ "SessionPool", 2 },
+	{ "SessionMaxUses", SESSION_USES },
+	{ "KeyPoolDepth", 0 },
+	{ NULL, 0 }
+};
+
+/* Session handles of the TPM, numbered in the order they were started */
+typedef struct _SESSION_TPM {
+	BOOLEAN Loaded[SESSION_MAX];
+	ULONG Next;
+	ULONG Room;		/* Sessions that fit at once */
+	ULONG Started;
+	ULONG Flushed;
+	UINT32 LastFlushed;
+} SESSION_TPM;
+
+static void put16(UINT8* p, UINT16 v) {
+	p[0] = (UINT8)(v >> 8);
+	p[1] = (UINT8)v;
+}
+
+static void put32(UINT8* p, UINT32 v) {
+	p[0] = (UINT8)(v >> 24);
+	p[1] = (UINT8)(v >> 16);
+	p[2] = (UINT8)(v >> 8);
+	p[3] = (UINT8)v;
+}
+
+static size_t session_respond(UINT8* Buffer, UINT32 Rc, size_t Length) {
+	put16(Buffer, TPM2_ST_NO_SESSIONS);
+	put32(Buffer + 2, (UINT32)Length);
+	put32(Buffer + 6, Rc);
+	return Length;
+}
+
+static ULONG session_loaded(const SESSION_TPM* Tpm) {
+	ULONG loaded = 0;
+
+	for (ULONG i = 0; i < SESSION_MAX; i++)
+		loaded += Tpm->Loaded[i];
+	return loaded;
+}
+
+static size_t session_handler(PVOID Context, UINT8* Buffer, size_t Length, size_t Size) {
+	SESSION_TPM* tpm = Context;
+	UINT32 handle;
+	ULONG slot;
+
+	UNREFERENCED_PARAMETER(Length);
+	UNREFERENCED_PARAMETER(Size);
+
+	switch (cr50_test_get32(Buffer + 6)) {
+	case TPM2_CC_START_AUTH_SESSION:
+		if (session_loaded(tpm) >= tpm->Room || tpm->Next == SESSION_MAX)
+			return session_respond(Buffer, TPM2_RC_SESSION_MEMORY, TPM_HEADER_SIZE);
+
+		slot = tpm->Next++;
+		tpm->Loaded[slot] = TRUE;
+		tpm->Started++;
+
+		/* sessionHandle, nonceTPM */
+		put32(Buffer + TPM_HEADER_SIZE, SESSION_FIRST + slot);
+		put16(Buffer + 14, CR50_SESSION_NONCE_SIZE);
+		memset(Buffer + 16, (int)slot, CR50_SESSION_NONCE_SIZE);
+		return session_respond(Buffer, TPM2_RC_SUCCESS, 16 + CR50_SESSION_NONCE_SIZE);
+	case TPM2_CC_FLUSH_CONTEXT:
+		handle = cr50_test_get32(Buffer + TPM_HEADER_SIZE);
+		slot = handle - SESSION_FIRST;
+		if (slot >= SESSION_MAX || !tpm->Loaded[slot])
+			return 0;
+
+		tpm->Loaded[slot] = FALSE;
+		tpm->Flushed++;
+		tpm->LastFlushed = handle;
+		return session_respond(Buffer, TPM2_RC_SUCCESS, TPM_HEADER_SIZE);
+	case TPM2_CC_SHUTDOWN:
+		/* Sessions are not saved; the model shuts down as usual */
+		memset(tpm->Loaded, 0, sizeof(tpm->Loaded));
+		return 0;
+	}
+	return 0;
+}
+
+static ULONG session_pooled(CR50_HOST* Host) {
+	CR50_SESSION_STATS stats;
+
+	tpm_cr50_session_stats(Host->Context, &stats);
+	return stats.Pooled;
+}
+
+static int session_open(SESSION_TPM* Tpm, ULONG Room, CR50_HOST** Host) {
+	UINT8 response[64];
+	size_t len;
+
+	memset(Tpm, 0, sizeof(*Tpm));
+	Tpm->Room = Room;
+	CHECK_STATUS(cr50_host_open(&(CR50_SIM_CONFIG) { 0 }, settings, Host));
+	cr50_sim_handler((*Host)->Sim, session_handler, Tpm);
+
+	/* The first command starts the TPM, then the pool fills */
+	CHECK_STATUS(cr50_host_transmit(*Host, get_random, sizeof(get_random),
+		response, sizeof(response), &len));
+	CHECK_SOON(session_pooled(*Host) == 2);
+	return 0;
+}
+
+static NTSTATUS session_acquire(WDFFILEOBJECT File, PCR50_SESSION Session) {
+	CR50_SESSION_REQUEST request = { TPM2_SE_HMAC, 0 };
+	ULONG_PTR information;
+
+	return cr50_shim_ioctl(File, IOCTL_CR50_SESSION_ACQUIRE, &request, sizeof(request),
+		Session, sizeof(*Session), &information);
+}
+
+static NTSTATUS session_release(WDFFILEOBJECT File, PCR50_SESSION Session, ULONG Uses) {
+	ULONG_PTR information;
+
+	Session->Uses = Uses;
+	Session->Flags = 0;
+	return cr50_shim_ioctl(File, IOCTL_CR50_SESSION_RELEASE, Session, sizeof(*Session),
+		NULL, 0, &information);
+}
+
+static PCR50_SESSION_SLOT session_slot(CR50_HOST* Host, ULONG Handle) {
+	for (ULONG i = 0; i < CR50_SESSION_SLOTS; i++) {
+		if (Host->Context->Sessions[i].State != Cr50SessionFree &&
+			Host->Context->Sessions[i].Handle == Handle)
+			return &Host->Context->Sessions[i];
+	}
+	return NULL;
+}
+
+static int test_reuse_per_handle(void) {
+	CR50_SESSION first, again, other;
+	WDFFILEOBJECT file;
+	CR50_HOST* host;
+	SESSION_TPM tpm;
+
+	if (session_open(&tpm, SESSION_MAX, &host))
+		return 1;
+	CHECK_STATUS(cr50_shim_open(host->Device, &file));
+
+	CHECK_STATUS(session_acquire(host->File, &first));
+	CHECK(first.Flags & CR50_SESSION_REUSED);
+	CHECK(first.Handle >= SESSION_FIRST && first.Handle < SESSION_FIRST + SESSION_MAX);
+	CHECK_STATUS(session_release(host->File, &first, 1));
+
+	/* Kept for the handle that released it, not for another one */
+	CHECK_STATUS(session_acquire(file, &other));
+	CHECK(other.Handle != first.Handle);
+	CHECK_STATUS(session_acquire(host->File, &again));
+	CHECK(again.Handle == first.Handle);
+	CHECK(again.Flags & CR50_SESSION_REUSED);
+	CHECK(again.Uses == 1);
+	CHECK(host->Context->SessionHits == 3);
+	CHECK(tpm.Flushed == 0);
+
+	CHECK_STATUS(session_release(file, &other, 1));
+	CHECK_STATUS(session_release(host->File, &again, 2));
+	cr50_shim_close(file);
+	cr50_host_close(host);
+	return 0;
+}
+
+static int test_refresh_at_max_uses(void) {
+	CR50_SESSION session, fresh;
+	CR50_HOST* host;
+	SESSION_TPM tpm;
+
+	if (session_open(&tpm, SESSION_MAX, &host))
+		return 1;
+
+	CHECK_STATUS(session_acquire(host->File, &session));
+	CHECK_STATUS(session_release(host->File, &session, SESSION_USES - 1));
+	CHECK(host->Context->SessionsRefreshed == 0);
+
+	CHECK_STATUS(session_acquire(host->File, &session));
+	CHECK_STATUS(session_release(host->File, &session, SESSION_USES));
+	CHECK(host->Context->SessionsRefreshed == 1);
+
+	/* Flushed and replaced in the background */
+	CHECK_SOON(tpm.Flushed == 1 && session_pooled(host) == 2);
+	CHECK(tpm.LastFlushed == session.Handle);
+	CHECK(tpm.Started == 3);
+
+	CHECK_STATUS(session_acquire(host->File, &fresh));
+	CHECK(fresh.Handle != session.Handle);
+	CHECK(fresh.Uses == 0);
+
+	CHECK_STATUS(session_release(host->File, &fresh, 1));
+	cr50_host_close(host);
+	return 0;
+}
+
+static int test_stale_after_d0_exit(void) {
+	PCR50_SESSION_SLOT slot;
+	CR50_SESSION session;
+	CR50_HOST* host;
+	SESSION_TPM tpm;
+
+	if (session_open(&tpm, SESSION_MAX, &host))
+		return 1;
+
+	CHECK_STATUS(session_acquire(host->File, &session));
+	CHECK_STATUS(cr50_host_sleep(host));
+
+	/* The pool is forgotten; the one handed out stays, marked */
+	slot = session_slot(host, session.Handle);
+	CHECK(slot && slot->State == Cr50SessionAcquired && slot->Stale);
+	CHECK(session_pooled(host) == 0);
+	CHECK(tpm.Flushed == 0);
+
+	CHECK_STATUS(cr50_host_wake(host));
+
+	/* Released, its slot is freed without a FlushContext */
+	CHECK_STATUS(session_release(host->File, &session, 1));
+	CHECK(!session_slot(host, session.Handle));
+	CHECK(tpm.Flushed == 0);
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static int test_evict_for_command(void) {
+	UINT8 command[TPM_HEADER_SIZE + 64], response[64];
+	ULONG_PTR args[2];
+	UINT8 nonce[CR50_SESSION_NONCE_SIZE] = { 0 };
+	CR50_HOST* host;
+	SESSION_TPM tpm;
+	size_t len;
+
+	/* The pool takes all the room there is */
+	if (session_open(&tpm, 2, &host))
+		return 1;
+
+	args[0] = TPM2_SE_HMAC;
+	args[1] = (ULONG_PTR)nonce;
+	len = tpm2_build(TPM2_CMD_START_AUTH_SESSION, command, sizeof(command), args);
+	CHECK(len);
+
+	CHECK_STATUS(cr50_host_transmit(host, command, len, response, sizeof(response), &len));
+	CHECK(cr50_test_rc(response) == TPM2_RC_SUCCESS);
+	CHECK(cr50_test_get32(response + TPM_HEADER_SIZE) == SESSION_FIRST + 2);
+	CHECK(host->Context->SessionsEvicted == 1);
+	CHECK(tpm.Flushed == 1);
+	CHECK(session_loaded(&tpm) == 2);
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static const CR50_TEST tests[] = {
+	{ "reuse_per_handle", test_reuse_per_handle },
+	{ "refresh_at_max_uses", test_refresh_at_max_uses },
+	{ "stale_after_d0_exit", test_stale_after_d0_exit },
+	{ "evict_for_command", test_evict_for_command },
+	{ NULL, NULL }
+};
+
+int main(void) {
+	return cr50_test_main(tests);
+}
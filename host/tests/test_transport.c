@@ -0,0 +1,164 @@
+/*
+ * Commands through the whole driver, IOCTL to bus transfers, against the
+ * chip model on both transports.
+ */
+
+#include <string.h>
+
+#include "test.h"
+
+static const UINT8 get_random[] = {
+	0x80, 0x01, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x01, 0x7b, 0x00, 0x10
+};
+
+/* No sessions, so the startup code leaves the TPM to the commands below */
+static const CR50_HOST_SETTING settings[] = {
+	{ "SessionPool", 0 },
+	{ "KeyPoolDepth", 0 },
+	{ NULL, 0 }
+};
+
+static int get_random_on(BOOLEAN Ti50, BOOLEAN Spi) {
+	CR50_SIM_CONFIG config = { .Ti50 = Ti50, .Spi = Spi, .ReadyUs = 50, .ExecUs = 500 };
+	CR50_HOST* host;
+	UINT8 response[64];
+	size_t len;
+
+	CHECK_STATUS(cr50_host_open(&config, settings, &host));
+	CHECK(host->Context->VendorId == (Ti50 ? TPM_TI50_DID_VID : TPM_CR50_DID_VID));
+
+	CHECK_STATUS(cr50_host_transmit(host, get_random, sizeof(get_random),
+		response, sizeof(response), &len));
+	CHECK(len == TPM_HEADER_SIZE + 2 + 16);
+	CHECK(cr50_test_get32(response + 2) == len);
+	CHECK(cr50_test_rc(response) == TPM2_RC_SUCCESS);
+	CHECK(response[TPM_HEADER_SIZE] == 0 && response[TPM_HEADER_SIZE + 1] == 16);
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static int test_cr50_i2c(void) {
+	return get_random_on(FALSE, FALSE);
+}
+
+static int test_ti50_i2c(void) {
+	return get_random_on(TRUE, FALSE);
+}
+
+static int test_cr50_spi(void) {
+	return get_random_on(FALSE, TRUE);
+}
+
+static int test_ti50_spi(void) {
+	return get_random_on(TRUE, TRUE);
+}
+
+/*
+ * A large command in bursts of a few bytes: the TPM must receive it
+ * whole, and answer TPM_RC_COMMAND_CODE for an ordinal it lacks.
+ */
+static int bursts_on(BOOLEAN Spi) {
+	CR50_SIM_CONFIG config = { .Spi = Spi, .Burst = 16 };
+	CR50_HOST* host;
+	UINT8 command[1000], seen[sizeof(command)];
+	UINT8 response[64];
+	size_t len;
+
+	memset(command, 0, sizeof(command));
+	command[0] = 0x80;
+	command[1] = 0x01;
+	command[4] = sizeof(command) >> 8;
+	command[5] = sizeof(command) & 0xff;
+	command[8] = 0x01;
+	command[9] = 0x99;
+	for (size_t i = TPM_HEADER_SIZE; i < sizeof(command); i++)
+		command[i] = (UINT8)(i * 7);
+
+	CHECK_STATUS(cr50_host_open(&config, settings, &host));
+	CHECK_STATUS(cr50_host_transmit(host, command, sizeof(command),
+		response, sizeof(response), &len));
+	CHECK(len == TPM_HEADER_SIZE);
+	CHECK(cr50_test_rc(response) == 0x143);
+	CHECK(cr50_sim_last_command(host->Sim, seen, sizeof(seen)) == sizeof(command));
+	CHECK(!memcmp(seen, command, sizeof(command)));
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static int test_bursts_i2c(void) {
+	return bursts_on(FALSE);
+}
+
+static int test_bursts_spi(void) {
+	return bursts_on(TRUE);
+}
+
+/*
+ * A lost ready pulse on I2C fails the transfer, so the health monitor
+ * sees it, and the status poll it belonged to is read again.
+ */
+static int test_dropped_ready(void) {
+	CR50_SIM_CONFIG config = { 0 };
+	CR50_SIM_COUNTERS before, after;
+	ULONG64 timeouts;
+	CR50_HOST* host;
+	UINT8 response[64];
+	size_t len;
+
+	CHECK_STATUS(cr50_host_open(&config, settings, &host));
+
+	/* The first command also starts the TPM up */
+	CHECK_STATUS(cr50_host_transmit(host, get_random, sizeof(get_random),
+		response, sizeof(response), &len));
+
+	timeouts = host->Context->HealthReadyTimeouts;
+	cr50_sim_counters(host->Sim, &before);
+	cr50_sim_drop_ready(host->Sim, 1);
+	CHECK_STATUS(cr50_host_transmit(host, get_random, sizeof(get_random),
+		response, sizeof(response), &len));
+	CHECK(cr50_test_rc(response) == TPM2_RC_SUCCESS);
+	cr50_sim_counters(host->Sim, &after);
+	CHECK(after.Commands == before.Commands + 1);
+	CHECK(host->Context->HealthReadyTimeouts == timeouts + 1);
+
+	cr50_host_close(host);
+	return 0;
+}
+
+/* A command shorter than its header says never reaches the bus */
+static int test_malformed(void) {
+	CR50_SIM_CONFIG config = { 0 };
+	CR50_SIM_COUNTERS before, after;
+	CR50_HOST* host;
+	UINT8 response[64];
+	size_t len;
+
+	CHECK_STATUS(cr50_host_open(&config, settings, &host));
+
+	cr50_sim_counters(host->Sim, &before);
+	CHECK(!NT_SUCCESS(cr50_host_transmit(host, get_random, sizeof(get_random) - 1,
+		response, sizeof(response), &len)));
+	cr50_sim_counters(host->Sim, &after);
+	CHECK(after.Commands == before.Commands);
+
+	cr50_host_close(host);
+	return 0;
+}
+
+static const CR50_TEST tests[] = {
+	{ "cr50_i2c", test_cr50_i2c },
+	{ "ti50_i2c", test_ti50_i2c },
+	{ "cr50_spi", test_cr50_spi },
+	{ "ti50_spi", test_ti50_spi },
+	{ "bursts_i2c", test_bursts_i2c },
+	{ "bursts_spi", test_bursts_spi },
+	{ "dropped_ready", test_dropped_ready },
+	{ "malformed", test_malformed },
+	{ NULL, NULL }
+};
+
+int main(void) {
+	return cr50_test_main(tests);
+}